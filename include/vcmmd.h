@@ -27,6 +27,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 /*
@@ -52,6 +53,7 @@ enum {
 	VCMMD_ERROR_TOO_MANY_REQUESTS,				/* 10 */
 	VCMMD_ERROR_POLICY_SET_ACTIVE_VES,                      /* 11 */
 	VCMMD_ERROR_POLICY_SET_INVALID_NAME,                    /* 12 */
+	VCMMD_ERROR_RESERVATION_NOT_FOUND,			/* 13 */
 
 	__VCMMD_SERVICE_ERROR_END,
 
@@ -65,6 +67,10 @@ enum {
 		__VCMMD_LIB_ERROR_START,			/* 1000 */
 	VCMMD_ERROR_CONNECTION_FAILED,				/* 1001 */
 	VCMMD_ERROR_BUSNAME_FETCH_FAILED,			/* 1002 */
+	VCMMD_ERROR_TOPOLOGY_UNAVAILABLE,			/* 1003 */
+	VCMMD_ERROR_PLACEMENT_FAILED,				/* 1004 */
+	VCMMD_ERROR_INVALID_BACKEND,				/* 1005 */
+	VCMMD_ERROR_NOT_SUPPORTED,				/* 1006 */
 
 	__VCMMD_LIB_ERROR_END,
 };
@@ -168,6 +174,162 @@ typedef enum _VCMMD_MEMGUARANTEE_TYPE
         VCMMD_MEMGUARANTEE_BYTES = 1,
 } VCMMD_MEMGUARANTEE_TYPE;
 
+/*
+ * Library calls, as accounted in statistics
+ */
+typedef enum {
+	VCMMD_CALL_REGISTER_VE,		/* vcmmd_register_ve{,_frozen} */
+	VCMMD_CALL_ACTIVATE_VE,		/* vcmmd_activate_ve{,_handle} */
+	VCMMD_CALL_UPDATE_VE,		/* vcmmd_update_ve{,_frozen,_handle} */
+	VCMMD_CALL_DEACTIVATE_VE,	/* vcmmd_deactivate_ve{,_handle} */
+	VCMMD_CALL_UNREGISTER_VE,
+	VCMMD_CALL_GET_VE_CONFIG,	/* vcmmd_get_ve_config{,_handle} */
+	VCMMD_CALL_GET_VE_STATE,	/* vcmmd_get_ve_state{,_handle} */
+	VCMMD_CALL_GET_CURRENT_POLICY,
+	VCMMD_CALL_GET_POLICY_FROM_FILE,
+	VCMMD_CALL_SET_POLICY,
+	VCMMD_CALL_DISCOVERY,		/* VCMMD bus name, feature, VE ID lookup */
+	VCMMD_CALL_GET_HOST_CAPACITY,
+	VCMMD_CALL_RESERVE,
+	VCMMD_CALL_UNRESERVE,
+	VCMMD_CALL_REGISTER_VE_EX,	/* with a shortfall to report */
+	VCMMD_CALL_UPDATE_VE_EX,	/* with a shortfall to report */
+	VCMMD_CALL_REGISTER_VE_RANGE,
+	VCMMD_CALL_REGISTER_VE_RESERVED,
+	VCMMD_CALL_GET_NODE_CAPACITY,
+
+	__NR_VCMMD_CALLS,
+} vcmmd_call_t;
+
+#define VCMMD_STATS_MAX_CALLS		32
+#define VCMMD_STATS_MAX_ERRORS		32
+
+/*
+ * Latency histogram buckets: bucket 0 counts durations below 1us, bucket i
+ * durations in [2^(i-1), 2^i) us, the last bucket everything longer.
+ */
+#define VCMMD_STATS_NR_BUCKETS		32
+
+struct vcmmd_call_stats {
+	uint64_t calls;
+	uint64_t errors;			/* calls that returned non-zero */
+	uint64_t retries;			/* resends after a failed send */
+	uint64_t reconnects;			/* connections dropped */
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t latency[VCMMD_STATS_NR_BUCKETS];
+};
+
+/*
+ * Library statistics
+ *
+ * Only uint64_t members, indexed by vcmmd_call_t and error code.
+ */
+struct vcmmd_stats {
+	struct vcmmd_call_stats calls[VCMMD_STATS_MAX_CALLS];
+
+	uint64_t retries;
+	uint64_t reconnects;
+
+	/* Waits for the connection lock that did not succeed right away */
+	uint64_t lock_waits;
+	uint64_t lock_wait_ns;
+	uint64_t lock_wait_latency[VCMMD_STATS_NR_BUCKETS];
+
+	/* Errors returned, by code and by code - __VCMMD_LIB_ERROR_START */
+	uint64_t service_errors[VCMMD_STATS_MAX_ERRORS];
+	uint64_t lib_errors[VCMMD_STATS_MAX_ERRORS];
+
+	/* Rate control, see vcmmd_set_rate_control */
+	uint64_t busy_retries;		/* resends after TOO_MANY_REQUESTS */
+	uint64_t admission_waits;	/* calls that had to queue */
+	uint64_t admission_wait_ns;
+	/* Current values, not reset by vcmmd_reset_stats */
+	uint64_t rate_limit;		/* in-flight limit, 0 if off */
+	uint64_t in_flight;		/* rate controlled calls in flight */
+	uint64_t queue_depth;		/* calls queued for admission */
+};
+
+/*
+ * Rate control settings, see vcmmd_set_rate_control
+ *
+ * %VCMMD_CALL_REGISTER_VE and %VCMMD_CALL_UPDATE_VE in @calls also cover the
+ * other calls that register or update a VE.
+ */
+struct vcmmd_rate_control {
+	uint32_t calls;			/* bitmask of 1 << vcmmd_call_t */
+	unsigned int max_in_flight;	/* 0 for the default, 64 */
+	unsigned int max_retries;	/* resends per call */
+	unsigned int backoff_ms;	/* 0 for the default, 10 */
+	unsigned int timeout_ms;	/* 0 for none */
+};
+
+#define VCMMD_RATE_CONTROL_ALL_CALLS	((1U << __NR_VCMMD_CALLS) - 1)
+
+/*
+ * Phases of a library call, as reported to the trace hook
+ */
+typedef enum {
+	VCMMD_PHASE_DISCOVERY,		/* VCMMD bus name and feature lookup */
+	VCMMD_PHASE_MARSHAL,		/* building the request */
+	VCMMD_PHASE_LOCK_WAIT,		/* waiting for the connection lock */
+	VCMMD_PHASE_CONNECT,		/* connecting to the bus */
+	VCMMD_PHASE_SEND,		/* writing the request to the bus */
+	VCMMD_PHASE_REPLY,		/* waiting for VCMMD to reply */
+	VCMMD_PHASE_UNMARSHAL,		/* parsing the reply */
+
+	__NR_VCMMD_PHASES,
+} vcmmd_phase_t;
+
+/*
+ * Trace span of a finished library call
+ *
+ * Phases follow each other in the order listed in vcmmd_phase_t; a phase
+ * repeated on retry is accounted once with the time of all its runs summed.
+ * Discovery is also reported as a span of its own.
+ */
+struct vcmmd_trace_span {
+	vcmmd_call_t call;
+	const char *ve_name;		/* VE or policy name, or NULL */
+	int result;
+	unsigned int retries;
+	unsigned int reconnects;
+	uint64_t start_ns;		/* CLOCK_MONOTONIC */
+	uint64_t end_ns;		/* CLOCK_MONOTONIC */
+	uint64_t start_realtime_ns;	/* CLOCK_REALTIME */
+	uint64_t phase_ns[__NR_VCMMD_PHASES];
+};
+
+typedef void (*vcmmd_trace_hook_t)(const struct vcmmd_trace_span *span,
+				   void *ctx);
+
+/*
+ * Flight recorder record of a finished library call
+ */
+#define VCMMD_FLIGHT_RECORDER_SIZE	256
+#define VCMMD_RECORD_NAME_LEN		64
+
+struct vcmmd_call_record {
+	uint64_t seq;			/* 1 for the first call recorded */
+	uint64_t end_realtime_ns;	/* CLOCK_REALTIME */
+	uint64_t duration_ns;
+	vcmmd_call_t call;
+	int result;
+	unsigned int retries;
+	unsigned int reconnects;
+	uint32_t config_keys;		/* bitmask of vcmmd_ve_config_key_t */
+	char ve_name[VCMMD_RECORD_NAME_LEN];	/* truncated, may be empty */
+};
+
+/*
+ * Call capture
+ *
+ * If the VCMMD_CAPTURE environment variable names a file when the library is
+ * loaded, every call is appended to that file with its arguments, timing and
+ * result, in a compact binary format. Several processes may share the file.
+ * vcmmd-replay from the source tree re-issues the calls of such a file.
+ */
+
 /*
  * VE config key-value pair
  */
@@ -197,7 +359,7 @@ static inline void vcmmd_ve_config_init(struct vcmmd_ve_config *config)
 
 static inline void vcmmd_ve_config_deinit(struct vcmmd_ve_config *config)
 {
-	int i;
+	unsigned int i;
 	for (i = 0; i < config->nr_entries; i++)
 		if (config->entries[i].str) {
 			free(config->entries[i].str);
@@ -273,6 +435,69 @@ bool vcmmd_ve_config_append_string(struct vcmmd_ve_config *config,
  */
 char *vcmmd_strerror(int err, char *buf, size_t buflen);
 
+/*
+ * vcmmd_set_backend: choose how requests are carried out
+ * @name: backend name
+ *
+ * Backends:
+ *
+ *   "dbus"  send requests to the VCMMD service over D-Bus (default)
+ *   "sdbus" same, using sd-bus from libsystemd, with a bus connection per
+ *           calling thread. Only available if the library was configured
+ *           --with-sdbus.
+ *   "fake"  keep VEs in the memory of the calling process; nothing is sent
+ *           anywhere. Meant for testing and benchmarking code that uses the
+ *           library without VCMMD.
+ *
+ * The fake backend checks requests the way VCMMD does and returns the same
+ * errors. It starts with no VEs and policy "performance" each time it is
+ * chosen. If VCMMD_FAKE_HOST_MEMORY is set in the environment, it refuses
+ * guarantees that do not fit in that many bytes in total.
+ *
+ * If VCMMD or the bus goes away after the dbus or sdbus backend has reached
+ * VCMMD, calls made within the next 10 seconds reconnect and look VCMMD up
+ * again with a jittered backoff of up to 100 ms between tries, so that they
+ * ride out a restart of the service. Before VCMMD has been reached once, and
+ * after that window, calls that cannot reach it fail without waiting.
+ *
+ * The backend may also be chosen with the VCMMD_BACKEND environment variable,
+ * read when the library is loaded. Switching backends while other threads
+ * have calls in progress is not supported.
+ *
+ * Returns 0 on success, an error code on failure.
+ *
+ * Error codes:
+ *
+ *   %VCMMD_ERROR_INVALID_BACKEND
+ */
+int vcmmd_set_backend(const char *name);
+
+/*
+ * vcmmd_get_backend: return name of backend in use
+ *
+ * Returns a static string.
+ */
+const char *vcmmd_get_backend(void);
+
+/*
+ * Request flags
+ *
+ * Flags in VCMMD_FLAGS_LIBRARY are acted upon by the library and never sent
+ * to VCMMD.
+ *
+ * With %VCMMD_FLAG_DRY_RUN, register and update requests are checked, and
+ * admitted or refused, as usual, but change nothing: the VE is not registered
+ * and its config is not updated. Requests with it fail with
+ * %VCMMD_ERROR_NOT_SUPPORTED if VCMMD does not support it, or with the
+ * connection error if VCMMD cannot be asked. Activate requests always refuse
+ * it with %VCMMD_ERROR_NOT_SUPPORTED.
+ */
+#define VCMMD_FLAG_DRY_RUN	(1U << 0)	/* check, change nothing */
+#define VCMMD_FLAG_VALIDATE	(1U << 31)	/* vcmmd_ve_config_validate
+						   the config first */
+
+#define VCMMD_FLAGS_LIBRARY	VCMMD_FLAG_VALIDATE
+
 /*
  * vcmmd_register_ve: register VE
  * @ve_name: VE name
@@ -317,6 +542,7 @@ int vcmmd_register_ve(const char *ve_name, vcmmd_ve_type_t ve_type,
  *   %VCMMD_ERROR_VE_NOT_REGISTERED
  *   %VCMMD_ERROR_VE_ALREADY_ACTIVE
  *   %VCMMD_ERROR_VE_OPERATION_FAILED
+ *   %VCMMD_ERROR_NOT_SUPPORTED
  */
 int vcmmd_activate_ve(const char *ve_name, unsigned int flags);
 
@@ -344,6 +570,175 @@ int vcmmd_update_ve(const char *ve_name,
 		    const struct vcmmd_ve_config *ve_config,
 		    unsigned int flags);
 
+/*
+ * Resources a VE guarantee may fall short of
+ */
+typedef enum {
+	VCMMD_RESOURCE_UNKNOWN = 0,	/* not reported by VCMMD */
+	VCMMD_RESOURCE_HOST_MEMORY,	/* host memory */
+	VCMMD_RESOURCE_NODE_MEMORY,	/* memory of NUMA nodes the VE is
+					   pinned to */
+} vcmmd_resource_t;
+
+#define VCMMD_SHORTFALL_MAX_NODES	64
+
+/*
+ * Admission shortfall, see vcmmd_register_ve_ex
+ */
+struct vcmmd_shortfall {
+	vcmmd_resource_t resource;	/* limiting resource */
+	uint64_t missing;		/* bytes to take off the guarantee */
+	/* bytes missing on each node, for %VCMMD_RESOURCE_NODE_MEMORY */
+	uint64_t node_missing[VCMMD_SHORTFALL_MAX_NODES];
+};
+
+/*
+ * vcmmd_register_ve_ex: register VE, reporting admission shortfall
+ * @ve_name: VE name
+ * @ve_type: VE type
+ * @ve_config: VE config
+ * @flags: flags passed along with the request
+ * @shortfall: pointer to store the shortfall at
+ *
+ * Same as vcmmd_register_ve, but if VCMMD refuses the VE guarantee, @shortfall
+ * tells what it fell short of and by how much: @missing is how far the
+ * guarantee must be reduced to fit right now. For a VE pinned with
+ * %VCMMD_VE_CONFIG_NODE_LIST, the guarantee is spread evenly over the nodes,
+ * and @node_missing tells how much each of them lacks. @shortfall is zeroed
+ * on success and on other errors, and its resource is
+ * %VCMMD_RESOURCE_UNKNOWN if VCMMD does not report shortfalls.
+ *
+ * Returns 0 on success, an error code on failure.
+ *
+ * Error codes: as for vcmmd_register_ve
+ */
+int vcmmd_register_ve_ex(const char *ve_name, vcmmd_ve_type_t ve_type,
+			 const struct vcmmd_ve_config *ve_config,
+			 unsigned int flags,
+			 struct vcmmd_shortfall *shortfall);
+
+/*
+ * vcmmd_update_ve_ex: update VE config, reporting admission shortfall
+ * @ve_name: VE name
+ * @ve_config: VE config
+ * @flags: flags passed along with the request
+ * @shortfall: pointer to store the shortfall at
+ *
+ * Same as vcmmd_update_ve, reporting the shortfall of the updated guarantee
+ * as vcmmd_register_ve_ex does. The VE's current guarantee counts as
+ * available to it.
+ *
+ * Returns 0 on success, an error code on failure.
+ *
+ * Error codes: as for vcmmd_update_ve
+ */
+int vcmmd_update_ve_ex(const char *ve_name,
+		       const struct vcmmd_ve_config *ve_config,
+		       unsigned int flags,
+		       struct vcmmd_shortfall *shortfall);
+
+/*
+ * Acceptable guarantee and limit of a VE, see vcmmd_register_ve_range
+ */
+struct vcmmd_ve_range {
+	uint64_t guarantee_min;
+	uint64_t guarantee_max;
+	uint64_t limit_min;
+	uint64_t limit_max;
+};
+
+/*
+ * vcmmd_register_ve_range: register VE with the best guarantee that fits
+ * @ve_name: VE name
+ * @ve_type: VE type
+ * @ve_config: VE config, %VCMMD_VE_CONFIG_GUARANTEE and %VCMMD_VE_CONFIG_LIMIT
+ *             are ignored
+ * @range: acceptable guarantee and limit
+ * @flags: flags passed along with the request
+ * @guarantee: pointer to store the chosen guarantee at, may be NULL
+ * @limit: pointer to store the chosen limit at, may be NULL
+ *
+ * Same as vcmmd_register_ve, but lets VCMMD choose the guarantee and limit
+ * within @range in a single request. The limit is the largest of the range
+ * not exceeding host memory, but not below @limit_min. The guarantee is the
+ * largest of the range that fits right now and does not exceed the limit.
+ *
+ * If VCMMD cannot choose them, the library does, starting from the host
+ * capacity VCMMD reports and coming down by the reported shortfall, or
+ * halfway to @guarantee_min if none is reported, which takes a few requests.
+ *
+ * Returns 0 on success, an error code on failure.
+ *
+ * Error codes: as for vcmmd_register_ve; %VCMMD_ERROR_INVALID_VE_CONFIG if
+ * a minimum is above a maximum or @guarantee_min is above @limit_max, and
+ * %VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE if not even @guarantee_min fits.
+ */
+int vcmmd_register_ve_range(const char *ve_name, vcmmd_ve_type_t ve_type,
+			    const struct vcmmd_ve_config *ve_config,
+			    const struct vcmmd_ve_range *range,
+			    unsigned int flags,
+			    uint64_t *guarantee, uint64_t *limit);
+
+/*
+ * Frozen request
+ *
+ * Opaque object binding a VE name, type, config and flags, see
+ * vcmmd_ve_config_freeze.
+ */
+struct vcmmd_ve_frozen;
+
+/*
+ * vcmmd_ve_config_freeze: freeze VE config for repeated requests
+ * @ve_name: VE name
+ * @ve_type: VE type, used by vcmmd_register_ve_frozen only
+ * @ve_config: VE config
+ * @flags: flags passed along with the request
+ * @frozen: pointer to store the frozen request at
+ *
+ * With %VCMMD_FLAG_VALIDATE, the config is validated here, once; whether
+ * VCMMD supports the other flags is checked on every use, as VCMMD may be
+ * replaced meanwhile. The config is copied, so @ve_config may be
+ * deinitialized afterwards. The request is marshalled once, on first use,
+ * and every following vcmmd_register_ve_frozen or vcmmd_update_ve_frozen
+ * call reuses the result. A frozen request may be used from several threads
+ * at once. Free it with vcmmd_ve_frozen_free.
+ *
+ * Returns 0 on success, an error code on failure.
+ *
+ * Error codes:
+ *
+ *   %VCMMD_ERROR_NO_MEMORY
+ *   %VCMMD_ERROR_INVALID_VE_CONFIG
+ */
+int vcmmd_ve_config_freeze(const char *ve_name, vcmmd_ve_type_t ve_type,
+			   const struct vcmmd_ve_config *ve_config,
+			   unsigned int flags,
+			   struct vcmmd_ve_frozen **frozen);
+
+/*
+ * vcmmd_ve_frozen_free: free frozen request
+ * @frozen: frozen request, may be NULL
+ */
+void vcmmd_ve_frozen_free(struct vcmmd_ve_frozen *frozen);
+
+/*
+ * vcmmd_register_ve_frozen: register VE using frozen request
+ * @frozen: frozen request
+ *
+ * Same as vcmmd_register_ve called with the arguments given to
+ * vcmmd_ve_config_freeze.
+ */
+int vcmmd_register_ve_frozen(struct vcmmd_ve_frozen *frozen);
+
+/*
+ * vcmmd_update_ve_frozen: update VE config using frozen request
+ * @frozen: frozen request
+ *
+ * Same as vcmmd_update_ve called with the arguments given to
+ * vcmmd_ve_config_freeze.
+ */
+int vcmmd_update_ve_frozen(struct vcmmd_ve_frozen *frozen);
+
 /*
  * vcmmd_deactivate_ve: deactivate VE
  * @ve_name: VE name
@@ -400,6 +795,189 @@ int vcmmd_get_ve_config(const char *ve_name, struct vcmmd_ve_config *ve_config);
  */
 int vcmmd_get_ve_state(const char *ve_name, vcmmd_ve_state_t *ve_state);
 
+/*
+ * Host memory as VCMMD accounts it for guarantees, in bytes
+ */
+struct vcmmd_host_capacity {
+	uint64_t total;		/* memory VCMMD lets VEs have guaranteed */
+	uint64_t guaranteed;	/* sum of guarantees of registered VEs */
+	uint64_t reserved;	/* held for VEs about to be registered */
+	uint64_t available;	/* left for new guarantees */
+	uint64_t generation;	/* changes whenever any of the above does */
+};
+
+/*
+ * vcmmd_get_host_capacity: get host memory accounting snapshot
+ * @cap: pointer to buffer to write the snapshot to
+ *
+ * Registering a VE, or raising its guarantee, fails with
+ * %VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE unless the guarantee, or the
+ * increase, fits in @cap->available. The snapshot lets callers weigh hosts
+ * without sending requests that would fail; it is only as good as long as
+ * @cap->generation stays the same, as other VEs may come and go meanwhile.
+ *
+ * Returns 0 on success, an error code on failure.
+ *
+ * Error codes:
+ *
+ *   %VCMMD_ERROR_NOT_SUPPORTED		VCMMD does not report it
+ */
+int vcmmd_get_host_capacity(struct vcmmd_host_capacity *cap);
+
+/*
+ * NUMA node memory accounting, see vcmmd_get_node_capacity
+ */
+struct vcmmd_node_capacity {
+	uint64_t total;		/* memory of the node VCMMD lets VEs have
+				   guaranteed */
+	/* guarantees and reservations pinned to the node, each spread evenly
+	   over the nodes it is pinned to */
+	uint64_t committed;
+};
+
+/*
+ * vcmmd_get_node_capacity: get NUMA node memory accounting snapshot
+ * @nodes: array to write the snapshot of nodes 0 to @nr_nodes - 1 to
+ * @nr_nodes: number of elements in @nodes
+ *
+ * Tells how much of each node VCMMD has promised to VEs pinned with
+ * %VCMMD_VE_CONFIG_NODE_LIST and to reservations on nodes, whichever process
+ * registered or made them. Nodes VCMMD does not report are zeroed. Like
+ * vcmmd_get_host_capacity, the snapshot may be outdated as soon as it is
+ * taken.
+ *
+ * Returns 0 on success, an error code on failure.
+ *
+ * Error codes:
+ *
+ *   %VCMMD_ERROR_NOT_SUPPORTED		VCMMD does not report it
+ */
+int vcmmd_get_node_capacity(struct vcmmd_node_capacity *nodes,
+			    unsigned int nr_nodes);
+
+/*
+ * Memory reservation token, see vcmmd_reserve
+ */
+typedef uint64_t vcmmd_reservation_t;
+
+/*
+ * vcmmd_reserve: reserve memory for a VE about to be registered
+ * @bytes: memory to reserve
+ * @nodes: NUMA nodes to reserve it on, spread evenly, in the format of
+ *         %VCMMD_VE_CONFIG_NODE_LIST, or NULL for anywhere on the host
+ * @ttl_ms: time in milliseconds after which the reservation expires
+ * @token: pointer to store the reservation token at
+ *
+ * Sets memory aside so that other registrations cannot take it while the VE
+ * is being prepared to start. The reservation is admitted like a guarantee
+ * and counts as reserved in vcmmd_get_host_capacity until it is consumed by
+ * vcmmd_register_ve_reserved, released with vcmmd_unreserve, or expires.
+ *
+ * Returns 0 on success, an error code on failure.
+ *
+ * Error codes:
+ *
+ *   %VCMMD_ERROR_INVALID_VE_CONFIG		@nodes is malformed or
+ *						@ttl_ms is 0
+ *   %VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE	@bytes do not fit
+ *   %VCMMD_ERROR_NOT_SUPPORTED			VCMMD does not support it
+ */
+int vcmmd_reserve(uint64_t bytes, const char *nodes, unsigned int ttl_ms,
+		  vcmmd_reservation_t *token);
+
+/*
+ * vcmmd_unreserve: release memory reservation
+ * @token: reservation token
+ *
+ * Returns 0 on success, an error code on failure.
+ *
+ * Error codes:
+ *
+ *   %VCMMD_ERROR_RESERVATION_NOT_FOUND
+ *   %VCMMD_ERROR_NOT_SUPPORTED
+ */
+int vcmmd_unreserve(vcmmd_reservation_t token);
+
+/*
+ * vcmmd_register_ve_reserved: register VE into a memory reservation
+ * @ve_name: VE name
+ * @ve_type: VE type
+ * @ve_config: VE config
+ * @token: reservation token
+ * @flags: flags passed along with the request
+ *
+ * Same as vcmmd_register_ve, but the VE guarantee is taken out of the
+ * reservation first, and only the part exceeding it must fit in the memory
+ * available. On success, the reservation is consumed and whatever the
+ * guarantee left of it is released; on failure, it is kept.
+ *
+ * Returns 0 on success, an error code on failure.
+ *
+ * Error codes: as for vcmmd_register_ve, and
+ *
+ *   %VCMMD_ERROR_RESERVATION_NOT_FOUND	@token is unknown or expired
+ *   %VCMMD_ERROR_NOT_SUPPORTED
+ */
+int vcmmd_register_ve_reserved(const char *ve_name, vcmmd_ve_type_t ve_type,
+			       const struct vcmmd_ve_config *ve_config,
+			       vcmmd_reservation_t token, unsigned int flags);
+
+/*
+ * VE handle
+ *
+ * Opaque object standing for a VE in repeated requests, see vcmmd_ve_open.
+ */
+struct vcmmd_ve_handle;
+typedef struct vcmmd_ve_handle *vcmmd_ve_handle_t;
+
+/*
+ * vcmmd_ve_open: get handle for VE
+ * @ve_name: VE name
+ * @handle: pointer to store the handle at
+ *
+ * The VE need not be registered yet. If VCMMD supports it, the first request
+ * made with the handle looks up a numeric ID VCMMD has for the VE, and the
+ * following ones send the ID instead of the name, which VCMMD would have to
+ * look up each time. The ID is looked up again if the VE is registered anew
+ * or VCMMD restarts. Otherwise requests made with the handle are sent by
+ * name. A handle may be used from several threads at once. Free it with
+ * vcmmd_ve_close.
+ *
+ * Returns 0 on success, an error code on failure.
+ *
+ * Error codes:
+ *
+ *   %VCMMD_ERROR_NO_MEMORY
+ */
+int vcmmd_ve_open(const char *ve_name, vcmmd_ve_handle_t *handle);
+
+/*
+ * vcmmd_ve_close: free VE handle
+ * @handle: VE handle, may be NULL
+ */
+void vcmmd_ve_close(vcmmd_ve_handle_t handle);
+
+/*
+ * vcmmd_activate_ve_handle, vcmmd_update_ve_handle,
+ * vcmmd_deactivate_ve_handle, vcmmd_get_ve_config_handle,
+ * vcmmd_get_ve_state_handle: requests for VE by handle
+ * @handle: VE handle
+ *
+ * Same as vcmmd_activate_ve, vcmmd_update_ve, vcmmd_deactivate_ve,
+ * vcmmd_get_ve_config and vcmmd_get_ve_state called with the name given to
+ * vcmmd_ve_open. Besides their error codes, these may return any of the
+ * errors of VCMMD service discovery when looking up the VE's ID.
+ */
+int vcmmd_activate_ve_handle(vcmmd_ve_handle_t handle, unsigned int flags);
+int vcmmd_update_ve_handle(vcmmd_ve_handle_t handle,
+			   const struct vcmmd_ve_config *ve_config,
+			   unsigned int flags);
+int vcmmd_deactivate_ve_handle(vcmmd_ve_handle_t handle);
+int vcmmd_get_ve_config_handle(vcmmd_ve_handle_t handle,
+			       struct vcmmd_ve_config *ve_config);
+int vcmmd_get_ve_state_handle(vcmmd_ve_handle_t handle,
+			      vcmmd_ve_state_t *ve_state);
+
 /*
  * vcmmd_get_current_policy: get current policy vcmmd uses
  * @policy_name: buffer for policy name
@@ -426,6 +1004,182 @@ int vcmmd_get_policy_from_file(char *policy_name, int len);
  */
 int vcmmd_set_policy(const char *policy_name);
 
+/*
+ * vcmmd_place_ve: choose NUMA nodes and CPUs for VE
+ * @ve_config: VE config
+ *
+ * This function picks NUMA nodes for a VE so that its memory stays local to
+ * the CPUs it runs on, and appends the resulting %VCMMD_VE_CONFIG_NODE_LIST
+ * and %VCMMD_VE_CONFIG_CPU_LIST to @ve_config. A list already present in the
+ * config is left intact; if only the node list is given, the CPU list is
+ * derived from it.
+ *
+ * The VE memory demand is taken from %VCMMD_VE_CONFIG_GUARANTEE, or from
+ * %VCMMD_VE_CONFIG_LIMIT if the guarantee is omitted, and the CPU demand from
+ * %VCMMD_VE_CONFIG_CPUNUM. Host topology is read from sysfs once and cached.
+ * Free memory is read on each call, and the memory a node can offer is also
+ * bounded by what VCMMD has not promised yet: on the node, as told by
+ * vcmmd_get_node_capacity, and on the whole host, as told by
+ * vcmmd_get_host_capacity, for those that VCMMD supports. A single node is
+ * preferred; if none fits, the nearest nodes are combined.
+ *
+ * Returns 0 on success, an error code on failure.
+ *
+ * Error codes:
+ *
+ *   %VCMMD_ERROR_INVALID_VE_CONFIG
+ *   %VCMMD_ERROR_TOPOLOGY_UNAVAILABLE
+ *   %VCMMD_ERROR_PLACEMENT_FAILED
+ *   %VCMMD_ERROR_NO_MEMORY
+ *
+ * and the errors of asking VCMMD, other than %VCMMD_ERROR_NOT_SUPPORTED.
+ */
+int vcmmd_place_ve(struct vcmmd_ve_config *ve_config);
+
+/*
+ * vcmmd_ve_config_validate: check VE config before sending it
+ * @config: config
+ * @bad_key: pointer to store the offending key at, may be NULL
+ *
+ * Checks what VCMMD would otherwise refuse with
+ * %VCMMD_ERROR_INVALID_VE_CONFIG, without asking it: that every key is
+ * known, that the limit is not below the guarantee, that the guarantee type
+ * is known, and that the NUMA node and CPU lists are well formed, not empty
+ * and name only nodes and CPUs online on this host. Host topology is read
+ * from sysfs once and cached, as for vcmmd_place_ve; if it cannot be read,
+ * the lists are only checked for syntax.
+ *
+ * Returns 0 if the config is valid, %VCMMD_ERROR_INVALID_VE_CONFIG with the
+ * first key found wrong stored in @bad_key otherwise.
+ */
+int vcmmd_ve_config_validate(const struct vcmmd_ve_config *config,
+			     vcmmd_ve_config_key_t *bad_key);
+
+/*
+ * vcmmd_parse_list: parse NUMA node or CPU list
+ * @str: list, like "0-3,8,10-11"
+ * @map: bitmap to store the bits listed in, (@nbits + 63) / 64 words
+ * @nbits: number of bits in @map
+ *
+ * Parses lists the way the library reads the values of
+ * %VCMMD_VE_CONFIG_NODE_LIST and %VCMMD_VE_CONFIG_CPU_LIST: numbers and
+ * ranges separated by commas, with whitespace allowed before the first one
+ * and after each, so a list read from sysfs may end in a newline. An empty
+ * list clears @map.
+ *
+ * Returns 0 on success, %VCMMD_ERROR_INVALID_VE_CONFIG if @str is malformed
+ * or lists a bit not below @nbits.
+ */
+int vcmmd_parse_list(const char *str, uint64_t *map, unsigned int nbits);
+
+/*
+ * vcmmd_call_name: return name of library call
+ * @call: call
+ *
+ * Returns a static string, or NULL if @call is out of range.
+ */
+const char *vcmmd_call_name(vcmmd_call_t call);
+
+/*
+ * vcmmd_get_stats: get library statistics
+ * @stats: pointer to buffer to write statistics to
+ *
+ * Statistics are collected for all calls made by the process since it
+ * started or since the last vcmmd_reset_stats. Counters are read one by one
+ * while calls may be in progress, so they are not guaranteed to be consistent
+ * with each other.
+ */
+void vcmmd_get_stats(struct vcmmd_stats *stats);
+
+/*
+ * vcmmd_reset_stats: reset library statistics
+ */
+void vcmmd_reset_stats(void);
+
+/*
+ * vcmmd_set_rate_control: share VCMMD's capacity between calls
+ * @rc: settings, or NULL to turn rate control off
+ *
+ * VCMMD answers %VCMMD_ERROR_TOO_MANY_REQUESTS when it has more requests
+ * than it can take. With rate control, the calls selected by @rc->calls are
+ * admitted only while fewer than a limit of them are in flight in the
+ * process; others wait for a call to finish. The limit starts at
+ * @rc->max_in_flight, is halved when VCMMD refuses a request for being busy
+ * and grows back by one per limit's worth of requests it answers, up to
+ * @rc->max_in_flight again. A refused call is sent again up to
+ * @rc->max_retries times, after a random delay of between half and all of
+ * @rc->backoff_ms doubled for each try, up to a second. If @rc->timeout_ms
+ * is not 0, a call gives up queuing and retrying once that much time has
+ * passed since it started and returns %VCMMD_ERROR_TOO_MANY_REQUESTS.
+ *
+ * The limit, the calls in flight and the queue depth are reported by
+ * vcmmd_get_stats and vcmmd_metrics_format. Calls in progress keep the
+ * settings they started with.
+ */
+void vcmmd_set_rate_control(const struct vcmmd_rate_control *rc);
+
+/*
+ * vcmmd_set_trace_hook: set trace hook
+ * @hook: function to call, or NULL to disable tracing
+ * @ctx: opaque pointer passed to @hook
+ *
+ * Once set, @hook is called in the calling thread at the end of every library
+ * call with the call's span. The span and the strings it points to are only
+ * valid until @hook returns. @hook must not call into the library. Phases are
+ * timed only while a hook is set.
+ */
+void vcmmd_set_trace_hook(vcmmd_trace_hook_t hook, void *ctx);
+
+/*
+ * vcmmd_flight_recorder_read: read recent calls
+ * @records: buffer to copy records to
+ * @nr: number of records @records can hold
+ *
+ * The library always keeps the last %VCMMD_FLIGHT_RECORDER_SIZE calls in a
+ * lock-free ring buffer. This function copies up to @nr of the most recent
+ * ones, oldest first. Records being written at the moment are skipped.
+ *
+ * Returns the number of records copied.
+ */
+unsigned int vcmmd_flight_recorder_read(struct vcmmd_call_record *records,
+					unsigned int nr);
+
+/*
+ * vcmmd_flight_recorder_dump: write recent calls to file descriptor
+ * @fd: file descriptor
+ *
+ * Writes the records kept by the flight recorder, oldest first, one line of
+ * text per call. This function is async-signal-safe, so it may be called from
+ * a signal handler installed by the application.
+ *
+ * Returns 0 on success, -1 if write failed (errno is set).
+ */
+int vcmmd_flight_recorder_dump(int fd);
+
+/*
+ * vcmmd_metrics_format: render library metrics in OpenMetrics text format
+ * @buf: buffer to write to
+ * @len: size of @buf
+ *
+ * Renders the statistics returned by vcmmd_get_stats (call, error, retry and
+ * reconnect counters, latency histograms) and the connection state. The
+ * output is truncated to fit @buf and always NUL-terminated if @len > 0.
+ *
+ * Returns the length of the full output, not counting the terminating NUL,
+ * like snprintf.
+ */
+size_t vcmmd_metrics_format(char *buf, size_t len);
+
+/*
+ * vcmmd_metrics_write: write library metrics in OpenMetrics text format
+ * @fd: file descriptor
+ *
+ * Same as vcmmd_metrics_format, but writes to @fd.
+ *
+ * Returns 0 on success, -1 if write failed (errno is set).
+ */
+int vcmmd_metrics_write(int fd);
+
 #ifdef __cplusplus
 }
 #endif
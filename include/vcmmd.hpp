@@ -0,0 +1,542 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/*
+ * C++17 wrapper around vcmmd.h
+ *
+ * Header-only; link with libvcmmd as for the C API. Configs are move-only and
+ * free themselves, config keys are typed so that numeric keys take uint64_t
+ * and list keys take a Bitmap, and calls return Result<T> instead of filling
+ * out-params.
+ */
+
+#ifndef _VCMMD_HPP_
+#define _VCMMD_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "vcmmd.h"
+
+namespace vcmmd {
+
+/*
+ * Error code returned by the library or the VCMMD service
+ */
+class Error {
+public:
+	constexpr explicit Error(int code) noexcept : code_(code) {}
+
+	constexpr int code() const noexcept { return code_; }
+
+	std::string message() const
+	{
+		char buf[128];
+		return vcmmd_strerror(code_, buf, sizeof(buf));
+	}
+
+	constexpr bool operator==(const Error &other) const noexcept
+	{
+		return code_ == other.code_;
+	}
+	constexpr bool operator!=(const Error &other) const noexcept
+	{
+		return code_ != other.code_;
+	}
+
+private:
+	int code_;
+};
+
+class BadResultAccess : public std::logic_error {
+public:
+	explicit BadResultAccess(Error err)
+		: std::logic_error(err.message()), error_(err) {}
+
+	Error error() const noexcept { return error_; }
+
+private:
+	Error error_;
+};
+
+/*
+ * Either a value or an Error, modelled after std::expected
+ */
+template <typename T>
+class [[nodiscard]] Result {
+public:
+	Result(const T &value) : v_(value) {}
+	Result(T &&value) : v_(std::move(value)) {}
+	Result(Error err) : v_(err) {}
+
+	bool has_value() const noexcept { return v_.index() == 0; }
+	explicit operator bool() const noexcept { return has_value(); }
+
+	T &value() &
+	{
+		check();
+		return std::get<0>(v_);
+	}
+	const T &value() const &
+	{
+		check();
+		return std::get<0>(v_);
+	}
+	T &&value() &&
+	{
+		check();
+		return std::get<0>(std::move(v_));
+	}
+
+	template <typename U>
+	T value_or(U &&other) const &
+	{
+		return has_value() ? std::get<0>(v_) :
+				     static_cast<T>(std::forward<U>(other));
+	}
+
+	T &operator*() & noexcept { return *std::get_if<0>(&v_); }
+	const T &operator*() const & noexcept { return *std::get_if<0>(&v_); }
+	T &&operator*() && noexcept { return std::move(*std::get_if<0>(&v_)); }
+	T *operator->() noexcept { return std::get_if<0>(&v_); }
+	const T *operator->() const noexcept { return std::get_if<0>(&v_); }
+
+	Error error() const noexcept
+	{
+		return has_value() ? Error(0) : std::get<1>(v_);
+	}
+
+private:
+	void check() const
+	{
+		if (!has_value())
+			throw BadResultAccess(std::get<1>(v_));
+	}
+
+	std::variant<T, Error> v_;
+};
+
+template <>
+class [[nodiscard]] Result<void> {
+public:
+	Result() noexcept : err_(0) {}
+	Result(Error err) noexcept : err_(err) {}
+
+	bool has_value() const noexcept { return err_.code() == 0; }
+	explicit operator bool() const noexcept { return has_value(); }
+
+	void value() const
+	{
+		if (!has_value())
+			throw BadResultAccess(err_);
+	}
+
+	Error error() const noexcept { return err_; }
+
+private:
+	Error err_;
+};
+
+namespace detail {
+
+inline Result<void> to_result(int err)
+{
+	if (err)
+		return Error(err);
+	return {};
+}
+
+/*
+ * NUL-terminated copy of a string_view. Short strings, which VE and policy
+ * names always are, live on the stack so that no allocation is made.
+ */
+class CString {
+public:
+	explicit CString(std::string_view sv)
+	{
+		if (sv.size() < sizeof(buf_)) {
+			std::memcpy(buf_, sv.data(), sv.size());
+			buf_[sv.size()] = '\0';
+			str_ = buf_;
+		} else {
+			heap_.assign(sv);
+			str_ = heap_.c_str();
+		}
+	}
+
+	CString(const CString &) = delete;
+	CString &operator=(const CString &) = delete;
+
+	const char *c_str() const noexcept { return str_; }
+
+private:
+	char buf_[256];
+	std::string heap_;
+	const char *str_;
+};
+
+} // namespace detail
+
+/*
+ * Set of NUMA nodes or CPUs, in list format ("0-3,8") on the wire
+ */
+class Bitmap {
+public:
+	Bitmap() = default;
+	Bitmap(std::initializer_list<unsigned int> bits)
+	{
+		for (unsigned int bit : bits)
+			set(bit);
+	}
+
+	Bitmap &set(unsigned int bit)
+	{
+		if (bit / 64 >= words_.size())
+			words_.resize(bit / 64 + 1);
+		words_[bit / 64] |= 1ULL << (bit % 64);
+		return *this;
+	}
+
+	Bitmap &reset(unsigned int bit) noexcept
+	{
+		if (bit / 64 < words_.size())
+			words_[bit / 64] &= ~(1ULL << (bit % 64));
+		return *this;
+	}
+
+	bool test(unsigned int bit) const noexcept
+	{
+		return bit / 64 < words_.size() &&
+		       (words_[bit / 64] & (1ULL << (bit % 64)));
+	}
+
+	bool empty() const noexcept
+	{
+		for (uint64_t w : words_)
+			if (w)
+				return false;
+		return true;
+	}
+
+	unsigned int size() const noexcept
+	{
+		return static_cast<unsigned int>(words_.size() * 64);
+	}
+
+	std::string to_string() const
+	{
+		std::string s;
+		unsigned int i, first, nbits = size();
+
+		for (i = 0; i < nbits; i++) {
+			if (!test(i))
+				continue;
+			first = i;
+			while (i + 1 < nbits && test(i + 1))
+				i++;
+			if (!s.empty())
+				s += ',';
+			s += std::to_string(first);
+			if (first != i) {
+				s += '-';
+				s += std::to_string(i);
+			}
+		}
+		return s;
+	}
+
+	/*
+	 * Parses @s with vcmmd_parse_list, so accepts exactly the lists the
+	 * library does.
+	 */
+	static Result<Bitmap> parse(std::string_view s)
+	{
+		Bitmap map;
+		int err;
+
+		map.words_.resize(max_bits / 64);
+		err = vcmmd_parse_list(std::string(s).c_str(), map.words_.data(),
+				       max_bits);
+		if (err)
+			return Error(err);
+		while (!map.words_.empty() && !map.words_.back())
+			map.words_.pop_back();
+		return map;
+	}
+
+	bool operator==(const Bitmap &other) const noexcept
+	{
+		size_t i, n = std::max(words_.size(), other.words_.size());
+
+		for (i = 0; i < n; i++) {
+			uint64_t a = i < words_.size() ? words_[i] : 0;
+			uint64_t b = i < other.words_.size() ? other.words_[i] : 0;
+			if (a != b)
+				return false;
+		}
+		return true;
+	}
+	bool operator!=(const Bitmap &other) const noexcept
+	{
+		return !(*this == other);
+	}
+
+private:
+	static constexpr unsigned int max_bits = 1U << 16;
+
+	std::vector<uint64_t> words_;
+};
+
+/*
+ * Typed config keys
+ *
+ * Key<K>::value_type is uint64_t for numeric keys and Bitmap for list keys,
+ * so passing a value of the wrong kind fails to compile.
+ */
+template <vcmmd_ve_config_key_t K>
+struct Key {
+	static constexpr vcmmd_ve_config_key_t id = K;
+	static constexpr bool is_list = K == VCMMD_VE_CONFIG_NODE_LIST ||
+					K == VCMMD_VE_CONFIG_CPU_LIST;
+	using value_type = std::conditional_t<is_list, Bitmap, uint64_t>;
+};
+
+namespace key {
+inline constexpr Key<VCMMD_VE_CONFIG_GUARANTEE> guarantee{};
+inline constexpr Key<VCMMD_VE_CONFIG_LIMIT> limit{};
+inline constexpr Key<VCMMD_VE_CONFIG_SWAP> swap{};
+inline constexpr Key<VCMMD_VE_CONFIG_VRAM> vram{};
+inline constexpr Key<VCMMD_VE_CONFIG_NODE_LIST> node_list{};
+inline constexpr Key<VCMMD_VE_CONFIG_CPU_LIST> cpu_list{};
+inline constexpr Key<VCMMD_VE_CONFIG_GUARANTEE_TYPE> guarantee_type{};
+inline constexpr Key<VCMMD_VE_CONFIG_CACHE> cache{};
+inline constexpr Key<VCMMD_VE_CONFIG_CPUNUM> cpunum{};
+} // namespace key
+
+/*
+ * VE config owning a struct vcmmd_ve_config
+ */
+class Config {
+public:
+	Config() noexcept { vcmmd_ve_config_init(&cfg_); }
+	~Config() { vcmmd_ve_config_deinit(&cfg_); }
+
+	Config(const Config &) = delete;
+	Config &operator=(const Config &) = delete;
+
+	Config(Config &&other) noexcept : cfg_(other.cfg_)
+	{
+		vcmmd_ve_config_init(&other.cfg_);
+	}
+
+	Config &operator=(Config &&other) noexcept
+	{
+		if (this != &other) {
+			vcmmd_ve_config_deinit(&cfg_);
+			cfg_ = other.cfg_;
+			vcmmd_ve_config_init(&other.cfg_);
+		}
+		return *this;
+	}
+
+	/*
+	 * Fails with %VCMMD_ERROR_INVALID_VE_CONFIG if the key is already set
+	 * or is a list key given an empty Bitmap, which VCMMD refuses, or with
+	 * %VCMMD_ERROR_NO_MEMORY if the string cannot be stored.
+	 */
+	template <vcmmd_ve_config_key_t K>
+	Result<void> set(Key<K>, const typename Key<K>::value_type &value)
+	{
+		bool ok;
+
+		if constexpr (Key<K>::is_list) {
+			if (value.empty())
+				return Error(VCMMD_ERROR_INVALID_VE_CONFIG);
+			ok = vcmmd_ve_config_append_string(&cfg_, K,
+						value.to_string().c_str());
+		} else
+			ok = vcmmd_ve_config_append(&cfg_, K, value);
+		if (!ok)
+			return Error(has(Key<K>{}) ?
+				     VCMMD_ERROR_INVALID_VE_CONFIG :
+				     VCMMD_ERROR_NO_MEMORY);
+		return {};
+	}
+
+	template <vcmmd_ve_config_key_t K>
+	std::optional<typename Key<K>::value_type> get(Key<K>) const
+	{
+		if constexpr (Key<K>::is_list) {
+			const char *str;
+
+			if (!vcmmd_ve_config_extract_string(&cfg_, K, &str))
+				return std::nullopt;
+			auto map = Bitmap::parse(str);
+			if (!map)
+				return std::nullopt;
+			return std::move(*map);
+		} else {
+			uint64_t value;
+
+			if (!vcmmd_ve_config_extract(&cfg_, K, &value))
+				return std::nullopt;
+			return value;
+		}
+	}
+
+	template <vcmmd_ve_config_key_t K>
+	bool has(Key<K>) const noexcept
+	{
+		for (unsigned int i = 0; i < cfg_.nr_entries; i++)
+			if (cfg_.entries[i].key == K)
+				return true;
+		return false;
+	}
+
+	unsigned int size() const noexcept { return cfg_.nr_entries; }
+	bool empty() const noexcept { return cfg_.nr_entries == 0; }
+
+	const struct vcmmd_ve_config *native() const noexcept { return &cfg_; }
+	struct vcmmd_ve_config *native() noexcept { return &cfg_; }
+
+private:
+	struct vcmmd_ve_config cfg_;
+};
+
+inline Result<void> register_ve(std::string_view ve_name,
+				vcmmd_ve_type_t ve_type,
+				const Config &ve_config,
+				unsigned int flags = 0)
+{
+	detail::CString name(ve_name);
+
+	return detail::to_result(vcmmd_register_ve(name.c_str(), ve_type,
+						   ve_config.native(), flags));
+}
+
+inline Result<void> activate_ve(std::string_view ve_name,
+				unsigned int flags = 0)
+{
+	detail::CString name(ve_name);
+
+	return detail::to_result(vcmmd_activate_ve(name.c_str(), flags));
+}
+
+inline Result<void> update_ve(std::string_view ve_name,
+			      const Config &ve_config,
+			      unsigned int flags = 0)
+{
+	detail::CString name(ve_name);
+
+	return detail::to_result(vcmmd_update_ve(name.c_str(),
+						 ve_config.native(), flags));
+}
+
+inline Result<void> deactivate_ve(std::string_view ve_name)
+{
+	detail::CString name(ve_name);
+
+	return detail::to_result(vcmmd_deactivate_ve(name.c_str()));
+}
+
+inline Result<void> unregister_ve(std::string_view ve_name)
+{
+	detail::CString name(ve_name);
+
+	return detail::to_result(vcmmd_unregister_ve(name.c_str()));
+}
+
+inline Result<Config> get_ve_config(std::string_view ve_name)
+{
+	detail::CString name(ve_name);
+	Config config;
+	int err;
+
+	err = vcmmd_get_ve_config(name.c_str(), config.native());
+	if (err)
+		return Error(err);
+	return config;
+}
+
+inline Result<vcmmd_ve_state_t> get_ve_state(std::string_view ve_name)
+{
+	detail::CString name(ve_name);
+	vcmmd_ve_state_t state;
+	int err;
+
+	err = vcmmd_get_ve_state(name.c_str(), &state);
+	if (err)
+		return Error(err);
+	return state;
+}
+
+namespace detail {
+
+inline Result<std::string> get_policy(int (*fn)(char *, int))
+{
+	char buf[256];
+	int err;
+
+	err = fn(buf, sizeof(buf));
+	if (err)
+		return Error(err);
+	return std::string(buf);
+}
+
+} // namespace detail
+
+inline Result<std::string> get_current_policy()
+{
+	return detail::get_policy(vcmmd_get_current_policy);
+}
+
+inline Result<std::string> get_policy_from_file()
+{
+	return detail::get_policy(vcmmd_get_policy_from_file);
+}
+
+inline Result<void> set_policy(std::string_view policy_name)
+{
+	detail::CString name(policy_name);
+
+	return detail::to_result(vcmmd_set_policy(name.c_str()));
+}
+
+inline Result<void> place_ve(Config &ve_config)
+{
+	return detail::to_result(vcmmd_place_ve(ve_config.native()));
+}
+
+} // namespace vcmmd
+
+#endif /* _VCMMD_HPP_ */
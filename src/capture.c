@@ -0,0 +1,206 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * Call capture
+ *
+ * If VCMMD_CAPTURE names a file when the library is loaded, every public call
+ * is appended to it with its arguments, timing and result, for replaying it
+ * later with vcmmd-replay. Each record goes out in a single write() to a file
+ * opened with O_APPEND, so threads and processes sharing the file do not need
+ * to lock it. Capture stops at the first failed write, and the file is closed
+ * once no thread is writing to it any more.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+
+#define CAPTURE_BUF_SIZE	4096
+
+static int capture_fd = -1;
+static int failed_fd = -1;		/* to close when writers drop to 0 */
+static unsigned int writers;
+static uint32_t nr_threads;
+static __thread uint32_t capture_thread;
+
+bool __vcmmd_capture_enabled(void)
+{
+	return __atomic_load_n(&capture_fd, __ATOMIC_RELAXED) >= 0;
+}
+
+static size_t record_len(const struct vcmmd_call_ctx *ctx, size_t name_len)
+{
+	size_t len = sizeof(struct vcmmd_capture_record) + name_len;
+	unsigned int i;
+
+	if (ctx->config)
+		for (i = 0; i < ctx->config->nr_entries; i++)
+			len += sizeof(struct vcmmd_capture_entry) +
+			       strlen(ctx->config->entries[i].str ?: "");
+	if (ctx->range)
+		len += sizeof(struct vcmmd_capture_range);
+	return len;
+}
+
+static void fill_record(char *buf, const struct vcmmd_call_ctx *ctx, int err,
+			uint64_t end_ns, size_t len, size_t name_len)
+{
+	struct vcmmd_capture_record rec = {
+		.len		= len,
+		.call		= ctx->call,
+		.ve_type	= ctx->ve_type,
+		.nr_entries	= ctx->config ? ctx->config->nr_entries : 0,
+		.result		= err,
+		.flags		= ctx->flags,
+		.pid		= getpid(),
+		.thread		= capture_thread,
+		.retries	= ctx->retries,
+		.reconnects	= ctx->reconnects,
+		.name_len	= name_len,
+		.start_ns	= ctx->start_ns,
+		.duration_ns	= end_ns - ctx->start_ns,
+	};
+	const struct vcmmd_ve_config_entry *entry;
+	struct vcmmd_capture_range range;
+	struct vcmmd_capture_entry e;
+	unsigned int i;
+
+	memcpy(buf, &rec, sizeof(rec));
+	buf += sizeof(rec);
+	memcpy(buf, ctx->ve_name, name_len);
+	buf += name_len;
+
+	for (i = 0; i < rec.nr_entries; i++) {
+		entry = &ctx->config->entries[i];
+		e.key = entry->key;
+		e.value = entry->value;
+		e.str_len = strlen(entry->str ?: "");
+		memcpy(buf, &e, sizeof(e));
+		buf += sizeof(e);
+		memcpy(buf, entry->str ?: "", e.str_len);
+		buf += e.str_len;
+	}
+
+	if (ctx->range) {
+		range.guarantee_min = ctx->range->guarantee_min;
+		range.guarantee_max = ctx->range->guarantee_max;
+		range.limit_min = ctx->range->limit_min;
+		range.limit_max = ctx->range->limit_max;
+		memcpy(buf, &range, sizeof(range));
+	}
+}
+
+static void write_record(int fd, const struct vcmmd_call_ctx *ctx, int err,
+			 uint64_t end_ns)
+{
+	char stack_buf[CAPTURE_BUF_SIZE], *buf = stack_buf;
+	size_t len, name_len;
+
+	if (!capture_thread)
+		capture_thread = __atomic_add_fetch(&nr_threads, 1,
+						    __ATOMIC_RELAXED);
+
+	name_len = ctx->ve_name ? strnlen(ctx->ve_name, UINT16_MAX) : 0;
+	len = record_len(ctx, name_len);
+	if (len > UINT32_MAX)
+		return;
+	if (len > sizeof(stack_buf)) {
+		buf = malloc(len);
+		if (!buf)
+			return;
+	}
+
+	fill_record(buf, ctx, err, end_ns, len, name_len);
+	/* The thread that takes the fd away hands it over to be closed */
+	if (write(fd, buf, len) != (ssize_t)len &&
+	    __atomic_compare_exchange_n(&capture_fd, &fd, -1, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		__atomic_store_n(&failed_fd, fd, __ATOMIC_SEQ_CST);
+
+	if (buf != stack_buf)
+		free(buf);
+}
+
+void __vcmmd_capture_call(const struct vcmmd_call_ctx *ctx, int err,
+			  uint64_t end_ns)
+{
+	int fd;
+
+	/* Discovery is redone by the replay itself */
+	if (ctx->parent || ctx->call == VCMMD_CALL_DISCOVERY)
+		return;
+
+	/*
+	 * Count ourselves in before looking at the fd, so that it is not
+	 * closed, and its number reused, while we write to it.
+	 */
+	__atomic_add_fetch(&writers, 1, __ATOMIC_SEQ_CST);
+	fd = __atomic_load_n(&capture_fd, __ATOMIC_SEQ_CST);
+	if (fd >= 0)
+		write_record(fd, ctx, err, end_ns);
+	if (!__atomic_sub_fetch(&writers, 1, __ATOMIC_SEQ_CST)) {
+		fd = __atomic_exchange_n(&failed_fd, -1, __ATOMIC_SEQ_CST);
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+static void __attribute__ ((constructor)) capture_init(void)
+{
+	struct vcmmd_capture_header hdr = {
+		.magic		= VCMMD_CAPTURE_MAGIC,
+		.version	= VCMMD_CAPTURE_VERSION,
+	};
+	const char *path = getenv("VCMMD_CAPTURE");
+	struct stat st;
+	int fd;
+
+	if (!path || !*path)
+		return;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+
+	/* Processes starting at once must not both write the header */
+	flock(fd, LOCK_EX);
+	if (fstat(fd, &st) || (st.st_size == 0 &&
+			       write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))) {
+		flock(fd, LOCK_UN);
+		close(fd);
+		return;
+	}
+	flock(fd, LOCK_UN);
+
+	capture_fd = fd;
+}
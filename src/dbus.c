@@ -0,0 +1,1831 @@
+/*
+ *  Copyright (c) 2015-2017, Parallels International GmbH
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/*
+ * D-Bus backend: talks to the VCMMD service on the system bus
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <dbus/dbus.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+
+#define VCMMD_BUSNAME_MAXLEN	128
+
+/*
+ * How long to wait for a reply. Meant to be forever, but not given as
+ * DBUS_TIMEOUT_INFINITE: libdbus then makes threads that wait for replies
+ * on a shared connection take turns, so concurrent calls get serialised.
+ */
+#define VCMMD_REPLY_TIMEOUT_MS	(24 * 3600 * 1000)
+
+/*
+ * VCMMD service discovery cache
+ *
+ * The bus name is looked up once and kept. If VCMMD turns out to be gone
+ * (ServiceUnknown, NameHasNoOwner) or the bus connection breaks, the cache is
+ * marked stale and the name looked up again by the next call, since VCMMD may
+ * come back under another name. The names and message templates are written
+ * under service_mutex; vcmmd_service_gen counts name changes so that
+ * messages built for the old name can be recognized.
+ */
+static char vcmmd_bus_name[VCMMD_BUSNAME_MAXLEN] = {0};
+static char vcmmd_iface_name[VCMMD_BUSNAME_MAXLEN + sizeof(".LoadManager")] = {0};
+static bool vcmmd_service_stale;
+static unsigned int vcmmd_service_gen;
+
+static dbus_uint64_t vcmmd_features;
+static bool vcmmd_features_known;
+
+/* Counts losses of VCMMD, which may come back with other VE IDs */
+static unsigned int vcmmd_service_epoch;
+
+enum {
+	METHOD_REGISTER_VE,
+	METHOD_ACTIVATE_VE,
+	METHOD_UPDATE_VE,
+	METHOD_DEACTIVATE_VE,
+	METHOD_UNREGISTER_VE,
+	METHOD_GET_VE_CONFIG,
+	METHOD_IS_VE_ACTIVE,
+	METHOD_GET_CURRENT_POLICY,
+	METHOD_GET_POLICY_FROM_FILE,
+	METHOD_SWITCH_POLICY,
+	METHOD_GET_FEATURES,
+	METHOD_REGISTER_VE2,
+	METHOD_UPDATE_VE2,
+	METHOD_OPEN_VE,
+	METHOD_ACTIVATE_VE_BY_ID,
+	METHOD_UPDATE_VE_BY_ID,
+	METHOD_DEACTIVATE_VE_BY_ID,
+	METHOD_GET_VE_CONFIG_BY_ID,
+	METHOD_IS_VE_ACTIVE_BY_ID,
+	METHOD_GET_HOST_CAPACITY,
+	METHOD_REGISTER_VE_EX,
+	METHOD_UPDATE_VE_EX,
+	METHOD_REGISTER_VE_RANGE,
+	METHOD_RESERVE,
+	METHOD_UNRESERVE,
+	METHOD_REGISTER_VE_RESERVED,
+	METHOD_GET_NODE_CAPACITY,
+
+	__NR_METHODS,
+};
+
+static const char *method_names[] = {
+	[METHOD_REGISTER_VE]		= "RegisterVE",
+	[METHOD_ACTIVATE_VE]		= "ActivateVE",
+	[METHOD_UPDATE_VE]		= "UpdateVE",
+	[METHOD_DEACTIVATE_VE]		= "DeactivateVE",
+	[METHOD_UNREGISTER_VE]		= "UnregisterVE",
+	[METHOD_GET_VE_CONFIG]		= "GetVEConfig",
+	[METHOD_IS_VE_ACTIVE]		= "IsVEActive",
+	[METHOD_GET_CURRENT_POLICY]	= "GetCurrentPolicy",
+	[METHOD_GET_POLICY_FROM_FILE]	= "GetPolicyFromFile",
+	[METHOD_SWITCH_POLICY]		= "SwitchPolicy",
+	[METHOD_GET_FEATURES]		= "GetFeatures",
+	[METHOD_REGISTER_VE2]		= "RegisterVE2",
+	[METHOD_UPDATE_VE2]		= "UpdateVE2",
+	[METHOD_OPEN_VE]		= "OpenVE",
+	[METHOD_ACTIVATE_VE_BY_ID]	= "ActivateVEById",
+	[METHOD_UPDATE_VE_BY_ID]	= "UpdateVEById",
+	[METHOD_DEACTIVATE_VE_BY_ID]	= "DeactivateVEById",
+	[METHOD_GET_VE_CONFIG_BY_ID]	= "GetVEConfigById",
+	[METHOD_IS_VE_ACTIVE_BY_ID]	= "IsVEActiveById",
+	[METHOD_GET_HOST_CAPACITY]	= "GetHostCapacity",
+	[METHOD_REGISTER_VE_EX]		= "RegisterVEEx",
+	[METHOD_UPDATE_VE_EX]		= "UpdateVEEx",
+	[METHOD_REGISTER_VE_RANGE]	= "RegisterVERange",
+	[METHOD_RESERVE]		= "Reserve",
+	[METHOD_UNRESERVE]		= "Unreserve",
+	[METHOD_REGISTER_VE_RESERVED]	= "RegisterVEReserved",
+	[METHOD_GET_NODE_CAPACITY]	= "GetNodeCapacity",
+};
+
+#define VCMMD_FETCH_BUSNAME do { \
+	int err = get_vcmmd_bus_name(); \
+	if (err || !*vcmmd_bus_name) \
+		return err; \
+} while(0)
+
+static bool append_str(DBusMessageIter *iter, const char *val)
+{
+	return dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &val);
+}
+
+static bool append_int32(DBusMessageIter *iter, dbus_int32_t val)
+{
+	return dbus_message_iter_append_basic(iter, DBUS_TYPE_INT32, &val);
+}
+
+static bool append_uint16(DBusMessageIter *iter, dbus_uint16_t val)
+{
+	return dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT16, &val);
+}
+
+static bool append_uint32(DBusMessageIter *iter, dbus_uint32_t val)
+{
+	return dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT32, &val);
+}
+
+static bool append_uint64(DBusMessageIter *iter, dbus_uint64_t val)
+{
+	return dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT64, &val);
+}
+
+static bool append_config_entry(DBusMessageIter *iter,
+				const struct vcmmd_ve_config_entry *entry)
+{
+	DBusMessageIter sub;
+
+	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, NULL,
+					      &sub) ||
+	    !append_uint16(&sub, entry->key) ||
+	    !append_uint64(&sub, entry->value) ||
+	    !append_str(&sub, entry->str) ||
+	    !dbus_message_iter_close_container(iter, &sub))
+		return false;
+
+	return true;
+}
+
+bool __vcmmd_append_config(DBusMessageIter *iter,
+			   const struct vcmmd_ve_config *config)
+{
+	DBusMessageIter sub;
+	int i;
+
+	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+					      DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+					      DBUS_TYPE_UINT16_AS_STRING
+					      DBUS_TYPE_UINT64_AS_STRING
+						  DBUS_TYPE_STRING_AS_STRING
+					      DBUS_STRUCT_END_CHAR_AS_STRING,
+					      &sub))
+		return false;
+
+	for (i = 0; i < config->nr_entries; i++)
+		if (!append_config_entry(&sub, &config->entries[i]))
+			return false;
+
+	if (!dbus_message_iter_close_container(iter, &sub))
+		return false;
+
+	return true;
+}
+
+/*
+ * Compact config encoding (VCMMD_FEATURE_COMPACT_CONFIG)
+ *
+ * Numeric entries go as a presence mask of keys (t) followed by their values
+ * in ascending key order (at), string entries as a(qs). This saves the empty
+ * string sent with every numeric entry and the dummy value sent with every
+ * string, and lets the values be copied in one go.
+ *
+ * The three go in one struct, (tata(qs)): libdbus rewrites the signature
+ * header field for every top-level argument appended, which costs several
+ * allocations each, so the config must stay a single argument to be any
+ * cheaper than the (qts) array.
+ */
+bool __vcmmd_append_config_compact(DBusMessageIter *iter,
+				   const struct vcmmd_ve_config *config)
+{
+	dbus_uint64_t values[__NR_VCMMD_VE_CONFIG_KEYS];
+	const dbus_uint64_t *values_ptr = values;
+	const struct vcmmd_ve_config_entry *entry;
+	dbus_uint64_t mask = 0;
+	DBusMessageIter st, sub, item;
+	int i, key, nr_values = 0;
+
+	for (i = 0; i < config->nr_entries; i++) {
+		entry = &config->entries[i];
+		if (!vcmmd_ve_config_entry_is_string(entry->key))
+			mask |= 1ULL << entry->key;
+	}
+
+	for (key = 0; key < __NR_VCMMD_VE_CONFIG_KEYS; key++) {
+		if (!(mask & (1ULL << key)))
+			continue;
+		for (i = 0; i < config->nr_entries; i++)
+			if (config->entries[i].key == key)
+				values[nr_values++] = config->entries[i].value;
+	}
+
+	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, NULL,
+					      &st) ||
+	    !append_uint64(&st, mask) ||
+	    !dbus_message_iter_open_container(&st, DBUS_TYPE_ARRAY,
+					      DBUS_TYPE_UINT64_AS_STRING,
+					      &sub) ||
+	    !dbus_message_iter_append_fixed_array(&sub, DBUS_TYPE_UINT64,
+						  &values_ptr, nr_values) ||
+	    !dbus_message_iter_close_container(&st, &sub))
+		return false;
+
+	if (!dbus_message_iter_open_container(&st, DBUS_TYPE_ARRAY,
+					      DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+					      DBUS_TYPE_UINT16_AS_STRING
+					      DBUS_TYPE_STRING_AS_STRING
+					      DBUS_STRUCT_END_CHAR_AS_STRING,
+					      &sub))
+		return false;
+
+	for (i = 0; i < config->nr_entries; i++) {
+		entry = &config->entries[i];
+		if (!vcmmd_ve_config_entry_is_string(entry->key))
+			continue;
+		if (!dbus_message_iter_open_container(&sub, DBUS_TYPE_STRUCT,
+						      NULL, &item) ||
+		    !append_uint16(&item, entry->key) ||
+		    !append_str(&item, entry->str) ||
+		    !dbus_message_iter_close_container(&sub, &item))
+			return false;
+	}
+
+	if (!dbus_message_iter_close_container(&st, &sub) ||
+	    !dbus_message_iter_close_container(iter, &st))
+		return false;
+
+	return true;
+}
+
+/*
+ * Per-method message templates
+ *
+ * A method call header (destination, path, interface, member) is the same
+ * for every call of a method, so it is built and validated once and then
+ * copied for each request.
+ */
+static DBusMessage *msg_templates[__NR_METHODS];
+static pthread_mutex_t service_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static DBusMessage *make_msg(int method, DBusMessageIter *args)
+{
+	DBusMessage *msg = NULL;
+
+	pthread_mutex_lock(&service_mutex);
+	if (!msg_templates[method])
+		msg_templates[method] = dbus_message_new_method_call(
+				vcmmd_bus_name, "/LoadManager",
+				vcmmd_iface_name, method_names[method]);
+	if (msg_templates[method])
+		msg = dbus_message_copy(msg_templates[method]);
+	pthread_mutex_unlock(&service_mutex);
+
+	if (msg && args)
+		dbus_message_iter_init_append(msg, args);
+
+	return msg;
+}
+
+/*
+ * Errors that mean the peer did answer, so dropping the connection would not
+ * help.
+ */
+static bool is_remote_error(DBusConnection *conn, const DBusError *error)
+{
+	return dbus_error_is_set(error) &&
+	       dbus_connection_get_is_connected(conn) &&
+	       !dbus_error_has_name(error, DBUS_ERROR_NO_REPLY) &&
+	       !dbus_error_has_name(error, DBUS_ERROR_TIMEOUT) &&
+	       !dbus_error_has_name(error, DBUS_ERROR_NO_MEMORY) &&
+	       !dbus_error_has_name(error, DBUS_ERROR_DISCONNECTED);
+}
+
+static DBusConnection *conn = NULL;
+static pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool dbus_connected(void)
+{
+	return __atomic_load_n(&conn, __ATOMIC_RELAXED) != NULL;
+}
+
+/*
+ * Make the next call look VCMMD up again. Features are forgotten too: it may
+ * have been restarted as another version.
+ */
+static void invalidate_vcmmd_service(void)
+{
+	if (!__atomic_exchange_n(&vcmmd_service_stale, true, __ATOMIC_RELAXED))
+		VCMMD_PROBE(service__lost);
+	__atomic_store_n(&vcmmd_features_known, false, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&vcmmd_service_epoch, 1, __ATOMIC_RELEASE);
+	__vcmmd_service_lost();
+}
+
+static bool is_service_gone(const DBusError *error)
+{
+	return dbus_error_has_name(error, DBUS_ERROR_SERVICE_UNKNOWN) ||
+	       dbus_error_has_name(error, DBUS_ERROR_NAME_HAS_NO_OWNER);
+}
+
+/*
+ * Only contended acquisitions are timed, so the common case costs nothing.
+ */
+static void lock_conn(pthread_mutex_t *mutex)
+{
+	uint64_t start;
+
+	if (!pthread_mutex_trylock(mutex))
+		return;
+
+	start = __vcmmd_now_ns();
+	pthread_mutex_lock(mutex);
+	__vcmmd_stats_lock_wait(__vcmmd_now_ns() - start);
+}
+
+/*
+ * Same as dbus_connection_send_with_reply_and_block, but the write and the
+ * wait for the reply are timed separately.
+ */
+static DBusMessage *send_and_wait(DBusConnection *c, DBusMessage *msg,
+				  DBusError *error)
+{
+	DBusPendingCall *pending;
+	DBusMessage *reply;
+
+	if (!dbus_connection_send_with_reply(c, msg, &pending,
+					     VCMMD_REPLY_TIMEOUT_MS)) {
+		dbus_set_error_const(error, DBUS_ERROR_NO_MEMORY,
+				     "Out of memory");
+		return NULL;
+	}
+	if (!pending) {
+		dbus_set_error_const(error, DBUS_ERROR_DISCONNECTED,
+				     "Connection is closed");
+		return NULL;
+	}
+
+	dbus_connection_flush(c);
+	__vcmmd_trace_mark(VCMMD_PHASE_SEND);
+
+	dbus_pending_call_block(pending);
+	reply = dbus_pending_call_steal_reply(pending);
+	dbus_pending_call_unref(pending);
+	__vcmmd_trace_mark(VCMMD_PHASE_REPLY);
+
+	if (!reply) {
+		dbus_set_error_const(error, DBUS_ERROR_NO_REPLY,
+				     "No reply received");
+		return NULL;
+	}
+	if (dbus_set_error_from_message(error, reply)) {
+		dbus_message_unref(reply);
+		return NULL;
+	}
+	return reply;
+}
+
+/*
+ * Send @msg and wait for the reply, reconnecting if the connection breaks.
+ * If the peer answers with an error, NULL is returned and the error is stored
+ * in @error unless it is NULL. @msg is consumed.
+ */
+static DBusMessage *__send_msg(DBusMessage *msg, DBusError *error)
+{
+	DBusConnection *c;
+	DBusMessage *reply = NULL;
+	DBusError err;
+
+	int tries_num = 5;
+	unsigned int retries = 0;
+	do {
+		if (retries) {
+			VCMMD_PROBE(send__retry, dbus_message_get_member(msg),
+				    tries_num);
+			__vcmmd_stats_retry();
+			__vcmmd_reconnect_backoff(retries);
+		}
+		retries++;
+
+		__vcmmd_trace_mark(VCMMD_PHASE_MARSHAL);
+		lock_conn(&conn_mutex);
+		__vcmmd_trace_mark(VCMMD_PHASE_LOCK_WAIT);
+		if (!conn) {
+			VCMMD_PROBE(connect__start);
+			conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, NULL);
+			VCMMD_PROBE(connect__done, conn != NULL);
+			__vcmmd_trace_mark(VCMMD_PHASE_CONNECT);
+		}
+		c = conn;
+		if (c)
+			dbus_connection_ref(c);
+		pthread_mutex_unlock(&conn_mutex);
+
+		if (!c)
+			continue;
+
+		VCMMD_PROBE(send__start, dbus_message_get_member(msg),
+			    tries_num);
+		dbus_error_init(&err);
+		reply = send_and_wait(c, msg, &err);
+		VCMMD_PROBE(send__done, dbus_message_get_member(msg),
+			    reply != NULL);
+		if (!reply && is_remote_error(c, &err)) {
+			if (is_service_gone(&err))
+				invalidate_vcmmd_service();
+			if (error)
+				dbus_move_error(&err, error);
+			else
+				dbus_error_free(&err);
+			dbus_connection_unref(c);
+			break;
+		}
+		dbus_error_free(&err);
+
+		/*
+		 * Only a connection that libdbus found broken is dropped. Other
+		 * threads may be waiting for replies on a live one, and closing
+		 * it under them would leave them hanging.
+		 */
+		if (!reply && !dbus_connection_get_is_connected(c)) {
+			lock_conn(&conn_mutex);
+			if (conn == c) {
+				dbus_connection_close(conn);
+				dbus_connection_unref(conn);
+				conn = NULL;
+				VCMMD_PROBE(reconnect);
+				__vcmmd_stats_reconnect();
+				invalidate_vcmmd_service();
+			}
+			pthread_mutex_unlock(&conn_mutex);
+		}
+		dbus_connection_unref(c);
+	} while (!reply && tries_num-- > 0);
+
+	dbus_message_unref(msg);
+
+	lock_conn(&conn_mutex);
+	if (conn) {
+		dbus_connection_flush(conn);
+	}
+	pthread_mutex_unlock(&conn_mutex);
+
+	return reply;
+}
+
+/*
+ * Switch to VCMMD bus name @name. Templates built for another name are
+ * dropped.
+ */
+static void set_vcmmd_bus_name(const char *name)
+{
+	int i;
+
+	pthread_mutex_lock(&service_mutex);
+	if (strcmp(vcmmd_bus_name, name)) {
+		strncpy(vcmmd_bus_name, name, VCMMD_BUSNAME_MAXLEN - 1);
+		strcpy(vcmmd_iface_name, vcmmd_bus_name);
+		strcat(vcmmd_iface_name, ".LoadManager");
+		for (i = 0; i < __NR_METHODS; i++) {
+			if (msg_templates[i])
+				dbus_message_unref(msg_templates[i]);
+			msg_templates[i] = NULL;
+		}
+		__atomic_add_fetch(&vcmmd_service_gen, 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&vcmmd_service_stale, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&service_mutex);
+}
+
+static int __get_vcmmd_bus_name(void)
+{
+	DBusMessage *msg, *reply;
+	DBusMessageIter reply_args, array;
+	char *str, *found = NULL;
+	int err;
+
+	msg = NULL;
+	reply = NULL;
+	err = 0;
+
+	msg = dbus_message_new_method_call("org.freedesktop.DBus", "/DBus",
+	                                   "org.freedesktop.DBus", "ListNames");
+	if (!msg) {
+		err = VCMMD_ERROR_NO_MEMORY;
+		goto error;
+	}
+
+	reply = __send_msg(msg, NULL);
+	if (!reply) {
+		err = VCMMD_ERROR_BUSNAME_FETCH_FAILED;
+		goto error;
+	}
+
+	if (!dbus_message_iter_init(reply, &reply_args) ||
+			dbus_message_iter_get_arg_type(&reply_args) != DBUS_TYPE_ARRAY) {
+		err = VCMMD_ERROR_BUSNAME_FETCH_FAILED;
+		goto error;
+	}
+
+	dbus_message_iter_recurse(&reply_args, &array);
+	do {
+		str = NULL;
+		dbus_message_iter_get_basic(&array, &str);
+		if (str && strnlen(str, VCMMD_BUSNAME_MAXLEN) > 0 &&
+				strstr(str, ".vcmmd")) {
+			found = str;
+			break;
+		}
+	} while (dbus_message_iter_next(&array));
+
+	if (found) {
+		set_vcmmd_bus_name(found);
+		__vcmmd_service_found();
+	} else {
+		/* We've looked through and still couldn't find the bus name. */
+		err = VCMMD_ERROR_BUSNAME_FETCH_FAILED;
+		goto error;
+	}
+
+error:
+	if (reply)
+		dbus_message_unref(reply);
+	return err;
+}
+
+/* Discoveries failed in a row, all threads together */
+static unsigned int discovery_failures;
+
+static int get_vcmmd_bus_name(void)
+{
+	struct vcmmd_call_ctx call;
+	unsigned int failures;
+	int err;
+
+	if (*vcmmd_bus_name &&
+	    !__atomic_load_n(&vcmmd_service_stale, __ATOMIC_RELAXED))
+		return 0;
+
+	VCMMD_PROBE(discovery__entry);
+	__vcmmd_call_begin(&call, VCMMD_CALL_DISCOVERY, NULL);
+	/* Do not have every caller query the bus while VCMMD restarts */
+	failures = __atomic_load_n(&discovery_failures, __ATOMIC_RELAXED);
+	if (failures)
+		__vcmmd_reconnect_backoff(failures);
+	err = __vcmmd_call_end(&call, __get_vcmmd_bus_name());
+	if (err)
+		__atomic_add_fetch(&discovery_failures, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(&discovery_failures, 0, __ATOMIC_RELAXED);
+	VCMMD_PROBE(discovery__return, vcmmd_bus_name, err);
+	return err;
+}
+
+/*
+ * Ask VCMMD which optional features it supports. The answer is cached; if
+ * the service cannot be reached, the error is returned and it will be asked
+ * again next time.
+ */
+static int __get_vcmmd_features(void)
+{
+	DBusMessage *msg, *reply;
+	dbus_uint64_t features = 0;
+	DBusError error;
+
+	msg = make_msg(METHOD_GET_FEATURES, NULL);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+
+	dbus_error_init(&error);
+	reply = __send_msg(msg, &error);
+	if (!reply) {
+		/* Services predating GetFeatures */
+		if (dbus_error_has_name(&error, DBUS_ERROR_UNKNOWN_METHOD))
+			goto out;
+		dbus_error_free(&error);
+		return VCMMD_ERROR_CONNECTION_FAILED;
+	}
+
+	if (!dbus_message_get_args(reply, NULL,
+				   DBUS_TYPE_UINT64, &features,
+				   DBUS_TYPE_INVALID))
+		features = 0;
+	dbus_message_unref(reply);
+out:
+	dbus_error_free(&error);
+	vcmmd_features = features;
+	__atomic_store_n(&vcmmd_features_known, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Get the features VCMMD supports into @features. Returns 0, or the error
+ * that kept VCMMD from answering, in which case no features are assumed.
+ */
+static int get_vcmmd_features(dbus_uint64_t *features)
+{
+	struct vcmmd_call_ctx call;
+	int err = 0;
+
+	if (!__atomic_load_n(&vcmmd_features_known, __ATOMIC_ACQUIRE)) {
+		__vcmmd_call_begin(&call, VCMMD_CALL_DISCOVERY, NULL);
+		err = __vcmmd_call_end(&call, __get_vcmmd_features());
+	}
+	*features = err ? 0 : vcmmd_features;
+	return err;
+}
+
+/*
+ * Whether to use @feature for a request that can do without it. If VCMMD
+ * cannot be asked, the plain request is sent, and fails on its own.
+ */
+static bool has_feature(dbus_uint64_t feature)
+{
+	dbus_uint64_t features;
+
+	return !get_vcmmd_features(&features) && (features & feature);
+}
+
+/*
+ * Check that VCMMD supports @feature, for requests that need it
+ */
+static int require_feature(dbus_uint64_t feature)
+{
+	dbus_uint64_t features;
+	int err;
+
+	err = get_vcmmd_features(&features);
+	if (err)
+		return err;
+	return features & feature ? 0 : VCMMD_ERROR_NOT_SUPPORTED;
+}
+
+static int send_msg(DBusMessage *msg)
+{
+	DBusMessage *reply;
+	dbus_int32_t err;
+
+	reply = __send_msg(msg, NULL);
+	if (!reply)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+
+	if (!dbus_message_get_args(reply, NULL, DBUS_TYPE_INT32, &err,
+				   DBUS_TYPE_INVALID)) {
+		dbus_message_unref(reply);
+		return VCMMD_ERROR_CONNECTION_FAILED;
+	}
+
+	dbus_message_unref(reply);
+
+	return err;
+}
+
+static bool use_compact_config(void)
+{
+	return has_feature(VCMMD_FEATURE_COMPACT_CONFIG);
+}
+
+/*
+ * Build a RegisterVE message, or its compact config counterpart @method
+ */
+static DBusMessage *make_register_msg(const char *ve_name,
+				      vcmmd_ve_type_t ve_type,
+				      const struct vcmmd_ve_config *ve_config,
+				      unsigned int flags, int method)
+{
+	bool compact = method != METHOD_REGISTER_VE;
+	DBusMessage *msg;
+	DBusMessageIter args;
+
+	msg = make_msg(method, &args);
+	if (!msg)
+		return NULL;
+
+	if (!append_str(&args, ve_name) ||
+	    !append_int32(&args, ve_type) ||
+	    !(compact ? __vcmmd_append_config_compact(&args, ve_config) :
+			__vcmmd_append_config(&args, ve_config)) ||
+	    !append_uint32(&args, flags)) {
+		dbus_message_unref(msg);
+		return NULL;
+	}
+
+	return msg;
+}
+
+/*
+ * Build an UpdateVE message, or its compact config counterpart @method
+ */
+static DBusMessage *make_update_msg(const char *ve_name,
+				    const struct vcmmd_ve_config *ve_config,
+				    unsigned int flags, int method)
+{
+	bool compact = method != METHOD_UPDATE_VE;
+	DBusMessage *msg;
+	DBusMessageIter args;
+
+	msg = make_msg(method, &args);
+	if (!msg)
+		return NULL;
+
+	if (!append_str(&args, ve_name) ||
+	    !(compact ? __vcmmd_append_config_compact(&args, ve_config) :
+			__vcmmd_append_config(&args, ve_config)) ||
+	    !append_uint32(&args, flags)) {
+		dbus_message_unref(msg);
+		return NULL;
+	}
+
+	return msg;
+}
+
+
+static int do_register_ve(const char *ve_name, vcmmd_ve_type_t ve_type,
+			  const struct vcmmd_ve_config *ve_config,
+			  unsigned int flags)
+{
+	DBusMessage *msg;
+
+	VCMMD_FETCH_BUSNAME;
+
+	msg = make_register_msg(ve_name, ve_type, ve_config, flags,
+				use_compact_config() ? METHOD_REGISTER_VE2 :
+						       METHOD_REGISTER_VE);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+
+	return send_msg(msg);
+}
+
+/*
+ * Frozen requests
+ *
+ * The RegisterVE/UpdateVE message for a frozen request is marshalled on first
+ * use and kept; subsequent sends only copy it.
+ */
+static void release_frozen(struct vcmmd_ve_frozen *frozen)
+{
+	if (frozen->register_msg)
+		dbus_message_unref(frozen->register_msg);
+	if (frozen->update_msg)
+		dbus_message_unref(frozen->update_msg);
+	frozen->register_msg = frozen->update_msg = NULL;
+}
+
+static DBusMessage *make_frozen_msg(struct vcmmd_ve_frozen *frozen,
+				    int method)
+{
+	DBusMessage **cached, *msg = NULL;
+	bool compact = use_compact_config();
+	unsigned int gen = __atomic_load_n(&vcmmd_service_gen, __ATOMIC_ACQUIRE);
+
+	cached = method == METHOD_REGISTER_VE ? &frozen->register_msg :
+						&frozen->update_msg;
+
+	pthread_mutex_lock(&frozen->mutex);
+	if (compact != frozen->compact || gen != frozen->service_gen) {
+		/*
+		 * The service changed its mind about the encoding or moved to
+		 * another bus name
+		 */
+		release_frozen(frozen);
+		frozen->compact = compact;
+		frozen->service_gen = gen;
+	}
+	if (!*cached)
+		*cached = method == METHOD_REGISTER_VE ?
+			make_register_msg(frozen->ve_name, frozen->ve_type,
+					  &frozen->config, frozen->flags,
+					  compact ? METHOD_REGISTER_VE2 :
+						    METHOD_REGISTER_VE) :
+			make_update_msg(frozen->ve_name, &frozen->config,
+					frozen->flags,
+					compact ? METHOD_UPDATE_VE2 :
+						  METHOD_UPDATE_VE);
+	if (*cached)
+		msg = dbus_message_copy(*cached);
+	pthread_mutex_unlock(&frozen->mutex);
+
+	return msg;
+}
+
+static int do_register_ve_frozen(struct vcmmd_ve_frozen *frozen)
+{
+	DBusMessage *msg;
+
+	VCMMD_FETCH_BUSNAME;
+
+	msg = make_frozen_msg(frozen, METHOD_REGISTER_VE);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+
+	return send_msg(msg);
+}
+
+static int do_update_ve_frozen(struct vcmmd_ve_frozen *frozen)
+{
+	DBusMessage *msg;
+
+	VCMMD_FETCH_BUSNAME;
+
+	msg = make_frozen_msg(frozen, METHOD_UPDATE_VE);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+
+	return send_msg(msg);
+}
+
+static int do_activate_ve(const char *ve_name, unsigned int flags)
+{
+	DBusMessage *msg;
+	DBusMessageIter args;
+
+	VCMMD_FETCH_BUSNAME;
+
+	msg = make_msg(METHOD_ACTIVATE_VE, &args);
+	if (!msg ||
+	    !append_str(&args, ve_name) ||
+	    !append_uint32(&args, flags))
+		return VCMMD_ERROR_NO_MEMORY;
+
+	return send_msg(msg);
+}
+
+static int do_update_ve(const char *ve_name,
+			const struct vcmmd_ve_config *ve_config,
+			unsigned int flags)
+{
+	DBusMessage *msg;
+
+	VCMMD_FETCH_BUSNAME;
+
+	msg = make_update_msg(ve_name, ve_config, flags,
+			      use_compact_config() ? METHOD_UPDATE_VE2 :
+						     METHOD_UPDATE_VE);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+
+	return send_msg(msg);
+}
+
+/*
+ * Requests reporting admission shortfall (VCMMD_FEATURE_SHORTFALL)
+ *
+ * RegisterVEEx and UpdateVEEx take the same arguments as RegisterVE2 and
+ * UpdateVE2. The reply carries the error code followed by the limiting
+ * resource (u), the missing bytes (t) and the bytes missing on each node
+ * (a(qt)), which only mean something with the error code
+ * VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE.
+ */
+static bool use_shortfall(void)
+{
+	return has_feature(VCMMD_FEATURE_SHORTFALL);
+}
+
+static int parse_shortfall(DBusMessage *reply,
+			   struct vcmmd_shortfall *shortfall)
+{
+	DBusMessageIter args, array, item;
+	dbus_int32_t err;
+	dbus_uint32_t resource;
+	dbus_uint64_t missing;
+	dbus_uint16_t node;
+
+	if (!dbus_message_iter_init(reply, &args) ||
+	    dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_INT32)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+	dbus_message_iter_get_basic(&args, &err);
+
+	if (!dbus_message_iter_next(&args) ||
+	    dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_UINT32)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+	dbus_message_iter_get_basic(&args, &resource);
+
+	if (!dbus_message_iter_next(&args) ||
+	    dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_UINT64)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+	dbus_message_iter_get_basic(&args, &missing);
+
+	if (!dbus_message_iter_next(&args) ||
+	    dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_ARRAY)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+
+	if (err != VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE)
+		return err;
+
+	shortfall->resource = resource;
+	shortfall->missing = missing;
+
+	dbus_message_iter_recurse(&args, &array);
+	while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+		dbus_message_iter_recurse(&array, &item);
+		if (dbus_message_iter_get_arg_type(&item) != DBUS_TYPE_UINT16)
+			return VCMMD_ERROR_CONNECTION_FAILED;
+		dbus_message_iter_get_basic(&item, &node);
+		if (!dbus_message_iter_next(&item) ||
+		    dbus_message_iter_get_arg_type(&item) != DBUS_TYPE_UINT64)
+			return VCMMD_ERROR_CONNECTION_FAILED;
+		dbus_message_iter_get_basic(&item, &missing);
+		if (node < VCMMD_SHORTFALL_MAX_NODES)
+			shortfall->node_missing[node] = missing;
+		dbus_message_iter_next(&array);
+	}
+
+	return err;
+}
+
+static int send_msg_shortfall(DBusMessage *msg,
+			      struct vcmmd_shortfall *shortfall)
+{
+	DBusMessage *reply;
+	int err;
+
+	reply = __send_msg(msg, NULL);
+	if (!reply)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+
+	err = parse_shortfall(reply, shortfall);
+	dbus_message_unref(reply);
+	return err;
+}
+
+static int do_register_ve_ex(const char *ve_name, vcmmd_ve_type_t ve_type,
+			     const struct vcmmd_ve_config *ve_config,
+			     unsigned int flags,
+			     struct vcmmd_shortfall *shortfall)
+{
+	DBusMessage *msg;
+
+	VCMMD_FETCH_BUSNAME;
+
+	if (!use_shortfall())
+		return do_register_ve(ve_name, ve_type, ve_config, flags);
+
+	msg = make_register_msg(ve_name, ve_type, ve_config, flags,
+				METHOD_REGISTER_VE_EX);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+
+	return send_msg_shortfall(msg, shortfall);
+}
+
+static int do_update_ve_ex(const char *ve_name,
+			   const struct vcmmd_ve_config *ve_config,
+			   unsigned int flags,
+			   struct vcmmd_shortfall *shortfall)
+{
+	DBusMessage *msg;
+
+	VCMMD_FETCH_BUSNAME;
+
+	if (!use_shortfall())
+		return do_update_ve(ve_name, ve_config, flags);
+
+	msg = make_update_msg(ve_name, ve_config, flags, METHOD_UPDATE_VE_EX);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+
+	return send_msg_shortfall(msg, shortfall);
+}
+
+/*
+ * Range registration (VCMMD_FEATURE_VE_RANGE)
+ *
+ * RegisterVERange takes the VE name, type and compact config followed by the
+ * guarantee and limit ranges (tttt) and the flags, and replies with the error
+ * code followed by the chosen guarantee and limit (tt).
+ */
+static int do_register_ve_range(const char *ve_name, vcmmd_ve_type_t ve_type,
+				const struct vcmmd_ve_config *ve_config,
+				const struct vcmmd_ve_range *range,
+				unsigned int flags,
+				uint64_t *guarantee, uint64_t *limit)
+{
+	DBusMessage *msg, *reply;
+	DBusMessageIter args;
+	dbus_uint64_t g, l;
+	dbus_int32_t err;
+
+	VCMMD_FETCH_BUSNAME;
+
+	err = require_feature(VCMMD_FEATURE_VE_RANGE);
+	if (err)
+		return err;
+
+	msg = make_msg(METHOD_REGISTER_VE_RANGE, &args);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+	if (!append_str(&args, ve_name) ||
+	    !append_int32(&args, ve_type) ||
+	    !__vcmmd_append_config_compact(&args, ve_config) ||
+	    !append_uint64(&args, range->guarantee_min) ||
+	    !append_uint64(&args, range->guarantee_max) ||
+	    !append_uint64(&args, range->limit_min) ||
+	    !append_uint64(&args, range->limit_max) ||
+	    !append_uint32(&args, flags)) {
+		dbus_message_unref(msg);
+		return VCMMD_ERROR_NO_MEMORY;
+	}
+
+	reply = __send_msg(msg, NULL);
+	if (!reply)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+
+	if (!dbus_message_get_args(reply, NULL,
+				   DBUS_TYPE_INT32, &err,
+				   DBUS_TYPE_UINT64, &g,
+				   DBUS_TYPE_UINT64, &l,
+				   DBUS_TYPE_INVALID))
+		err = VCMMD_ERROR_CONNECTION_FAILED;
+	dbus_message_unref(reply);
+	if (err)
+		return err;
+
+	*guarantee = g;
+	*limit = l;
+	return 0;
+}
+
+static int do_deactivate_ve(const char *ve_name)
+{
+	DBusMessage *msg;
+	DBusMessageIter args;
+
+	VCMMD_FETCH_BUSNAME;
+
+	msg = make_msg(METHOD_DEACTIVATE_VE, &args);
+	if (!msg ||
+	    !append_str(&args, ve_name))
+		return VCMMD_ERROR_NO_MEMORY;
+
+	return send_msg(msg);
+}
+
+static int do_unregister_ve(const char *ve_name)
+{
+	DBusMessage *msg;
+	DBusMessageIter args;
+
+	VCMMD_FETCH_BUSNAME;
+
+	msg = make_msg(METHOD_UNREGISTER_VE, &args);
+	if (!msg ||
+	    !append_str(&args, ve_name))
+		return VCMMD_ERROR_NO_MEMORY;
+
+	return send_msg(msg);
+}
+
+int __vcmmd_parse_ve_config(DBusMessage *reply,
+			    struct vcmmd_ve_config *ve_config)
+{
+	DBusMessageIter args, array, structure;
+	dbus_int32_t err;
+	dbus_uint16_t t;
+	vcmmd_ve_config_key_t tag;
+	dbus_uint64_t value;
+	char *string;
+
+	vcmmd_ve_config_init(ve_config);
+
+	dbus_message_iter_init(reply, &args);
+	if (DBUS_TYPE_INT32 != dbus_message_iter_get_arg_type(&args)) {
+		err = VCMMD_ERROR_INVALID_VE_CONFIG;
+		goto error;
+	}
+
+	dbus_message_iter_get_basic(&args, &err);
+	if (err)
+		goto error;
+
+	err = VCMMD_ERROR_INVALID_VE_CONFIG;
+
+	if (FALSE == dbus_message_iter_next(&args) ||
+			DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&args))
+		goto error;
+	dbus_message_iter_recurse(&args, &array);
+
+	if (dbus_message_iter_get_element_count(&args) == 0) {
+		/* We treat empty config (i.e. empty D-Bus array) as valid. */
+		return 0;
+	}
+
+	do {
+		if (DBUS_TYPE_STRUCT != dbus_message_iter_get_arg_type(&array))
+			goto error;
+		dbus_message_iter_recurse(&array, &structure);
+		if (DBUS_TYPE_UINT16 != dbus_message_iter_get_arg_type(&structure))
+			goto error;
+		dbus_message_iter_get_basic(&structure, &t);
+		tag = (vcmmd_ve_config_key_t)t;
+		if (FALSE == dbus_message_iter_next(&structure) ||
+				DBUS_TYPE_UINT64 != dbus_message_iter_get_arg_type(&structure))
+			goto error;
+		dbus_message_iter_get_basic(&structure, &value);
+		if (FALSE == dbus_message_iter_next(&structure) ||
+				DBUS_TYPE_STRING != dbus_message_iter_get_arg_type(&structure))
+			goto error;
+		dbus_message_iter_get_basic(&structure, &string);
+
+		if (vcmmd_ve_config_entry_is_string(tag)) {
+			if (!vcmmd_ve_config_append_string(ve_config, tag, string))
+				goto error;
+		}
+		else {
+			if (!vcmmd_ve_config_append(ve_config, tag, value))
+				goto error;
+		}
+	} while (TRUE == dbus_message_iter_next(&array));
+
+	return 0;
+
+error:
+	vcmmd_ve_config_deinit(ve_config);
+	return (int) err;
+}
+
+static int do_get_ve_config(const char *ve_name, struct vcmmd_ve_config *ve_config)
+{
+	DBusMessage *msg, *reply;
+	DBusMessageIter args;
+	int err;
+
+	VCMMD_FETCH_BUSNAME;
+
+	msg = make_msg(METHOD_GET_VE_CONFIG, &args);
+	if (!msg ||
+	    !append_str(&args, ve_name))
+		return VCMMD_ERROR_NO_MEMORY;
+
+	reply = __send_msg(msg, NULL);
+	if (!reply)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+
+	err = __vcmmd_parse_ve_config(reply, ve_config);
+
+	/* Frees data */
+	dbus_message_unref(reply);
+	return err;
+}
+
+static int do_get_ve_state(const char *ve_name, vcmmd_ve_state_t *ve_state)
+{
+	DBusMessage *msg, *reply;
+	DBusMessageIter args;
+	dbus_int32_t err;
+	dbus_bool_t active;
+
+	VCMMD_FETCH_BUSNAME;
+
+	msg = make_msg(METHOD_IS_VE_ACTIVE, &args);
+	if (!msg ||
+	    !append_str(&args, ve_name))
+		return VCMMD_ERROR_NO_MEMORY;
+
+	reply = __send_msg(msg, NULL);
+	if (!reply)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+
+	if (!dbus_message_get_args(reply, NULL,
+				   DBUS_TYPE_INT32, &err,
+				   DBUS_TYPE_BOOLEAN, &active,
+				   DBUS_TYPE_INVALID)) {
+		dbus_message_unref(reply);
+		return VCMMD_ERROR_CONNECTION_FAILED;
+	}
+
+	dbus_message_unref(reply);
+
+	if (err) {
+		if (err == VCMMD_ERROR_VE_NOT_REGISTERED) {
+			*ve_state = VCMMD_VE_UNREGISTERED;
+			err = 0;
+		}
+		return err;
+	}
+
+	if (active)
+		*ve_state = VCMMD_VE_ACTIVE;
+	else
+		*ve_state = VCMMD_VE_REGISTERED;
+	return 0;
+}
+
+static int do_get_current_policy(char *policy_name, int len)
+{
+	DBusMessage *msg, *reply;
+	char *ret;
+
+	VCMMD_FETCH_BUSNAME;
+
+	msg = make_msg(METHOD_GET_CURRENT_POLICY, NULL);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+
+	reply = __send_msg(msg, NULL);
+	if (!reply)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+
+	if (!dbus_message_get_args(reply, NULL,
+				   DBUS_TYPE_STRING, &ret,
+				   DBUS_TYPE_INVALID)) {
+		dbus_message_unref(reply);
+		return VCMMD_ERROR_CONNECTION_FAILED;
+	}
+
+	if (strlen(ret) > len - 1) {
+		dbus_message_unref(reply);
+		return VCMMD_ERROR_NO_MEMORY;
+	}
+
+	strcpy(policy_name, ret);
+	dbus_message_unref(reply);
+	return 0;
+}
+
+static int do_get_policy_from_file(char *policy_name, int len)
+{
+	DBusMessage *msg, *reply;
+	char *ret;
+
+	VCMMD_FETCH_BUSNAME;
+
+	msg = make_msg(METHOD_GET_POLICY_FROM_FILE, NULL);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+
+	reply = __send_msg(msg, NULL);
+	if (!reply)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+
+	if (!dbus_message_get_args(reply, NULL,
+				   DBUS_TYPE_STRING, &ret,
+				   DBUS_TYPE_INVALID)) {
+		dbus_message_unref(reply);
+		return VCMMD_ERROR_CONNECTION_FAILED;
+	}
+
+	if (strlen(ret) > len - 1) {
+		dbus_message_unref(reply);
+		return VCMMD_ERROR_NO_MEMORY;
+	}
+
+	strcpy(policy_name, ret);
+	dbus_message_unref(reply);
+	return 0;
+}
+
+static int do_set_policy(const char *policy_name)
+{
+	DBusMessage *msg;
+	DBusMessageIter args;
+
+	VCMMD_FETCH_BUSNAME;
+
+	msg = make_msg(METHOD_SWITCH_POLICY, &args);
+	if (!msg ||
+	    !append_str(&args, policy_name))
+		return VCMMD_ERROR_NO_MEMORY;
+
+	return send_msg(msg);
+}
+
+static int do_get_host_capacity(struct vcmmd_host_capacity *cap)
+{
+	DBusMessage *msg, *reply;
+	dbus_uint64_t total, guaranteed, reserved, available, generation;
+	dbus_int32_t err;
+
+	VCMMD_FETCH_BUSNAME;
+
+	err = require_feature(VCMMD_FEATURE_HOST_CAPACITY);
+	if (err)
+		return err;
+
+	msg = make_msg(METHOD_GET_HOST_CAPACITY, NULL);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+
+	reply = __send_msg(msg, NULL);
+	if (!reply)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+
+	if (!dbus_message_get_args(reply, NULL,
+				   DBUS_TYPE_INT32, &err,
+				   DBUS_TYPE_UINT64, &total,
+				   DBUS_TYPE_UINT64, &guaranteed,
+				   DBUS_TYPE_UINT64, &reserved,
+				   DBUS_TYPE_UINT64, &available,
+				   DBUS_TYPE_UINT64, &generation,
+				   DBUS_TYPE_INVALID))
+		err = VCMMD_ERROR_CONNECTION_FAILED;
+	dbus_message_unref(reply);
+	if (err)
+		return err;
+
+	cap->total = total;
+	cap->guaranteed = guaranteed;
+	cap->reserved = reserved;
+	cap->available = available;
+	cap->generation = generation;
+	return 0;
+}
+
+/*
+ * GetNodeCapacity replies with the error code and, for each node VCMMD
+ * models, its number, total and committed memory (ia(qtt)).
+ */
+static int read_node_capacity(DBusMessage *reply,
+			      struct vcmmd_node_capacity *nodes,
+			      unsigned int nr_nodes)
+{
+	DBusMessageIter args, array, item;
+	dbus_uint64_t total, committed;
+	dbus_uint16_t node;
+	dbus_int32_t err;
+
+	if (!dbus_message_iter_init(reply, &args) ||
+	    dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_INT32)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+	dbus_message_iter_get_basic(&args, &err);
+	if (err)
+		return err;
+
+	if (!dbus_message_iter_next(&args) ||
+	    dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_ARRAY)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+
+	dbus_message_iter_recurse(&args, &array);
+	while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+		dbus_message_iter_recurse(&array, &item);
+		if (dbus_message_iter_get_arg_type(&item) != DBUS_TYPE_UINT16)
+			return VCMMD_ERROR_CONNECTION_FAILED;
+		dbus_message_iter_get_basic(&item, &node);
+		if (!dbus_message_iter_next(&item) ||
+		    dbus_message_iter_get_arg_type(&item) != DBUS_TYPE_UINT64)
+			return VCMMD_ERROR_CONNECTION_FAILED;
+		dbus_message_iter_get_basic(&item, &total);
+		if (!dbus_message_iter_next(&item) ||
+		    dbus_message_iter_get_arg_type(&item) != DBUS_TYPE_UINT64)
+			return VCMMD_ERROR_CONNECTION_FAILED;
+		dbus_message_iter_get_basic(&item, &committed);
+		if (node < nr_nodes) {
+			nodes[node].total = total;
+			nodes[node].committed = committed;
+		}
+		dbus_message_iter_next(&array);
+	}
+	return 0;
+}
+
+static int do_get_node_capacity(struct vcmmd_node_capacity *nodes,
+				unsigned int nr_nodes)
+{
+	DBusMessage *msg, *reply;
+	int err;
+
+	VCMMD_FETCH_BUSNAME;
+
+	err = require_feature(VCMMD_FEATURE_NODE_CAPACITY);
+	if (err)
+		return err;
+
+	msg = make_msg(METHOD_GET_NODE_CAPACITY, NULL);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+
+	reply = __send_msg(msg, NULL);
+	if (!reply)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+
+	memset(nodes, 0, nr_nodes * sizeof(*nodes));
+	err = read_node_capacity(reply, nodes, nr_nodes);
+	dbus_message_unref(reply);
+	return err;
+}
+
+/*
+ * Memory reservations (VCMMD_FEATURE_RESERVE)
+ *
+ * Reserve takes the size, the node list, empty for the whole host, and the
+ * time to live in milliseconds (tsu), and replies with the error code
+ * followed by the token (t). Unreserve takes the token. RegisterVEReserved
+ * takes the VE name, type and compact config followed by the token and the
+ * flags.
+ */
+static int do_reserve(uint64_t bytes, const char *nodes, unsigned int ttl_ms,
+		      vcmmd_reservation_t *token)
+{
+	DBusMessage *msg, *reply;
+	DBusMessageIter args;
+	dbus_uint64_t t;
+	dbus_int32_t err;
+
+	VCMMD_FETCH_BUSNAME;
+
+	err = require_feature(VCMMD_FEATURE_RESERVE);
+	if (err)
+		return err;
+
+	msg = make_msg(METHOD_RESERVE, &args);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+	if (!append_uint64(&args, bytes) ||
+	    !append_str(&args, nodes ? nodes : "") ||
+	    !append_uint32(&args, ttl_ms)) {
+		dbus_message_unref(msg);
+		return VCMMD_ERROR_NO_MEMORY;
+	}
+
+	reply = __send_msg(msg, NULL);
+	if (!reply)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+
+	if (!dbus_message_get_args(reply, NULL,
+				   DBUS_TYPE_INT32, &err,
+				   DBUS_TYPE_UINT64, &t,
+				   DBUS_TYPE_INVALID))
+		err = VCMMD_ERROR_CONNECTION_FAILED;
+	dbus_message_unref(reply);
+	if (err)
+		return err;
+
+	*token = t;
+	return 0;
+}
+
+static int do_unreserve(vcmmd_reservation_t token)
+{
+	DBusMessage *msg;
+	DBusMessageIter args;
+	int err;
+
+	VCMMD_FETCH_BUSNAME;
+
+	err = require_feature(VCMMD_FEATURE_RESERVE);
+	if (err)
+		return err;
+
+	msg = make_msg(METHOD_UNRESERVE, &args);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+	if (!append_uint64(&args, token)) {
+		dbus_message_unref(msg);
+		return VCMMD_ERROR_NO_MEMORY;
+	}
+
+	return send_msg(msg);
+}
+
+static int do_register_ve_reserved(const char *ve_name,
+				   vcmmd_ve_type_t ve_type,
+				   const struct vcmmd_ve_config *ve_config,
+				   vcmmd_reservation_t token,
+				   unsigned int flags)
+{
+	DBusMessage *msg;
+	DBusMessageIter args;
+	int err;
+
+	VCMMD_FETCH_BUSNAME;
+
+	err = require_feature(VCMMD_FEATURE_RESERVE);
+	if (err)
+		return err;
+
+	msg = make_msg(METHOD_REGISTER_VE_RESERVED, &args);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+	if (!append_str(&args, ve_name) ||
+	    !append_int32(&args, ve_type) ||
+	    !__vcmmd_append_config_compact(&args, ve_config) ||
+	    !append_uint64(&args, token) ||
+	    !append_uint32(&args, flags)) {
+		dbus_message_unref(msg);
+		return VCMMD_ERROR_NO_MEMORY;
+	}
+
+	return send_msg(msg);
+}
+
+/*
+ * Requests by VE handle (VCMMD_FEATURE_VE_IDS)
+ *
+ * VCMMD gives out a numeric ID for a registered VE with OpenVE; the *ById
+ * methods take it in place of the VE name. The ID is kept in the handle and
+ * used until VCMMD is lost (it may come back with other IDs) or answers that
+ * no VE has it (the VE was unregistered, and maybe registered again with a
+ * new ID), then looked up again. Without the feature, requests go by name.
+ */
+static bool use_ve_ids(void)
+{
+	return has_feature(VCMMD_FEATURE_VE_IDS);
+}
+
+static int __open_ve(const char *ve_name, dbus_uint64_t *id)
+{
+	DBusMessage *msg, *reply;
+	DBusMessageIter args;
+	dbus_int32_t err;
+
+	msg = make_msg(METHOD_OPEN_VE, &args);
+	if (!msg)
+		return VCMMD_ERROR_NO_MEMORY;
+	if (!append_str(&args, ve_name)) {
+		dbus_message_unref(msg);
+		return VCMMD_ERROR_NO_MEMORY;
+	}
+
+	reply = __send_msg(msg, NULL);
+	if (!reply)
+		return VCMMD_ERROR_CONNECTION_FAILED;
+
+	if (!dbus_message_get_args(reply, NULL,
+				   DBUS_TYPE_INT32, &err,
+				   DBUS_TYPE_UINT64, id,
+				   DBUS_TYPE_INVALID))
+		err = VCMMD_ERROR_CONNECTION_FAILED;
+	dbus_message_unref(reply);
+	return err;
+}
+
+/*
+ * Get the ID of the VE of @handle, looking it up if it is not known. @fresh
+ * tells whether it was just looked up.
+ */
+static int get_ve_id(struct vcmmd_ve_handle *handle, dbus_uint64_t *id,
+		     bool *fresh)
+{
+	unsigned int epoch = __atomic_load_n(&vcmmd_service_epoch,
+					     __ATOMIC_ACQUIRE);
+	struct vcmmd_call_ctx call;
+	int err;
+
+	pthread_mutex_lock(&handle->mutex);
+	*id = handle->id_epoch == epoch ? handle->id : 0;
+	pthread_mutex_unlock(&handle->mutex);
+	*fresh = !*id;
+	if (*id)
+		return 0;
+
+	__vcmmd_call_begin(&call, VCMMD_CALL_DISCOVERY, handle->ve_name);
+	err = __vcmmd_call_end(&call, __open_ve(handle->ve_name, id));
+	if (err)
+		return err;
+
+	pthread_mutex_lock(&handle->mutex);
+	handle->id = *id;
+	handle->id_epoch = epoch;
+	pthread_mutex_unlock(&handle->mutex);
+	return 0;
+}
+
+static void forget_ve_id(struct vcmmd_ve_handle *handle, dbus_uint64_t id)
+{
+	pthread_mutex_lock(&handle->mutex);
+	if (handle->id == id)
+		handle->id = 0;
+	pthread_mutex_unlock(&handle->mutex);
+}
+
+/*
+ * Send @method for the VE of @handle, with the ID and whatever @append adds
+ * to it as arguments. Returns the error code VCMMD answered with, which is
+ * the first value of every *ById reply, and the reply in @reply if there is
+ * one; the caller must unref it.
+ */
+static int send_by_id(struct vcmmd_ve_handle *handle, int method,
+		      bool (*append)(DBusMessageIter *args, const void *arg),
+		      const void *arg, DBusMessage **reply)
+{
+	DBusMessage *msg;
+	DBusMessageIter args;
+	dbus_uint64_t id;
+	dbus_int32_t err;
+	bool fresh;
+
+	*reply = NULL;
+	for (;;) {
+		err = get_ve_id(handle, &id, &fresh);
+		if (err)
+			return err;
+
+		msg = make_msg(method, &args);
+		if (!msg)
+			return VCMMD_ERROR_NO_MEMORY;
+		if (!append_uint64(&args, id) ||
+		    (append && !append(&args, arg))) {
+			dbus_message_unref(msg);
+			return VCMMD_ERROR_NO_MEMORY;
+		}
+
+		*reply = __send_msg(msg, NULL);
+		if (!*reply)
+			return VCMMD_ERROR_CONNECTION_FAILED;
+		if (!dbus_message_get_args(*reply, NULL, DBUS_TYPE_INT32, &err,
+					   DBUS_TYPE_INVALID))
+			err = VCMMD_ERROR_CONNECTION_FAILED;
+		if (err != VCMMD_ERROR_VE_NOT_REGISTERED || fresh)
+			return err;
+
+		/* The ID is stale, look the VE up again */
+		dbus_message_unref(*reply);
+		*reply = NULL;
+		forget_ve_id(handle, id);
+	}
+}
+
+static int send_by_id_simple(struct vcmmd_ve_handle *handle, int method,
+			     bool (*append)(DBusMessageIter *args,
+					    const void *arg),
+			     const void *arg)
+{
+	DBusMessage *reply;
+	int err;
+
+	err = send_by_id(handle, method, append, arg, &reply);
+	if (reply)
+		dbus_message_unref(reply);
+	return err;
+}
+
+static bool append_flags(DBusMessageIter *args, const void *arg)
+{
+	return append_uint32(args, *(const unsigned int *)arg);
+}
+
+struct update_args {
+	const struct vcmmd_ve_config *ve_config;
+	unsigned int flags;
+};
+
+static bool append_update(DBusMessageIter *args, const void *arg)
+{
+	const struct update_args *a = arg;
+
+	return __vcmmd_append_config_compact(args, a->ve_config) &&
+	       append_uint32(args, a->flags);
+}
+
+static int do_activate_ve_handle(struct vcmmd_ve_handle *handle,
+				 unsigned int flags)
+{
+	VCMMD_FETCH_BUSNAME;
+
+	if (!use_ve_ids())
+		return do_activate_ve(handle->ve_name, flags);
+	return send_by_id_simple(handle, METHOD_ACTIVATE_VE_BY_ID,
+				 append_flags, &flags);
+}
+
+static int do_update_ve_handle(struct vcmmd_ve_handle *handle,
+			       const struct vcmmd_ve_config *ve_config,
+			       unsigned int flags)
+{
+	struct update_args a = { ve_config, flags };
+
+	VCMMD_FETCH_BUSNAME;
+
+	if (!use_ve_ids())
+		return do_update_ve(handle->ve_name, ve_config, flags);
+	return send_by_id_simple(handle, METHOD_UPDATE_VE_BY_ID,
+				 append_update, &a);
+}
+
+static int do_deactivate_ve_handle(struct vcmmd_ve_handle *handle)
+{
+	VCMMD_FETCH_BUSNAME;
+
+	if (!use_ve_ids())
+		return do_deactivate_ve(handle->ve_name);
+	return send_by_id_simple(handle, METHOD_DEACTIVATE_VE_BY_ID,
+				 NULL, NULL);
+}
+
+static int do_get_ve_config_handle(struct vcmmd_ve_handle *handle,
+				   struct vcmmd_ve_config *ve_config)
+{
+	DBusMessage *reply;
+	int err;
+
+	VCMMD_FETCH_BUSNAME;
+
+	if (!use_ve_ids())
+		return do_get_ve_config(handle->ve_name, ve_config);
+
+	err = send_by_id(handle, METHOD_GET_VE_CONFIG_BY_ID, NULL, NULL,
+			 &reply);
+	if (!reply)
+		return err;
+	err = __vcmmd_parse_ve_config(reply, ve_config);
+	dbus_message_unref(reply);
+	return err;
+}
+
+static int do_get_ve_state_handle(struct vcmmd_ve_handle *handle,
+				  vcmmd_ve_state_t *ve_state)
+{
+	DBusMessage *reply;
+	dbus_int32_t err;
+	dbus_bool_t active;
+
+	VCMMD_FETCH_BUSNAME;
+
+	if (!use_ve_ids())
+		return do_get_ve_state(handle->ve_name, ve_state);
+
+	err = send_by_id(handle, METHOD_IS_VE_ACTIVE_BY_ID, NULL, NULL,
+			 &reply);
+	if (reply) {
+		if (!err && !dbus_message_get_args(reply, NULL,
+						   DBUS_TYPE_INT32, &err,
+						   DBUS_TYPE_BOOLEAN, &active,
+						   DBUS_TYPE_INVALID))
+			err = VCMMD_ERROR_CONNECTION_FAILED;
+		dbus_message_unref(reply);
+	}
+
+	if (err) {
+		if (err == VCMMD_ERROR_VE_NOT_REGISTERED) {
+			*ve_state = VCMMD_VE_UNREGISTERED;
+			err = 0;
+		}
+		return err;
+	}
+
+	*ve_state = active ? VCMMD_VE_ACTIVE : VCMMD_VE_REGISTERED;
+	return 0;
+}
+
+static int do_supported_flags(unsigned int *flags)
+{
+	dbus_uint64_t features;
+	int err;
+
+	*flags = 0;
+	err = get_vcmmd_bus_name();
+	if (!err)
+		err = get_vcmmd_features(&features);
+	if (err)
+		return err;
+	if (features & VCMMD_FEATURE_DRY_RUN)
+		*flags |= VCMMD_FLAG_DRY_RUN;
+	return 0;
+}
+
+static void dbus_backend_init(void)
+{
+	if (!dbus_threads_init_default())
+		abort();
+}
+
+const struct vcmmd_backend __vcmmd_dbus_backend = {
+	.name			= "dbus",
+	.init			= dbus_backend_init,
+	.connected		= dbus_connected,
+	.register_ve		= do_register_ve,
+	.register_ve_ex		= do_register_ve_ex,
+	.register_ve_range	= do_register_ve_range,
+	.register_ve_frozen	= do_register_ve_frozen,
+	.activate_ve		= do_activate_ve,
+	.update_ve		= do_update_ve,
+	.update_ve_ex		= do_update_ve_ex,
+	.update_ve_frozen	= do_update_ve_frozen,
+	.release_frozen		= release_frozen,
+	.deactivate_ve		= do_deactivate_ve,
+	.unregister_ve		= do_unregister_ve,
+	.get_ve_config		= do_get_ve_config,
+	.get_ve_state		= do_get_ve_state,
+	.activate_ve_handle	= do_activate_ve_handle,
+	.update_ve_handle	= do_update_ve_handle,
+	.deactivate_ve_handle	= do_deactivate_ve_handle,
+	.get_ve_config_handle	= do_get_ve_config_handle,
+	.get_ve_state_handle	= do_get_ve_state_handle,
+	.get_current_policy	= do_get_current_policy,
+	.get_policy_from_file	= do_get_policy_from_file,
+	.set_policy		= do_set_policy,
+	.get_host_capacity	= do_get_host_capacity,
+	.get_node_capacity	= do_get_node_capacity,
+	.reserve		= do_reserve,
+	.unreserve		= do_unreserve,
+	.register_ve_reserved	= do_register_ve_reserved,
+	.supported_flags	= do_supported_flags,
+};
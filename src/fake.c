@@ -0,0 +1,669 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * Fake backend
+ *
+ * Keeps registered VEs in a hash table in process memory and answers every
+ * request right away, checking it the way VCMMD does. Nothing is enforced or
+ * tuned, and no D-Bus connection is made.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+
+#define FAKE_HASH_SIZE		1024
+#define FAKE_POLICY_MAXLEN	256
+#define FAKE_DEFAULT_POLICY	"performance"
+
+struct fake_ve {
+	struct fake_ve *next;
+	vcmmd_ve_type_t type;
+	bool active;
+	struct vcmmd_ve_config config;
+	char name[];
+};
+
+struct fake_reservation {
+	struct fake_reservation *next;
+	vcmmd_reservation_t token;
+	uint64_t bytes;
+	uint64_t expires_ns;
+};
+
+static struct fake_ve *fake_ves[FAKE_HASH_SIZE];
+static struct fake_reservation *reservations;
+static vcmmd_reservation_t last_token;
+static unsigned int nr_active;
+static uint64_t total_guarantee;
+static uint64_t total_reserved;
+static uint64_t generation;		/* of the totals above */
+static uint64_t host_memory = UINT64_MAX;
+static char policy[FAKE_POLICY_MAXLEN] = FAKE_DEFAULT_POLICY;
+static pthread_mutex_t fake_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hash_name(const char *name)
+{
+	unsigned int h = 5381;
+
+	while (*name)
+		h = h * 33 + (unsigned char)*name++;
+	return h % FAKE_HASH_SIZE;
+}
+
+static struct fake_ve **find_ve(const char *name)
+{
+	struct fake_ve **p;
+
+	for (p = &fake_ves[hash_name(name)]; *p; p = &(*p)->next)
+		if (!strcmp((*p)->name, name))
+			break;
+	return p;
+}
+
+static uint64_t guarantee_of(const struct vcmmd_ve_config *config)
+{
+	uint64_t value;
+
+	return vcmmd_ve_config_extract(config, VCMMD_VE_CONFIG_GUARANTEE,
+				       &value) ? value : 0;
+}
+
+static bool config_is_valid(const struct vcmmd_ve_config *config)
+{
+	uint64_t guarantee, limit;
+
+	if (vcmmd_ve_config_extract(config, VCMMD_VE_CONFIG_GUARANTEE,
+				    &guarantee) &&
+	    vcmmd_ve_config_extract(config, VCMMD_VE_CONFIG_LIMIT, &limit) &&
+	    limit < guarantee)
+		return false;
+	return true;
+}
+
+static struct fake_reservation **find_reservation(vcmmd_reservation_t token)
+{
+	struct fake_reservation **p;
+
+	for (p = &reservations; *p; p = &(*p)->next)
+		if ((*p)->token == token)
+			break;
+	return p;
+}
+
+static void drop_reservation(struct fake_reservation **p)
+{
+	struct fake_reservation *res = *p;
+
+	*p = res->next;
+	total_reserved -= res->bytes;
+	generation++;
+	free(res);
+}
+
+/*
+ * Drop reservations whose time is up. Done lazily, whenever memory is
+ * accounted.
+ */
+static void expire_reservations(void)
+{
+	uint64_t now = __vcmmd_now_ns();
+	struct fake_reservation **p = &reservations;
+
+	while (*p) {
+		if ((*p)->expires_ns <= now)
+			drop_reservation(p);
+		else
+			p = &(*p)->next;
+	}
+}
+
+/*
+ * Whether @guarantee fits on the host in place of @old
+ */
+static bool guarantee_fits(uint64_t old, uint64_t guarantee)
+{
+	uint64_t used = total_guarantee + total_reserved - old;
+
+	return used <= host_memory && guarantee <= host_memory - used;
+}
+
+/*
+ * Tell by how much @guarantee does not fit in place of @old
+ */
+static void get_shortfall(uint64_t old, uint64_t guarantee,
+			  struct vcmmd_shortfall *shortfall)
+{
+	uint64_t used = total_guarantee + total_reserved - old;
+
+	if (!shortfall)
+		return;
+	shortfall->resource = VCMMD_RESOURCE_HOST_MEMORY;
+	shortfall->missing = used < host_memory ?
+			     guarantee - (host_memory - used) : guarantee;
+}
+
+/*
+ * Set the key of @entry in @config, replacing the value if it is already there.
+ */
+static bool config_set(struct vcmmd_ve_config *config,
+		       const struct vcmmd_ve_config_entry *entry)
+{
+	struct vcmmd_ve_config_entry *e;
+	unsigned int i;
+	char *str;
+
+	for (i = 0; i < config->nr_entries; i++) {
+		e = &config->entries[i];
+		if (e->key != entry->key)
+			continue;
+		str = strdup(entry->str ? entry->str : "");
+		if (!str)
+			return false;
+		free(e->str);
+		e->value = entry->value;
+		e->str = str;
+		return true;
+	}
+
+	if (vcmmd_ve_config_entry_is_string(entry->key))
+		return vcmmd_ve_config_append_string(config, entry->key,
+						     entry->str);
+	return vcmmd_ve_config_append(config, entry->key, entry->value);
+}
+
+static bool config_merge(struct vcmmd_ve_config *dst,
+			 const struct vcmmd_ve_config *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < src->nr_entries; i++)
+		if (!config_set(dst, &src->entries[i]))
+			return false;
+	return true;
+}
+
+/*
+ * Register VE, into the reservation of @token unless it is NULL
+ */
+static int register_ve(const char *ve_name, vcmmd_ve_type_t ve_type,
+		       const struct vcmmd_ve_config *ve_config,
+		       const vcmmd_reservation_t *token, unsigned int flags,
+		       struct vcmmd_shortfall *shortfall)
+{
+	uint64_t guarantee = guarantee_of(ve_config);
+	struct fake_reservation **res = NULL;
+	struct fake_ve **p, *ve;
+	uint64_t reserved = 0;
+	int err = 0;
+
+	if (!*ve_name)
+		return VCMMD_ERROR_INVALID_VE_NAME;
+	if (ve_type < VCMMD_VE_CT || ve_type > VCMMD_VE_SERVICE)
+		return VCMMD_ERROR_INVALID_VE_TYPE;
+	if (!config_is_valid(ve_config))
+		return VCMMD_ERROR_INVALID_VE_CONFIG;
+
+	ve = calloc(1, sizeof(*ve) + strlen(ve_name) + 1);
+	if (!ve)
+		return VCMMD_ERROR_VE_OPERATION_FAILED;
+	strcpy(ve->name, ve_name);
+	ve->type = ve_type;
+	vcmmd_ve_config_init(&ve->config);
+	if (!config_merge(&ve->config, ve_config)) {
+		err = VCMMD_ERROR_VE_OPERATION_FAILED;
+		goto out_free;
+	}
+
+	pthread_mutex_lock(&fake_mutex);
+	expire_reservations();
+	if (token) {
+		res = find_reservation(*token);
+		if (*res)
+			reserved = (*res)->bytes;
+	}
+	p = find_ve(ve_name);
+	if (*p)
+		err = VCMMD_ERROR_VE_NAME_ALREADY_IN_USE;
+	else if (res && !*res)
+		err = VCMMD_ERROR_RESERVATION_NOT_FOUND;
+	else if (!guarantee_fits(reserved, guarantee)) {
+		err = VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE;
+		get_shortfall(reserved, guarantee, shortfall);
+	} else if (!(flags & VCMMD_FLAG_DRY_RUN)) {
+		*p = ve;
+		total_guarantee += guarantee;
+		generation++;
+		if (res)
+			drop_reservation(res);
+		ve = NULL;
+	}
+	pthread_mutex_unlock(&fake_mutex);
+	if (!ve)
+		return 0;
+
+out_free:
+	vcmmd_ve_config_deinit(&ve->config);
+	free(ve);
+	return err;
+}
+
+static int fake_register_ve_ex(const char *ve_name, vcmmd_ve_type_t ve_type,
+			       const struct vcmmd_ve_config *ve_config,
+			       unsigned int flags,
+			       struct vcmmd_shortfall *shortfall)
+{
+	return register_ve(ve_name, ve_type, ve_config, NULL, flags,
+			   shortfall);
+}
+
+static int fake_register_ve(const char *ve_name, vcmmd_ve_type_t ve_type,
+			    const struct vcmmd_ve_config *ve_config,
+			    unsigned int flags)
+{
+	return register_ve(ve_name, ve_type, ve_config, NULL, flags, NULL);
+}
+
+static int fake_register_ve_reserved(const char *ve_name,
+				     vcmmd_ve_type_t ve_type,
+				     const struct vcmmd_ve_config *ve_config,
+				     vcmmd_reservation_t token,
+				     unsigned int flags)
+{
+	return register_ve(ve_name, ve_type, ve_config, &token, flags, NULL);
+}
+
+static int fake_register_ve_range(const char *ve_name, vcmmd_ve_type_t ve_type,
+				  const struct vcmmd_ve_config *ve_config,
+				  const struct vcmmd_ve_range *range,
+				  unsigned int flags,
+				  uint64_t *guarantee, uint64_t *limit)
+{
+	struct vcmmd_ve_config_entry g = { .key = VCMMD_VE_CONFIG_GUARANTEE };
+	struct vcmmd_ve_config_entry l = { .key = VCMMD_VE_CONFIG_LIMIT };
+	struct vcmmd_ve_config config;
+	uint64_t avail;
+	int err;
+
+	pthread_mutex_lock(&fake_mutex);
+	expire_reservations();
+	l.value = __vcmmd_range_limit(range, host_memory);
+	avail = total_guarantee + total_reserved;
+	avail = host_memory > avail ? host_memory - avail : 0;
+	pthread_mutex_unlock(&fake_mutex);
+
+	g.value = range->guarantee_max < l.value ? range->guarantee_max :
+						   l.value;
+	if (g.value > avail)
+		g.value = avail;
+	if (g.value < range->guarantee_min)
+		return VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE;
+
+	vcmmd_ve_config_init(&config);
+	if (!config_merge(&config, ve_config) ||
+	    !config_set(&config, &g) || !config_set(&config, &l))
+		err = VCMMD_ERROR_VE_OPERATION_FAILED;
+	else
+		err = fake_register_ve(ve_name, ve_type, &config, flags);
+	vcmmd_ve_config_deinit(&config);
+
+	if (!err) {
+		*guarantee = g.value;
+		*limit = l.value;
+	}
+	return err;
+}
+
+static int fake_activate_ve(const char *ve_name, unsigned int flags)
+{
+	struct fake_ve *ve;
+	int err = 0;
+
+	pthread_mutex_lock(&fake_mutex);
+	ve = *find_ve(ve_name);
+	if (!ve)
+		err = VCMMD_ERROR_VE_NOT_REGISTERED;
+	else if (ve->active)
+		err = VCMMD_ERROR_VE_ALREADY_ACTIVE;
+	else {
+		ve->active = true;
+		nr_active++;
+	}
+	pthread_mutex_unlock(&fake_mutex);
+	return err;
+}
+
+static int fake_update_ve_ex(const char *ve_name,
+			     const struct vcmmd_ve_config *ve_config,
+			     unsigned int flags,
+			     struct vcmmd_shortfall *shortfall)
+{
+	struct vcmmd_ve_config merged;
+	uint64_t old, guarantee;
+	struct fake_ve *ve;
+	int err = 0;
+
+	vcmmd_ve_config_init(&merged);
+
+	pthread_mutex_lock(&fake_mutex);
+	expire_reservations();
+	ve = *find_ve(ve_name);
+	if (!ve) {
+		err = VCMMD_ERROR_VE_NOT_REGISTERED;
+		goto out;
+	}
+	if (!ve->active) {
+		err = VCMMD_ERROR_VE_NOT_ACTIVE;
+		goto out;
+	}
+
+	if (!config_merge(&merged, &ve->config) ||
+	    !config_merge(&merged, ve_config)) {
+		err = VCMMD_ERROR_VE_OPERATION_FAILED;
+		goto out;
+	}
+
+	old = guarantee_of(&ve->config);
+	guarantee = guarantee_of(&merged);
+	if (!config_is_valid(&merged))
+		err = VCMMD_ERROR_INVALID_VE_CONFIG;
+	else if (!guarantee_fits(old, guarantee)) {
+		err = VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE;
+		get_shortfall(old, guarantee, shortfall);
+	} else if (!(flags & VCMMD_FLAG_DRY_RUN)) {
+		total_guarantee += guarantee - old;
+		generation++;
+		vcmmd_ve_config_deinit(&ve->config);
+		ve->config = merged;
+		vcmmd_ve_config_init(&merged);
+	}
+out:
+	pthread_mutex_unlock(&fake_mutex);
+	vcmmd_ve_config_deinit(&merged);
+	return err;
+}
+
+static int fake_update_ve(const char *ve_name,
+			  const struct vcmmd_ve_config *ve_config,
+			  unsigned int flags)
+{
+	return fake_update_ve_ex(ve_name, ve_config, flags, NULL);
+}
+
+static int fake_deactivate_ve(const char *ve_name)
+{
+	struct fake_ve *ve;
+	int err = 0;
+
+	pthread_mutex_lock(&fake_mutex);
+	ve = *find_ve(ve_name);
+	if (!ve)
+		err = VCMMD_ERROR_VE_NOT_REGISTERED;
+	else if (!ve->active)
+		err = VCMMD_ERROR_VE_NOT_ACTIVE;
+	else {
+		ve->active = false;
+		nr_active--;
+	}
+	pthread_mutex_unlock(&fake_mutex);
+	return err;
+}
+
+static void free_ve(struct fake_ve *ve)
+{
+	vcmmd_ve_config_deinit(&ve->config);
+	free(ve);
+}
+
+static int fake_unregister_ve(const char *ve_name)
+{
+	struct fake_ve **p, *ve;
+
+	pthread_mutex_lock(&fake_mutex);
+	p = find_ve(ve_name);
+	ve = *p;
+	if (ve) {
+		*p = ve->next;
+		total_guarantee -= guarantee_of(&ve->config);
+		generation++;
+		if (ve->active)
+			nr_active--;
+	}
+	pthread_mutex_unlock(&fake_mutex);
+
+	if (!ve)
+		return VCMMD_ERROR_VE_NOT_REGISTERED;
+	free_ve(ve);
+	return 0;
+}
+
+static int fake_get_ve_config(const char *ve_name,
+			      struct vcmmd_ve_config *ve_config)
+{
+	struct fake_ve *ve;
+	int err = 0;
+
+	vcmmd_ve_config_init(ve_config);
+
+	pthread_mutex_lock(&fake_mutex);
+	ve = *find_ve(ve_name);
+	if (!ve)
+		err = VCMMD_ERROR_VE_NOT_REGISTERED;
+	else if (!config_merge(ve_config, &ve->config))
+		err = VCMMD_ERROR_NO_MEMORY;
+	pthread_mutex_unlock(&fake_mutex);
+
+	if (err)
+		vcmmd_ve_config_deinit(ve_config);
+	return err;
+}
+
+static int fake_get_ve_state(const char *ve_name, vcmmd_ve_state_t *ve_state)
+{
+	struct fake_ve *ve;
+
+	pthread_mutex_lock(&fake_mutex);
+	ve = *find_ve(ve_name);
+	if (!ve)
+		*ve_state = VCMMD_VE_UNREGISTERED;
+	else if (ve->active)
+		*ve_state = VCMMD_VE_ACTIVE;
+	else
+		*ve_state = VCMMD_VE_REGISTERED;
+	pthread_mutex_unlock(&fake_mutex);
+	return 0;
+}
+
+static int copy_policy(char *policy_name, int len, const char *name)
+{
+	if (strlen(name) > len - 1)
+		return VCMMD_ERROR_NO_MEMORY;
+	strcpy(policy_name, name);
+	return 0;
+}
+
+static int fake_get_current_policy(char *policy_name, int len)
+{
+	int err;
+
+	pthread_mutex_lock(&fake_mutex);
+	err = copy_policy(policy_name, len, policy);
+	pthread_mutex_unlock(&fake_mutex);
+	return err;
+}
+
+static int fake_get_policy_from_file(char *policy_name, int len)
+{
+	return copy_policy(policy_name, len, FAKE_DEFAULT_POLICY);
+}
+
+static int fake_set_policy(const char *policy_name)
+{
+	int err = 0;
+
+	if (!*policy_name || strlen(policy_name) >= FAKE_POLICY_MAXLEN)
+		return VCMMD_ERROR_POLICY_SET_INVALID_NAME;
+
+	pthread_mutex_lock(&fake_mutex);
+	if (nr_active && strcmp(policy, policy_name))
+		err = VCMMD_ERROR_POLICY_SET_ACTIVE_VES;
+	else
+		strcpy(policy, policy_name);
+	pthread_mutex_unlock(&fake_mutex);
+	return err;
+}
+
+static int fake_get_host_capacity(struct vcmmd_host_capacity *cap)
+{
+	uint64_t used;
+
+	pthread_mutex_lock(&fake_mutex);
+	expire_reservations();
+	used = total_guarantee + total_reserved;
+	cap->total = host_memory;
+	cap->guaranteed = total_guarantee;
+	cap->reserved = total_reserved;
+	cap->available = host_memory > used ? host_memory - used : 0;
+	cap->generation = generation;
+	pthread_mutex_unlock(&fake_mutex);
+	return 0;
+}
+
+/*
+ * NUMA nodes are not modelled: @nodes is checked, and the reservation is
+ * taken out of host memory
+ */
+static int fake_reserve(uint64_t bytes, const char *nodes,
+			unsigned int ttl_ms, vcmmd_reservation_t *token)
+{
+	uint64_t map[VCMMD_MAX_NUMA_NODES / 64];
+	struct fake_reservation *res;
+	int err = 0;
+
+	if (!ttl_ms || (nodes && *nodes &&
+			__vcmmd_parse_list(nodes, map, VCMMD_MAX_NUMA_NODES)))
+		return VCMMD_ERROR_INVALID_VE_CONFIG;
+
+	res = calloc(1, sizeof(*res));
+	if (!res)
+		return VCMMD_ERROR_VE_OPERATION_FAILED;
+	res->bytes = bytes;
+
+	pthread_mutex_lock(&fake_mutex);
+	expire_reservations();
+	if (!guarantee_fits(0, bytes))
+		err = VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE;
+	else {
+		res->token = ++last_token;
+		res->expires_ns = __vcmmd_now_ns() + ttl_ms * 1000000ULL;
+		res->next = reservations;
+		reservations = res;
+		total_reserved += bytes;
+		generation++;
+		*token = res->token;
+		res = NULL;
+	}
+	pthread_mutex_unlock(&fake_mutex);
+	free(res);
+	return err;
+}
+
+static int fake_unreserve(vcmmd_reservation_t token)
+{
+	struct fake_reservation **p;
+	int err = 0;
+
+	pthread_mutex_lock(&fake_mutex);
+	expire_reservations();
+	p = find_reservation(token);
+	if (*p)
+		drop_reservation(p);
+	else
+		err = VCMMD_ERROR_RESERVATION_NOT_FOUND;
+	pthread_mutex_unlock(&fake_mutex);
+	return err;
+}
+
+static int fake_supported_flags(unsigned int *flags)
+{
+	*flags = VCMMD_FLAG_DRY_RUN;
+	return 0;
+}
+
+/*
+ * Start over with no VEs
+ */
+static void fake_backend_init(void)
+{
+	struct fake_ve *ve;
+	const char *str;
+	unsigned int i;
+
+	pthread_mutex_lock(&fake_mutex);
+	for (i = 0; i < FAKE_HASH_SIZE; i++) {
+		while ((ve = fake_ves[i])) {
+			fake_ves[i] = ve->next;
+			free_ve(ve);
+		}
+	}
+	while (reservations)
+		drop_reservation(&reservations);
+	nr_active = 0;
+	total_guarantee = 0;
+	generation++;
+	strcpy(policy, FAKE_DEFAULT_POLICY);
+
+	str = getenv("VCMMD_FAKE_HOST_MEMORY");
+	host_memory = str && *str ? strtoull(str, NULL, 0) : UINT64_MAX;
+	pthread_mutex_unlock(&fake_mutex);
+}
+
+const struct vcmmd_backend __vcmmd_fake_backend = {
+	.name			= "fake",
+	.init			= fake_backend_init,
+	.register_ve		= fake_register_ve,
+	.register_ve_ex		= fake_register_ve_ex,
+	.register_ve_range	= fake_register_ve_range,
+	.activate_ve		= fake_activate_ve,
+	.update_ve		= fake_update_ve,
+	.update_ve_ex		= fake_update_ve_ex,
+	.deactivate_ve		= fake_deactivate_ve,
+	.unregister_ve		= fake_unregister_ve,
+	.get_ve_config		= fake_get_ve_config,
+	.get_ve_state		= fake_get_ve_state,
+	.get_current_policy	= fake_get_current_policy,
+	.get_policy_from_file	= fake_get_policy_from_file,
+	.set_policy		= fake_set_policy,
+	.get_host_capacity	= fake_get_host_capacity,
+	.reserve		= fake_reserve,
+	.unreserve		= fake_unreserve,
+	.register_ve_reserved	= fake_register_ve_reserved,
+	.supported_flags	= fake_supported_flags,
+};
@@ -0,0 +1,432 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/*
+ * Declarations shared between the library's translation units. Nothing here
+ * is part of the public API.
+ */
+
+#ifndef _VCMMD_INTERNAL_H_
+#define _VCMMD_INTERNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+#include "vcmmd.h"
+
+/*
+ * USDT probes, provider "vcmmd". Compiled out unless sys/sdt.h is available;
+ * when compiled in, a disabled probe costs a single nop.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define VCMMD_PROBE(name, ...)	STAP_PROBEV(vcmmd, name, ##__VA_ARGS__)
+#else
+#define VCMMD_PROBE(name, ...)	do { } while (0)
+#endif
+
+/*
+ * Optional protocol features advertised by VCMMD via GetFeatures. A service
+ * that does not implement GetFeatures supports none of them.
+ */
+#define VCMMD_FEATURE_COMPACT_CONFIG	(1ULL << 0)	/* RegisterVE2, UpdateVE2 */
+/* OpenVE, ActivateVEById, UpdateVEById (compact config), ... */
+#define VCMMD_FEATURE_VE_IDS		(1ULL << 1)
+#define VCMMD_FEATURE_HOST_CAPACITY	(1ULL << 2)	/* GetHostCapacity */
+/* RegisterVEEx, UpdateVEEx (compact config) */
+#define VCMMD_FEATURE_SHORTFALL		(1ULL << 3)
+/* RegisterVERange (compact config) */
+#define VCMMD_FEATURE_VE_RANGE		(1ULL << 4)
+/* VCMMD_FLAG_DRY_RUN in RegisterVE*, UpdateVE* */
+#define VCMMD_FEATURE_DRY_RUN		(1ULL << 5)
+/* Reserve, Unreserve, RegisterVEReserved (compact config) */
+#define VCMMD_FEATURE_RESERVE		(1ULL << 6)
+#define VCMMD_FEATURE_NODE_CAPACITY	(1ULL << 7)	/* GetNodeCapacity */
+
+#define __vcmmd_hidden		__attribute__ ((visibility("hidden")))
+
+#define VCMMD_MAX_NUMA_NODES	64
+#define VCMMD_MAX_CPUS		4096
+
+#define BITMAP_WORDS(nbits)	(((nbits) + 63) / 64)
+
+static inline void bitmap_set(uint64_t *map, unsigned int bit)
+{
+	map[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static inline bool bitmap_test(const uint64_t *map, unsigned int bit)
+{
+	return map[bit / 64] & (1ULL << (bit % 64));
+}
+
+/*
+ * Parse a list like "0-3,8,10-11" into bitmap @map of @nbits bits.
+ * Returns 0 on success, -1 if the list is malformed or out of range.
+ */
+__vcmmd_hidden int __vcmmd_parse_list(const char *str,
+				      uint64_t *map, unsigned int nbits);
+
+/*
+ * Format bitmap @map of @nbits bits as a list like "0-3,8,10-11".
+ * Returns 0 on success, -1 if @buf is too small.
+ */
+__vcmmd_hidden int __vcmmd_format_list(const uint64_t *map, unsigned int nbits,
+				       char *buf, size_t len);
+
+/*
+ * Read the host topology from under @root instead of /, for tests. Takes
+ * effect only if called before the topology is first needed.
+ */
+__vcmmd_hidden void __vcmmd_set_topology_root(const char *root);
+
+/*
+ * Limit chosen from @range on a host with @total bytes of memory, see
+ * vcmmd_register_ve_range
+ */
+static inline uint64_t __vcmmd_range_limit(const struct vcmmd_ve_range *range,
+					   uint64_t total)
+{
+	uint64_t limit = range->limit_max < total ? range->limit_max : total;
+
+	return limit > range->limit_min ? limit : range->limit_min;
+}
+
+static inline uint64_t __vcmmd_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Context of a public API call in progress. Calls may nest: discovery done
+ * on behalf of a call is accounted as a call of its own.
+ */
+struct vcmmd_call_ctx {
+	struct vcmmd_call_ctx *parent;
+	vcmmd_call_t call;
+	const char *ve_name;
+	uint64_t start_ns;
+	uint32_t config_keys;
+	/* Remaining arguments, for capture */
+	vcmmd_ve_type_t ve_type;
+	unsigned int flags;
+	const struct vcmmd_ve_config *config;
+	const struct vcmmd_ve_range *range;
+	unsigned int retries;
+	unsigned int reconnects;
+
+	/* Phase timing, only done if traced */
+	bool traced;
+	bool sent;
+	uint64_t mark_ns;
+	uint64_t start_realtime_ns;
+	uint64_t phase_ns[__NR_VCMMD_PHASES];
+};
+
+__vcmmd_hidden void __vcmmd_call_begin(struct vcmmd_call_ctx *ctx,
+				       vcmmd_call_t call, const char *ve_name);
+/* Returns @err for convenience */
+__vcmmd_hidden int __vcmmd_call_end(struct vcmmd_call_ctx *ctx, int err);
+
+static inline uint32_t __vcmmd_config_keys(const struct vcmmd_ve_config *c)
+{
+	uint32_t keys = 0;
+	unsigned int i;
+
+	for (i = 0; i < c->nr_entries; i++)
+		keys |= 1U << c->entries[i].key;
+	return keys;
+}
+
+/* Events accounted to the current call */
+__vcmmd_hidden void __vcmmd_stats_retry(void);
+__vcmmd_hidden void __vcmmd_stats_reconnect(void);
+__vcmmd_hidden void __vcmmd_stats_lock_wait(uint64_t ns);
+__vcmmd_hidden void __vcmmd_stats_busy_retry(void);
+__vcmmd_hidden void __vcmmd_stats_admission_wait(uint64_t ns);
+
+/*
+ * Rate control of a call, see ratelimit.c. A backend request is sent once
+ * __vcmmd_rc_admit returns 0, and sent again while __vcmmd_rc_retry, given
+ * its result, returns true.
+ */
+struct vcmmd_rc_ctx {
+	bool enabled;
+	bool admitted;
+	unsigned int tries;
+	unsigned int max_retries;
+	unsigned int backoff_ms;
+	uint64_t deadline_ns;
+	uint64_t admitted_ns;
+};
+
+__vcmmd_hidden void __vcmmd_rc_begin(struct vcmmd_rc_ctx *rc,
+				     vcmmd_call_t call);
+__vcmmd_hidden int __vcmmd_rc_admit(struct vcmmd_rc_ctx *rc);
+__vcmmd_hidden bool __vcmmd_rc_retry(struct vcmmd_rc_ctx *rc, int err);
+__vcmmd_hidden void __vcmmd_rc_get_state(uint64_t *limit, uint64_t *in_flight,
+					 uint64_t *queued);
+
+/*
+ * Sleep before try @tries, counted from 1 for the first retry, of a request
+ * that found VCMMD or the bus unreachable. Jittered and capped, so that
+ * callers do not spin on a restarting daemon. Only while recovering: within
+ * a while of losing a VCMMD that was reached before, see ratelimit.c.
+ */
+__vcmmd_hidden void __vcmmd_reconnect_backoff(unsigned int tries);
+
+/*
+ * Tell the reconnect backoff that VCMMD was found by discovery, or that the
+ * service or the connection to it was lost
+ */
+__vcmmd_hidden void __vcmmd_service_found(void);
+__vcmmd_hidden void __vcmmd_service_lost(void);
+
+/*
+ * Close @phase of the current call: the time since the previous mark is
+ * accounted to it.
+ */
+__vcmmd_hidden void __vcmmd_trace_mark(vcmmd_phase_t phase);
+
+__vcmmd_hidden bool __vcmmd_trace_enabled(void);
+__vcmmd_hidden void __vcmmd_trace_call(const struct vcmmd_call_ctx *ctx,
+				       int err, uint64_t end_ns);
+
+/*
+ * Call capture, see capture.c
+ *
+ * A capture file is a struct vcmmd_capture_header followed by records of
+ * variable length, each a struct vcmmd_capture_record, the VE or policy name
+ * (not NUL-terminated) and nr_entries config entries. A config entry is a
+ * struct vcmmd_capture_entry followed by its string. Records of
+ * %VCMMD_CALL_REGISTER_VE_RANGE end with a struct vcmmd_capture_range.
+ * Integers are in host byte order.
+ *
+ * Version 1 lacks the calls from %VCMMD_CALL_REGISTER_VE_EX on, which it
+ * recorded as the call they are a variant of.
+ */
+#define VCMMD_CAPTURE_MAGIC	"VCMMDCAP"
+#define VCMMD_CAPTURE_VERSION	2
+
+struct vcmmd_capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+} __attribute__ ((packed));
+
+struct vcmmd_capture_record {
+	uint32_t len;			/* of the whole record */
+	uint16_t call;			/* vcmmd_call_t */
+	uint8_t ve_type;
+	uint8_t nr_entries;		/* 0 if the call takes no config */
+	int32_t result;
+	uint32_t flags;
+	uint32_t pid;
+	uint32_t thread;		/* numbered from 1 in each process */
+	uint16_t retries;
+	uint16_t reconnects;
+	uint16_t name_len;
+	uint16_t reserved;
+	uint64_t start_ns;		/* CLOCK_MONOTONIC */
+	uint64_t duration_ns;
+} __attribute__ ((packed));
+
+struct vcmmd_capture_entry {
+	uint16_t key;
+	uint16_t str_len;
+	uint64_t value;
+} __attribute__ ((packed));
+
+struct vcmmd_capture_range {
+	uint64_t guarantee_min;
+	uint64_t guarantee_max;
+	uint64_t limit_min;
+	uint64_t limit_max;
+} __attribute__ ((packed));
+
+__vcmmd_hidden bool __vcmmd_capture_enabled(void);
+__vcmmd_hidden void __vcmmd_capture_call(const struct vcmmd_call_ctx *ctx,
+					 int err, uint64_t end_ns);
+
+/*
+ * VE config marshalling, see dbus.c. Declared with struct tags so that
+ * users of this header need not include dbus.h.
+ */
+struct DBusMessage;
+struct DBusMessageIter;
+
+__vcmmd_hidden bool __vcmmd_append_config(struct DBusMessageIter *iter,
+					  const struct vcmmd_ve_config *config);
+__vcmmd_hidden bool __vcmmd_append_config_compact(struct DBusMessageIter *iter,
+					  const struct vcmmd_ve_config *config);
+
+/*
+ * Parse a GetVEConfig reply into @ve_config, which is initialized first.
+ * Returns 0 or the error code; @ve_config is left empty on error.
+ */
+__vcmmd_hidden int __vcmmd_parse_ve_config(struct DBusMessage *reply,
+					   struct vcmmd_ve_config *ve_config);
+
+static inline bool vcmmd_ve_config_entry_is_string(
+		vcmmd_ve_config_key_t key)
+{
+	if (key == VCMMD_VE_CONFIG_NODE_LIST ||
+		key == VCMMD_VE_CONFIG_CPU_LIST)
+		return true;
+	return false;
+}
+
+/*
+ * Frozen request, see vcmmd_ve_config_freeze
+ */
+struct vcmmd_ve_frozen {
+	pthread_mutex_t mutex;
+	vcmmd_ve_type_t ve_type;
+	unsigned int flags;
+	struct vcmmd_ve_config config;
+
+	/* Marshalled requests, see dbus.c */
+	bool compact;
+	unsigned int service_gen;
+	struct DBusMessage *register_msg;
+	struct DBusMessage *update_msg;
+
+	char ve_name[];
+};
+
+/*
+ * VE handle, see vcmmd_ve_open
+ */
+struct vcmmd_ve_handle {
+	pthread_mutex_t mutex;
+
+	/* VCMMD's ID for the VE, 0 until looked up, see dbus.c */
+	uint64_t id;
+	unsigned int id_epoch;
+
+	char ve_name[];
+};
+
+/*
+ * Backend
+ *
+ * Carries out the requests behind the public API calls; the public functions
+ * only add probes, accounting and statistics around them. Methods return 0 or
+ * an error code like the public function of the same name. The frozen request
+ * and VE handle methods are optional: without them, the request is sent as a
+ * plain one, by VE name. Without the _ex methods, requests are sent as plain
+ * ones and report no shortfall. Without register_ve_range, or if it returns
+ * VCMMD_ERROR_NOT_SUPPORTED, the library chooses the guarantee itself.
+ * Without get_host_capacity, vcmmd_get_host_capacity is not supported, and
+ * likewise for get_node_capacity and the reservation methods.
+ * supported_flags gets the request flags VCMMD honours, of those it would be
+ * wrong to ignore, like VCMMD_FLAG_DRY_RUN, or fails if VCMMD cannot be
+ * asked; without it, there are none.
+ * release_frozen, if given, frees whatever the backend cached in a frozen
+ * request. connected, if given, tells whether the backend holds a connection
+ * to the bus.
+ */
+struct vcmmd_backend {
+	const char *name;
+	void (*init)(void);
+	bool (*connected)(void);
+
+	int (*register_ve)(const char *ve_name, vcmmd_ve_type_t ve_type,
+			   const struct vcmmd_ve_config *ve_config,
+			   unsigned int flags);
+	int (*register_ve_ex)(const char *ve_name, vcmmd_ve_type_t ve_type,
+			      const struct vcmmd_ve_config *ve_config,
+			      unsigned int flags,
+			      struct vcmmd_shortfall *shortfall);
+	int (*register_ve_range)(const char *ve_name, vcmmd_ve_type_t ve_type,
+				 const struct vcmmd_ve_config *ve_config,
+				 const struct vcmmd_ve_range *range,
+				 unsigned int flags,
+				 uint64_t *guarantee, uint64_t *limit);
+	int (*register_ve_frozen)(struct vcmmd_ve_frozen *frozen);
+	int (*activate_ve)(const char *ve_name, unsigned int flags);
+	int (*update_ve)(const char *ve_name,
+			 const struct vcmmd_ve_config *ve_config,
+			 unsigned int flags);
+	int (*update_ve_ex)(const char *ve_name,
+			    const struct vcmmd_ve_config *ve_config,
+			    unsigned int flags,
+			    struct vcmmd_shortfall *shortfall);
+	int (*update_ve_frozen)(struct vcmmd_ve_frozen *frozen);
+	void (*release_frozen)(struct vcmmd_ve_frozen *frozen);
+	int (*deactivate_ve)(const char *ve_name);
+	int (*unregister_ve)(const char *ve_name);
+	int (*get_ve_config)(const char *ve_name,
+			     struct vcmmd_ve_config *ve_config);
+	int (*get_ve_state)(const char *ve_name, vcmmd_ve_state_t *ve_state);
+	int (*activate_ve_handle)(struct vcmmd_ve_handle *handle,
+				  unsigned int flags);
+	int (*update_ve_handle)(struct vcmmd_ve_handle *handle,
+				const struct vcmmd_ve_config *ve_config,
+				unsigned int flags);
+	int (*deactivate_ve_handle)(struct vcmmd_ve_handle *handle);
+	int (*get_ve_config_handle)(struct vcmmd_ve_handle *handle,
+				    struct vcmmd_ve_config *ve_config);
+	int (*get_ve_state_handle)(struct vcmmd_ve_handle *handle,
+				   vcmmd_ve_state_t *ve_state);
+	int (*get_current_policy)(char *policy_name, int len);
+	int (*get_policy_from_file)(char *policy_name, int len);
+	int (*set_policy)(const char *policy_name);
+	int (*get_host_capacity)(struct vcmmd_host_capacity *cap);
+	int (*get_node_capacity)(struct vcmmd_node_capacity *nodes,
+				 unsigned int nr_nodes);
+	int (*reserve)(uint64_t bytes, const char *nodes, unsigned int ttl_ms,
+		       vcmmd_reservation_t *token);
+	int (*unreserve)(vcmmd_reservation_t token);
+	int (*register_ve_reserved)(const char *ve_name,
+				    vcmmd_ve_type_t ve_type,
+				    const struct vcmmd_ve_config *ve_config,
+				    vcmmd_reservation_t token,
+				    unsigned int flags);
+	int (*supported_flags)(unsigned int *flags);
+};
+
+/* Talks to VCMMD over D-Bus, the default */
+__vcmmd_hidden extern const struct vcmmd_backend __vcmmd_dbus_backend;
+#ifdef HAVE_SDBUS
+/* Same, using sd-bus from libsystemd */
+__vcmmd_hidden extern const struct vcmmd_backend __vcmmd_sdbus_backend;
+#endif
+/* Keeps VEs in memory, for testing callers without VCMMD */
+__vcmmd_hidden extern const struct vcmmd_backend __vcmmd_fake_backend;
+
+/* Whether the backend in use holds a connection to the bus */
+__vcmmd_hidden bool __vcmmd_connected(void);
+
+__vcmmd_hidden void __vcmmd_record_call(const struct vcmmd_call_ctx *ctx,
+					int err, uint64_t end_ns);
+
+#endif /* _VCMMD_INTERNAL_H_ */
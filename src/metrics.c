@@ -0,0 +1,255 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+
+/*
+ * Output goes either to a caller's buffer, truncated like snprintf, or to a
+ * file descriptor through a small staging buffer.
+ */
+struct sink {
+	char *buf;
+	size_t len;
+	size_t pos;
+	int fd;
+	int err;
+	char tmp[4096];
+};
+
+static void sink_flush(struct sink *s)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (!s->err && off < s->pos) {
+		n = write(s->fd, s->tmp + off, s->pos - off);
+		if (n < 0) {
+			if (errno != EINTR)
+				s->err = errno;
+			continue;
+		}
+		off += n;
+	}
+	s->pos = 0;
+}
+
+static void __attribute__ ((format(printf, 2, 3)))
+sink_printf(struct sink *s, const char *fmt, ...)
+{
+	char line[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if ((size_t)n >= sizeof(line))
+		n = sizeof(line) - 1;
+
+	if (s->fd < 0) {
+		if (s->pos < s->len)
+			memcpy(s->buf + s->pos, line,
+			       s->len - s->pos > (size_t)n ?
+			       (size_t)n : s->len - s->pos);
+		s->pos += n;
+		return;
+	}
+
+	if (s->pos + n > sizeof(s->tmp))
+		sink_flush(s);
+	memcpy(s->tmp + s->pos, line, n);
+	s->pos += n;
+}
+
+static void put_help(struct sink *s, const char *name, const char *type,
+		     const char *help)
+{
+	sink_printf(s, "# TYPE %s %s\n", name, type);
+	sink_printf(s, "# HELP %s %s\n", name, help);
+}
+
+/*
+ * Upper bound of histogram bucket @i, in seconds. A whole number of
+ * microseconds, so printed with exactly six decimals: %g would round the
+ * larger ones.
+ */
+static double bucket_le(unsigned int i)
+{
+	return (double)(1ULL << i) / 1e6;
+}
+
+static void put_histogram(struct sink *s, const char *name,
+			  const char *labels, const uint64_t *buckets,
+			  uint64_t count, uint64_t sum_ns)
+{
+	uint64_t cum = 0;
+	unsigned int i;
+
+	for (i = 0; i < VCMMD_STATS_NR_BUCKETS - 1; i++) {
+		cum += buckets[i];
+		sink_printf(s, "%s_bucket{%s%sle=\"%.6f\"} %llu\n",
+			    name, labels, *labels ? "," : "", bucket_le(i),
+			    (unsigned long long)cum);
+	}
+	sink_printf(s, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+		    name, labels, *labels ? "," : "",
+		    (unsigned long long)count);
+	sink_printf(s, "%s_count{%s} %llu\n", name, labels,
+		    (unsigned long long)count);
+	sink_printf(s, "%s_sum{%s} %.9f\n", name, labels, sum_ns / 1e9);
+}
+
+#define CALL_COUNTER(s, st, field, metric, help) do { \
+	int __c; \
+	put_help(s, metric, "counter", help); \
+	for (__c = 0; __c < __NR_VCMMD_CALLS; __c++) \
+		sink_printf(s, metric "_total{call=\"%s\"} %llu\n", \
+			    vcmmd_call_name(__c), \
+			    (unsigned long long)(st)->calls[__c].field); \
+} while (0)
+
+static void render(struct sink *s)
+{
+	struct vcmmd_stats st;
+	char labels[64];
+	int c, i;
+
+	vcmmd_get_stats(&st);
+
+	CALL_COUNTER(s, &st, calls, "vcmmd_client_calls",
+		     "Library calls made.");
+	CALL_COUNTER(s, &st, errors, "vcmmd_client_call_errors",
+		     "Library calls that returned an error.");
+	CALL_COUNTER(s, &st, retries, "vcmmd_client_call_retries",
+		     "Requests resent after a failed send.");
+	CALL_COUNTER(s, &st, reconnects, "vcmmd_client_call_reconnects",
+		     "Bus connections dropped during calls.");
+
+	put_help(s, "vcmmd_client_call_duration_seconds", "histogram",
+		 "Library call latency.");
+	for (c = 0; c < __NR_VCMMD_CALLS; c++) {
+		snprintf(labels, sizeof(labels), "call=\"%s\"",
+			 vcmmd_call_name(c));
+		put_histogram(s, "vcmmd_client_call_duration_seconds", labels,
+			      st.calls[c].latency, st.calls[c].calls,
+			      st.calls[c].total_ns);
+	}
+
+	put_help(s, "vcmmd_client_errors", "counter",
+		 "Errors returned by the library, by code.");
+	for (i = 0; i < VCMMD_STATS_MAX_ERRORS; i++)
+		if (st.service_errors[i])
+			sink_printf(s, "vcmmd_client_errors_total{code=\"%d\"} %llu\n",
+				    i, (unsigned long long)st.service_errors[i]);
+	for (i = 0; i < VCMMD_STATS_MAX_ERRORS; i++)
+		if (st.lib_errors[i])
+			sink_printf(s, "vcmmd_client_errors_total{code=\"%d\"} %llu\n",
+				    i + __VCMMD_LIB_ERROR_START,
+				    (unsigned long long)st.lib_errors[i]);
+
+	put_help(s, "vcmmd_client_retries", "counter",
+		 "Requests resent after a failed send.");
+	sink_printf(s, "vcmmd_client_retries_total %llu\n",
+		    (unsigned long long)st.retries);
+	put_help(s, "vcmmd_client_reconnects", "counter",
+		 "Bus connections dropped.");
+	sink_printf(s, "vcmmd_client_reconnects_total %llu\n",
+		    (unsigned long long)st.reconnects);
+
+	put_help(s, "vcmmd_client_lock_wait_seconds", "histogram",
+		 "Contended waits for the connection lock.");
+	put_histogram(s, "vcmmd_client_lock_wait_seconds", "",
+		      st.lock_wait_latency, st.lock_waits, st.lock_wait_ns);
+
+	put_help(s, "vcmmd_client_busy_retries", "counter",
+		 "Requests resent after VCMMD was too busy to take them.");
+	sink_printf(s, "vcmmd_client_busy_retries_total %llu\n",
+		    (unsigned long long)st.busy_retries);
+	put_help(s, "vcmmd_client_admission_waits", "counter",
+		 "Calls queued by rate control.");
+	sink_printf(s, "vcmmd_client_admission_waits_total %llu\n",
+		    (unsigned long long)st.admission_waits);
+	put_help(s, "vcmmd_client_admission_wait_seconds", "counter",
+		 "Time calls spent queued by rate control.");
+	sink_printf(s, "vcmmd_client_admission_wait_seconds_total %.9f\n",
+		    st.admission_wait_ns / 1e9);
+	put_help(s, "vcmmd_client_rate_limit", "gauge",
+		 "Rate controlled calls allowed in flight, 0 if off.");
+	sink_printf(s, "vcmmd_client_rate_limit %llu\n",
+		    (unsigned long long)st.rate_limit);
+	put_help(s, "vcmmd_client_in_flight", "gauge",
+		 "Rate controlled calls in flight.");
+	sink_printf(s, "vcmmd_client_in_flight %llu\n",
+		    (unsigned long long)st.in_flight);
+	put_help(s, "vcmmd_client_queue_depth", "gauge",
+		 "Calls queued by rate control.");
+	sink_printf(s, "vcmmd_client_queue_depth %llu\n",
+		    (unsigned long long)st.queue_depth);
+
+	put_help(s, "vcmmd_client_connected", "gauge",
+		 "Whether the library holds a bus connection.");
+	sink_printf(s, "vcmmd_client_connected %d\n", __vcmmd_connected());
+
+	sink_printf(s, "# EOF\n");
+}
+
+size_t vcmmd_metrics_format(char *buf, size_t len)
+{
+	struct sink s = {
+		.buf = buf,
+		.len = len,
+		.fd = -1,
+	};
+
+	render(&s);
+	if (len)
+		buf[s.pos < len ? s.pos : len - 1] = '\0';
+	return s.pos;
+}
+
+int vcmmd_metrics_write(int fd)
+{
+	struct sink s = {
+		.fd = fd,
+	};
+
+	render(&s);
+	sink_flush(&s);
+	if (s.err) {
+		errno = s.err;
+		return -1;
+	}
+	return 0;
+}
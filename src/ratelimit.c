@@ -0,0 +1,312 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * Rate control
+ *
+ * An AIMD limit on the rate controlled calls a process has in flight, the
+ * way TCP adjusts its congestion window: VCMMD refusing a request with
+ * VCMMD_ERROR_TOO_MANY_REQUESTS halves the limit, every answer it gives
+ * grows it by 1 / limit. Calls sent before the last decrease were sent at
+ * the old limit, so their refusals do not decrease it again. Calls over the
+ * limit wait on a condition variable and are woken one per call leaving.
+ *
+ * The jittered backoff of resent calls also spaces out the reconnect
+ * attempts of the backends, see __vcmmd_reconnect_backoff. Those back off
+ * only while recovering, for RECOVERY_WINDOW_MS after losing a VCMMD that
+ * was reached before. Before VCMMD was ever reached, or once it has been
+ * gone for longer, a call fails as fast as the bus lets it, so that hosts
+ * without VCMMD running do not make every caller wait.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+
+#define DEFAULT_MAX_IN_FLIGHT	64
+#define DEFAULT_BACKOFF_MS	10
+#define MAX_BACKOFF_MS		1000
+#define RECONNECT_BACKOFF_MS	5
+#define MAX_RECONNECT_BACKOFF_MS	100
+#define RECOVERY_WINDOW_MS	10000
+
+static pthread_mutex_t rc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rc_cond;
+static pthread_once_t rc_once = PTHREAD_ONCE_INIT;
+
+/* Settings, written under rc_mutex */
+static struct vcmmd_rate_control settings;
+
+/* State, under rc_mutex */
+static double limit;
+static unsigned int in_flight;
+static unsigned int queued;
+static uint64_t last_decrease_ns;
+
+static __thread unsigned int seed;
+
+/* Whether discovery ever found VCMMD, and when it was lost since, or 0 */
+static bool service_seen;
+static uint64_t service_lost_ns;
+
+static void rc_init_cond(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&rc_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+void vcmmd_set_rate_control(const struct vcmmd_rate_control *rc)
+{
+	pthread_once(&rc_once, rc_init_cond);
+
+	pthread_mutex_lock(&rc_mutex);
+	if (rc && rc->calls) {
+		settings = *rc;
+		if (!settings.max_in_flight)
+			settings.max_in_flight = DEFAULT_MAX_IN_FLIGHT;
+		if (!settings.backoff_ms)
+			settings.backoff_ms = DEFAULT_BACKOFF_MS;
+		limit = settings.max_in_flight;
+	} else {
+		settings.calls = 0;
+		limit = 0;
+	}
+	last_decrease_ns = 0;
+	__atomic_store_n(&settings.calls, settings.calls, __ATOMIC_RELEASE);
+	/* Let the queue go, whether the limit grew or there is none now */
+	pthread_cond_broadcast(&rc_cond);
+	pthread_mutex_unlock(&rc_mutex);
+}
+
+/* The call whose bit in settings.calls controls @call */
+static vcmmd_call_t rc_call(vcmmd_call_t call)
+{
+	switch (call) {
+	case VCMMD_CALL_REGISTER_VE_EX:
+	case VCMMD_CALL_REGISTER_VE_RANGE:
+	case VCMMD_CALL_REGISTER_VE_RESERVED:
+		return VCMMD_CALL_REGISTER_VE;
+	case VCMMD_CALL_UPDATE_VE_EX:
+		return VCMMD_CALL_UPDATE_VE;
+	default:
+		return call;
+	}
+}
+
+void __vcmmd_rc_begin(struct vcmmd_rc_ctx *rc, vcmmd_call_t call)
+{
+	uint32_t calls = __atomic_load_n(&settings.calls, __ATOMIC_ACQUIRE);
+
+	rc->enabled = calls & (1U << rc_call(call));
+	rc->admitted = false;
+	if (!rc->enabled)
+		return;
+
+	pthread_mutex_lock(&rc_mutex);
+	rc->max_retries = settings.max_retries;
+	rc->backoff_ms = settings.backoff_ms;
+	rc->deadline_ns = settings.timeout_ms ?
+		__vcmmd_now_ns() + settings.timeout_ms * 1000000ULL : 0;
+	pthread_mutex_unlock(&rc_mutex);
+	rc->tries = 0;
+}
+
+static bool over_limit(void)
+{
+	return settings.calls && in_flight >= (unsigned int)limit;
+}
+
+int __vcmmd_rc_admit(struct vcmmd_rc_ctx *rc)
+{
+	uint64_t start_ns;
+	int ret = 0;
+
+	if (!rc->enabled)
+		return 0;
+
+	pthread_mutex_lock(&rc_mutex);
+	if (over_limit()) {
+		start_ns = __vcmmd_now_ns();
+		queued++;
+		while (over_limit()) {
+			struct timespec ts;
+
+			if (!rc->deadline_ns) {
+				pthread_cond_wait(&rc_cond, &rc_mutex);
+				continue;
+			}
+			ts.tv_sec = rc->deadline_ns / 1000000000;
+			ts.tv_nsec = rc->deadline_ns % 1000000000;
+			ret = pthread_cond_timedwait(&rc_cond, &rc_mutex, &ts);
+			if (ret == ETIMEDOUT && over_limit())
+				break;
+			ret = 0;
+		}
+		queued--;
+		__vcmmd_stats_admission_wait(__vcmmd_now_ns() - start_ns);
+		if (ret) {
+			/* Pass the wake up on, we are not taking it */
+			pthread_cond_signal(&rc_cond);
+			pthread_mutex_unlock(&rc_mutex);
+			return VCMMD_ERROR_TOO_MANY_REQUESTS;
+		}
+	}
+	in_flight++;
+	rc->admitted = true;
+	rc->admitted_ns = __vcmmd_now_ns();
+	pthread_mutex_unlock(&rc_mutex);
+	return 0;
+}
+
+/*
+ * Sleep for between half and all of @base_ms doubled @tries times, capped at
+ * @max_ms, but not past @deadline_ns if it is not 0. The jitter spreads out
+ * threads and processes that failed at once.
+ */
+static void jittered_sleep(unsigned int base_ms, unsigned int tries,
+			   uint64_t max_ms, uint64_t deadline_ns)
+{
+	unsigned int shift = tries < 16 ? tries : 16;
+	uint64_t ms = (uint64_t)base_ms << shift;
+	uint64_t ns, now;
+	struct timespec ts;
+
+	if (ms > max_ms)
+		ms = max_ms;
+	if (!seed)
+		seed = (unsigned int)__vcmmd_now_ns() ^ (uintptr_t)&seed;
+	ns = ms * 1000000 / 2;
+	ns += (uint64_t)rand_r(&seed) * ns / RAND_MAX;
+
+	now = __vcmmd_now_ns();
+	if (deadline_ns && now + ns > deadline_ns)
+		ns = deadline_ns > now ? deadline_ns - now : 0;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+/* Sleep before resending, with jitter so that refused calls spread out */
+static void backoff(const struct vcmmd_rc_ctx *rc)
+{
+	jittered_sleep(rc->backoff_ms, rc->tries, MAX_BACKOFF_MS,
+		       rc->deadline_ns);
+}
+
+void __vcmmd_service_found(void)
+{
+	__atomic_store_n(&service_seen, true, __ATOMIC_RELAXED);
+	__atomic_store_n(&service_lost_ns, 0, __ATOMIC_RELAXED);
+}
+
+void __vcmmd_service_lost(void)
+{
+	uint64_t zero = 0;
+
+	/* The window starts with the first loss, not the latest */
+	if (__atomic_load_n(&service_seen, __ATOMIC_RELAXED))
+		__atomic_compare_exchange_n(&service_lost_ns, &zero,
+					    __vcmmd_now_ns(), false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static bool recovering(void)
+{
+	uint64_t lost_ns = __atomic_load_n(&service_lost_ns, __ATOMIC_RELAXED);
+
+	return lost_ns &&
+	       __vcmmd_now_ns() - lost_ns < RECOVERY_WINDOW_MS * 1000000ULL;
+}
+
+void __vcmmd_reconnect_backoff(unsigned int tries)
+{
+	if (!recovering())
+		return;
+	jittered_sleep(RECONNECT_BACKOFF_MS, tries - 1,
+		       MAX_RECONNECT_BACKOFF_MS, 0);
+}
+
+bool __vcmmd_rc_retry(struct vcmmd_rc_ctx *rc, int err)
+{
+	bool busy = err == VCMMD_ERROR_TOO_MANY_REQUESTS;
+
+	if (!rc->admitted)
+		return false;
+
+	pthread_mutex_lock(&rc_mutex);
+	rc->admitted = false;
+	in_flight--;
+	if (settings.calls) {
+		unsigned int old = limit;
+
+		if (busy && rc->admitted_ns > last_decrease_ns) {
+			limit /= 2;
+			if (limit < 1)
+				limit = 1;
+			last_decrease_ns = __vcmmd_now_ns();
+		} else if (!busy && (err < __VCMMD_LIB_ERROR_START)) {
+			/* VCMMD answered */
+			limit += 1 / limit;
+			if (limit > settings.max_in_flight)
+				limit = settings.max_in_flight;
+		}
+		if ((unsigned int)limit > old)
+			pthread_cond_broadcast(&rc_cond);
+		else
+			pthread_cond_signal(&rc_cond);
+	} else {
+		pthread_cond_signal(&rc_cond);
+	}
+	pthread_mutex_unlock(&rc_mutex);
+
+	if (!busy || rc->tries >= rc->max_retries)
+		return false;
+	if (rc->deadline_ns && __vcmmd_now_ns() >= rc->deadline_ns)
+		return false;
+	backoff(rc);
+	rc->tries++;
+	__vcmmd_stats_busy_retry();
+	return true;
+}
+
+void __vcmmd_rc_get_state(uint64_t *cur_limit, uint64_t *cur_in_flight,
+			  uint64_t *cur_queued)
+{
+	pthread_mutex_lock(&rc_mutex);
+	*cur_limit = settings.calls ? (uint64_t)limit : 0;
+	*cur_in_flight = in_flight;
+	*cur_queued = queued;
+	pthread_mutex_unlock(&rc_mutex);
+}
@@ -0,0 +1,233 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+
+/*
+ * Flight recorder
+ *
+ * A ring of the last VCMMD_FLIGHT_RECORDER_SIZE calls. Writers claim a slot
+ * by bumping ring_head and publish a record by storing its sequence number
+ * last; readers copy a slot and check that the sequence number did not
+ * change meanwhile, seqlock style. Nothing here takes a lock, so records can
+ * be read from a signal handler.
+ */
+struct ring_slot {
+	uint64_t seq;				/* 0 while being written */
+	struct vcmmd_call_record rec;
+};
+
+static struct ring_slot ring[VCMMD_FLIGHT_RECORDER_SIZE];
+static uint64_t ring_head;
+
+void __vcmmd_record_call(const struct vcmmd_call_ctx *ctx, int err,
+			 uint64_t end_ns)
+{
+	uint64_t seq = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED) + 1;
+	struct ring_slot *slot = &ring[(seq - 1) % VCMMD_FLIGHT_RECORDER_SIZE];
+	struct vcmmd_call_record *rec = &slot->rec;
+	struct timespec ts;
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec->seq = seq;
+	rec->end_realtime_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	rec->duration_ns = end_ns - ctx->start_ns;
+	rec->call = ctx->call;
+	rec->result = err;
+	rec->retries = ctx->retries;
+	rec->reconnects = ctx->reconnects;
+	rec->config_keys = ctx->config_keys;
+	if (ctx->ve_name) {
+		strncpy(rec->ve_name, ctx->ve_name, VCMMD_RECORD_NAME_LEN - 1);
+		rec->ve_name[VCMMD_RECORD_NAME_LEN - 1] = '\0';
+	} else
+		rec->ve_name[0] = '\0';
+
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy record number @seq to @rec. Returns false if it has been overwritten
+ * or is being written.
+ */
+static bool read_record(uint64_t seq, struct vcmmd_call_record *rec)
+{
+	struct ring_slot *slot = &ring[(seq - 1) % VCMMD_FLIGHT_RECORDER_SIZE];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+		return false;
+	memcpy(rec, &slot->rec, sizeof(*rec));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+static uint64_t first_seq(uint64_t head, unsigned int nr)
+{
+	if (nr > VCMMD_FLIGHT_RECORDER_SIZE)
+		nr = VCMMD_FLIGHT_RECORDER_SIZE;
+	return head > nr ? head - nr + 1 : 1;
+}
+
+unsigned int vcmmd_flight_recorder_read(struct vcmmd_call_record *records,
+					unsigned int nr)
+{
+	uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	uint64_t seq;
+	unsigned int n = 0;
+
+	if (!nr)
+		return 0;
+
+	for (seq = first_seq(head, nr); seq <= head; seq++)
+		if (read_record(seq, &records[n]))
+			n++;
+	return n;
+}
+
+/*
+ * Async-signal-safe formatting helpers: no stdio, no allocation.
+ */
+struct line {
+	char buf[256];
+	size_t len;
+};
+
+static void put_str(struct line *l, const char *s)
+{
+	while (*s && l->len < sizeof(l->buf))
+		l->buf[l->len++] = *s++;
+}
+
+static void put_uint(struct line *l, uint64_t v, unsigned int min_digits)
+{
+	char tmp[20];
+	unsigned int n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v || n < min_digits);
+
+	while (n && l->len < sizeof(l->buf))
+		l->buf[l->len++] = tmp[--n];
+}
+
+static void put_int(struct line *l, int v)
+{
+	if (v < 0) {
+		put_str(l, "-");
+		put_uint(l, -(int64_t)v, 1);
+	} else
+		put_uint(l, v, 1);
+}
+
+static void put_hex(struct line *l, uint32_t v)
+{
+	static const char digits[] = "0123456789abcdef";
+	char tmp[8];
+	unsigned int n = 0;
+
+	do {
+		tmp[n++] = digits[v & 0xf];
+		v >>= 4;
+	} while (v);
+
+	put_str(l, "0x");
+	while (n && l->len < sizeof(l->buf))
+		l->buf[l->len++] = tmp[--n];
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int vcmmd_flight_recorder_dump(int fd)
+{
+	uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	struct vcmmd_call_record rec;
+	struct line l;
+	const char *name;
+	uint64_t seq;
+
+	for (seq = first_seq(head, VCMMD_FLIGHT_RECORDER_SIZE);
+	     seq <= head; seq++) {
+		if (!read_record(seq, &rec))
+			continue;
+
+		name = vcmmd_call_name(rec.call);
+
+		l.len = 0;
+		put_str(&l, "seq=");
+		put_uint(&l, rec.seq, 1);
+		put_str(&l, " time=");
+		put_uint(&l, rec.end_realtime_ns / 1000000000, 1);
+		put_str(&l, ".");
+		put_uint(&l, rec.end_realtime_ns % 1000000000, 9);
+		put_str(&l, " call=");
+		put_str(&l, name ? name : "?");
+		put_str(&l, " ve=");
+		put_str(&l, rec.ve_name[0] ? rec.ve_name : "-");
+		put_str(&l, " keys=");
+		put_hex(&l, rec.config_keys);
+		put_str(&l, " duration_us=");
+		put_uint(&l, rec.duration_ns / 1000, 1);
+		put_str(&l, " retries=");
+		put_uint(&l, rec.retries, 1);
+		put_str(&l, " reconnects=");
+		put_uint(&l, rec.reconnects, 1);
+		put_str(&l, " result=");
+		put_int(&l, rec.result);
+		if (l.len == sizeof(l.buf))
+			l.len--;
+		l.buf[l.len++] = '\n';
+
+		if (write_all(fd, l.buf, l.len))
+			return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,1094 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * sd-bus backend: talks to the VCMMD service on the system bus using sd-bus
+ * from libsystemd instead of libdbus
+ *
+ * An sd_bus connection must not be shared between threads, so every thread
+ * gets a connection of its own on its first call. Calls never wait for a
+ * lock, at the price of a bus connection per calling thread; it is closed
+ * when the thread exits. Requests are not cached, so frozen requests are
+ * sent as plain ones.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <systemd/sd-bus.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+
+#define VCMMD_BUSNAME_MAXLEN	128
+
+/* See VCMMD_REPLY_TIMEOUT_MS in dbus.c */
+#define VCMMD_REPLY_TIMEOUT_USEC	(24 * 3600 * 1000000ULL)
+
+#define MAX_TRIES		6
+
+/*
+ * VCMMD service discovery cache, same as in dbus.c: the name is looked up
+ * again once VCMMD turns out to be gone or a connection breaks.
+ */
+static char vcmmd_bus_name[VCMMD_BUSNAME_MAXLEN];
+static char vcmmd_iface_name[VCMMD_BUSNAME_MAXLEN + sizeof(".LoadManager")];
+static bool vcmmd_service_stale;
+static pthread_mutex_t service_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t vcmmd_features;
+static bool vcmmd_features_known;
+
+static __thread sd_bus *bus;
+static pthread_key_t bus_key;
+static pthread_once_t bus_key_once = PTHREAD_ONCE_INIT;
+static unsigned int nr_buses;
+
+static void close_bus(void *b)
+{
+	sd_bus_flush_close_unref(b);
+	__atomic_sub_fetch(&nr_buses, 1, __ATOMIC_RELAXED);
+}
+
+static void make_bus_key(void)
+{
+	if (pthread_key_create(&bus_key, close_bus))
+		abort();
+}
+
+static bool sdbus_connected(void)
+{
+	return __atomic_load_n(&nr_buses, __ATOMIC_RELAXED) > 0;
+}
+
+/* The calling thread's connection, made on first use */
+static sd_bus *get_bus(void)
+{
+	sd_bus *b;
+	int r;
+
+	if (bus)
+		return bus;
+
+	pthread_once(&bus_key_once, make_bus_key);
+
+	VCMMD_PROBE(connect__start);
+	r = sd_bus_open_system(&b);
+	VCMMD_PROBE(connect__done, r >= 0);
+	__vcmmd_trace_mark(VCMMD_PHASE_CONNECT);
+	if (r < 0)
+		return NULL;
+
+	bus = b;
+	pthread_setspecific(bus_key, b);
+	__atomic_add_fetch(&nr_buses, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+static void invalidate_vcmmd_service(void)
+{
+	if (!__atomic_exchange_n(&vcmmd_service_stale, true, __ATOMIC_RELAXED))
+		VCMMD_PROBE(service__lost);
+	__atomic_store_n(&vcmmd_features_known, false, __ATOMIC_RELEASE);
+	__vcmmd_service_lost();
+}
+
+static void drop_bus(void)
+{
+	pthread_setspecific(bus_key, NULL);
+	close_bus(bus);
+	bus = NULL;
+	VCMMD_PROBE(reconnect);
+	__vcmmd_stats_reconnect();
+	invalidate_vcmmd_service();
+}
+
+/*
+ * Errors that mean the peer did answer, so reconnecting would not help.
+ * sd-bus names the errnos of its own failures System.Error.E*, which look
+ * just like an answer, so an error only counts while @b is still open: a
+ * call on a closed bus fails with ENOTCONN, and would keep failing.
+ */
+static bool is_remote_error(sd_bus *b, const sd_bus_error *error)
+{
+	return sd_bus_is_open(b) > 0 && sd_bus_error_is_set(error) &&
+	       !sd_bus_error_has_name(error, SD_BUS_ERROR_NO_REPLY) &&
+	       !sd_bus_error_has_name(error, SD_BUS_ERROR_TIMEOUT) &&
+	       !sd_bus_error_has_name(error, SD_BUS_ERROR_NO_MEMORY) &&
+	       !sd_bus_error_has_name(error, SD_BUS_ERROR_DISCONNECTED);
+}
+
+static bool is_service_gone(const sd_bus_error *error)
+{
+	return sd_bus_error_has_name(error, SD_BUS_ERROR_SERVICE_UNKNOWN) ||
+	       sd_bus_error_has_name(error, SD_BUS_ERROR_NAME_HAS_NO_OWNER);
+}
+
+typedef int (*append_fn)(sd_bus_message *m, const void *data);
+
+/*
+ * Call @method of VCMMD, or of the bus itself if @dest is NULL, retrying
+ * on a new connection if the connection breaks. @append, if not NULL, adds
+ * the arguments; the message is built anew for every try, since sd-bus ties
+ * it to the connection. If the peer answers with an error, it is stored in
+ * @error unless it is NULL. Returns 0 and the reply in @reply, or an error
+ * code.
+ */
+static int call_method(const char *dest, const char *path, const char *iface,
+		       const char *method, append_fn append, const void *data,
+		       sd_bus_message **reply, sd_bus_error *error)
+{
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+	sd_bus_message *m;
+	int tries, r;
+	sd_bus *b;
+
+	for (tries = 0; tries < MAX_TRIES; tries++) {
+		if (tries) {
+			VCMMD_PROBE(send__retry, method, MAX_TRIES - tries);
+			__vcmmd_stats_retry();
+			__vcmmd_reconnect_backoff(tries);
+		}
+
+		__vcmmd_trace_mark(VCMMD_PHASE_MARSHAL);
+		b = get_bus();
+		if (!b)
+			continue;
+
+		r = sd_bus_message_new_method_call(b, &m, dest, path, iface,
+						   method);
+		if (r < 0) {
+			if (r != -ENOMEM) {
+				drop_bus();
+				continue;
+			}
+			return VCMMD_ERROR_NO_MEMORY;
+		}
+		if (append && append(m, data) < 0) {
+			sd_bus_message_unref(m);
+			return VCMMD_ERROR_NO_MEMORY;
+		}
+		__vcmmd_trace_mark(VCMMD_PHASE_MARSHAL);
+
+		VCMMD_PROBE(send__start, method, MAX_TRIES - tries);
+		/* Sending is not timed apart from waiting for the reply */
+		__vcmmd_trace_mark(VCMMD_PHASE_SEND);
+		r = sd_bus_call(b, m, VCMMD_REPLY_TIMEOUT_USEC, &err, reply);
+		__vcmmd_trace_mark(VCMMD_PHASE_REPLY);
+		VCMMD_PROBE(send__done, method, r >= 0);
+		sd_bus_message_unref(m);
+
+		if (r >= 0)
+			return 0;
+
+		if (is_remote_error(b, &err)) {
+			if (is_service_gone(&err))
+				invalidate_vcmmd_service();
+			if (error)
+				sd_bus_error_move(error, &err);
+			else
+				sd_bus_error_free(&err);
+			return VCMMD_ERROR_CONNECTION_FAILED;
+		}
+		sd_bus_error_free(&err);
+
+		/* Only this thread uses the connection, so it can go at once */
+		drop_bus();
+	}
+	return VCMMD_ERROR_CONNECTION_FAILED;
+}
+
+static void set_vcmmd_bus_name(const char *name)
+{
+	pthread_mutex_lock(&service_mutex);
+	if (strcmp(vcmmd_bus_name, name)) {
+		strncpy(vcmmd_bus_name, name, VCMMD_BUSNAME_MAXLEN - 1);
+		strcpy(vcmmd_iface_name, vcmmd_bus_name);
+		strcat(vcmmd_iface_name, ".LoadManager");
+	}
+	__atomic_store_n(&vcmmd_service_stale, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&service_mutex);
+}
+
+static int __get_vcmmd_bus_name(void)
+{
+	sd_bus_message *reply = NULL;
+	const char *str;
+	bool found = false;
+	int err, r;
+
+	err = call_method("org.freedesktop.DBus", "/org/freedesktop/DBus",
+			  "org.freedesktop.DBus", "ListNames", NULL, NULL,
+			  &reply, NULL);
+	if (err)
+		return VCMMD_ERROR_BUSNAME_FETCH_FAILED;
+
+	r = sd_bus_message_enter_container(reply, 'a', "s");
+	while (r >= 0 && (r = sd_bus_message_read(reply, "s", &str)) > 0) {
+		if (strnlen(str, VCMMD_BUSNAME_MAXLEN) > 0 &&
+		    strstr(str, ".vcmmd")) {
+			set_vcmmd_bus_name(str);
+			__vcmmd_service_found();
+			found = true;
+			break;
+		}
+	}
+	sd_bus_message_unref(reply);
+
+	return found ? 0 : VCMMD_ERROR_BUSNAME_FETCH_FAILED;
+}
+
+/* Discoveries failed in a row, all threads together */
+static unsigned int discovery_failures;
+
+static int get_vcmmd_bus_name(void)
+{
+	struct vcmmd_call_ctx call;
+	unsigned int failures;
+	int err;
+
+	if (*vcmmd_bus_name &&
+	    !__atomic_load_n(&vcmmd_service_stale, __ATOMIC_RELAXED))
+		return 0;
+
+	VCMMD_PROBE(discovery__entry);
+	__vcmmd_call_begin(&call, VCMMD_CALL_DISCOVERY, NULL);
+	/* Do not have every caller query the bus while VCMMD restarts */
+	failures = __atomic_load_n(&discovery_failures, __ATOMIC_RELAXED);
+	if (failures)
+		__vcmmd_reconnect_backoff(failures);
+	err = __vcmmd_call_end(&call, __get_vcmmd_bus_name());
+	if (err)
+		__atomic_add_fetch(&discovery_failures, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(&discovery_failures, 0, __ATOMIC_RELAXED);
+	VCMMD_PROBE(discovery__return, vcmmd_bus_name, err);
+	return err;
+}
+
+/*
+ * Call @method of VCMMD. The destination is copied, since another thread
+ * may change it meanwhile.
+ */
+static int call_vcmmd(const char *method, append_fn append, const void *data,
+		      sd_bus_message **reply, sd_bus_error *error)
+{
+	char dest[sizeof(vcmmd_bus_name)], iface[sizeof(vcmmd_iface_name)];
+	int err;
+
+	err = get_vcmmd_bus_name();
+	if (err)
+		return err;
+
+	pthread_mutex_lock(&service_mutex);
+	strcpy(dest, vcmmd_bus_name);
+	strcpy(iface, vcmmd_iface_name);
+	pthread_mutex_unlock(&service_mutex);
+
+	return call_method(dest, "/LoadManager", iface, method, append, data,
+			   reply, error);
+}
+
+static int __get_vcmmd_features(void)
+{
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	sd_bus_message *reply;
+	uint64_t features = 0;
+	int err;
+
+	err = call_vcmmd("GetFeatures", NULL, NULL, &reply, &error);
+	if (err) {
+		/* Services predating GetFeatures */
+		if (!sd_bus_error_has_name(&error, SD_BUS_ERROR_UNKNOWN_METHOD)) {
+			sd_bus_error_free(&error);
+			return err;
+		}
+		sd_bus_error_free(&error);
+	} else {
+		if (sd_bus_message_read(reply, "t", &features) < 0)
+			features = 0;
+		sd_bus_message_unref(reply);
+	}
+
+	vcmmd_features = features;
+	__atomic_store_n(&vcmmd_features_known, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Get the features VCMMD supports into @features. Returns 0, or the error
+ * that kept VCMMD from answering, in which case no features are assumed.
+ */
+static int get_vcmmd_features(uint64_t *features)
+{
+	struct vcmmd_call_ctx call;
+	int err = 0;
+
+	if (!__atomic_load_n(&vcmmd_features_known, __ATOMIC_ACQUIRE)) {
+		__vcmmd_call_begin(&call, VCMMD_CALL_DISCOVERY, NULL);
+		err = __vcmmd_call_end(&call, __get_vcmmd_features());
+	}
+	*features = err ? 0 : vcmmd_features;
+	return err;
+}
+
+/*
+ * Whether to use @feature for a request that can do without it. If VCMMD
+ * cannot be asked, the plain request is sent, and fails on its own.
+ */
+static bool has_feature(uint64_t feature)
+{
+	uint64_t features;
+
+	return !get_vcmmd_features(&features) && (features & feature);
+}
+
+/*
+ * Check that VCMMD supports @feature, for requests that need it
+ */
+static int require_feature(uint64_t feature)
+{
+	uint64_t features;
+	int err;
+
+	err = get_vcmmd_features(&features);
+	if (err)
+		return err;
+	return features & feature ? 0 : VCMMD_ERROR_NOT_SUPPORTED;
+}
+
+/*
+ * Call @method and return the error code VCMMD replied with
+ */
+static int send_msg(const char *method, append_fn append, const void *data)
+{
+	sd_bus_message *reply;
+	int32_t ret;
+	int err;
+
+	err = call_vcmmd(method, append, data, &reply, NULL);
+	if (err)
+		return err;
+
+	if (sd_bus_message_read(reply, "i", &ret) < 0)
+		ret = VCMMD_ERROR_CONNECTION_FAILED;
+	sd_bus_message_unref(reply);
+	return ret;
+}
+
+static int append_config(sd_bus_message *m,
+			 const struct vcmmd_ve_config *config)
+{
+	const struct vcmmd_ve_config_entry *entry;
+	int i, r;
+
+	r = sd_bus_message_open_container(m, 'a', "(qts)");
+	for (i = 0; r >= 0 && i < config->nr_entries; i++) {
+		entry = &config->entries[i];
+		r = sd_bus_message_append(m, "(qts)", (uint16_t)entry->key,
+					  (uint64_t)entry->value,
+					  entry->str ? entry->str : "");
+	}
+	if (r >= 0)
+		r = sd_bus_message_close_container(m);
+	return r;
+}
+
+/*
+ * Compact config encoding, see __vcmmd_append_config_compact
+ */
+static int append_config_compact(sd_bus_message *m,
+				 const struct vcmmd_ve_config *config)
+{
+	uint64_t values[__NR_VCMMD_VE_CONFIG_KEYS];
+	const struct vcmmd_ve_config_entry *entry;
+	uint64_t mask = 0;
+	int i, key, r, nr_values = 0;
+
+	for (i = 0; i < config->nr_entries; i++) {
+		entry = &config->entries[i];
+		if (!vcmmd_ve_config_entry_is_string(entry->key))
+			mask |= 1ULL << entry->key;
+	}
+
+	for (key = 0; key < __NR_VCMMD_VE_CONFIG_KEYS; key++) {
+		if (!(mask & (1ULL << key)))
+			continue;
+		for (i = 0; i < config->nr_entries; i++)
+			if (config->entries[i].key == key)
+				values[nr_values++] = config->entries[i].value;
+	}
+
+	r = sd_bus_message_open_container(m, 'r', "tata(qs)");
+	if (r >= 0)
+		r = sd_bus_message_append(m, "t", mask);
+	if (r >= 0)
+		r = sd_bus_message_append_array(m, 't', values,
+						nr_values * sizeof(values[0]));
+	if (r >= 0)
+		r = sd_bus_message_open_container(m, 'a', "(qs)");
+	for (i = 0; r >= 0 && i < config->nr_entries; i++) {
+		entry = &config->entries[i];
+		if (!vcmmd_ve_config_entry_is_string(entry->key))
+			continue;
+		r = sd_bus_message_append(m, "(qs)", (uint16_t)entry->key,
+					  entry->str ? entry->str : "");
+	}
+	if (r >= 0)
+		r = sd_bus_message_close_container(m);
+	if (r >= 0)
+		r = sd_bus_message_close_container(m);
+	return r;
+}
+
+struct ve_request {
+	const char *ve_name;
+	vcmmd_ve_type_t ve_type;
+	const struct vcmmd_ve_config *ve_config;
+	unsigned int flags;
+	bool compact;
+};
+
+static int append_register(sd_bus_message *m, const void *data)
+{
+	const struct ve_request *req = data;
+	int r;
+
+	r = sd_bus_message_append(m, "si", req->ve_name,
+				  (int32_t)req->ve_type);
+	if (r >= 0)
+		r = req->compact ? append_config_compact(m, req->ve_config) :
+				   append_config(m, req->ve_config);
+	if (r >= 0)
+		r = sd_bus_message_append(m, "u", (uint32_t)req->flags);
+	return r;
+}
+
+static int append_update(sd_bus_message *m, const void *data)
+{
+	const struct ve_request *req = data;
+	int r;
+
+	r = sd_bus_message_append(m, "s", req->ve_name);
+	if (r >= 0)
+		r = req->compact ? append_config_compact(m, req->ve_config) :
+				   append_config(m, req->ve_config);
+	if (r >= 0)
+		r = sd_bus_message_append(m, "u", (uint32_t)req->flags);
+	return r;
+}
+
+static int append_name_flags(sd_bus_message *m, const void *data)
+{
+	const struct ve_request *req = data;
+
+	return sd_bus_message_append(m, "su", req->ve_name,
+				     (uint32_t)req->flags);
+}
+
+static int append_name(sd_bus_message *m, const void *data)
+{
+	return sd_bus_message_append(m, "s", (const char *)data);
+}
+
+static bool use_compact_config(void)
+{
+	return has_feature(VCMMD_FEATURE_COMPACT_CONFIG);
+}
+
+static int sdbus_register_ve(const char *ve_name, vcmmd_ve_type_t ve_type,
+			     const struct vcmmd_ve_config *ve_config,
+			     unsigned int flags)
+{
+	struct ve_request req = {
+		.ve_name	= ve_name,
+		.ve_type	= ve_type,
+		.ve_config	= ve_config,
+		.flags		= flags,
+	};
+	int err;
+
+	err = get_vcmmd_bus_name();
+	if (err)
+		return err;
+	req.compact = use_compact_config();
+
+	return send_msg(req.compact ? "RegisterVE2" : "RegisterVE",
+			append_register, &req);
+}
+
+static int sdbus_activate_ve(const char *ve_name, unsigned int flags)
+{
+	struct ve_request req = {
+		.ve_name	= ve_name,
+		.flags		= flags,
+	};
+
+	return send_msg("ActivateVE", append_name_flags, &req);
+}
+
+static int sdbus_update_ve(const char *ve_name,
+			   const struct vcmmd_ve_config *ve_config,
+			   unsigned int flags)
+{
+	struct ve_request req = {
+		.ve_name	= ve_name,
+		.ve_config	= ve_config,
+		.flags		= flags,
+	};
+	int err;
+
+	err = get_vcmmd_bus_name();
+	if (err)
+		return err;
+	req.compact = use_compact_config();
+
+	return send_msg(req.compact ? "UpdateVE2" : "UpdateVE",
+			append_update, &req);
+}
+
+/*
+ * Call @method, one of RegisterVEEx and UpdateVEEx, and parse the shortfall
+ * VCMMD replied with
+ */
+static int send_msg_shortfall(const char *method, append_fn append,
+			      const void *data,
+			      struct vcmmd_shortfall *shortfall)
+{
+	sd_bus_message *reply;
+	uint64_t missing;
+	uint32_t resource;
+	uint16_t node;
+	int32_t ret;
+	int err, r;
+
+	err = call_vcmmd(method, append, data, &reply, NULL);
+	if (err)
+		return err;
+
+	if (sd_bus_message_read(reply, "iut", &ret, &resource, &missing) < 0) {
+		ret = VCMMD_ERROR_CONNECTION_FAILED;
+		goto out;
+	}
+	if (ret != VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE)
+		goto out;
+
+	shortfall->resource = resource;
+	shortfall->missing = missing;
+	if (sd_bus_message_enter_container(reply, 'a', "(qt)") < 0) {
+		ret = VCMMD_ERROR_CONNECTION_FAILED;
+		goto out;
+	}
+	while ((r = sd_bus_message_read(reply, "(qt)", &node, &missing)) > 0)
+		if (node < VCMMD_SHORTFALL_MAX_NODES)
+			shortfall->node_missing[node] = missing;
+	if (r < 0)
+		ret = VCMMD_ERROR_CONNECTION_FAILED;
+out:
+	sd_bus_message_unref(reply);
+	return ret;
+}
+
+static bool use_shortfall(void)
+{
+	return has_feature(VCMMD_FEATURE_SHORTFALL);
+}
+
+static int sdbus_register_ve_ex(const char *ve_name, vcmmd_ve_type_t ve_type,
+				const struct vcmmd_ve_config *ve_config,
+				unsigned int flags,
+				struct vcmmd_shortfall *shortfall)
+{
+	struct ve_request req = {
+		.ve_name	= ve_name,
+		.ve_type	= ve_type,
+		.ve_config	= ve_config,
+		.flags		= flags,
+		.compact	= true,
+	};
+	int err;
+
+	err = get_vcmmd_bus_name();
+	if (err)
+		return err;
+	if (!use_shortfall())
+		return sdbus_register_ve(ve_name, ve_type, ve_config, flags);
+
+	return send_msg_shortfall("RegisterVEEx", append_register, &req,
+				  shortfall);
+}
+
+static int sdbus_update_ve_ex(const char *ve_name,
+			      const struct vcmmd_ve_config *ve_config,
+			      unsigned int flags,
+			      struct vcmmd_shortfall *shortfall)
+{
+	struct ve_request req = {
+		.ve_name	= ve_name,
+		.ve_config	= ve_config,
+		.flags		= flags,
+		.compact	= true,
+	};
+	int err;
+
+	err = get_vcmmd_bus_name();
+	if (err)
+		return err;
+	if (!use_shortfall())
+		return sdbus_update_ve(ve_name, ve_config, flags);
+
+	return send_msg_shortfall("UpdateVEEx", append_update, &req,
+				  shortfall);
+}
+
+struct range_request {
+	struct ve_request req;
+	const struct vcmmd_ve_range *range;
+};
+
+static int append_register_range(sd_bus_message *m, const void *data)
+{
+	const struct range_request *rr = data;
+	const struct ve_request *req = &rr->req;
+	int r;
+
+	r = sd_bus_message_append(m, "si", req->ve_name,
+				  (int32_t)req->ve_type);
+	if (r >= 0)
+		r = append_config_compact(m, req->ve_config);
+	if (r >= 0)
+		r = sd_bus_message_append(m, "ttttu",
+					  rr->range->guarantee_min,
+					  rr->range->guarantee_max,
+					  rr->range->limit_min,
+					  rr->range->limit_max,
+					  (uint32_t)req->flags);
+	return r;
+}
+
+static int sdbus_register_ve_range(const char *ve_name,
+				   vcmmd_ve_type_t ve_type,
+				   const struct vcmmd_ve_config *ve_config,
+				   const struct vcmmd_ve_range *range,
+				   unsigned int flags,
+				   uint64_t *guarantee, uint64_t *limit)
+{
+	struct range_request rr = {
+		.req = {
+			.ve_name	= ve_name,
+			.ve_type	= ve_type,
+			.ve_config	= ve_config,
+			.flags		= flags,
+			.compact	= true,
+		},
+		.range = range,
+	};
+	sd_bus_message *reply;
+	uint64_t g, l;
+	int32_t ret;
+	int err;
+
+	err = get_vcmmd_bus_name();
+	if (err)
+		return err;
+	err = require_feature(VCMMD_FEATURE_VE_RANGE);
+	if (err)
+		return err;
+
+	err = call_vcmmd("RegisterVERange", append_register_range, &rr,
+			 &reply, NULL);
+	if (err)
+		return err;
+
+	if (sd_bus_message_read(reply, "itt", &ret, &g, &l) < 0)
+		ret = VCMMD_ERROR_CONNECTION_FAILED;
+	sd_bus_message_unref(reply);
+	if (ret)
+		return ret;
+
+	*guarantee = g;
+	*limit = l;
+	return 0;
+}
+
+static int sdbus_deactivate_ve(const char *ve_name)
+{
+	return send_msg("DeactivateVE", append_name, ve_name);
+}
+
+static int sdbus_unregister_ve(const char *ve_name)
+{
+	return send_msg("UnregisterVE", append_name, ve_name);
+}
+
+static int parse_ve_config(sd_bus_message *reply,
+			   struct vcmmd_ve_config *ve_config)
+{
+	const char *str;
+	uint16_t key;
+	uint64_t value;
+	int32_t err;
+	bool ok;
+	int r;
+
+	if (sd_bus_message_read(reply, "i", &err) < 0)
+		return VCMMD_ERROR_INVALID_VE_CONFIG;
+	if (err)
+		return err;
+
+	if (sd_bus_message_enter_container(reply, 'a', "(qts)") < 0)
+		return VCMMD_ERROR_INVALID_VE_CONFIG;
+	while ((r = sd_bus_message_read(reply, "(qts)",
+					&key, &value, &str)) > 0) {
+		if (vcmmd_ve_config_entry_is_string(key))
+			ok = vcmmd_ve_config_append_string(ve_config, key, str);
+		else
+			ok = vcmmd_ve_config_append(ve_config, key, value);
+		if (!ok)
+			return VCMMD_ERROR_INVALID_VE_CONFIG;
+	}
+	return r < 0 ? VCMMD_ERROR_INVALID_VE_CONFIG : 0;
+}
+
+static int sdbus_get_ve_config(const char *ve_name,
+			       struct vcmmd_ve_config *ve_config)
+{
+	sd_bus_message *reply;
+	int err;
+
+	vcmmd_ve_config_init(ve_config);
+
+	err = call_vcmmd("GetVEConfig", append_name, ve_name, &reply, NULL);
+	if (err)
+		return err;
+
+	err = parse_ve_config(reply, ve_config);
+	if (err)
+		vcmmd_ve_config_deinit(ve_config);
+	sd_bus_message_unref(reply);
+	return err;
+}
+
+static int sdbus_get_ve_state(const char *ve_name, vcmmd_ve_state_t *ve_state)
+{
+	sd_bus_message *reply;
+	int32_t ret;
+	int active, err;
+
+	err = call_vcmmd("IsVEActive", append_name, ve_name, &reply, NULL);
+	if (err)
+		return err;
+
+	if (sd_bus_message_read(reply, "ib", &ret, &active) < 0) {
+		sd_bus_message_unref(reply);
+		return VCMMD_ERROR_CONNECTION_FAILED;
+	}
+	sd_bus_message_unref(reply);
+
+	if (ret) {
+		if (ret == VCMMD_ERROR_VE_NOT_REGISTERED) {
+			*ve_state = VCMMD_VE_UNREGISTERED;
+			ret = 0;
+		}
+		return ret;
+	}
+
+	*ve_state = active ? VCMMD_VE_ACTIVE : VCMMD_VE_REGISTERED;
+	return 0;
+}
+
+static int get_policy(const char *method, char *policy_name, int len)
+{
+	sd_bus_message *reply;
+	const char *ret;
+	int err;
+
+	err = call_vcmmd(method, NULL, NULL, &reply, NULL);
+	if (err)
+		return err;
+
+	if (sd_bus_message_read(reply, "s", &ret) < 0)
+		err = VCMMD_ERROR_CONNECTION_FAILED;
+	else if (strlen(ret) > len - 1)
+		err = VCMMD_ERROR_NO_MEMORY;
+	else
+		strcpy(policy_name, ret);
+	sd_bus_message_unref(reply);
+	return err;
+}
+
+static int sdbus_get_current_policy(char *policy_name, int len)
+{
+	return get_policy("GetCurrentPolicy", policy_name, len);
+}
+
+static int sdbus_get_policy_from_file(char *policy_name, int len)
+{
+	return get_policy("GetPolicyFromFile", policy_name, len);
+}
+
+static int sdbus_set_policy(const char *policy_name)
+{
+	return send_msg("SwitchPolicy", append_name, policy_name);
+}
+
+static int sdbus_get_host_capacity(struct vcmmd_host_capacity *cap)
+{
+	sd_bus_message *reply;
+	uint64_t total, guaranteed, reserved, available, generation;
+	int32_t ret;
+	int err;
+
+	err = get_vcmmd_bus_name();
+	if (err)
+		return err;
+	err = require_feature(VCMMD_FEATURE_HOST_CAPACITY);
+	if (err)
+		return err;
+
+	err = call_vcmmd("GetHostCapacity", NULL, NULL, &reply, NULL);
+	if (err)
+		return err;
+
+	if (sd_bus_message_read(reply, "ittttt", &ret, &total, &guaranteed,
+				&reserved, &available, &generation) < 0)
+		ret = VCMMD_ERROR_CONNECTION_FAILED;
+	sd_bus_message_unref(reply);
+	if (ret)
+		return ret;
+
+	cap->total = total;
+	cap->guaranteed = guaranteed;
+	cap->reserved = reserved;
+	cap->available = available;
+	cap->generation = generation;
+	return 0;
+}
+
+static int sdbus_get_node_capacity(struct vcmmd_node_capacity *nodes,
+				   unsigned int nr_nodes)
+{
+	sd_bus_message *reply;
+	uint64_t total, committed;
+	uint16_t node;
+	int32_t ret;
+	int err, r;
+
+	err = get_vcmmd_bus_name();
+	if (err)
+		return err;
+	err = require_feature(VCMMD_FEATURE_NODE_CAPACITY);
+	if (err)
+		return err;
+
+	err = call_vcmmd("GetNodeCapacity", NULL, NULL, &reply, NULL);
+	if (err)
+		return err;
+
+	memset(nodes, 0, nr_nodes * sizeof(*nodes));
+	if (sd_bus_message_read(reply, "i", &ret) < 0) {
+		ret = VCMMD_ERROR_CONNECTION_FAILED;
+		goto out;
+	}
+	if (ret)
+		goto out;
+	if (sd_bus_message_enter_container(reply, 'a', "(qtt)") < 0) {
+		ret = VCMMD_ERROR_CONNECTION_FAILED;
+		goto out;
+	}
+	while ((r = sd_bus_message_read(reply, "(qtt)", &node, &total,
+					&committed)) > 0) {
+		if (node < nr_nodes) {
+			nodes[node].total = total;
+			nodes[node].committed = committed;
+		}
+	}
+	if (r < 0)
+		ret = VCMMD_ERROR_CONNECTION_FAILED;
+out:
+	sd_bus_message_unref(reply);
+	return ret;
+}
+
+struct reserve_request {
+	uint64_t bytes;
+	const char *nodes;
+	unsigned int ttl_ms;
+};
+
+static int append_reserve(sd_bus_message *m, const void *data)
+{
+	const struct reserve_request *rq = data;
+
+	return sd_bus_message_append(m, "tsu", rq->bytes,
+				     rq->nodes ? rq->nodes : "",
+				     (uint32_t)rq->ttl_ms);
+}
+
+static int sdbus_reserve(uint64_t bytes, const char *nodes,
+			 unsigned int ttl_ms, vcmmd_reservation_t *token)
+{
+	struct reserve_request rq = {
+		.bytes	= bytes,
+		.nodes	= nodes,
+		.ttl_ms	= ttl_ms,
+	};
+	sd_bus_message *reply;
+	uint64_t t;
+	int32_t ret;
+	int err;
+
+	err = get_vcmmd_bus_name();
+	if (err)
+		return err;
+	err = require_feature(VCMMD_FEATURE_RESERVE);
+	if (err)
+		return err;
+
+	err = call_vcmmd("Reserve", append_reserve, &rq, &reply, NULL);
+	if (err)
+		return err;
+
+	if (sd_bus_message_read(reply, "it", &ret, &t) < 0)
+		ret = VCMMD_ERROR_CONNECTION_FAILED;
+	sd_bus_message_unref(reply);
+	if (ret)
+		return ret;
+
+	*token = t;
+	return 0;
+}
+
+static int append_token(sd_bus_message *m, const void *data)
+{
+	return sd_bus_message_append(m, "t",
+				     *(const vcmmd_reservation_t *)data);
+}
+
+static int sdbus_unreserve(vcmmd_reservation_t token)
+{
+	int err;
+
+	err = get_vcmmd_bus_name();
+	if (err)
+		return err;
+	err = require_feature(VCMMD_FEATURE_RESERVE);
+	if (err)
+		return err;
+
+	return send_msg("Unreserve", append_token, &token);
+}
+
+struct reserved_request {
+	struct ve_request req;
+	vcmmd_reservation_t token;
+};
+
+static int append_register_reserved(sd_bus_message *m, const void *data)
+{
+	const struct reserved_request *rr = data;
+	const struct ve_request *req = &rr->req;
+	int r;
+
+	r = sd_bus_message_append(m, "si", req->ve_name,
+				  (int32_t)req->ve_type);
+	if (r >= 0)
+		r = append_config_compact(m, req->ve_config);
+	if (r >= 0)
+		r = sd_bus_message_append(m, "tu", rr->token,
+					  (uint32_t)req->flags);
+	return r;
+}
+
+static int sdbus_register_ve_reserved(const char *ve_name,
+				      vcmmd_ve_type_t ve_type,
+				      const struct vcmmd_ve_config *ve_config,
+				      vcmmd_reservation_t token,
+				      unsigned int flags)
+{
+	struct reserved_request rr = {
+		.req = {
+			.ve_name	= ve_name,
+			.ve_type	= ve_type,
+			.ve_config	= ve_config,
+			.flags		= flags,
+			.compact	= true,
+		},
+		.token = token,
+	};
+	int err;
+
+	err = get_vcmmd_bus_name();
+	if (err)
+		return err;
+	err = require_feature(VCMMD_FEATURE_RESERVE);
+	if (err)
+		return err;
+
+	return send_msg("RegisterVEReserved", append_register_reserved, &rr);
+}
+
+static int sdbus_supported_flags(unsigned int *flags)
+{
+	uint64_t features;
+	int err;
+
+	*flags = 0;
+	err = get_vcmmd_bus_name();
+	if (!err)
+		err = get_vcmmd_features(&features);
+	if (err)
+		return err;
+	if (features & VCMMD_FEATURE_DRY_RUN)
+		*flags |= VCMMD_FLAG_DRY_RUN;
+	return 0;
+}
+
+const struct vcmmd_backend __vcmmd_sdbus_backend = {
+	.name			= "sdbus",
+	.connected		= sdbus_connected,
+	.register_ve		= sdbus_register_ve,
+	.register_ve_ex		= sdbus_register_ve_ex,
+	.register_ve_range	= sdbus_register_ve_range,
+	.activate_ve		= sdbus_activate_ve,
+	.update_ve		= sdbus_update_ve,
+	.update_ve_ex		= sdbus_update_ve_ex,
+	.deactivate_ve		= sdbus_deactivate_ve,
+	.unregister_ve		= sdbus_unregister_ve,
+	.get_ve_config		= sdbus_get_ve_config,
+	.get_ve_state		= sdbus_get_ve_state,
+	.get_current_policy	= sdbus_get_current_policy,
+	.get_policy_from_file	= sdbus_get_policy_from_file,
+	.set_policy		= sdbus_set_policy,
+	.get_host_capacity	= sdbus_get_host_capacity,
+	.get_node_capacity	= sdbus_get_node_capacity,
+	.reserve		= sdbus_reserve,
+	.unreserve		= sdbus_unreserve,
+	.register_ve_reserved	= sdbus_register_ve_reserved,
+	.supported_flags	= sdbus_supported_flags,
+};
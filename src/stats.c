@@ -0,0 +1,237 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+
+/*
+ * All counters are updated with relaxed atomics and never under a lock, so
+ * that accounting costs a few atomic adds per call.
+ */
+static struct vcmmd_stats stats;
+
+static __thread struct vcmmd_call_ctx *cur_call;
+
+static const char *call_names[] = {
+	[VCMMD_CALL_REGISTER_VE]		= "register_ve",
+	[VCMMD_CALL_ACTIVATE_VE]		= "activate_ve",
+	[VCMMD_CALL_UPDATE_VE]			= "update_ve",
+	[VCMMD_CALL_DEACTIVATE_VE]		= "deactivate_ve",
+	[VCMMD_CALL_UNREGISTER_VE]		= "unregister_ve",
+	[VCMMD_CALL_GET_VE_CONFIG]		= "get_ve_config",
+	[VCMMD_CALL_GET_VE_STATE]		= "get_ve_state",
+	[VCMMD_CALL_GET_CURRENT_POLICY]		= "get_current_policy",
+	[VCMMD_CALL_GET_POLICY_FROM_FILE]	= "get_policy_from_file",
+	[VCMMD_CALL_SET_POLICY]			= "set_policy",
+	[VCMMD_CALL_DISCOVERY]			= "discovery",
+	[VCMMD_CALL_GET_HOST_CAPACITY]		= "get_host_capacity",
+	[VCMMD_CALL_RESERVE]			= "reserve",
+	[VCMMD_CALL_UNRESERVE]			= "unreserve",
+	[VCMMD_CALL_REGISTER_VE_EX]		= "register_ve_ex",
+	[VCMMD_CALL_UPDATE_VE_EX]		= "update_ve_ex",
+	[VCMMD_CALL_REGISTER_VE_RANGE]		= "register_ve_range",
+	[VCMMD_CALL_REGISTER_VE_RESERVED]	= "register_ve_reserved",
+	[VCMMD_CALL_GET_NODE_CAPACITY]		= "get_node_capacity",
+};
+
+_Static_assert(__NR_VCMMD_CALLS <= VCMMD_STATS_MAX_CALLS,
+	       "struct vcmmd_stats cannot hold all calls");
+
+#define STATS_ADD(field, val) \
+	__atomic_fetch_add(&(field), (val), __ATOMIC_RELAXED)
+
+static unsigned int latency_bucket(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	unsigned int bucket;
+
+	if (!us)
+		return 0;
+	bucket = 64 - __builtin_clzll(us);
+	if (bucket >= VCMMD_STATS_NR_BUCKETS)
+		bucket = VCMMD_STATS_NR_BUCKETS - 1;
+	return bucket;
+}
+
+static void stats_max(uint64_t *field, uint64_t val)
+{
+	uint64_t old = __atomic_load_n(field, __ATOMIC_RELAXED);
+
+	while (old < val &&
+	       !__atomic_compare_exchange_n(field, &old, val, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+const char *vcmmd_call_name(vcmmd_call_t call)
+{
+	if (call < 0 || call >= __NR_VCMMD_CALLS)
+		return NULL;
+	return call_names[call];
+}
+
+void __vcmmd_call_begin(struct vcmmd_call_ctx *ctx, vcmmd_call_t call,
+			const char *ve_name)
+{
+	ctx->parent = cur_call;
+	ctx->call = call;
+	ctx->ve_name = ve_name;
+	ctx->config_keys = 0;
+	ctx->ve_type = 0;
+	ctx->flags = 0;
+	ctx->config = NULL;
+	ctx->range = NULL;
+	ctx->retries = 0;
+	ctx->reconnects = 0;
+	ctx->traced = __vcmmd_trace_enabled();
+	if (ctx->traced) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ctx->start_realtime_ns = (uint64_t)ts.tv_sec * 1000000000 +
+					 ts.tv_nsec;
+		ctx->sent = false;
+		memset(ctx->phase_ns, 0, sizeof(ctx->phase_ns));
+	}
+	ctx->start_ns = __vcmmd_now_ns();
+	ctx->mark_ns = ctx->start_ns;
+	cur_call = ctx;
+}
+
+int __vcmmd_call_end(struct vcmmd_call_ctx *ctx, int err)
+{
+	struct vcmmd_call_stats *cs = &stats.calls[ctx->call];
+	uint64_t end_ns = __vcmmd_now_ns();
+	uint64_t ns = end_ns - ctx->start_ns;
+
+	cur_call = ctx->parent;
+
+	__vcmmd_record_call(ctx, err, end_ns);
+	if (__vcmmd_capture_enabled())
+		__vcmmd_capture_call(ctx, err, end_ns);
+
+	if (ctx->traced) {
+		/* Whatever follows the reply is parsing it */
+		ctx->phase_ns[ctx->sent ? VCMMD_PHASE_UNMARSHAL :
+					  VCMMD_PHASE_MARSHAL] +=
+			end_ns - ctx->mark_ns;
+		__vcmmd_trace_call(ctx, err, end_ns);
+	}
+	if (cur_call && cur_call->traced &&
+	    ctx->call == VCMMD_CALL_DISCOVERY) {
+		cur_call->phase_ns[VCMMD_PHASE_DISCOVERY] +=
+			end_ns - cur_call->mark_ns;
+		cur_call->mark_ns = end_ns;
+	}
+
+	STATS_ADD(cs->calls, 1);
+	STATS_ADD(cs->total_ns, ns);
+	STATS_ADD(cs->latency[latency_bucket(ns)], 1);
+	stats_max(&cs->max_ns, ns);
+	if (ctx->retries)
+		STATS_ADD(cs->retries, ctx->retries);
+	if (ctx->reconnects)
+		STATS_ADD(cs->reconnects, ctx->reconnects);
+
+	if (err) {
+		STATS_ADD(cs->errors, 1);
+		if (err >= 0 && err < VCMMD_STATS_MAX_ERRORS)
+			STATS_ADD(stats.service_errors[err], 1);
+		else if (err >= __VCMMD_LIB_ERROR_START &&
+			 err < __VCMMD_LIB_ERROR_START + VCMMD_STATS_MAX_ERRORS)
+			STATS_ADD(stats.lib_errors[err - __VCMMD_LIB_ERROR_START], 1);
+	}
+	return err;
+}
+
+void __vcmmd_trace_mark(vcmmd_phase_t phase)
+{
+	struct vcmmd_call_ctx *ctx = cur_call;
+	uint64_t now;
+
+	if (!ctx || !ctx->traced)
+		return;
+
+	now = __vcmmd_now_ns();
+	ctx->phase_ns[phase] += now - ctx->mark_ns;
+	ctx->mark_ns = now;
+	if (phase == VCMMD_PHASE_REPLY)
+		ctx->sent = true;
+}
+
+void __vcmmd_stats_retry(void)
+{
+	if (cur_call)
+		cur_call->retries++;
+	STATS_ADD(stats.retries, 1);
+}
+
+void __vcmmd_stats_reconnect(void)
+{
+	if (cur_call)
+		cur_call->reconnects++;
+	STATS_ADD(stats.reconnects, 1);
+}
+
+void __vcmmd_stats_lock_wait(uint64_t ns)
+{
+	STATS_ADD(stats.lock_waits, 1);
+	STATS_ADD(stats.lock_wait_ns, ns);
+	STATS_ADD(stats.lock_wait_latency[latency_bucket(ns)], 1);
+}
+
+void __vcmmd_stats_busy_retry(void)
+{
+	STATS_ADD(stats.busy_retries, 1);
+}
+
+void __vcmmd_stats_admission_wait(uint64_t ns)
+{
+	STATS_ADD(stats.admission_waits, 1);
+	STATS_ADD(stats.admission_wait_ns, ns);
+}
+
+void vcmmd_get_stats(struct vcmmd_stats *out)
+{
+	const uint64_t *src = (const uint64_t *)&stats;
+	uint64_t *dst = (uint64_t *)out;
+	size_t i;
+
+	for (i = 0; i < sizeof(stats) / sizeof(uint64_t); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	__vcmmd_rc_get_state(&out->rate_limit, &out->in_flight,
+			     &out->queue_depth);
+}
+
+void vcmmd_reset_stats(void)
+{
+	uint64_t *p = (uint64_t *)&stats;
+	size_t i;
+
+	for (i = 0; i < sizeof(stats) / sizeof(uint64_t); i++)
+		__atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,568 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+
+#define SYSFS_NODE_DIR		"/sys/devices/system/node"
+#define SYSFS_CPU_ONLINE	"/sys/devices/system/cpu/online"
+#define PROC_MEMINFO		"/proc/meminfo"
+
+#define NODE_WORDS		BITMAP_WORDS(VCMMD_MAX_NUMA_NODES)
+#define CPU_WORDS		BITMAP_WORDS(VCMMD_MAX_CPUS)
+
+#define LIST_BUF_LEN		4096
+
+struct numa_node {
+	unsigned int nr_cpus;
+	uint64_t cpus[CPU_WORDS];
+	uint64_t mem_total;
+	unsigned int distance[VCMMD_MAX_NUMA_NODES];
+};
+
+/*
+ * Host topology is read once and cached: nodes and CPUs do not come and go
+ * often enough to justify re-reading sysfs on every placement. Free memory,
+ * on the contrary, is read each time.
+ */
+static struct {
+	int err;
+	bool numa;
+	uint64_t nodes[NODE_WORDS];
+	struct numa_node node[VCMMD_MAX_NUMA_NODES];
+} topology;
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+/* Prepended to the sysfs and procfs paths read */
+static const char *topology_root = "";
+
+void __vcmmd_set_topology_root(const char *root)
+{
+	topology_root = root;
+}
+
+int __vcmmd_parse_list(const char *str, uint64_t *map, unsigned int nbits)
+{
+	unsigned long first, last, i;
+	char *end;
+
+	memset(map, 0, BITMAP_WORDS(nbits) * sizeof(*map));
+
+	while (isspace(*str))
+		str++;
+
+	while (*str) {
+		if (!isdigit(*str))
+			return -1;
+		first = last = strtoul(str, &end, 10);
+		str = end;
+		if (*str == '-') {
+			str++;
+			if (!isdigit(*str))
+				return -1;
+			last = strtoul(str, &end, 10);
+			str = end;
+		}
+		if (first > last || last >= nbits)
+			return -1;
+		for (i = first; i <= last; i++)
+			bitmap_set(map, i);
+
+		while (isspace(*str))
+			str++;
+		if (*str == ',') {
+			/* "1," is as malformed as "1,,2" */
+			if (!isdigit(*++str))
+				return -1;
+		} else if (*str)
+			return -1;
+	}
+	return 0;
+}
+
+int vcmmd_parse_list(const char *str, uint64_t *map, unsigned int nbits)
+{
+	return __vcmmd_parse_list(str, map, nbits) ?
+	       VCMMD_ERROR_INVALID_VE_CONFIG : 0;
+}
+
+int __vcmmd_format_list(const uint64_t *map, unsigned int nbits,
+			char *buf, size_t len)
+{
+	unsigned int i, first;
+	size_t pos = 0;
+	int n;
+
+	if (!len)
+		return -1;
+	buf[0] = '\0';
+
+	for (i = 0; i < nbits; i++) {
+		if (!bitmap_test(map, i))
+			continue;
+		first = i;
+		while (i + 1 < nbits && bitmap_test(map, i + 1))
+			i++;
+		if (first == i)
+			n = snprintf(buf + pos, len - pos, "%s%u",
+				     pos ? "," : "", first);
+		else
+			n = snprintf(buf + pos, len - pos, "%s%u-%u",
+				     pos ? "," : "", first, i);
+		if (n < 0 || (size_t)n >= len - pos)
+			return -1;
+		pos += n;
+	}
+	return 0;
+}
+
+static int read_file(const char *path, char *buf, size_t len)
+{
+	FILE *f;
+	size_t n;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	n = fread(buf, 1, len - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+	return 0;
+}
+
+static int read_list(const char *path, uint64_t *map, unsigned int nbits)
+{
+	char buf[LIST_BUF_LEN];
+
+	if (read_file(path, buf, sizeof(buf)))
+		return -1;
+	return __vcmmd_parse_list(buf, map, nbits);
+}
+
+/*
+ * Read a "Node N <field>: <value> kB" line from a node's meminfo, or a
+ * "<field>: <value> kB" line from /proc/meminfo if @node is -1.
+ */
+static int read_meminfo(int node, const char *field, uint64_t *bytes)
+{
+	char path[128], line[256];
+	unsigned long long kb;
+	size_t field_len = strlen(field);
+	const char *p;
+	FILE *f;
+	int err = -1;
+
+	if (node < 0)
+		snprintf(path, sizeof(path), "%s" PROC_MEMINFO, topology_root);
+	else
+		snprintf(path, sizeof(path), "%s" SYSFS_NODE_DIR
+			 "/node%d/meminfo", topology_root, node);
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		p = line;
+		if (node >= 0) {
+			/* Skip "Node N " prefix */
+			p = strchr(p, ' ');
+			if (!p || !(p = strchr(p + 1, ' ')))
+				continue;
+			p++;
+		}
+		if (strncmp(p, field, field_len) || p[field_len] != ':')
+			continue;
+		if (sscanf(p + field_len + 1, "%llu", &kb) == 1) {
+			*bytes = kb * 1024;
+			err = 0;
+		}
+		break;
+	}
+	fclose(f);
+	return err;
+}
+
+static unsigned int count_bits(const uint64_t *map, unsigned int words)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < words; i++)
+		n += __builtin_popcountll(map[i]);
+	return n;
+}
+
+static int load_node(int n)
+{
+	struct numa_node *node = &topology.node[n];
+	char path[128], buf[LIST_BUF_LEN], *p, *end;
+	int i, m;
+
+	snprintf(path, sizeof(path), "%s" SYSFS_NODE_DIR "/node%d/cpulist",
+		 topology_root, n);
+	if (read_list(path, node->cpus, VCMMD_MAX_CPUS))
+		return -1;
+	node->nr_cpus = count_bits(node->cpus, CPU_WORDS);
+
+	if (read_meminfo(n, "MemTotal", &node->mem_total))
+		return -1;
+
+	for (i = 0; i < VCMMD_MAX_NUMA_NODES; i++)
+		node->distance[i] = i == n ? 10 : 20;
+
+	snprintf(path, sizeof(path), "%s" SYSFS_NODE_DIR "/node%d/distance",
+		 topology_root, n);
+	if (read_file(path, buf, sizeof(buf)))
+		return 0;
+
+	/*
+	 * Distances are listed for online nodes only, in ascending order, so
+	 * the i-th one is to the i-th online node, whose ID may be larger
+	 */
+	p = buf;
+	for (m = 0; m < VCMMD_MAX_NUMA_NODES; m++) {
+		unsigned long d;
+
+		if (!bitmap_test(topology.nodes, m))
+			continue;
+		d = strtoul(p, &end, 10);
+		if (end == p)
+			break;
+		node->distance[m] = d;
+		p = end;
+	}
+	return 0;
+}
+
+static void load_topology(void)
+{
+	char path[128];
+	int n;
+
+	snprintf(path, sizeof(path), "%s" SYSFS_NODE_DIR "/online",
+		 topology_root);
+	if (read_list(path, topology.nodes, VCMMD_MAX_NUMA_NODES)) {
+		/* Kernel without NUMA: the whole host is node 0 */
+		struct numa_node *node = &topology.node[0];
+
+		memset(topology.nodes, 0, sizeof(topology.nodes));
+		bitmap_set(topology.nodes, 0);
+		snprintf(path, sizeof(path), "%s" SYSFS_CPU_ONLINE,
+			 topology_root);
+		if (read_list(path, node->cpus, VCMMD_MAX_CPUS) ||
+		    read_meminfo(-1, "MemTotal", &node->mem_total)) {
+			topology.err = VCMMD_ERROR_TOPOLOGY_UNAVAILABLE;
+			return;
+		}
+		node->nr_cpus = count_bits(node->cpus, CPU_WORDS);
+		node->distance[0] = 10;
+		return;
+	}
+
+	topology.numa = true;
+	for (n = 0; n < VCMMD_MAX_NUMA_NODES; n++) {
+		if (!bitmap_test(topology.nodes, n))
+			continue;
+		if (load_node(n)) {
+			topology.err = VCMMD_ERROR_TOPOLOGY_UNAVAILABLE;
+			return;
+		}
+	}
+}
+
+static int get_topology(void)
+{
+	pthread_once(&topology_once, load_topology);
+	return topology.err;
+}
+
+/*
+ * Memory a node can still offer: no more than is free right now, and no more
+ * than VCMMD has left to promise, on the node and on the host. VCMMD knows of
+ * the VEs of all processes; bounds it does not report are not applied.
+ */
+static int get_headroom(uint64_t *headroom)
+{
+	struct vcmmd_node_capacity node_cap[VCMMD_MAX_NUMA_NODES];
+	struct vcmmd_host_capacity host_cap;
+	uint64_t free_mem, total, avail = UINT64_MAX;
+	unsigned int n;
+	int err;
+
+	err = vcmmd_get_host_capacity(&host_cap);
+	if (!err)
+		avail = host_cap.available;
+	else if (err != VCMMD_ERROR_NOT_SUPPORTED)
+		return err;
+
+	/* Without NUMA, node 0 is the whole host, which the above covers */
+	err = topology.numa ?
+		vcmmd_get_node_capacity(node_cap, VCMMD_MAX_NUMA_NODES) :
+		VCMMD_ERROR_NOT_SUPPORTED;
+	if (err == VCMMD_ERROR_NOT_SUPPORTED)
+		memset(node_cap, 0, sizeof(node_cap));
+	else if (err)
+		return err;
+
+	for (n = 0; n < VCMMD_MAX_NUMA_NODES; n++) {
+		headroom[n] = 0;
+		if (!bitmap_test(topology.nodes, n))
+			continue;
+		if (read_meminfo(topology.numa ? (int)n : -1,
+				 "MemFree", &free_mem))
+			free_mem = topology.node[n].mem_total;
+		total = topology.node[n].mem_total;
+		if (node_cap[n].total && node_cap[n].total < total)
+			total = node_cap[n].total;
+		if (node_cap[n].committed >= total)
+			continue;
+		headroom[n] = total - node_cap[n].committed;
+		if (free_mem < headroom[n])
+			headroom[n] = free_mem;
+		if (avail < headroom[n])
+			headroom[n] = avail;
+	}
+	return 0;
+}
+
+/*
+ * Pick nodes for a VE needing @mem bytes and @nr_cpus CPUs. A single node is
+ * preferred; the one with the most headroom wins so that VEs spread evenly.
+ * If no single node fits, the set grows from the roomiest node by adding its
+ * nearest neighbours until both demands are met.
+ */
+static int pick_nodes(uint64_t mem, unsigned int nr_cpus, uint64_t *nodes)
+{
+	uint64_t headroom[VCMMD_MAX_NUMA_NODES];
+	uint64_t set_mem = 0;
+	unsigned int set_cpus = 0;
+	int n, m, best = -1;
+	int err;
+
+	err = get_headroom(headroom);
+	if (err)
+		return err;
+
+	for (n = 0; n < VCMMD_MAX_NUMA_NODES; n++) {
+		if (!bitmap_test(topology.nodes, n) ||
+		    headroom[n] < mem ||
+		    topology.node[n].nr_cpus < nr_cpus)
+			continue;
+		if (best < 0 || headroom[n] > headroom[best])
+			best = n;
+	}
+	if (best >= 0) {
+		bitmap_set(nodes, best);
+		return 0;
+	}
+
+	for (n = 0; n < VCMMD_MAX_NUMA_NODES; n++) {
+		if (!bitmap_test(topology.nodes, n))
+			continue;
+		if (best < 0 || headroom[n] > headroom[best])
+			best = n;
+	}
+
+	while (best >= 0) {
+		bitmap_set(nodes, best);
+		set_mem += headroom[best];
+		set_cpus += topology.node[best].nr_cpus;
+		if (set_mem >= mem && set_cpus >= nr_cpus)
+			return 0;
+
+		/* Next is the node closest to those already picked */
+		best = -1;
+		for (n = 0; n < VCMMD_MAX_NUMA_NODES; n++) {
+			unsigned int dist = 0, best_dist = 0;
+
+			if (!bitmap_test(topology.nodes, n) ||
+			    bitmap_test(nodes, n))
+				continue;
+			for (m = 0; m < VCMMD_MAX_NUMA_NODES; m++)
+				if (bitmap_test(nodes, m))
+					dist += topology.node[m].distance[n];
+			if (best >= 0)
+				for (m = 0; m < VCMMD_MAX_NUMA_NODES; m++)
+					if (bitmap_test(nodes, m))
+						best_dist += topology.node[m].distance[best];
+			if (best < 0 || dist < best_dist ||
+			    (dist == best_dist && headroom[n] > headroom[best]))
+				best = n;
+		}
+	}
+	return VCMMD_ERROR_PLACEMENT_FAILED;
+}
+
+int vcmmd_place_ve(struct vcmmd_ve_config *ve_config)
+{
+	uint64_t nodes[NODE_WORDS] = {0};
+	uint64_t cpus[CPU_WORDS] = {0};
+	uint64_t mem, nr_cpus;
+	const char *str, *cpu_str;
+	char buf[LIST_BUF_LEN];
+	bool have_nodes, have_cpus;
+	unsigned int n, i;
+	int err;
+
+	err = get_topology();
+	if (err)
+		return err;
+
+	have_nodes = vcmmd_ve_config_extract_string(ve_config,
+					VCMMD_VE_CONFIG_NODE_LIST, &str);
+	have_cpus = vcmmd_ve_config_extract_string(ve_config,
+					VCMMD_VE_CONFIG_CPU_LIST, &cpu_str);
+	if (have_nodes && have_cpus)
+		return 0;
+
+	if (have_nodes) {
+		if (__vcmmd_parse_list(str, nodes, VCMMD_MAX_NUMA_NODES))
+			return VCMMD_ERROR_INVALID_VE_CONFIG;
+	} else {
+		if (!vcmmd_ve_config_extract(ve_config,
+					     VCMMD_VE_CONFIG_GUARANTEE, &mem) &&
+		    !vcmmd_ve_config_extract(ve_config,
+					     VCMMD_VE_CONFIG_LIMIT, &mem))
+			mem = 0;
+		if (!vcmmd_ve_config_extract(ve_config,
+					     VCMMD_VE_CONFIG_CPUNUM, &nr_cpus))
+			nr_cpus = 0;
+
+		err = pick_nodes(mem, nr_cpus, nodes);
+		if (err)
+			return err;
+
+		if (__vcmmd_format_list(nodes, VCMMD_MAX_NUMA_NODES,
+					buf, sizeof(buf)))
+			return VCMMD_ERROR_NO_MEMORY;
+		if (!vcmmd_ve_config_append_string(ve_config,
+					VCMMD_VE_CONFIG_NODE_LIST, buf))
+			return VCMMD_ERROR_NO_MEMORY;
+	}
+
+	if (have_cpus)
+		return 0;
+
+	for (n = 0; n < VCMMD_MAX_NUMA_NODES; n++) {
+		if (!bitmap_test(nodes, n) || !bitmap_test(topology.nodes, n))
+			continue;
+		for (i = 0; i < CPU_WORDS; i++)
+			cpus[i] |= topology.node[n].cpus[i];
+	}
+
+	if (__vcmmd_format_list(cpus, VCMMD_MAX_CPUS, buf, sizeof(buf)))
+		return VCMMD_ERROR_NO_MEMORY;
+	if (!vcmmd_ve_config_append_string(ve_config,
+					   VCMMD_VE_CONFIG_CPU_LIST, buf))
+		return VCMMD_ERROR_NO_MEMORY;
+
+	return 0;
+}
+
+static bool check_list(const struct vcmmd_ve_config *config,
+		       vcmmd_ve_config_key_t key, const uint64_t *online,
+		       unsigned int nbits)
+{
+	uint64_t map[CPU_WORDS] = {0};
+	const char *str;
+	unsigned int i;
+	bool empty = true;
+
+	if (!vcmmd_ve_config_extract_string(config, key, &str))
+		return true;
+	if (__vcmmd_parse_list(str, map, nbits))
+		return false;
+	for (i = 0; i < BITMAP_WORDS(nbits); i++) {
+		if (map[i])
+			empty = false;
+		if (online && (map[i] & ~online[i]))
+			return false;
+	}
+	return !empty;
+}
+
+int vcmmd_ve_config_validate(const struct vcmmd_ve_config *config,
+			     vcmmd_ve_config_key_t *bad_key)
+{
+	uint64_t online_cpus[CPU_WORDS] = {0};
+	const uint64_t *nodes = NULL, *cpus = NULL;
+	uint64_t guarantee, limit, type;
+	vcmmd_ve_config_key_t key;
+	unsigned int n, i;
+	unsigned int k;
+
+	for (k = 0; k < config->nr_entries; k++) {
+		key = config->entries[k].key;
+		if (key >= __NR_VCMMD_VE_CONFIG_KEYS ||
+		    (vcmmd_ve_config_entry_is_string(key) &&
+		     !config->entries[k].str))
+			goto invalid;
+	}
+
+	key = VCMMD_VE_CONFIG_LIMIT;
+	if (vcmmd_ve_config_extract(config, VCMMD_VE_CONFIG_GUARANTEE,
+				    &guarantee) &&
+	    vcmmd_ve_config_extract(config, VCMMD_VE_CONFIG_LIMIT, &limit) &&
+	    limit < guarantee)
+		goto invalid;
+
+	key = VCMMD_VE_CONFIG_GUARANTEE_TYPE;
+	if (vcmmd_ve_config_extract(config, key, &type) &&
+	    type != VCMMD_MEMGUARANTEE_AUTO && type != VCMMD_MEMGUARANTEE_BYTES)
+		goto invalid;
+
+	/* Without topology, the lists can still be checked for syntax */
+	if (!get_topology()) {
+		nodes = topology.nodes;
+		for (n = 0; n < VCMMD_MAX_NUMA_NODES; n++) {
+			if (!bitmap_test(topology.nodes, n))
+				continue;
+			for (i = 0; i < CPU_WORDS; i++)
+				online_cpus[i] |= topology.node[n].cpus[i];
+		}
+		cpus = online_cpus;
+	}
+
+	key = VCMMD_VE_CONFIG_NODE_LIST;
+	if (!check_list(config, key, nodes, VCMMD_MAX_NUMA_NODES))
+		goto invalid;
+	key = VCMMD_VE_CONFIG_CPU_LIST;
+	if (!check_list(config, key, cpus, VCMMD_MAX_CPUS))
+		goto invalid;
+
+	return 0;
+
+invalid:
+	if (bad_key)
+		*bad_key = key;
+	return VCMMD_ERROR_INVALID_VE_CONFIG;
+}
@@ -0,0 +1,82 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+
+/*
+ * The hook and its context must be read together, so they are kept under a
+ * mutex. The mutex is only taken for calls made while a hook is set.
+ */
+static vcmmd_trace_hook_t trace_hook;
+static void *trace_hook_ctx;
+static bool trace_enabled;
+static pthread_mutex_t trace_hook_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void vcmmd_set_trace_hook(vcmmd_trace_hook_t hook, void *ctx)
+{
+	pthread_mutex_lock(&trace_hook_mutex);
+	trace_hook = hook;
+	trace_hook_ctx = ctx;
+	__atomic_store_n(&trace_enabled, hook != NULL, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&trace_hook_mutex);
+}
+
+bool __vcmmd_trace_enabled(void)
+{
+	return __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED);
+}
+
+void __vcmmd_trace_call(const struct vcmmd_call_ctx *ctx, int err,
+			uint64_t end_ns)
+{
+	struct vcmmd_trace_span span;
+	vcmmd_trace_hook_t hook;
+	void *hook_ctx;
+
+	pthread_mutex_lock(&trace_hook_mutex);
+	hook = trace_hook;
+	hook_ctx = trace_hook_ctx;
+	pthread_mutex_unlock(&trace_hook_mutex);
+
+	if (!hook)
+		return;
+
+	span.call = ctx->call;
+	span.ve_name = ctx->ve_name;
+	span.result = err;
+	span.retries = ctx->retries;
+	span.reconnects = ctx->reconnects;
+	span.start_ns = ctx->start_ns;
+	span.end_ns = end_ns;
+	span.start_realtime_ns = ctx->start_realtime_ns;
+	memcpy(span.phase_ns, ctx->phase_ns, sizeof(span.phase_ns));
+
+	hook(&span, hook_ctx);
+}
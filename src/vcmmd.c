@@ -28,31 +28,8 @@
 #include <string.h>
 #include <pthread.h>
 
-#include <dbus/dbus.h>
-
 #include "vcmmd.h"
-
-#define VCMMD_BUSNAME_MAXLEN	128
-
-static char vcmmd_bus_name[VCMMD_BUSNAME_MAXLEN] = {0};
-static char vcmmd_iface_name[VCMMD_BUSNAME_MAXLEN + sizeof(".LoadManager")] = {0};
-
-#define VCMMD_FETCH_BUSNAME do { \
-	int err = get_vcmmd_bus_name(); \
-	if (err || !*vcmmd_bus_name) \
-		return err; \
-	if (!*vcmmd_iface_name) \
-		get_vcmmd_iface_name(); \
-} while(0)
-
-static inline bool vcmmd_ve_config_entry_is_string(
-		vcmmd_ve_config_key_t key)
-{
-	if (key == VCMMD_VE_CONFIG_NODE_LIST ||
-		key == VCMMD_VE_CONFIG_CPU_LIST)
-		return true;
-	return false;
-}
+#include "internal.h"
 
 bool vcmmd_ve_config_extract_string(const struct vcmmd_ve_config *config,
 			     vcmmd_ve_config_key_t key, const char **str)
@@ -160,12 +137,19 @@ char *vcmmd_strerror(int err, char *buf, size_t buflen)
 		"Unable to apply VE guarantee",			/* 8 */
 		"VE not active",				/* 9 */
 		"Too many requests",				/* 10 */
+		"Policy cannot be switched with active VEs",	/* 11 */
+		"Invalid policy name",				/* 12 */
+		"Reservation not found or expired",		/* 13 */
 	};
 
 	static const char *lib_err_list[] = {
 		"Failed to allocate memory",			/* 1000 */
 		"Failed to connect to VCMMD service",		/* 1001 */
 		"Failed to get VCMMD D-Bus name",		/* 1002 */
+		"Failed to read host NUMA topology",		/* 1003 */
+		"No NUMA placement fits the VE",		/* 1004 */
+		"Unknown backend",				/* 1005 */
+		"Not supported by VCMMD",			/* 1006 */
 	};
 
 	const char *err_str;
@@ -187,502 +171,876 @@ char *vcmmd_strerror(int err, char *buf, size_t buflen)
 	return buf;
 }
 
-static bool append_str(DBusMessageIter *iter, const char *val)
+/*
+ * Backends
+ *
+ * The D-Bus one is used unless another one is picked with vcmmd_set_backend
+ * or the VCMMD_BACKEND environment variable.
+ */
+static const struct vcmmd_backend *backends[] = {
+	&__vcmmd_dbus_backend,
+#ifdef HAVE_SDBUS
+	&__vcmmd_sdbus_backend,
+#endif
+	&__vcmmd_fake_backend,
+};
+#define NR_BACKENDS	(sizeof(backends) / sizeof(backends[0]))
+
+static const struct vcmmd_backend *backend = &__vcmmd_dbus_backend;
+
+static inline const struct vcmmd_backend *get_backend(void)
 {
-	return dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &val);
+	return __atomic_load_n(&backend, __ATOMIC_ACQUIRE);
 }
 
-static bool append_int32(DBusMessageIter *iter, dbus_int32_t val)
+int vcmmd_set_backend(const char *name)
 {
-	return dbus_message_iter_append_basic(iter, DBUS_TYPE_INT32, &val);
+	unsigned int i;
+
+	for (i = 0; i < NR_BACKENDS; i++) {
+		if (strcmp(backends[i]->name, name))
+			continue;
+		if (backends[i]->init)
+			backends[i]->init();
+		__atomic_store_n(&backend, backends[i], __ATOMIC_RELEASE);
+		return 0;
+	}
+	return VCMMD_ERROR_INVALID_BACKEND;
 }
 
-static bool append_uint16(DBusMessageIter *iter, dbus_uint16_t val)
+const char *vcmmd_get_backend(void)
 {
-	return dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT16, &val);
+	return get_backend()->name;
 }
 
-static bool append_uint32(DBusMessageIter *iter, dbus_uint32_t val)
+bool __vcmmd_connected(void)
 {
-	return dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT32, &val);
+	const struct vcmmd_backend *b = get_backend();
+
+	return b->connected && b->connected();
 }
 
-static bool append_uint64(DBusMessageIter *iter, dbus_uint64_t val)
+/*
+ * err = expr, where @expr sends the request of the call @ctx, under rate
+ * control if the call is subject to it
+ */
+#define RATE_CONTROLLED(ctx, err, expr)				\
+	do {								\
+		struct vcmmd_rc_ctx __rc;				\
+									\
+		__vcmmd_rc_begin(&__rc, (ctx)->call);			\
+		do {							\
+			(err) = __vcmmd_rc_admit(&__rc);		\
+			if (err)					\
+				break;					\
+			(err) = (expr);					\
+		} while (__vcmmd_rc_retry(&__rc, (err)));		\
+	} while (0)
+
+/*
+ * Act upon library flags in @flags and strip them, so that only flags meant
+ * for VCMMD are passed to the backend
+ */
+static int apply_library_flags(const struct vcmmd_ve_config *ve_config,
+			       unsigned int *flags)
 {
-	return dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT64, &val);
+	bool validate = *flags & VCMMD_FLAG_VALIDATE;
+
+	*flags &= ~VCMMD_FLAGS_LIBRARY;
+	if (validate)
+		return vcmmd_ve_config_validate(ve_config, NULL);
+	return 0;
 }
 
-static bool append_config_entry(DBusMessageIter *iter,
-				const struct vcmmd_ve_config_entry *entry)
+/*
+ * Check that the backend honours the flags in @flags that must not be
+ * ignored. This may ask VCMMD, so it is done within a call.
+ */
+static int check_flags(unsigned int flags)
 {
-	DBusMessageIter sub;
-
-	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, NULL,
-					      &sub) ||
-	    !append_uint16(&sub, entry->key) ||
-	    !append_uint64(&sub, entry->value) ||
-	    !append_str(&sub, entry->str) ||
-	    !dbus_message_iter_close_container(iter, &sub))
-		return false;
+	const struct vcmmd_backend *b = get_backend();
+	unsigned int supported = 0;
+	int err;
 
-	return true;
+	if (!(flags & VCMMD_FLAG_DRY_RUN))
+		return 0;
+	if (b->supported_flags) {
+		err = b->supported_flags(&supported);
+		if (err)
+			return err;
+	}
+	return supported & VCMMD_FLAG_DRY_RUN ? 0 : VCMMD_ERROR_NOT_SUPPORTED;
 }
 
-static bool append_config(DBusMessageIter *iter,
-			  const struct vcmmd_ve_config *config)
+static int library_flags(const struct vcmmd_ve_config *ve_config,
+			 unsigned int *flags)
 {
-	DBusMessageIter sub;
-	int i;
+	int err;
 
-	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
-					      DBUS_STRUCT_BEGIN_CHAR_AS_STRING
-					      DBUS_TYPE_UINT16_AS_STRING
-					      DBUS_TYPE_UINT64_AS_STRING
-						  DBUS_TYPE_STRING_AS_STRING
-					      DBUS_STRUCT_END_CHAR_AS_STRING,
-					      &sub))
-		return false;
+	err = apply_library_flags(ve_config, flags);
+	if (err)
+		return err;
+	return check_flags(*flags);
+}
 
-	for (i = 0; i < config->nr_entries; i++)
-		if (!append_config_entry(&sub, &config->entries[i]))
-			return false;
+static int do_register_ve(const char *ve_name, vcmmd_ve_type_t ve_type,
+			  const struct vcmmd_ve_config *ve_config,
+			  unsigned int flags,
+			  struct vcmmd_shortfall *shortfall)
+{
+	const struct vcmmd_backend *b = get_backend();
 
-	if (!dbus_message_iter_close_container(iter, &sub))
-		return false;
+	if (shortfall && b->register_ve_ex)
+		return b->register_ve_ex(ve_name, ve_type, ve_config, flags,
+					 shortfall);
+	return b->register_ve(ve_name, ve_type, ve_config, flags);
+}
 
-	return true;
+int vcmmd_register_ve(const char *ve_name, vcmmd_ve_type_t ve_type,
+		      const struct vcmmd_ve_config *ve_config,
+		      unsigned int flags)
+{
+	return vcmmd_register_ve_ex(ve_name, ve_type, ve_config, flags, NULL);
 }
 
-static DBusMessage *make_msg(const char *method, DBusMessageIter *args)
+int vcmmd_register_ve_ex(const char *ve_name, vcmmd_ve_type_t ve_type,
+			 const struct vcmmd_ve_config *ve_config,
+			 unsigned int flags,
+			 struct vcmmd_shortfall *shortfall)
 {
-	DBusMessage *msg;
+	struct vcmmd_call_ctx call;
+	int err;
 
-	msg = dbus_message_new_method_call(vcmmd_bus_name, "/LoadManager",
-	                                   vcmmd_iface_name, method);
-	if (msg && args)
-		dbus_message_iter_init_append(msg, args);
+	VCMMD_PROBE(register_ve__entry, ve_name, ve_type, flags);
+	__vcmmd_call_begin(&call, shortfall ? VCMMD_CALL_REGISTER_VE_EX :
+					      VCMMD_CALL_REGISTER_VE, ve_name);
+	if (shortfall)
+		memset(shortfall, 0, sizeof(*shortfall));
+	call.config_keys = __vcmmd_config_keys(ve_config);
+	call.ve_type = ve_type;
+	call.flags = flags;
+	call.config = ve_config;
+	err = library_flags(ve_config, &flags);
+	if (!err)
+		RATE_CONTROLLED(&call, err,
+				do_register_ve(ve_name, ve_type, ve_config,
+					       flags, shortfall));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(register_ve__return, ve_name, err);
+	return err;
+}
+
+/* Requests the library makes at most to choose a guarantee from a range */
+#define RANGE_MAX_TRIES		8
 
-	return msg;
+static bool range_is_valid(const struct vcmmd_ve_range *range)
+{
+	return range->guarantee_min <= range->guarantee_max &&
+	       range->limit_min <= range->limit_max &&
+	       range->guarantee_min <= range->limit_max;
 }
 
-static DBusMessage *__send_msg(DBusMessage *msg)
+/*
+ * Make @dst a copy of @src with @guarantee and @limit
+ */
+static bool set_range_config(struct vcmmd_ve_config *dst,
+			     const struct vcmmd_ve_config *src,
+			     uint64_t guarantee, uint64_t limit)
 {
-	static DBusConnection *conn = NULL;
-	static pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+	const struct vcmmd_ve_config_entry *entry;
+	int i;
 
-	DBusMessage *reply = NULL;
+	vcmmd_ve_config_deinit(dst);
+	vcmmd_ve_config_init(dst);
+	for (i = 0; i < src->nr_entries; i++) {
+		entry = &src->entries[i];
+		if (entry->key == VCMMD_VE_CONFIG_GUARANTEE ||
+		    entry->key == VCMMD_VE_CONFIG_LIMIT)
+			continue;
+		if (!_vcmmd_ve_config_append(dst, entry->key,
+					     entry->value, entry->str))
+			return false;
+	}
+	return _vcmmd_ve_config_append(dst, VCMMD_VE_CONFIG_GUARANTEE,
+				       guarantee, NULL) &&
+	       _vcmmd_ve_config_append(dst, VCMMD_VE_CONFIG_LIMIT,
+				       limit, NULL);
+}
 
-	int tries_num = 5;
-	do {
-		pthread_mutex_lock(&conn_mutex);
-		if (!conn) {
-			conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, NULL);
-			if (!conn) {
-				continue;
-			}
-		}
-		pthread_mutex_unlock(&conn_mutex);
-
-		reply = dbus_connection_send_with_reply_and_block(conn, msg, DBUS_TIMEOUT_INFINITE, NULL);
-		if (!reply) {
-			pthread_mutex_lock(&conn_mutex);
-			dbus_connection_close(conn);
-			dbus_connection_unref(conn);
-			conn = NULL;
-			pthread_mutex_unlock(&conn_mutex);
+/*
+ * Choose the guarantee from @range for a service that cannot: start from what
+ * the host has available and come down by the shortfall reported, or halfway
+ * to the minimum if none is, trying the minimum last.
+ */
+static int register_ve_range_fallback(const char *ve_name,
+				      vcmmd_ve_type_t ve_type,
+				      const struct vcmmd_ve_config *ve_config,
+				      const struct vcmmd_ve_range *range,
+				      unsigned int flags,
+				      uint64_t *guarantee, uint64_t *limit)
+{
+	const struct vcmmd_backend *b = get_backend();
+	const uint64_t min = range->guarantee_min;
+	struct vcmmd_host_capacity cap;
+	struct vcmmd_shortfall shortfall;
+	struct vcmmd_ve_config config;
+	uint64_t g, l;
+	int i, err;
+
+	if (b->get_host_capacity && !b->get_host_capacity(&cap))
+		l = __vcmmd_range_limit(range, cap.total);
+	else
+		cap.available = l = __vcmmd_range_limit(range, UINT64_MAX);
+
+	g = range->guarantee_max;
+	if (g > l)
+		g = l;
+	if (g > cap.available)
+		g = cap.available > min ? cap.available : min;
+	if (g < min)
+		return VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE;
+
+	vcmmd_ve_config_init(&config);
+	for (i = 0; ; i++) {
+		if (!set_range_config(&config, ve_config, g, l)) {
+			err = VCMMD_ERROR_NO_MEMORY;
+			break;
 		}
-	} while (!reply && tries_num-- > 0);
+		memset(&shortfall, 0, sizeof(shortfall));
+		err = do_register_ve(ve_name, ve_type, &config, flags,
+				     &shortfall);
+		if (err != VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE ||
+		    g == min || i == RANGE_MAX_TRIES - 1)
+			break;
 
-	dbus_message_unref(msg);
+		if (i == RANGE_MAX_TRIES - 2)
+			g = min;
+		else if (shortfall.missing)
+			g -= shortfall.missing < g - min ? shortfall.missing :
+							   g - min;
+		else
+			g = min + (g - min) / 2;
+	}
+	vcmmd_ve_config_deinit(&config);
 
-	pthread_mutex_lock(&conn_mutex);
-	if (conn) {
-		dbus_connection_flush(conn);
+	if (!err) {
+		*guarantee = g;
+		*limit = l;
 	}
-	pthread_mutex_unlock(&conn_mutex);
+	return err;
+}
 
-	return reply;
+static int do_register_ve_range(const char *ve_name, vcmmd_ve_type_t ve_type,
+				const struct vcmmd_ve_config *ve_config,
+				const struct vcmmd_ve_range *range,
+				unsigned int flags,
+				uint64_t *guarantee, uint64_t *limit)
+{
+	const struct vcmmd_backend *b = get_backend();
+	int err = VCMMD_ERROR_NOT_SUPPORTED;
+
+	if (b->register_ve_range)
+		err = b->register_ve_range(ve_name, ve_type, ve_config, range,
+					   flags, guarantee, limit);
+	if (err == VCMMD_ERROR_NOT_SUPPORTED)
+		err = register_ve_range_fallback(ve_name, ve_type, ve_config,
+						 range, flags, guarantee,
+						 limit);
+	return err;
 }
 
-static int get_vcmmd_bus_name(void)
+int vcmmd_register_ve_range(const char *ve_name, vcmmd_ve_type_t ve_type,
+			    const struct vcmmd_ve_config *ve_config,
+			    const struct vcmmd_ve_range *range,
+			    unsigned int flags,
+			    uint64_t *guarantee, uint64_t *limit)
 {
-	DBusMessage *msg, *reply;
-	DBusMessageIter reply_args, array;
-	char *str;
+	struct vcmmd_call_ctx call;
+	uint64_t g = 0, l = 0;
 	int err;
 
-	if (*vcmmd_bus_name)
-		return 0;
-
-	msg = NULL;
-	reply = NULL;
-	err = 0;
-
-	msg = dbus_message_new_method_call("org.freedesktop.DBus", "/DBus",
-	                                   "org.freedesktop.DBus", "ListNames");
-	if (!msg) {
-		err = VCMMD_ERROR_NO_MEMORY;
-		goto error;
+	VCMMD_PROBE(register_ve_range__entry, ve_name, ve_type, flags);
+	__vcmmd_call_begin(&call, VCMMD_CALL_REGISTER_VE_RANGE, ve_name);
+	call.config_keys = __vcmmd_config_keys(ve_config) |
+			   1U << VCMMD_VE_CONFIG_GUARANTEE |
+			   1U << VCMMD_VE_CONFIG_LIMIT;
+	call.ve_type = ve_type;
+	call.flags = flags;
+	call.config = ve_config;
+	call.range = range;
+	err = range_is_valid(range) ? library_flags(ve_config, &flags) :
+				      VCMMD_ERROR_INVALID_VE_CONFIG;
+	if (!err)
+		RATE_CONTROLLED(&call, err,
+				do_register_ve_range(ve_name, ve_type,
+						     ve_config, range, flags,
+						     &g, &l));
+	if (!err) {
+		if (guarantee)
+			*guarantee = g;
+		if (limit)
+			*limit = l;
 	}
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(register_ve_range__return, ve_name, err);
+	return err;
+}
 
-	reply = __send_msg(msg);
-	if (!reply) {
-		err = VCMMD_ERROR_BUSNAME_FETCH_FAILED;
-		goto error;
-	}
+int vcmmd_ve_config_freeze(const char *ve_name, vcmmd_ve_type_t ve_type,
+			   const struct vcmmd_ve_config *ve_config,
+			   unsigned int flags,
+			   struct vcmmd_ve_frozen **frozen)
+{
+	const struct vcmmd_ve_config_entry *entry;
+	struct vcmmd_ve_frozen *f;
+	int i, err;
 
-	if (!dbus_message_iter_init(reply, &reply_args) ||
-			dbus_message_iter_get_arg_type(&reply_args) != DBUS_TYPE_ARRAY) {
-		err = VCMMD_ERROR_BUSNAME_FETCH_FAILED;
-		goto error;
-	}
+	err = apply_library_flags(ve_config, &flags);
+	if (err)
+		return err;
 
-	dbus_message_iter_recurse(&reply_args, &array);
-	do {
-		str = NULL;
-		dbus_message_iter_get_basic(&array, &str);
-		if (str && strnlen(str, VCMMD_BUSNAME_MAXLEN) > 0 &&
-				strstr(str, ".vcmmd")) {
-			strncpy(vcmmd_bus_name, str, VCMMD_BUSNAME_MAXLEN - 1);
-			break;
-		}
-	} while (dbus_message_iter_next(&array));
+	f = calloc(1, sizeof(*f) + strlen(ve_name) + 1);
+	if (!f)
+		return VCMMD_ERROR_NO_MEMORY;
 
-	if (!*vcmmd_bus_name) {
-		/* We've looked through and still couldn't find the bus name. */
-		err = VCMMD_ERROR_BUSNAME_FETCH_FAILED;
-		goto error;
+	pthread_mutex_init(&f->mutex, NULL);
+	f->ve_type = ve_type;
+	f->flags = flags;
+	strcpy(f->ve_name, ve_name);
+
+	vcmmd_ve_config_init(&f->config);
+	for (i = 0; i < ve_config->nr_entries; i++) {
+		entry = &ve_config->entries[i];
+		if (!_vcmmd_ve_config_append(&f->config, entry->key,
+					     entry->value, entry->str)) {
+			vcmmd_ve_frozen_free(f);
+			return VCMMD_ERROR_NO_MEMORY;
+		}
 	}
 
-error:
-	if (reply)
-		dbus_message_unref(reply);
-	return err;
+	*frozen = f;
+	return 0;
 }
 
-static void get_vcmmd_iface_name(void)
+void vcmmd_ve_frozen_free(struct vcmmd_ve_frozen *frozen)
 {
-	if (!*vcmmd_bus_name)
+	unsigned int i;
+
+	if (!frozen)
 		return;
 
-	strcpy(vcmmd_iface_name, vcmmd_bus_name);
-	strcat(vcmmd_iface_name, ".LoadManager");
+	/* It may have been used with any of them */
+	for (i = 0; i < NR_BACKENDS; i++)
+		if (backends[i]->release_frozen)
+			backends[i]->release_frozen(frozen);
+	vcmmd_ve_config_deinit(&frozen->config);
+	pthread_mutex_destroy(&frozen->mutex);
+	free(frozen);
 }
 
-static int send_msg(DBusMessage *msg)
+static int do_register_ve_frozen(struct vcmmd_ve_frozen *frozen)
 {
-	DBusMessage *reply;
-	dbus_int32_t err;
+	const struct vcmmd_backend *b = get_backend();
 
-	reply = __send_msg(msg);
-	if (!reply)
-		return VCMMD_ERROR_CONNECTION_FAILED;
-
-	if (!dbus_message_get_args(reply, NULL, DBUS_TYPE_INT32, &err,
-				   DBUS_TYPE_INVALID)) {
-		dbus_message_unref(reply);
-		return VCMMD_ERROR_CONNECTION_FAILED;
-	}
+	if (b->register_ve_frozen)
+		return b->register_ve_frozen(frozen);
+	return b->register_ve(frozen->ve_name, frozen->ve_type,
+			      &frozen->config, frozen->flags);
+}
 
-	dbus_message_unref(reply);
+int vcmmd_register_ve_frozen(struct vcmmd_ve_frozen *frozen)
+{
+	struct vcmmd_call_ctx call;
+	int err;
 
+	VCMMD_PROBE(register_ve_frozen__entry, frozen->ve_name, frozen->ve_type, frozen->flags);
+	__vcmmd_call_begin(&call, VCMMD_CALL_REGISTER_VE, frozen->ve_name);
+	call.config_keys = __vcmmd_config_keys(&frozen->config);
+	call.ve_type = frozen->ve_type;
+	call.flags = frozen->flags;
+	call.config = &frozen->config;
+	err = check_flags(frozen->flags);
+	if (!err)
+		RATE_CONTROLLED(&call, err, do_register_ve_frozen(frozen));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(register_ve_frozen__return, frozen->ve_name, err);
 	return err;
 }
 
-int vcmmd_register_ve(const char *ve_name, vcmmd_ve_type_t ve_type,
-		      const struct vcmmd_ve_config *ve_config,
-		      unsigned int flags)
+static int do_update_ve_frozen(struct vcmmd_ve_frozen *frozen)
 {
-	DBusMessage *msg;
-	DBusMessageIter args;
+	const struct vcmmd_backend *b = get_backend();
 
-	VCMMD_FETCH_BUSNAME;
+	if (b->update_ve_frozen)
+		return b->update_ve_frozen(frozen);
+	return b->update_ve(frozen->ve_name, &frozen->config, frozen->flags);
+}
 
-	msg = make_msg("RegisterVE", &args);
-	if (!msg ||
-	    !append_str(&args, ve_name) ||
-	    !append_int32(&args, ve_type) ||
-	    !append_config(&args, ve_config) ||
-	    !append_uint32(&args, flags))
-		return VCMMD_ERROR_NO_MEMORY;
+int vcmmd_update_ve_frozen(struct vcmmd_ve_frozen *frozen)
+{
+	struct vcmmd_call_ctx call;
+	int err;
 
-	return send_msg(msg);
+	VCMMD_PROBE(update_ve_frozen__entry, frozen->ve_name, frozen->flags);
+	__vcmmd_call_begin(&call, VCMMD_CALL_UPDATE_VE, frozen->ve_name);
+	call.config_keys = __vcmmd_config_keys(&frozen->config);
+	call.flags = frozen->flags;
+	call.config = &frozen->config;
+	err = check_flags(frozen->flags);
+	if (!err)
+		RATE_CONTROLLED(&call, err, do_update_ve_frozen(frozen));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(update_ve_frozen__return, frozen->ve_name, err);
+	return err;
 }
 
 int vcmmd_activate_ve(const char *ve_name, unsigned int flags)
 {
-	DBusMessage *msg;
-	DBusMessageIter args;
+	struct vcmmd_call_ctx call;
+	int err;
 
-	VCMMD_FETCH_BUSNAME;
+	VCMMD_PROBE(activate_ve__entry, ve_name, flags);
+	__vcmmd_call_begin(&call, VCMMD_CALL_ACTIVATE_VE, ve_name);
+	call.flags = flags;
+	flags &= ~VCMMD_FLAGS_LIBRARY;
+	/* dry run is defined for register and update only */
+	err = flags & VCMMD_FLAG_DRY_RUN ? VCMMD_ERROR_NOT_SUPPORTED : 0;
+	if (!err)
+		RATE_CONTROLLED(&call, err, get_backend()->activate_ve(ve_name, flags));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(activate_ve__return, ve_name, err);
+	return err;
+}
 
-	msg = make_msg("ActivateVE", &args);
-	if (!msg ||
-	    !append_str(&args, ve_name) ||
-	    !append_uint32(&args, flags))
-		return VCMMD_ERROR_NO_MEMORY;
+static int do_update_ve(const char *ve_name,
+			const struct vcmmd_ve_config *ve_config,
+			unsigned int flags,
+			struct vcmmd_shortfall *shortfall)
+{
+	const struct vcmmd_backend *b = get_backend();
 
-	return send_msg(msg);
+	if (shortfall && b->update_ve_ex)
+		return b->update_ve_ex(ve_name, ve_config, flags, shortfall);
+	return b->update_ve(ve_name, ve_config, flags);
 }
 
 int vcmmd_update_ve(const char *ve_name,
 		    const struct vcmmd_ve_config *ve_config,
 		    unsigned int flags)
 {
-	DBusMessage *msg;
-	DBusMessageIter args;
-
-	VCMMD_FETCH_BUSNAME;
+	return vcmmd_update_ve_ex(ve_name, ve_config, flags, NULL);
+}
 
-	msg = make_msg("UpdateVE", &args);
-	if (!msg ||
-	    !append_str(&args, ve_name) ||
-	    !append_config(&args, ve_config) ||
-	    !append_uint32(&args, flags))
-		return VCMMD_ERROR_NO_MEMORY;
+int vcmmd_update_ve_ex(const char *ve_name,
+		       const struct vcmmd_ve_config *ve_config,
+		       unsigned int flags,
+		       struct vcmmd_shortfall *shortfall)
+{
+	struct vcmmd_call_ctx call;
+	int err;
 
-	return send_msg(msg);
+	VCMMD_PROBE(update_ve__entry, ve_name, flags);
+	__vcmmd_call_begin(&call, shortfall ? VCMMD_CALL_UPDATE_VE_EX :
+					      VCMMD_CALL_UPDATE_VE, ve_name);
+	if (shortfall)
+		memset(shortfall, 0, sizeof(*shortfall));
+	call.config_keys = __vcmmd_config_keys(ve_config);
+	call.flags = flags;
+	call.config = ve_config;
+	err = library_flags(ve_config, &flags);
+	if (!err)
+		RATE_CONTROLLED(&call, err,
+				do_update_ve(ve_name, ve_config, flags,
+					     shortfall));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(update_ve__return, ve_name, err);
+	return err;
 }
 
 int vcmmd_deactivate_ve(const char *ve_name)
 {
-	DBusMessage *msg;
-	DBusMessageIter args;
-
-	VCMMD_FETCH_BUSNAME;
-
-	msg = make_msg("DeactivateVE", &args);
-	if (!msg ||
-	    !append_str(&args, ve_name))
-		return VCMMD_ERROR_NO_MEMORY;
+	struct vcmmd_call_ctx call;
+	int err;
 
-	return send_msg(msg);
+	VCMMD_PROBE(deactivate_ve__entry, ve_name);
+	__vcmmd_call_begin(&call, VCMMD_CALL_DEACTIVATE_VE, ve_name);
+	RATE_CONTROLLED(&call, err, get_backend()->deactivate_ve(ve_name));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(deactivate_ve__return, ve_name, err);
+	return err;
 }
 
 int vcmmd_unregister_ve(const char *ve_name)
 {
-	DBusMessage *msg;
-	DBusMessageIter args;
+	struct vcmmd_call_ctx call;
+	int err;
 
-	VCMMD_FETCH_BUSNAME;
+	VCMMD_PROBE(unregister_ve__entry, ve_name);
+	__vcmmd_call_begin(&call, VCMMD_CALL_UNREGISTER_VE, ve_name);
+	RATE_CONTROLLED(&call, err, get_backend()->unregister_ve(ve_name));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(unregister_ve__return, ve_name, err);
+	return err;
+}
 
-	msg = make_msg("UnregisterVE", &args);
-	if (!msg ||
-	    !append_str(&args, ve_name))
-		return VCMMD_ERROR_NO_MEMORY;
+int vcmmd_get_ve_config(const char *ve_name, struct vcmmd_ve_config *ve_config)
+{
+	struct vcmmd_call_ctx call;
+	int err;
 
-	return send_msg(msg);
+	VCMMD_PROBE(get_ve_config__entry, ve_name);
+	__vcmmd_call_begin(&call, VCMMD_CALL_GET_VE_CONFIG, ve_name);
+	RATE_CONTROLLED(&call, err,
+			get_backend()->get_ve_config(ve_name, ve_config));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(get_ve_config__return, ve_name, err);
+	return err;
 }
 
-int vcmmd_get_ve_config(const char *ve_name, struct vcmmd_ve_config *ve_config)
+int vcmmd_get_ve_state(const char *ve_name, vcmmd_ve_state_t *ve_state)
 {
-	DBusMessage *msg, *reply;
-	DBusMessageIter args, array, structure;
-	dbus_int32_t err;
-	dbus_uint16_t t;
-	vcmmd_ve_config_key_t tag;
-	dbus_uint64_t value;
-	char *string;
+	struct vcmmd_call_ctx call;
+	int err;
+
+	VCMMD_PROBE(get_ve_state__entry, ve_name);
+	__vcmmd_call_begin(&call, VCMMD_CALL_GET_VE_STATE, ve_name);
+	RATE_CONTROLLED(&call, err,
+			get_backend()->get_ve_state(ve_name, ve_state));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(get_ve_state__return, ve_name, err);
+	return err;
+}
 
-	VCMMD_FETCH_BUSNAME;
+int vcmmd_ve_open(const char *ve_name, vcmmd_ve_handle_t *handle)
+{
+	struct vcmmd_ve_handle *h;
 
-	msg = make_msg("GetVEConfig", &args);
-	if (!msg ||
-	    !append_str(&args, ve_name))
+	h = calloc(1, sizeof(*h) + strlen(ve_name) + 1);
+	if (!h)
 		return VCMMD_ERROR_NO_MEMORY;
 
-	reply = __send_msg(msg);
-	if (!reply)
-		return VCMMD_ERROR_CONNECTION_FAILED;
+	pthread_mutex_init(&h->mutex, NULL);
+	strcpy(h->ve_name, ve_name);
+	*handle = h;
+	return 0;
+}
 
-	vcmmd_ve_config_init(ve_config);
+void vcmmd_ve_close(vcmmd_ve_handle_t handle)
+{
+	if (!handle)
+		return;
 
-	dbus_message_iter_init(reply, &args);
-	if (DBUS_TYPE_INT32 != dbus_message_iter_get_arg_type(&args)) {
-		err = VCMMD_ERROR_INVALID_VE_CONFIG;
-		goto error;
-	}
+	pthread_mutex_destroy(&handle->mutex);
+	free(handle);
+}
 
-	dbus_message_iter_get_basic(&args, &err);
-	if (err)
-		goto error;
+static int do_activate_ve_handle(struct vcmmd_ve_handle *handle,
+				 unsigned int flags)
+{
+	const struct vcmmd_backend *b = get_backend();
 
-	err = VCMMD_ERROR_INVALID_VE_CONFIG;
+	if (b->activate_ve_handle)
+		return b->activate_ve_handle(handle, flags);
+	return b->activate_ve(handle->ve_name, flags);
+}
 
-	if (FALSE == dbus_message_iter_next(&args) ||
-			DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&args))
-		goto error;
-	dbus_message_iter_recurse(&args, &array);
+int vcmmd_activate_ve_handle(vcmmd_ve_handle_t handle, unsigned int flags)
+{
+	struct vcmmd_call_ctx call;
+	int err;
 
-	if (dbus_message_iter_get_element_count(&args) == 0) {
-		/* We treat empty config (i.e. empty D-Bus array) as valid. */
-		dbus_message_unref(reply);
-		return 0;
-	}
+	VCMMD_PROBE(activate_ve_handle__entry, handle->ve_name, flags);
+	__vcmmd_call_begin(&call, VCMMD_CALL_ACTIVATE_VE, handle->ve_name);
+	call.flags = flags;
+	flags &= ~VCMMD_FLAGS_LIBRARY;
+	/* dry run is defined for register and update only */
+	err = flags & VCMMD_FLAG_DRY_RUN ? VCMMD_ERROR_NOT_SUPPORTED : 0;
+	if (!err)
+		RATE_CONTROLLED(&call, err, do_activate_ve_handle(handle, flags));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(activate_ve_handle__return, handle->ve_name, err);
+	return err;
+}
 
-	do {
-		if (DBUS_TYPE_STRUCT != dbus_message_iter_get_arg_type(&array))
-			goto error;
-		dbus_message_iter_recurse(&array, &structure);
-		if (DBUS_TYPE_UINT16 != dbus_message_iter_get_arg_type(&structure))
-			goto error;
-		dbus_message_iter_get_basic(&structure, &t);
-		tag = (vcmmd_ve_config_key_t)t;
-		if (FALSE == dbus_message_iter_next(&structure) ||
-				DBUS_TYPE_UINT64 != dbus_message_iter_get_arg_type(&structure))
-			goto error;
-		dbus_message_iter_get_basic(&structure, &value);
-		if (FALSE == dbus_message_iter_next(&structure) ||
-				DBUS_TYPE_STRING != dbus_message_iter_get_arg_type(&structure))
-			goto error;
-		dbus_message_iter_get_basic(&structure, &string);
-
-		if (vcmmd_ve_config_entry_is_string(tag)) {
-			if (!vcmmd_ve_config_append_string(ve_config, tag, string))
-				goto error;
-		}
-		else {
-			if (!vcmmd_ve_config_append(ve_config, tag, value))
-				goto error;
-		}
-	} while (TRUE == dbus_message_iter_next(&array));
+static int do_update_ve_handle(struct vcmmd_ve_handle *handle,
+			       const struct vcmmd_ve_config *ve_config,
+			       unsigned int flags)
+{
+	const struct vcmmd_backend *b = get_backend();
+
+	if (b->update_ve_handle)
+		return b->update_ve_handle(handle, ve_config, flags);
+	return b->update_ve(handle->ve_name, ve_config, flags);
+}
 
+int vcmmd_update_ve_handle(vcmmd_ve_handle_t handle,
+			   const struct vcmmd_ve_config *ve_config,
+			   unsigned int flags)
+{
+	struct vcmmd_call_ctx call;
+	int err;
 
-	/* Frees data */
-	dbus_message_unref(reply);
+	VCMMD_PROBE(update_ve_handle__entry, handle->ve_name, flags);
+	__vcmmd_call_begin(&call, VCMMD_CALL_UPDATE_VE, handle->ve_name);
+	call.config_keys = __vcmmd_config_keys(ve_config);
+	call.flags = flags;
+	call.config = ve_config;
+	err = library_flags(ve_config, &flags);
+	if (!err)
+		RATE_CONTROLLED(&call, err,
+				do_update_ve_handle(handle, ve_config, flags));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(update_ve_handle__return, handle->ve_name, err);
+	return err;
+}
 
-	return 0;
+static int do_deactivate_ve_handle(struct vcmmd_ve_handle *handle)
+{
+	const struct vcmmd_backend *b = get_backend();
 
-error:
-	dbus_message_unref(reply);
-	vcmmd_ve_config_deinit(ve_config);
-	return (int) err;
+	if (b->deactivate_ve_handle)
+		return b->deactivate_ve_handle(handle);
+	return b->deactivate_ve(handle->ve_name);
 }
 
-int vcmmd_get_ve_state(const char *ve_name, vcmmd_ve_state_t *ve_state)
+int vcmmd_deactivate_ve_handle(vcmmd_ve_handle_t handle)
 {
-	DBusMessage *msg, *reply;
-	DBusMessageIter args;
-	dbus_int32_t err;
-	dbus_bool_t active;
+	struct vcmmd_call_ctx call;
+	int err;
 
-	VCMMD_FETCH_BUSNAME;
+	VCMMD_PROBE(deactivate_ve_handle__entry, handle->ve_name);
+	__vcmmd_call_begin(&call, VCMMD_CALL_DEACTIVATE_VE, handle->ve_name);
+	RATE_CONTROLLED(&call, err, do_deactivate_ve_handle(handle));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(deactivate_ve_handle__return, handle->ve_name, err);
+	return err;
+}
 
-	msg = make_msg("IsVEActive", &args);
-	if (!msg ||
-	    !append_str(&args, ve_name))
-		return VCMMD_ERROR_NO_MEMORY;
+static int do_get_ve_config_handle(struct vcmmd_ve_handle *handle,
+				   struct vcmmd_ve_config *ve_config)
+{
+	const struct vcmmd_backend *b = get_backend();
 
-	reply = __send_msg(msg);
-	if (!reply)
-		return VCMMD_ERROR_CONNECTION_FAILED;
+	if (b->get_ve_config_handle)
+		return b->get_ve_config_handle(handle, ve_config);
+	return b->get_ve_config(handle->ve_name, ve_config);
+}
 
-	if (!dbus_message_get_args(reply, NULL,
-				   DBUS_TYPE_INT32, &err,
-				   DBUS_TYPE_BOOLEAN, &active,
-				   DBUS_TYPE_INVALID)) {
-		dbus_message_unref(reply);
-		return VCMMD_ERROR_CONNECTION_FAILED;
-	}
+int vcmmd_get_ve_config_handle(vcmmd_ve_handle_t handle,
+			       struct vcmmd_ve_config *ve_config)
+{
+	struct vcmmd_call_ctx call;
+	int err;
 
-	dbus_message_unref(reply);
+	VCMMD_PROBE(get_ve_config_handle__entry, handle->ve_name);
+	__vcmmd_call_begin(&call, VCMMD_CALL_GET_VE_CONFIG, handle->ve_name);
+	RATE_CONTROLLED(&call, err,
+			do_get_ve_config_handle(handle, ve_config));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(get_ve_config_handle__return, handle->ve_name, err);
+	return err;
+}
 
-	if (err) {
-		if (err == VCMMD_ERROR_VE_NOT_REGISTERED) {
-			*ve_state = VCMMD_VE_UNREGISTERED;
-			err = 0;
-		}
-		return err;
-	}
+static int do_get_ve_state_handle(struct vcmmd_ve_handle *handle,
+				  vcmmd_ve_state_t *ve_state)
+{
+	const struct vcmmd_backend *b = get_backend();
 
-	if (active)
-		*ve_state = VCMMD_VE_ACTIVE;
-	else
-		*ve_state = VCMMD_VE_REGISTERED;
-	return 0;
+	if (b->get_ve_state_handle)
+		return b->get_ve_state_handle(handle, ve_state);
+	return b->get_ve_state(handle->ve_name, ve_state);
+}
+
+int vcmmd_get_ve_state_handle(vcmmd_ve_handle_t handle,
+			      vcmmd_ve_state_t *ve_state)
+{
+	struct vcmmd_call_ctx call;
+	int err;
+
+	VCMMD_PROBE(get_ve_state_handle__entry, handle->ve_name);
+	__vcmmd_call_begin(&call, VCMMD_CALL_GET_VE_STATE, handle->ve_name);
+	RATE_CONTROLLED(&call, err, do_get_ve_state_handle(handle, ve_state));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(get_ve_state_handle__return, handle->ve_name, err);
+	return err;
 }
 
 int vcmmd_get_current_policy(char *policy_name, int len)
 {
-	DBusMessage *msg, *reply;
-	char *ret;
+	struct vcmmd_call_ctx call;
+	int err;
 
-	VCMMD_FETCH_BUSNAME;
+	VCMMD_PROBE(get_current_policy__entry);
+	__vcmmd_call_begin(&call, VCMMD_CALL_GET_CURRENT_POLICY, NULL);
+	RATE_CONTROLLED(&call, err,
+			get_backend()->get_current_policy(policy_name, len));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(get_current_policy__return, err);
+	return err;
+}
 
-	msg = make_msg("GetCurrentPolicy", NULL);
-	if (!msg)
-		return VCMMD_ERROR_NO_MEMORY;
+int vcmmd_get_policy_from_file(char *policy_name, int len)
+{
+	struct vcmmd_call_ctx call;
+	int err;
 
-	reply = __send_msg(msg);
-	if (!reply)
-		return VCMMD_ERROR_CONNECTION_FAILED;
+	VCMMD_PROBE(get_policy_from_file__entry);
+	__vcmmd_call_begin(&call, VCMMD_CALL_GET_POLICY_FROM_FILE, NULL);
+	RATE_CONTROLLED(&call, err,
+			get_backend()->get_policy_from_file(policy_name, len));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(get_policy_from_file__return, err);
+	return err;
+}
 
-	if (!dbus_message_get_args(reply, NULL,
-				   DBUS_TYPE_STRING, &ret,
-				   DBUS_TYPE_INVALID)) {
-		dbus_message_unref(reply);
-		return VCMMD_ERROR_CONNECTION_FAILED;
-	}
+int vcmmd_set_policy(const char *policy_name)
+{
+	struct vcmmd_call_ctx call;
+	int err;
 
-	if (strlen(ret) > len - 1) {
-		dbus_message_unref(reply);
-		return VCMMD_ERROR_NO_MEMORY;
-	}
+	VCMMD_PROBE(set_policy__entry, policy_name);
+	__vcmmd_call_begin(&call, VCMMD_CALL_SET_POLICY, policy_name);
+	RATE_CONTROLLED(&call, err, get_backend()->set_policy(policy_name));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(set_policy__return, policy_name, err);
+	return err;
+}
 
-	strcpy(policy_name, ret);
-	dbus_message_unref(reply);
-	return 0;
+static int do_get_host_capacity(struct vcmmd_host_capacity *cap)
+{
+	const struct vcmmd_backend *b = get_backend();
+
+	if (!b->get_host_capacity)
+		return VCMMD_ERROR_NOT_SUPPORTED;
+	return b->get_host_capacity(cap);
 }
 
-int vcmmd_get_policy_from_file(char *policy_name, int len)
+int vcmmd_get_host_capacity(struct vcmmd_host_capacity *cap)
 {
-	DBusMessage *msg, *reply;
-	char *ret;
+	struct vcmmd_call_ctx call;
+	int err;
 
-	VCMMD_FETCH_BUSNAME;
+	VCMMD_PROBE(get_host_capacity__entry);
+	__vcmmd_call_begin(&call, VCMMD_CALL_GET_HOST_CAPACITY, NULL);
+	RATE_CONTROLLED(&call, err, do_get_host_capacity(cap));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(get_host_capacity__return, err);
+	return err;
+}
 
-	msg = make_msg("GetPolicyFromFile", NULL);
-	if (!msg)
-		return VCMMD_ERROR_NO_MEMORY;
+static int do_get_node_capacity(struct vcmmd_node_capacity *nodes,
+				unsigned int nr_nodes)
+{
+	const struct vcmmd_backend *b = get_backend();
 
-	reply = __send_msg(msg);
-	if (!reply)
-		return VCMMD_ERROR_CONNECTION_FAILED;
+	if (!b->get_node_capacity)
+		return VCMMD_ERROR_NOT_SUPPORTED;
+	return b->get_node_capacity(nodes, nr_nodes);
+}
 
-	if (!dbus_message_get_args(reply, NULL,
-				   DBUS_TYPE_STRING, &ret,
-				   DBUS_TYPE_INVALID)) {
-		dbus_message_unref(reply);
-		return VCMMD_ERROR_CONNECTION_FAILED;
-	}
+int vcmmd_get_node_capacity(struct vcmmd_node_capacity *nodes,
+			    unsigned int nr_nodes)
+{
+	struct vcmmd_call_ctx call;
+	int err;
 
-	if (strlen(ret) > len - 1) {
-		dbus_message_unref(reply);
-		return VCMMD_ERROR_NO_MEMORY;
-	}
+	VCMMD_PROBE(get_node_capacity__entry, nr_nodes);
+	__vcmmd_call_begin(&call, VCMMD_CALL_GET_NODE_CAPACITY, NULL);
+	RATE_CONTROLLED(&call, err, do_get_node_capacity(nodes, nr_nodes));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(get_node_capacity__return, err);
+	return err;
+}
 
-	strcpy(policy_name, ret);
-	dbus_message_unref(reply);
-	return 0;
+static int do_reserve(uint64_t bytes, const char *nodes, unsigned int ttl_ms,
+		      vcmmd_reservation_t *token)
+{
+	const struct vcmmd_backend *b = get_backend();
+
+	if (!b->reserve)
+		return VCMMD_ERROR_NOT_SUPPORTED;
+	return b->reserve(bytes, nodes, ttl_ms, token);
 }
 
-int vcmmd_set_policy(const char *policy_name)
+int vcmmd_reserve(uint64_t bytes, const char *nodes, unsigned int ttl_ms,
+		  vcmmd_reservation_t *token)
 {
-	DBusMessage *msg;
-	DBusMessageIter args;
+	struct vcmmd_call_ctx call;
+	int err;
 
-	VCMMD_FETCH_BUSNAME;
+	VCMMD_PROBE(reserve__entry, bytes, ttl_ms);
+	__vcmmd_call_begin(&call, VCMMD_CALL_RESERVE, NULL);
+	RATE_CONTROLLED(&call, err, do_reserve(bytes, nodes, ttl_ms, token));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(reserve__return, err);
+	return err;
+}
 
-	msg = make_msg("SwitchPolicy", &args);
-	if (!msg ||
-	    !append_str(&args, policy_name))
-		return VCMMD_ERROR_NO_MEMORY;
+static int do_unreserve(vcmmd_reservation_t token)
+{
+	const struct vcmmd_backend *b = get_backend();
+
+	if (!b->unreserve)
+		return VCMMD_ERROR_NOT_SUPPORTED;
+	return b->unreserve(token);
+}
+
+int vcmmd_unreserve(vcmmd_reservation_t token)
+{
+	struct vcmmd_call_ctx call;
+	int err;
+
+	VCMMD_PROBE(unreserve__entry, token);
+	__vcmmd_call_begin(&call, VCMMD_CALL_UNRESERVE, NULL);
+	RATE_CONTROLLED(&call, err, do_unreserve(token));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(unreserve__return, err);
+	return err;
+}
+
+static int do_register_ve_reserved(const char *ve_name,
+				   vcmmd_ve_type_t ve_type,
+				   const struct vcmmd_ve_config *ve_config,
+				   vcmmd_reservation_t token,
+				   unsigned int flags)
+{
+	const struct vcmmd_backend *b = get_backend();
 
-	return send_msg(msg);
+	if (!b->register_ve_reserved)
+		return VCMMD_ERROR_NOT_SUPPORTED;
+	return b->register_ve_reserved(ve_name, ve_type, ve_config, token,
+				       flags);
+}
+
+int vcmmd_register_ve_reserved(const char *ve_name, vcmmd_ve_type_t ve_type,
+			       const struct vcmmd_ve_config *ve_config,
+			       vcmmd_reservation_t token, unsigned int flags)
+{
+	struct vcmmd_call_ctx call;
+	int err;
+
+	VCMMD_PROBE(register_ve_reserved__entry, ve_name, ve_type, token,
+		    flags);
+	__vcmmd_call_begin(&call, VCMMD_CALL_REGISTER_VE_RESERVED, ve_name);
+	call.config_keys = __vcmmd_config_keys(ve_config);
+	call.ve_type = ve_type;
+	call.flags = flags;
+	call.config = ve_config;
+	err = library_flags(ve_config, &flags);
+	if (!err)
+		RATE_CONTROLLED(&call, err,
+				do_register_ve_reserved(ve_name, ve_type,
+							ve_config, token,
+							flags));
+	__vcmmd_call_end(&call, err);
+	VCMMD_PROBE(register_ve_reserved__return, ve_name, err);
+	return err;
 }
 
 void __attribute__ ((constructor)) vcmmd_init(void)
 {
-	if (!dbus_threads_init_default())
-		abort();
+	const char *name = getenv("VCMMD_BACKEND");
+
+	if (!name || vcmmd_set_backend(name))
+		vcmmd_set_backend(__vcmmd_dbus_backend.name);
 }
@@ -0,0 +1,76 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * Assertions shared by the tests
+ *
+ * A failed check reports itself and the test carries on, so that one run
+ * lists every failure; CHECK_EXIT then gives the exit status automake
+ * expects, 1 if anything failed.
+ */
+
+#ifndef _VCMMD_TESTS_CHECK_H_
+#define _VCMMD_TESTS_CHECK_H_
+
+#include <stdio.h>
+#include <string.h>
+
+static int nr_failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s failed\n",		\
+				__FILE__, __LINE__, #cond);		\
+			nr_failures++;					\
+		}							\
+	} while (0)
+
+#define CHECK_EQ(a, b)							\
+	do {								\
+		long long _a = (a), _b = (b);				\
+									\
+		if (_a != _b) {						\
+			fprintf(stderr, "%s:%d: %s == %s failed: "	\
+				"%lld != %lld\n", __FILE__, __LINE__,	\
+				#a, #b, _a, _b);			\
+			nr_failures++;					\
+		}							\
+	} while (0)
+
+#define CHECK_STR(a, b)							\
+	do {								\
+		const char *_a = (a), *_b = (b);			\
+									\
+		if (!_a || strcmp(_a, _b)) {				\
+			fprintf(stderr, "%s:%d: %s == %s failed: "	\
+				"\"%s\" != \"%s\"\n", __FILE__,		\
+				__LINE__, #a, #b,			\
+				_a ? _a : "(null)", _b);		\
+			nr_failures++;					\
+		}							\
+	} while (0)
+
+#define CHECK_EXIT()	(nr_failures ? 1 : 0)
+
+#endif /* _VCMMD_TESTS_CHECK_H_ */
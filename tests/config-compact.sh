@@ -0,0 +1,5 @@
+#!/bin/sh
+# VE configs in the compact encoding, which the mock advertises by default
+for b in $TEST_BACKENDS; do
+	VCMMD_BACKEND=$b "$PRIVATE_BUS" ./test-config || exit 1
+done
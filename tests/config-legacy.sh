@@ -0,0 +1,5 @@
+#!/bin/sh
+# VE configs in the (qts) encoding, with the mock advertising no features
+for b in $TEST_BACKENDS; do
+	VCMMD_BACKEND=$b "$PRIVATE_BUS" -m "-F 0" ./test-config || exit 1
+done
@@ -0,0 +1,6 @@
+#!/bin/sh
+# The library calls against a mock with 4G of memory over 2 NUMA nodes
+for b in $TEST_BACKENDS; do
+	VCMMD_BACKEND=$b "$PRIVATE_BUS" -m "-M 4294967296 -N 2" \
+		./test-smoke 4294967296 2 || exit 1
+done
@@ -0,0 +1,104 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * Fake sysfs and procfs trees for the topology code, which reads them from
+ * under the root given to __vcmmd_set_topology_root
+ */
+
+#ifndef _VCMMD_TESTS_SYSFS_H_
+#define _VCMMD_TESTS_SYSFS_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define NODE_DIR	"/sys/devices/system/node"
+
+static char sysfs_root[] = "/tmp/vcmmd-sysfs.XXXXXX";
+
+/* Write @str to @path under the root, making the directories on the way */
+static void sysfs_write(const char *path, const char *str)
+{
+	char full[256], *p;
+	FILE *f;
+
+	snprintf(full, sizeof(full), "%s%s", sysfs_root, path);
+	for (p = full + strlen(sysfs_root) + 1; (p = strchr(p, '/')); p++) {
+		*p = '\0';
+		mkdir(full, 0755);
+		*p = '/';
+	}
+	f = fopen(full, "w");
+	if (!f || fputs(str, f) < 0 || fclose(f)) {
+		perror(full);
+		exit(99);
+	}
+}
+
+/*
+ * Add NUMA node @n with CPUs @cpus, @mem_mb megabytes of memory of which
+ * @free_mb are free, and the distances to the online nodes @distance
+ */
+static void sysfs_node(int n, const char *cpus, unsigned long mem_mb,
+		       unsigned long free_mb, const char *distance)
+{
+	char path[128], buf[256];
+
+	snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", n);
+	snprintf(buf, sizeof(buf), "%s\n", cpus);
+	sysfs_write(path, buf);
+
+	snprintf(path, sizeof(path), NODE_DIR "/node%d/meminfo", n);
+	snprintf(buf, sizeof(buf),
+		 "Node %d MemTotal:       %8lu kB\n"
+		 "Node %d MemFree:        %8lu kB\n",
+		 n, mem_mb * 1024, n, free_mb * 1024);
+	sysfs_write(path, buf);
+
+	snprintf(path, sizeof(path), NODE_DIR "/node%d/distance", n);
+	snprintf(buf, sizeof(buf), "%s\n", distance);
+	sysfs_write(path, buf);
+}
+
+/* Make the root and have the library read the topology from it */
+static void sysfs_init(void)
+{
+	if (!mkdtemp(sysfs_root)) {
+		perror(sysfs_root);
+		exit(99);
+	}
+	__vcmmd_set_topology_root(sysfs_root);
+}
+
+static void sysfs_cleanup(void)
+{
+	char cmd[64 + sizeof(sysfs_root)];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", sysfs_root);
+	if (system(cmd))
+		fprintf(stderr, "cannot remove %s\n", sysfs_root);
+}
+
+#endif /* _VCMMD_TESTS_SYSFS_H_ */
@@ -0,0 +1,167 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * test-bitmap: vcmmd::Bitmap list parsing and formatting, alone and through
+ * the list keys of vcmmd::Config. Parsing must agree with vcmmd_parse_list.
+ */
+
+#include <string>
+
+#include "vcmmd.hpp"
+#include "check.h"
+
+using vcmmd::Bitmap;
+
+static void test_parse()
+{
+	auto map = Bitmap::parse("0-3,8,10-11");
+
+	CHECK(map.has_value());
+	for (unsigned int i = 0; i < 64; i++)
+		CHECK_EQ(map->test(i), i <= 3 || i == 8 || i == 10 || i == 11);
+	CHECK(*map == Bitmap({0, 1, 2, 3, 8, 10, 11}));
+
+	map = Bitmap::parse("");
+	CHECK(map.has_value() && map->empty());
+
+	/* whitespace as read from sysfs */
+	map = Bitmap::parse(" 0-1\n");
+	CHECK(map.has_value() && *map == Bitmap({0, 1}));
+	map = Bitmap::parse("1 ,3");
+	CHECK(map.has_value() && *map == Bitmap({1, 3}));
+
+	/* the largest bit there is */
+	map = Bitmap::parse("65535");
+	CHECK(map.has_value() && map->test(65535) && map->size() == 65536);
+}
+
+static void test_parse_invalid()
+{
+	static const char *const invalid[] = {
+		"a", "-1", "1-", "3-1", "1-2-3", "1;2", "1,,2", "1,", ",1",
+		"1 2", "65536", "0-65536", "18446744073709551617",
+	};
+	uint64_t words[65536 / 64];
+
+	for (const char *s : invalid) {
+		auto map = Bitmap::parse(s);
+
+		CHECK_EQ(vcmmd_parse_list(s, words, 65536),
+			 VCMMD_ERROR_INVALID_VE_CONFIG);
+
+		if (map.has_value()) {
+			fprintf(stderr, "test-bitmap: \"%s\" parsed\n", s);
+			nr_failures++;
+			continue;
+		}
+		CHECK_EQ(map.error().code(), VCMMD_ERROR_INVALID_VE_CONFIG);
+	}
+
+	/* value() of an error throws it */
+	auto map = Bitmap::parse("x");
+	try {
+		(void)map.value();
+		CHECK(false);
+	} catch (const vcmmd::BadResultAccess &e) {
+		CHECK_EQ(e.error().code(), VCMMD_ERROR_INVALID_VE_CONFIG);
+	}
+}
+
+static void test_to_string()
+{
+	CHECK_STR(Bitmap().to_string().c_str(), "");
+	CHECK_STR(Bitmap({5}).to_string().c_str(), "5");
+	CHECK_STR(Bitmap({0, 2, 3, 4, 63, 64, 200}).to_string().c_str(),
+		  "0,2-4,63-64,200");
+
+	/* trailing zero words do not make bitmaps differ */
+	Bitmap a({1, 100}), b({1});
+	a.reset(100);
+	CHECK(a == b);
+	CHECK(a.to_string() == b.to_string());
+	CHECK(a != Bitmap({2}));
+}
+
+static void test_round_trip()
+{
+	static const char *const lists[] = {
+		"0", "65535", "0-127", "1,3,5,7", "0-3,8,10-11", "62-65,127-128",
+	};
+
+	for (const char *s : lists) {
+		auto map = Bitmap::parse(s);
+
+		CHECK(map.has_value());
+		if (map)
+			CHECK_STR(map->to_string().c_str(), s);
+	}
+}
+
+static void test_config()
+{
+	vcmmd::Config config;
+	const char *str;
+
+	CHECK(config.set(vcmmd::key::node_list, Bitmap({0, 1, 3})).has_value());
+	CHECK(vcmmd_ve_config_extract_string(config.native(),
+					     VCMMD_VE_CONFIG_NODE_LIST, &str));
+	CHECK_STR(str, "0-1,3");
+	CHECK(config.get(vcmmd::key::node_list) == Bitmap({0, 1, 3}));
+
+	/* set twice */
+	CHECK_EQ(config.set(vcmmd::key::node_list, Bitmap({2})).error().code(),
+		 VCMMD_ERROR_INVALID_VE_CONFIG);
+
+	/* VCMMD refuses empty lists, so they are not stored */
+	CHECK_EQ(config.set(vcmmd::key::cpu_list, Bitmap()).error().code(),
+		 VCMMD_ERROR_INVALID_VE_CONFIG);
+	CHECK_EQ(config.set(vcmmd::key::cpu_list,
+			    Bitmap({1, 2}).reset(1).reset(2)).error().code(),
+		 VCMMD_ERROR_INVALID_VE_CONFIG);
+	CHECK(!config.has(vcmmd::key::cpu_list));
+
+	/* lists stored through the C API read as the library parses them */
+	vcmmd::Config c;
+	CHECK(vcmmd_ve_config_append_string(c.native(),
+					    VCMMD_VE_CONFIG_CPU_LIST, "0-1\n"));
+	CHECK(c.get(vcmmd::key::cpu_list) == Bitmap({0, 1}));
+	CHECK(vcmmd_ve_config_append_string(c.native(),
+					    VCMMD_VE_CONFIG_NODE_LIST, "1,"));
+	CHECK(!c.get(vcmmd::key::node_list).has_value());
+
+	/* a list the C API let in that does not parse reads as unset */
+	CHECK(vcmmd_ve_config_append_string(config.native(),
+					    VCMMD_VE_CONFIG_CPU_LIST, "1-x"));
+	CHECK(!config.get(vcmmd::key::cpu_list).has_value());
+}
+
+int main()
+{
+	test_parse();
+	test_parse_invalid();
+	test_to_string();
+	test_round_trip();
+	test_config();
+	return CHECK_EXIT();
+}
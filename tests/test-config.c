@@ -0,0 +1,172 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * test-config: VE configs round-tripped through VCMMD
+ *
+ * Registers and updates VEs with every config key set and reads their
+ * configs back. Run against vcmmd-mockd, in its default setup to go through
+ * the compact config encoding and with -F 0 to go through the (qts) one.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "vcmmd.h"
+#include "check.h"
+
+#define MiB		(1ULL << 20)
+
+static void fill_config(struct vcmmd_ve_config *config, uint64_t limit,
+			const char *cpus)
+{
+	vcmmd_ve_config_init(config);
+	vcmmd_ve_config_append(config, VCMMD_VE_CONFIG_GUARANTEE, 256 * MiB);
+	vcmmd_ve_config_append(config, VCMMD_VE_CONFIG_LIMIT, limit);
+	vcmmd_ve_config_append(config, VCMMD_VE_CONFIG_SWAP, 512 * MiB);
+	vcmmd_ve_config_append(config, VCMMD_VE_CONFIG_VRAM, 16 * MiB);
+	vcmmd_ve_config_append_string(config, VCMMD_VE_CONFIG_NODE_LIST, "0");
+	vcmmd_ve_config_append_string(config, VCMMD_VE_CONFIG_CPU_LIST, cpus);
+	vcmmd_ve_config_append(config, VCMMD_VE_CONFIG_GUARANTEE_TYPE,
+			       VCMMD_MEMGUARANTEE_BYTES);
+	vcmmd_ve_config_append(config, VCMMD_VE_CONFIG_CACHE, 64 * MiB);
+	vcmmd_ve_config_append(config, VCMMD_VE_CONFIG_CPUNUM, 4);
+}
+
+/* Check that VE @name has @expected as config, every key of it */
+static void check_config(const char *name,
+			 const struct vcmmd_ve_config *expected)
+{
+	struct vcmmd_ve_config config;
+	unsigned int i;
+	uint64_t value;
+	const char *str;
+	int err;
+
+	vcmmd_ve_config_init(&config);
+	err = vcmmd_get_ve_config(name, &config);
+	CHECK_EQ(err, 0);
+	if (err)
+		return;
+
+	CHECK_EQ(config.nr_entries, expected->nr_entries);
+	for (i = 0; i < expected->nr_entries; i++) {
+		const struct vcmmd_ve_config_entry *entry =
+			&expected->entries[i];
+
+		if (entry->key == VCMMD_VE_CONFIG_NODE_LIST ||
+		    entry->key == VCMMD_VE_CONFIG_CPU_LIST) {
+			str = NULL;
+			CHECK(vcmmd_ve_config_extract_string(&config,
+							     entry->key, &str));
+			CHECK_STR(str, entry->str);
+		} else {
+			value = ~0ULL;
+			CHECK(vcmmd_ve_config_extract(&config, entry->key,
+						      &value));
+			CHECK_EQ(value, entry->value);
+		}
+	}
+	vcmmd_ve_config_deinit(&config);
+}
+
+static void test_register(void)
+{
+	struct vcmmd_ve_config config;
+
+	fill_config(&config, 1024 * MiB, "0-3,8");
+	CHECK_EQ(vcmmd_register_ve("test-config", VCMMD_VE_VM, &config, 0), 0);
+	check_config("test-config", &config);
+	CHECK_EQ(vcmmd_unregister_ve("test-config"), 0);
+	vcmmd_ve_config_deinit(&config);
+
+	/* numeric keys only, and string keys only */
+	vcmmd_ve_config_init(&config);
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_CPUNUM, 2);
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_GUARANTEE, 0);
+	CHECK_EQ(vcmmd_register_ve("test-config", VCMMD_VE_CT, &config, 0), 0);
+	check_config("test-config", &config);
+	CHECK_EQ(vcmmd_unregister_ve("test-config"), 0);
+	vcmmd_ve_config_deinit(&config);
+
+	vcmmd_ve_config_init(&config);
+	vcmmd_ve_config_append_string(&config, VCMMD_VE_CONFIG_CPU_LIST, "1");
+	CHECK_EQ(vcmmd_register_ve("test-config", VCMMD_VE_CT, &config, 0), 0);
+	check_config("test-config", &config);
+	CHECK_EQ(vcmmd_unregister_ve("test-config"), 0);
+	vcmmd_ve_config_deinit(&config);
+}
+
+static void test_update(void)
+{
+	struct vcmmd_ve_config config, update, expected;
+
+	fill_config(&config, 1024 * MiB, "0-3,8");
+	CHECK_EQ(vcmmd_register_ve("test-config", VCMMD_VE_VM, &config, 0), 0);
+	CHECK_EQ(vcmmd_activate_ve("test-config", 0), 0);
+
+	/* keys left out keep their values */
+	vcmmd_ve_config_init(&update);
+	vcmmd_ve_config_append(&update, VCMMD_VE_CONFIG_LIMIT, 2048 * MiB);
+	vcmmd_ve_config_append_string(&update, VCMMD_VE_CONFIG_CPU_LIST, "4");
+	CHECK_EQ(vcmmd_update_ve("test-config", &update, 0), 0);
+
+	fill_config(&expected, 2048 * MiB, "4");
+	check_config("test-config", &expected);
+
+	CHECK_EQ(vcmmd_deactivate_ve("test-config"), 0);
+	CHECK_EQ(vcmmd_unregister_ve("test-config"), 0);
+	vcmmd_ve_config_deinit(&expected);
+	vcmmd_ve_config_deinit(&update);
+	vcmmd_ve_config_deinit(&config);
+}
+
+static void test_frozen(void)
+{
+	struct vcmmd_ve_frozen *frozen;
+	struct vcmmd_ve_config config;
+	int i, err;
+
+	fill_config(&config, 1024 * MiB, "0-3,8");
+	err = vcmmd_ve_config_freeze("test-config", VCMMD_VE_VM, &config, 0,
+				     &frozen);
+	CHECK_EQ(err, 0);
+	/* marshalled once, sent twice */
+	for (i = 0; !err && i < 2; i++) {
+		CHECK_EQ(vcmmd_register_ve_frozen(frozen), 0);
+		check_config("test-config", &config);
+		CHECK_EQ(vcmmd_unregister_ve("test-config"), 0);
+	}
+	vcmmd_ve_frozen_free(frozen);
+	vcmmd_ve_config_deinit(&config);
+}
+
+int main(void)
+{
+	test_register();
+	test_update();
+	test_frozen();
+	return CHECK_EXIT();
+}
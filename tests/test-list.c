@@ -0,0 +1,130 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * test-list: __vcmmd_parse_list and __vcmmd_format_list
+ *
+ * Links the library statically to reach its internal functions.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+#include "check.h"
+
+#define NBITS		130
+
+static void test_parse(void)
+{
+	uint64_t map[BITMAP_WORDS(NBITS)];
+	unsigned int i;
+
+	CHECK_EQ(__vcmmd_parse_list("0-3,8,10-11", map, NBITS), 0);
+	for (i = 0; i < NBITS; i++)
+		CHECK_EQ(bitmap_test(map, i),
+			 i <= 3 || i == 8 || i == 10 || i == 11);
+
+	/* sysfs lists end with a newline */
+	CHECK_EQ(__vcmmd_parse_list("0-1\n", map, NBITS), 0);
+	CHECK_EQ(map[0], 0x3);
+
+	/* across a word boundary, up to the last bit */
+	CHECK_EQ(__vcmmd_parse_list("63-64,129", map, NBITS), 0);
+	CHECK_EQ(map[0], 1ULL << 63);
+	CHECK_EQ(map[1], 1);
+	CHECK_EQ(map[2], 2);
+
+	/* the map is cleared first */
+	CHECK_EQ(__vcmmd_parse_list("", map, NBITS), 0);
+	for (i = 0; i < BITMAP_WORDS(NBITS); i++)
+		CHECK_EQ(map[i], 0);
+}
+
+static void test_parse_invalid(void)
+{
+	static const char *const invalid[] = {
+		"a", "-1", "1-", "3-1", "1-2-3", "1;2", "1,,2", "0-130", "130",
+		"1 2", "1,", "1 ,", ",1",
+	};
+	uint64_t map[BITMAP_WORDS(NBITS)];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+		if (__vcmmd_parse_list(invalid[i], map, NBITS) != -1) {
+			fprintf(stderr, "test-list: \"%s\" parsed\n",
+				invalid[i]);
+			nr_failures++;
+		}
+}
+
+static void test_format(void)
+{
+	uint64_t map[BITMAP_WORDS(NBITS)] = {};
+	char buf[64];
+
+	CHECK_EQ(__vcmmd_format_list(map, NBITS, buf, sizeof(buf)), 0);
+	CHECK_STR(buf, "");
+
+	bitmap_set(map, 0);
+	bitmap_set(map, 2);
+	bitmap_set(map, 3);
+	bitmap_set(map, 4);
+	bitmap_set(map, 64);
+	bitmap_set(map, 129);
+	CHECK_EQ(__vcmmd_format_list(map, NBITS, buf, sizeof(buf)), 0);
+	CHECK_STR(buf, "0,2-4,64,129");
+
+	/* too small, by one byte and by all of it */
+	CHECK_EQ(__vcmmd_format_list(map, NBITS, buf, 12), -1);
+	CHECK_EQ(__vcmmd_format_list(map, NBITS, buf, 13), 0);
+	CHECK_EQ(__vcmmd_format_list(map, NBITS, buf, 0), -1);
+}
+
+static void test_round_trip(void)
+{
+	static const char *const lists[] = {
+		"0", "129", "0-129", "1,3,5,7", "0-3,8,10-11", "62-65,127-128",
+	};
+	uint64_t map[BITMAP_WORDS(NBITS)];
+	char buf[64];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+		CHECK_EQ(__vcmmd_parse_list(lists[i], map, NBITS), 0);
+		CHECK_EQ(__vcmmd_format_list(map, NBITS, buf, sizeof(buf)), 0);
+		CHECK_STR(buf, lists[i]);
+	}
+}
+
+int main(void)
+{
+	test_parse();
+	test_parse_invalid();
+	test_format();
+	test_round_trip();
+	return CHECK_EXIT();
+}
@@ -0,0 +1,201 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * test-metrics: statistics, flight recorder and metrics output
+ *
+ * Makes a known number of calls on the fake backend, some failing, and checks
+ * what vcmmd_get_stats, the flight recorder and vcmmd_metrics_format report
+ * for them, down to the text of the histogram bucket bounds.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vcmmd.h"
+#include "check.h"
+
+#define NR_VES		10
+
+static char metrics[256 * 1024];
+
+static void make_calls(void)
+{
+	struct vcmmd_ve_config config;
+	char name[16];
+	int i;
+
+	vcmmd_ve_config_init(&config);
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_GUARANTEE, 1 << 20);
+	for (i = 0; i < NR_VES; i++) {
+		snprintf(name, sizeof(name), "ct%d", i);
+		CHECK_EQ(vcmmd_register_ve(name, VCMMD_VE_CT, &config, 0), 0);
+	}
+	vcmmd_ve_config_deinit(&config);
+
+	CHECK_EQ(vcmmd_unregister_ve("nope"), VCMMD_ERROR_VE_NOT_REGISTERED);
+}
+
+static void test_stats(void)
+{
+	struct vcmmd_stats st;
+	uint64_t sum = 0;
+	int i;
+
+	vcmmd_get_stats(&st);
+	CHECK_EQ(st.calls[VCMMD_CALL_REGISTER_VE].calls, NR_VES);
+	CHECK_EQ(st.calls[VCMMD_CALL_REGISTER_VE].errors, 0);
+	CHECK_EQ(st.calls[VCMMD_CALL_UNREGISTER_VE].calls, 1);
+	CHECK_EQ(st.calls[VCMMD_CALL_UNREGISTER_VE].errors, 1);
+	CHECK_EQ(st.service_errors[VCMMD_ERROR_VE_NOT_REGISTERED], 1);
+	for (i = 0; i < VCMMD_STATS_NR_BUCKETS; i++)
+		sum += st.calls[VCMMD_CALL_REGISTER_VE].latency[i];
+	CHECK_EQ(sum, NR_VES);
+}
+
+static void test_flight_recorder(void)
+{
+	struct vcmmd_call_record rec[2];
+	char buf[4096], *last;
+	FILE *f;
+	size_t n;
+
+	CHECK_EQ(vcmmd_flight_recorder_read(rec, 2), 2);
+	CHECK_EQ(rec[0].call, VCMMD_CALL_REGISTER_VE);
+	CHECK_STR(rec[0].ve_name, "ct9");
+	CHECK_EQ(rec[0].result, 0);
+	CHECK_EQ(rec[0].config_keys, 1U << VCMMD_VE_CONFIG_GUARANTEE);
+	CHECK_EQ(rec[1].call, VCMMD_CALL_UNREGISTER_VE);
+	CHECK_STR(rec[1].ve_name, "nope");
+	CHECK_EQ(rec[1].result, VCMMD_ERROR_VE_NOT_REGISTERED);
+	CHECK_EQ(rec[1].seq, rec[0].seq + 1);
+
+	f = tmpfile();
+	if (!f) {
+		CHECK(f);
+		return;
+	}
+	CHECK_EQ(vcmmd_flight_recorder_dump(fileno(f)), 0);
+	rewind(f);
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[n] = '\0';
+	fclose(f);
+
+	CHECK_EQ(n && buf[n - 1] == '\n', 1);
+	buf[n - 1] = '\0';
+	last = strrchr(buf, '\n');
+	last = last ? last + 1 : buf;
+	CHECK(!strncmp(last, "seq=", 4));
+	CHECK(strstr(last, " call=unregister_ve ve=nope keys=0x0 "));
+	CHECK(strstr(last, " retries=0 reconnects=0 result=5"));
+}
+
+/* Value of the metric line starting with @prefix, or -1 */
+static long long metric(const char *prefix)
+{
+	const char *p = metrics;
+	size_t len = strlen(prefix);
+
+	while (p && *p) {
+		if (!strncmp(p, prefix, len) && p[len] == ' ')
+			return strtoll(p + len + 1, NULL, 10);
+		p = strchr(p, '\n');
+		if (p)
+			p++;
+	}
+	return -1;
+}
+
+static void test_metrics_format(void)
+{
+	char prefix[128], small[16];
+	long long cum, prev = 0;
+	unsigned long long us;
+	size_t len;
+	int i;
+
+	len = vcmmd_metrics_format(metrics, sizeof(metrics));
+	CHECK(len < sizeof(metrics));
+	CHECK_EQ(strlen(metrics), len);
+	CHECK(len >= 6 && !strcmp(metrics + len - 6, "# EOF\n"));
+
+	/* Too small a buffer truncates but reports the full length */
+	CHECK_EQ(vcmmd_metrics_format(NULL, 0), len);
+	CHECK_EQ(vcmmd_metrics_format(small, sizeof(small)), len);
+	CHECK_EQ(strlen(small), sizeof(small) - 1);
+	CHECK(!strncmp(small, metrics, sizeof(small) - 1));
+
+	CHECK_EQ(metric("vcmmd_client_calls_total{call=\"register_ve\"}"),
+		 NR_VES);
+	CHECK_EQ(metric("vcmmd_client_call_errors_total{call=\"unregister_ve\"}"),
+		 1);
+	CHECK_EQ(metric("vcmmd_client_errors_total{code=\"5\"}"), 1);
+
+	/*
+	 * Bounds are whole microseconds, printed exactly: 0.000001 up to
+	 * 1073.741824 for the last finite bucket, not rounded
+	 */
+	for (i = 0; i < VCMMD_STATS_NR_BUCKETS - 1; i++) {
+		us = 1ULL << i;
+		snprintf(prefix, sizeof(prefix),
+			 "vcmmd_client_call_duration_seconds_bucket"
+			 "{call=\"register_ve\",le=\"%llu.%06llu\"}",
+			 us / 1000000, us % 1000000);
+		cum = metric(prefix);
+		if (cum < 0)
+			fprintf(stderr, "no line %s\n", prefix);
+		CHECK(cum >= prev);
+		prev = cum;
+	}
+	CHECK(strstr(metrics, "le=\"1073.741824\""));
+	CHECK(strstr(metrics, "le=\"0.000001\""));
+	CHECK_EQ(metric("vcmmd_client_call_duration_seconds_bucket"
+			"{call=\"register_ve\",le=\"+Inf\"}"), NR_VES);
+	CHECK_EQ(metric("vcmmd_client_call_duration_seconds_count"
+			"{call=\"register_ve\"}"), NR_VES);
+	CHECK_EQ(metric("vcmmd_client_connected"), 0);
+}
+
+int main(void)
+{
+	if (vcmmd_set_backend("fake")) {
+		fprintf(stderr, "fake backend unavailable\n");
+		return 1;
+	}
+	vcmmd_reset_stats();
+
+	make_calls();
+	test_stats();
+	test_flight_recorder();
+	test_metrics_format();
+
+	vcmmd_reset_stats();
+	vcmmd_metrics_format(metrics, sizeof(metrics));
+	CHECK_EQ(metric("vcmmd_client_calls_total{call=\"register_ve\"}"), 0);
+
+	return CHECK_EXIT();
+}
@@ -0,0 +1,143 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * test-placement: vcmmd_place_ve on a fake host
+ *
+ * The host has online NUMA nodes 0, 2 and 5 only, as with memory-only or
+ * offlined nodes, so their distances, listed for online nodes only, must be
+ * mapped to node IDs that are not their positions. Uses the fake backend,
+ * which reports no node capacity, so headroom is free memory. Links the
+ * library statically to reach its internal functions.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+#include "check.h"
+#include "sysfs.h"
+
+#define MiB		(1ULL << 20)
+
+/* Place a VE with @guarantee and @cpunum, and check the lists picked */
+static void check_place(uint64_t guarantee, uint64_t cpunum,
+			const char *nodes, const char *cpus)
+{
+	struct vcmmd_ve_config config;
+	const char *str;
+	int err;
+
+	vcmmd_ve_config_init(&config);
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_GUARANTEE, guarantee);
+	if (cpunum)
+		vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_CPUNUM, cpunum);
+
+	err = vcmmd_place_ve(&config);
+	CHECK_EQ(err, nodes ? 0 : VCMMD_ERROR_PLACEMENT_FAILED);
+	if (!err && nodes) {
+		str = NULL;
+		vcmmd_ve_config_extract_string(&config,
+					       VCMMD_VE_CONFIG_NODE_LIST, &str);
+		CHECK_STR(str, nodes);
+		str = NULL;
+		vcmmd_ve_config_extract_string(&config,
+					       VCMMD_VE_CONFIG_CPU_LIST, &str);
+		CHECK_STR(str, cpus);
+	}
+	vcmmd_ve_config_deinit(&config);
+}
+
+static void set_free(int n, unsigned long free_mb)
+{
+	sysfs_node(n, n == 0 ? "0-1" : n == 2 ? "2-3" : "4-5", 1024, free_mb,
+		   n == 0 ? "10 30 15" : n == 2 ? "30 10 20" : "15 20 10");
+}
+
+static void test_place(void)
+{
+	/* the roomiest single node that fits */
+	check_place(512 * MiB, 0, "0", "0-1");
+	set_free(0, 900);
+	set_free(5, 900);
+	check_place(512 * MiB, 0, "2", "2-3");
+	check_place(512 * MiB, 2, "2", "2-3");
+	set_free(0, 1024);
+	set_free(5, 1024);
+
+	/* from node 0, node 5 is nearer than node 2 */
+	check_place(1536 * MiB, 0, "0,5", "0-1,4-5");
+	check_place(0, 3, "0,5", "0-1,4-5");
+	/* from node 2, so is node 5 than node 0 */
+	set_free(0, 1000);
+	set_free(5, 1000);
+	check_place(1536 * MiB, 0, "2,5", "2-5");
+	set_free(0, 1024);
+	set_free(5, 1024);
+
+	check_place(3072 * MiB, 0, "0,2,5", "0-5");
+	check_place(3073 * MiB, 0, NULL, NULL);
+	check_place(0, 7, NULL, NULL);
+}
+
+static void test_keep(void)
+{
+	struct vcmmd_ve_config config;
+	const char *str;
+
+	/* nodes given, only the CPUs are filled in */
+	vcmmd_ve_config_init(&config);
+	vcmmd_ve_config_append_string(&config, VCMMD_VE_CONFIG_NODE_LIST,
+				      "2,5");
+	CHECK_EQ(vcmmd_place_ve(&config), 0);
+	str = NULL;
+	vcmmd_ve_config_extract_string(&config, VCMMD_VE_CONFIG_CPU_LIST,
+				       &str);
+	CHECK_STR(str, "2-5");
+	vcmmd_ve_config_deinit(&config);
+
+	vcmmd_ve_config_init(&config);
+	vcmmd_ve_config_append_string(&config, VCMMD_VE_CONFIG_NODE_LIST,
+				      "0-");
+	CHECK_EQ(vcmmd_place_ve(&config), VCMMD_ERROR_INVALID_VE_CONFIG);
+	vcmmd_ve_config_deinit(&config);
+}
+
+int main(void)
+{
+	sysfs_init();
+	sysfs_write(NODE_DIR "/online", "0,2,5\n");
+	set_free(0, 1024);
+	set_free(2, 1024);
+	set_free(5, 1024);
+
+	CHECK_EQ(vcmmd_set_backend("fake"), 0);
+	test_place();
+	test_keep();
+
+	sysfs_cleanup();
+	return CHECK_EXIT();
+}
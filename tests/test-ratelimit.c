@@ -0,0 +1,218 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * test-ratelimit: AIMD steps of the rate control
+ *
+ * Drives __vcmmd_rc_admit and __vcmmd_rc_retry directly with the answers a
+ * backend would have got, and checks the limit after each. Links the library
+ * statically to reach its internal functions.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+#include "check.h"
+
+static void set_rate_control(unsigned int max_in_flight,
+			     unsigned int max_retries, unsigned int timeout_ms)
+{
+	struct vcmmd_rate_control rc = {
+		.calls		= VCMMD_RATE_CONTROL_ALL_CALLS,
+		.max_in_flight	= max_in_flight,
+		.max_retries	= max_retries,
+		.backoff_ms	= 1,
+		.timeout_ms	= timeout_ms,
+	};
+
+	vcmmd_set_rate_control(&rc);
+}
+
+static uint64_t get_limit(void)
+{
+	uint64_t limit, in_flight, queued;
+
+	__vcmmd_rc_get_state(&limit, &in_flight, &queued);
+	return limit;
+}
+
+static uint64_t get_in_flight(void)
+{
+	uint64_t limit, in_flight, queued;
+
+	__vcmmd_rc_get_state(&limit, &in_flight, &queued);
+	return in_flight;
+}
+
+/* Send one call and have VCMMD answer @err; returns whether it is resent */
+static bool answer(int err)
+{
+	struct vcmmd_rc_ctx rc;
+
+	__vcmmd_rc_begin(&rc, VCMMD_CALL_REGISTER_VE);
+	if (__vcmmd_rc_admit(&rc))
+		return false;
+	return __vcmmd_rc_retry(&rc, err);
+}
+
+static void test_disabled(void)
+{
+	struct vcmmd_rc_ctx rc;
+
+	vcmmd_set_rate_control(NULL);
+	CHECK_EQ(get_limit(), 0);
+
+	__vcmmd_rc_begin(&rc, VCMMD_CALL_REGISTER_VE);
+	CHECK(!rc.enabled);
+	CHECK_EQ(__vcmmd_rc_admit(&rc), 0);
+	CHECK_EQ(get_in_flight(), 0);
+	CHECK(!__vcmmd_rc_retry(&rc, VCMMD_ERROR_TOO_MANY_REQUESTS));
+
+	/* calls not in the mask are not controlled */
+	set_rate_control(4, 0, 0);
+	__vcmmd_rc_begin(&rc, VCMMD_CALL_REGISTER_VE);
+	CHECK(rc.enabled);
+	vcmmd_set_rate_control(&(struct vcmmd_rate_control){
+		.calls = 1U << VCMMD_CALL_UPDATE_VE,
+	});
+	__vcmmd_rc_begin(&rc, VCMMD_CALL_REGISTER_VE);
+	CHECK(!rc.enabled);
+	/* but the variants of a call are */
+	__vcmmd_rc_begin(&rc, VCMMD_CALL_UPDATE_VE_EX);
+	CHECK(rc.enabled);
+	CHECK_EQ(get_limit(), 64);
+}
+
+static void test_decrease(void)
+{
+	struct vcmmd_rc_ctx a, b;
+
+	set_rate_control(8, 0, 0);
+	CHECK_EQ(get_limit(), 8);
+
+	CHECK(!answer(VCMMD_ERROR_TOO_MANY_REQUESTS));
+	CHECK_EQ(get_limit(), 4);
+
+	/* b was sent at the old limit, its refusal does not count again */
+	__vcmmd_rc_begin(&a, VCMMD_CALL_REGISTER_VE);
+	__vcmmd_rc_begin(&b, VCMMD_CALL_REGISTER_VE);
+	CHECK_EQ(__vcmmd_rc_admit(&a), 0);
+	CHECK_EQ(__vcmmd_rc_admit(&b), 0);
+	CHECK_EQ(get_in_flight(), 2);
+	CHECK(!__vcmmd_rc_retry(&a, VCMMD_ERROR_TOO_MANY_REQUESTS));
+	CHECK_EQ(get_limit(), 2);
+	CHECK(!__vcmmd_rc_retry(&b, VCMMD_ERROR_TOO_MANY_REQUESTS));
+	CHECK_EQ(get_limit(), 2);
+	CHECK_EQ(get_in_flight(), 0);
+
+	/* halved down to 1, never below */
+	CHECK(!answer(VCMMD_ERROR_TOO_MANY_REQUESTS));
+	CHECK_EQ(get_limit(), 1);
+	CHECK(!answer(VCMMD_ERROR_TOO_MANY_REQUESTS));
+	CHECK_EQ(get_limit(), 1);
+}
+
+static void test_increase(void)
+{
+	set_rate_control(4, 0, 0);
+	CHECK(!answer(VCMMD_ERROR_TOO_MANY_REQUESTS));
+	CHECK(!answer(VCMMD_ERROR_TOO_MANY_REQUESTS));
+	CHECK_EQ(get_limit(), 1);
+
+	/* 1 / limit per answer: 1, 2, 2.5, 2.9, 3.24 */
+	CHECK(!answer(0));
+	CHECK_EQ(get_limit(), 2);
+	CHECK(!answer(0));
+	CHECK_EQ(get_limit(), 2);
+	/* errors VCMMD answers with count, the library's own do not */
+	CHECK(!answer(VCMMD_ERROR_VE_NOT_REGISTERED));
+	CHECK_EQ(get_limit(), 2);
+	CHECK(!answer(VCMMD_ERROR_CONNECTION_FAILED));
+	CHECK(!answer(VCMMD_ERROR_NO_MEMORY));
+	CHECK_EQ(get_limit(), 2);
+	CHECK(!answer(0));
+	CHECK_EQ(get_limit(), 3);
+
+	/* capped at max_in_flight */
+	CHECK(!answer(0));
+	CHECK(!answer(0));
+	CHECK(!answer(0));
+	CHECK_EQ(get_limit(), 4);
+	CHECK(!answer(0));
+	CHECK_EQ(get_limit(), 4);
+}
+
+static void test_retry(void)
+{
+	struct vcmmd_rc_ctx rc;
+
+	set_rate_control(4, 2, 0);
+	__vcmmd_rc_begin(&rc, VCMMD_CALL_REGISTER_VE);
+	CHECK_EQ(__vcmmd_rc_admit(&rc), 0);
+	CHECK(__vcmmd_rc_retry(&rc, VCMMD_ERROR_TOO_MANY_REQUESTS));
+	CHECK_EQ(rc.tries, 1);
+	CHECK_EQ(__vcmmd_rc_admit(&rc), 0);
+	CHECK(__vcmmd_rc_retry(&rc, VCMMD_ERROR_TOO_MANY_REQUESTS));
+	CHECK_EQ(rc.tries, 2);
+	/* out of retries */
+	CHECK_EQ(__vcmmd_rc_admit(&rc), 0);
+	CHECK(!__vcmmd_rc_retry(&rc, VCMMD_ERROR_TOO_MANY_REQUESTS));
+	CHECK_EQ(get_in_flight(), 0);
+
+	/* only refusals are resent */
+	CHECK(!answer(VCMMD_ERROR_VE_OPERATION_FAILED));
+	CHECK(!answer(VCMMD_ERROR_CONNECTION_FAILED));
+	CHECK(!answer(0));
+}
+
+static void test_admission_timeout(void)
+{
+	struct vcmmd_rc_ctx a, b;
+
+	set_rate_control(1, 0, 10);
+	__vcmmd_rc_begin(&a, VCMMD_CALL_REGISTER_VE);
+	__vcmmd_rc_begin(&b, VCMMD_CALL_REGISTER_VE);
+	CHECK_EQ(__vcmmd_rc_admit(&a), 0);
+	/* over the limit until the deadline */
+	CHECK_EQ(__vcmmd_rc_admit(&b), VCMMD_ERROR_TOO_MANY_REQUESTS);
+	CHECK(!b.admitted);
+	CHECK(!__vcmmd_rc_retry(&b, VCMMD_ERROR_TOO_MANY_REQUESTS));
+	CHECK_EQ(get_in_flight(), 1);
+	CHECK(!__vcmmd_rc_retry(&a, 0));
+	CHECK_EQ(get_in_flight(), 0);
+}
+
+int main(void)
+{
+	test_disabled();
+	test_decrease();
+	test_increase();
+	test_retry();
+	test_admission_timeout();
+	vcmmd_set_rate_control(NULL);
+	return CHECK_EXIT();
+}
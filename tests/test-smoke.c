@@ -0,0 +1,305 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * test-smoke: the library calls against vcmmd-mockd
+ *
+ * Takes VEs through their lifecycle and checks the error codes VCMMD gives
+ * for each wrong step, the memory accounting, reservations, dry runs and VE
+ * handles. Expects a mock started with -M HOST_MEM -N NR_NODES as given on
+ * the command line, and nothing else registered.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vcmmd.h"
+#include "check.h"
+
+#define MiB		(1ULL << 20)
+
+static uint64_t host_mem;
+static unsigned int nr_nodes;
+
+static void make_config(struct vcmmd_ve_config *config, uint64_t guarantee,
+			const char *nodes)
+{
+	vcmmd_ve_config_init(config);
+	vcmmd_ve_config_append(config, VCMMD_VE_CONFIG_GUARANTEE, guarantee);
+	vcmmd_ve_config_append(config, VCMMD_VE_CONFIG_LIMIT, 2 * guarantee);
+	if (nodes)
+		vcmmd_ve_config_append_string(config,
+					      VCMMD_VE_CONFIG_NODE_LIST, nodes);
+}
+
+static int register_ve(const char *name, uint64_t guarantee,
+		       const char *nodes, unsigned int flags)
+{
+	struct vcmmd_ve_config config;
+	int err;
+
+	make_config(&config, guarantee, nodes);
+	err = vcmmd_register_ve(name, VCMMD_VE_CT, &config, flags);
+	vcmmd_ve_config_deinit(&config);
+	return err;
+}
+
+static vcmmd_ve_state_t get_state(const char *name)
+{
+	vcmmd_ve_state_t state = -1;
+
+	CHECK_EQ(vcmmd_get_ve_state(name, &state), 0);
+	return state;
+}
+
+static uint64_t available(void)
+{
+	struct vcmmd_host_capacity cap;
+
+	CHECK_EQ(vcmmd_get_host_capacity(&cap), 0);
+	return cap.available;
+}
+
+static void test_lifecycle(void)
+{
+	struct vcmmd_ve_config config;
+
+	CHECK_EQ(get_state("smoke"), VCMMD_VE_UNREGISTERED);
+	CHECK_EQ(register_ve("smoke", 256 * MiB, NULL, 0), 0);
+	CHECK_EQ(get_state("smoke"), VCMMD_VE_REGISTERED);
+	CHECK_EQ(vcmmd_activate_ve("smoke", 0), 0);
+	CHECK_EQ(get_state("smoke"), VCMMD_VE_ACTIVE);
+
+	make_config(&config, 512 * MiB, NULL);
+	CHECK_EQ(vcmmd_update_ve("smoke", &config, 0), 0);
+	vcmmd_ve_config_deinit(&config);
+
+	CHECK_EQ(vcmmd_deactivate_ve("smoke"), 0);
+	CHECK_EQ(get_state("smoke"), VCMMD_VE_REGISTERED);
+	CHECK_EQ(vcmmd_unregister_ve("smoke"), 0);
+	CHECK_EQ(get_state("smoke"), VCMMD_VE_UNREGISTERED);
+}
+
+static void test_errors(void)
+{
+	struct vcmmd_ve_config config;
+	char buf[128];
+
+	CHECK_EQ(register_ve("", 0, NULL, 0), VCMMD_ERROR_INVALID_VE_NAME);
+	make_config(&config, 0, NULL);
+	CHECK_EQ(vcmmd_register_ve("smoke", 42, &config, 0),
+		 VCMMD_ERROR_INVALID_VE_TYPE);
+	vcmmd_ve_config_deinit(&config);
+
+	/* limit below guarantee */
+	vcmmd_ve_config_init(&config);
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_GUARANTEE, 2 * MiB);
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_LIMIT, MiB);
+	CHECK_EQ(vcmmd_register_ve("smoke", VCMMD_VE_CT, &config, 0),
+		 VCMMD_ERROR_INVALID_VE_CONFIG);
+	/* caught before it is sent */
+	CHECK_EQ(vcmmd_register_ve("smoke", VCMMD_VE_CT, &config,
+				   VCMMD_FLAG_VALIDATE),
+		 VCMMD_ERROR_INVALID_VE_CONFIG);
+	vcmmd_ve_config_deinit(&config);
+
+	CHECK_EQ(register_ve("smoke", host_mem + 1, NULL, 0),
+		 VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE);
+
+	CHECK_EQ(vcmmd_activate_ve("smoke", 0), VCMMD_ERROR_VE_NOT_REGISTERED);
+	CHECK_EQ(vcmmd_deactivate_ve("smoke"), VCMMD_ERROR_VE_NOT_REGISTERED);
+	CHECK_EQ(vcmmd_unregister_ve("smoke"), VCMMD_ERROR_VE_NOT_REGISTERED);
+
+	CHECK_EQ(register_ve("smoke", 0, NULL, 0), 0);
+	CHECK_EQ(register_ve("smoke", 0, NULL, 0),
+		 VCMMD_ERROR_VE_NAME_ALREADY_IN_USE);
+	make_config(&config, 0, NULL);
+	CHECK_EQ(vcmmd_update_ve("smoke", &config, 0),
+		 VCMMD_ERROR_VE_NOT_ACTIVE);
+	vcmmd_ve_config_deinit(&config);
+	CHECK_EQ(vcmmd_deactivate_ve("smoke"), VCMMD_ERROR_VE_NOT_ACTIVE);
+	CHECK_EQ(vcmmd_activate_ve("smoke", 0), 0);
+	CHECK_EQ(vcmmd_activate_ve("smoke", 0),
+		 VCMMD_ERROR_VE_ALREADY_ACTIVE);
+	CHECK_EQ(vcmmd_deactivate_ve("smoke"), 0);
+	CHECK_EQ(vcmmd_unregister_ve("smoke"), 0);
+
+	CHECK_EQ(vcmmd_set_policy(""), VCMMD_ERROR_POLICY_SET_INVALID_NAME);
+
+	CHECK(strlen(vcmmd_strerror(VCMMD_ERROR_NOT_SUPPORTED, buf,
+				    sizeof(buf))) > 0);
+}
+
+static void test_dry_run(void)
+{
+	struct vcmmd_ve_config config;
+	uint64_t before = available();
+
+	CHECK_EQ(register_ve("smoke", 256 * MiB, NULL, VCMMD_FLAG_DRY_RUN), 0);
+	CHECK_EQ(get_state("smoke"), VCMMD_VE_UNREGISTERED);
+	CHECK_EQ(available(), before);
+	CHECK_EQ(register_ve("smoke", host_mem + 1, NULL, VCMMD_FLAG_DRY_RUN),
+		 VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE);
+
+	CHECK_EQ(register_ve("smoke", 256 * MiB, NULL, 0), 0);
+	/* dry run is for register and update only */
+	CHECK_EQ(vcmmd_activate_ve("smoke", VCMMD_FLAG_DRY_RUN),
+		 VCMMD_ERROR_NOT_SUPPORTED);
+	CHECK_EQ(get_state("smoke"), VCMMD_VE_REGISTERED);
+	CHECK_EQ(vcmmd_activate_ve("smoke", 0), 0);
+
+	make_config(&config, 512 * MiB, NULL);
+	CHECK_EQ(vcmmd_update_ve("smoke", &config, VCMMD_FLAG_DRY_RUN), 0);
+	vcmmd_ve_config_deinit(&config);
+	CHECK_EQ(available(), before - 256 * MiB);
+
+	CHECK_EQ(vcmmd_deactivate_ve("smoke"), 0);
+	CHECK_EQ(vcmmd_unregister_ve("smoke"), 0);
+}
+
+static void test_capacity(void)
+{
+	struct vcmmd_node_capacity nodes[nr_nodes + 1];
+	struct vcmmd_host_capacity cap, cap2;
+	unsigned int i;
+
+	CHECK_EQ(vcmmd_get_host_capacity(&cap), 0);
+	CHECK_EQ(cap.total, host_mem);
+	CHECK_EQ(cap.guaranteed, 0);
+	CHECK_EQ(cap.reserved, 0);
+	CHECK_EQ(cap.available, host_mem);
+
+	CHECK_EQ(register_ve("smoke", 256 * MiB, NULL, 0), 0);
+	CHECK_EQ(register_ve("smoke-node", 128 * MiB, "0", 0), 0);
+	CHECK_EQ(vcmmd_get_host_capacity(&cap2), 0);
+	CHECK_EQ(cap2.guaranteed, 384 * MiB);
+	CHECK_EQ(cap2.available, host_mem - 384 * MiB);
+	CHECK(cap2.generation != cap.generation);
+
+	/* only VEs pinned to nodes commit node memory */
+	CHECK_EQ(vcmmd_get_node_capacity(nodes, nr_nodes + 1), 0);
+	for (i = 0; i < nr_nodes; i++) {
+		CHECK_EQ(nodes[i].total, host_mem / nr_nodes);
+		CHECK_EQ(nodes[i].committed, i ? 0 : 128 * MiB);
+	}
+	CHECK_EQ(nodes[nr_nodes].total, 0);
+
+	CHECK_EQ(vcmmd_unregister_ve("smoke-node"), 0);
+	CHECK_EQ(vcmmd_unregister_ve("smoke"), 0);
+	CHECK_EQ(available(), host_mem);
+}
+
+static void test_reservations(void)
+{
+	struct vcmmd_ve_config config;
+	struct vcmmd_host_capacity cap;
+	vcmmd_reservation_t token, token2;
+
+	CHECK_EQ(vcmmd_reserve(512 * MiB, NULL, 60000, &token), 0);
+	CHECK_EQ(vcmmd_get_host_capacity(&cap), 0);
+	CHECK_EQ(cap.reserved, 512 * MiB);
+	CHECK_EQ(cap.available, host_mem - 512 * MiB);
+
+	CHECK_EQ(vcmmd_reserve(host_mem, NULL, 60000, &token2),
+		 VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE);
+	CHECK_EQ(vcmmd_reserve(MiB, NULL, 0, &token2),
+		 VCMMD_ERROR_INVALID_VE_CONFIG);
+
+	/* the reservation is consumed and what it held above 256M released */
+	make_config(&config, 256 * MiB, NULL);
+	CHECK_EQ(vcmmd_register_ve_reserved("smoke", VCMMD_VE_CT, &config,
+					    token, 0), 0);
+	CHECK_EQ(vcmmd_get_host_capacity(&cap), 0);
+	CHECK_EQ(cap.reserved, 0);
+	CHECK_EQ(cap.available, host_mem - 256 * MiB);
+	CHECK_EQ(vcmmd_register_ve_reserved("smoke-2", VCMMD_VE_CT, &config,
+					    token, 0),
+		 VCMMD_ERROR_RESERVATION_NOT_FOUND);
+	CHECK_EQ(vcmmd_unreserve(token), VCMMD_ERROR_RESERVATION_NOT_FOUND);
+	vcmmd_ve_config_deinit(&config);
+	CHECK_EQ(vcmmd_unregister_ve("smoke"), 0);
+
+	CHECK_EQ(vcmmd_reserve(MiB, "0", 60000, &token), 0);
+	CHECK_EQ(vcmmd_unreserve(token), 0);
+	CHECK_EQ(available(), host_mem);
+}
+
+static void test_handle(void)
+{
+	struct vcmmd_ve_config config;
+	vcmmd_ve_handle_t handle;
+	vcmmd_ve_state_t state;
+	uint64_t value;
+
+	/* opened before the VE is registered */
+	CHECK_EQ(vcmmd_ve_open("smoke", &handle), 0);
+	CHECK_EQ(vcmmd_activate_ve_handle(handle, 0),
+		 VCMMD_ERROR_VE_NOT_REGISTERED);
+	CHECK_EQ(register_ve("smoke", 256 * MiB, NULL, 0), 0);
+
+	CHECK_EQ(vcmmd_activate_ve_handle(handle, VCMMD_FLAG_DRY_RUN),
+		 VCMMD_ERROR_NOT_SUPPORTED);
+	CHECK_EQ(vcmmd_activate_ve_handle(handle, 0), 0);
+	CHECK_EQ(vcmmd_get_ve_state_handle(handle, &state), 0);
+	CHECK_EQ(state, VCMMD_VE_ACTIVE);
+
+	make_config(&config, 128 * MiB, NULL);
+	CHECK_EQ(vcmmd_update_ve_handle(handle, &config, 0), 0);
+	vcmmd_ve_config_deinit(&config);
+	vcmmd_ve_config_init(&config);
+	CHECK_EQ(vcmmd_get_ve_config_handle(handle, &config), 0);
+	CHECK(vcmmd_ve_config_extract(&config, VCMMD_VE_CONFIG_GUARANTEE,
+				      &value));
+	CHECK_EQ(value, 128 * MiB);
+	vcmmd_ve_config_deinit(&config);
+
+	CHECK_EQ(vcmmd_deactivate_ve_handle(handle), 0);
+	CHECK_EQ(vcmmd_unregister_ve("smoke"), 0);
+	/* the handle outlives the VE */
+	CHECK_EQ(vcmmd_get_ve_state_handle(handle, &state), 0);
+	CHECK_EQ(state, VCMMD_VE_UNREGISTERED);
+	CHECK_EQ(vcmmd_deactivate_ve_handle(handle),
+		 VCMMD_ERROR_VE_NOT_REGISTERED);
+	vcmmd_ve_close(handle);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		fprintf(stderr, "usage: test-smoke HOST_MEM NR_NODES\n");
+		return 2;
+	}
+	host_mem = strtoull(argv[1], NULL, 0);
+	nr_nodes = strtoul(argv[2], NULL, 0);
+
+	test_lifecycle();
+	test_errors();
+	test_dry_run();
+	test_capacity();
+	test_reservations();
+	test_handle();
+	return CHECK_EXIT();
+}
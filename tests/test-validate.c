@@ -0,0 +1,206 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * test-validate: vcmmd_ve_config_validate on a fake host
+ *
+ * The host has NUMA nodes 0 and 2 online, with CPUs 0-1 and 2-3, so node 1
+ * and CPUs from 4 up are offline. Each case checks the result and the key
+ * reported as wrong. Links the library statically to reach its internal
+ * functions.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+#include "check.h"
+#include "sysfs.h"
+
+#define GiB		(1ULL << 30)
+
+/* No key is wrong */
+#define VALID		__NR_VCMMD_VE_CONFIG_KEYS
+
+static void check_config(const struct vcmmd_ve_config *config,
+			 vcmmd_ve_config_key_t bad, int line)
+{
+	vcmmd_ve_config_key_t key = VALID;
+	int err;
+
+	err = vcmmd_ve_config_validate(config, &key);
+	if (err != (bad == VALID ? 0 : VCMMD_ERROR_INVALID_VE_CONFIG) ||
+	    key != bad) {
+		fprintf(stderr, "%s:%d: validate returned %d, bad_key %d, "
+			"expected bad_key %d\n", __FILE__, line, err, key,
+			bad);
+		nr_failures++;
+	}
+}
+
+#define CHECK_CONFIG(config, bad) check_config(config, bad, __LINE__)
+
+/* Check a config of just @key set to the list @str */
+static void check_list(vcmmd_ve_config_key_t key, const char *str, bool valid,
+		       int line)
+{
+	struct vcmmd_ve_config config;
+
+	vcmmd_ve_config_init(&config);
+	vcmmd_ve_config_append_string(&config, key, str);
+	check_config(&config, valid ? VALID : key, line);
+	vcmmd_ve_config_deinit(&config);
+}
+
+#define CHECK_NODES(str, valid) \
+	check_list(VCMMD_VE_CONFIG_NODE_LIST, str, valid, __LINE__)
+#define CHECK_CPUS(str, valid) \
+	check_list(VCMMD_VE_CONFIG_CPU_LIST, str, valid, __LINE__)
+
+static void test_memory(void)
+{
+	struct vcmmd_ve_config config;
+
+	vcmmd_ve_config_init(&config);
+	CHECK_CONFIG(&config, VALID);
+
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_GUARANTEE, 2 * GiB);
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_LIMIT, 2 * GiB);
+	CHECK_CONFIG(&config, VALID);
+	vcmmd_ve_config_deinit(&config);
+
+	vcmmd_ve_config_init(&config);
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_GUARANTEE, 2 * GiB);
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_LIMIT, 2 * GiB - 1);
+	CHECK_CONFIG(&config, VCMMD_VE_CONFIG_LIMIT);
+	/* a NULL bad_key is fine */
+	CHECK_EQ(vcmmd_ve_config_validate(&config, NULL),
+		 VCMMD_ERROR_INVALID_VE_CONFIG);
+	vcmmd_ve_config_deinit(&config);
+
+	/* either alone is fine */
+	vcmmd_ve_config_init(&config);
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_LIMIT, 1);
+	CHECK_CONFIG(&config, VALID);
+	vcmmd_ve_config_deinit(&config);
+}
+
+static void test_guarantee_type(void)
+{
+	struct vcmmd_ve_config config;
+	uint64_t type;
+
+	for (type = 0; type < 4; type++) {
+		vcmmd_ve_config_init(&config);
+		vcmmd_ve_config_append(&config,
+				       VCMMD_VE_CONFIG_GUARANTEE_TYPE, type);
+		CHECK_CONFIG(&config, type == VCMMD_MEMGUARANTEE_AUTO ||
+				      type == VCMMD_MEMGUARANTEE_BYTES ?
+				      VALID : VCMMD_VE_CONFIG_GUARANTEE_TYPE);
+		vcmmd_ve_config_deinit(&config);
+	}
+}
+
+static void test_unknown_key(void)
+{
+	struct vcmmd_ve_config config;
+
+	vcmmd_ve_config_init(&config);
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_GUARANTEE, GiB);
+	config.entries[config.nr_entries++] = (struct vcmmd_ve_config_entry) {
+		.key = __NR_VCMMD_VE_CONFIG_KEYS + 1,
+	};
+	CHECK_CONFIG(&config, __NR_VCMMD_VE_CONFIG_KEYS + 1);
+	config.nr_entries--;
+	vcmmd_ve_config_deinit(&config);
+}
+
+static void test_lists(void)
+{
+	CHECK_NODES("0,2", true);
+	CHECK_NODES("2", true);
+	CHECK_NODES("0,2\n", true);
+	CHECK_CPUS("0-3", true);
+	CHECK_CPUS("0-1\n", true);
+	CHECK_CPUS("3,0-1", true);
+
+	/* malformed */
+	CHECK_NODES("", false);
+	CHECK_NODES("\n", false);
+	CHECK_NODES("x", false);
+	CHECK_NODES("0-", false);
+	CHECK_NODES("-2", false);
+	CHECK_NODES("2-0", false);
+	CHECK_NODES("0,,2", false);
+	CHECK_NODES("0,", false);
+	CHECK_NODES("0;2", false);
+	CHECK_CPUS("0-1 2", false);
+	CHECK_CPUS("1-x", false);
+
+	/* beyond VCMMD_MAX_NUMA_NODES and VCMMD_MAX_CPUS */
+	CHECK_NODES("64", false);
+	CHECK_CPUS("4096", false);
+
+	/* offline */
+	CHECK_NODES("1", false);
+	CHECK_NODES("0-2", false);
+	CHECK_CPUS("4", false);
+	CHECK_CPUS("0-4", false);
+}
+
+/* The first key checked wrong is reported, in a fixed order */
+static void test_first_bad_key(void)
+{
+	struct vcmmd_ve_config config;
+
+	vcmmd_ve_config_init(&config);
+	vcmmd_ve_config_append_string(&config, VCMMD_VE_CONFIG_CPU_LIST, "4");
+	vcmmd_ve_config_append_string(&config, VCMMD_VE_CONFIG_NODE_LIST, "1");
+	CHECK_CONFIG(&config, VCMMD_VE_CONFIG_NODE_LIST);
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_GUARANTEE_TYPE, 5);
+	CHECK_CONFIG(&config, VCMMD_VE_CONFIG_GUARANTEE_TYPE);
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_LIMIT, 1);
+	vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_GUARANTEE, 2);
+	CHECK_CONFIG(&config, VCMMD_VE_CONFIG_LIMIT);
+	vcmmd_ve_config_deinit(&config);
+}
+
+int main(void)
+{
+	sysfs_init();
+	sysfs_write(NODE_DIR "/online", "0,2\n");
+	sysfs_node(0, "0-1", 1024, 1024, "10 20");
+	sysfs_node(2, "2-3", 1024, 1024, "20 10");
+
+	test_memory();
+	test_guarantee_type();
+	test_unknown_key();
+	test_lists();
+	test_first_bad_key();
+
+	sysfs_cleanup();
+	return CHECK_EXIT();
+}
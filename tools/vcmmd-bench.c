@@ -0,0 +1,418 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/*
+ * vcmmd-bench: throughput and latency of the public calls
+ *
+ * For each thread count from 1 up to -t, every thread registers its own set
+ * of VEs and drives them through the whole lifecycle. Each call is a phase of
+ * its own: all threads start it together, issue -n requests each, and the
+ * phase ends when the last thread is done, so a phase measures one call in
+ * isolation. Results, including how often and how long callers waited for the
+ * shared connection, are printed as JSON for comparison between builds.
+ *
+ * Meant to be run against vcmmd-mockd, see "make bench"; "make bench-backends"
+ * runs it once per library backend built.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "vcmmd.h"
+
+#define VE_NAME_LEN		64
+#define MAX_THREADS		1024
+
+enum {
+	PHASE_REGISTER,
+	PHASE_ACTIVATE,
+	PHASE_UPDATE,
+	PHASE_GET_CONFIG,
+	PHASE_GET_STATE,
+	PHASE_GET_CURRENT_POLICY,
+	PHASE_GET_POLICY_FROM_FILE,
+	PHASE_SET_POLICY,
+	PHASE_DEACTIVATE,
+	PHASE_UNREGISTER,
+	__NR_PHASES,
+};
+
+static const vcmmd_call_t phase_calls[__NR_PHASES] = {
+	[PHASE_REGISTER]		= VCMMD_CALL_REGISTER_VE,
+	[PHASE_ACTIVATE]		= VCMMD_CALL_ACTIVATE_VE,
+	[PHASE_UPDATE]			= VCMMD_CALL_UPDATE_VE,
+	[PHASE_GET_CONFIG]		= VCMMD_CALL_GET_VE_CONFIG,
+	[PHASE_GET_STATE]		= VCMMD_CALL_GET_VE_STATE,
+	[PHASE_GET_CURRENT_POLICY]	= VCMMD_CALL_GET_CURRENT_POLICY,
+	[PHASE_GET_POLICY_FROM_FILE]	= VCMMD_CALL_GET_POLICY_FROM_FILE,
+	[PHASE_SET_POLICY]		= VCMMD_CALL_SET_POLICY,
+	[PHASE_DEACTIVATE]		= VCMMD_CALL_DEACTIVATE_VE,
+	[PHASE_UNREGISTER]		= VCMMD_CALL_UNREGISTER_VE,
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	uint64_t *latency_ns;		/* one per request of the current phase */
+	unsigned int errors;
+	int first_error;
+};
+
+static struct {
+	unsigned int max_threads;
+	unsigned int nr_ops;
+	const char *output;
+} opts = {
+	.nr_ops = 1000,
+};
+
+static pthread_barrier_t start_barrier, end_barrier;
+static unsigned int nr_threads;
+static int cur_phase;
+static char policy[256];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void ve_name(char *buf, const struct worker *w, unsigned int i)
+{
+	snprintf(buf, VE_NAME_LEN, "bench-%d-%u-%u", (int)getpid(), w->id, i);
+}
+
+static int do_op(struct worker *w, int phase, unsigned int i)
+{
+	struct vcmmd_ve_config config;
+	char name[VE_NAME_LEN], buf[256];
+	vcmmd_ve_state_t state;
+	int err;
+
+	ve_name(name, w, i);
+	vcmmd_ve_config_init(&config);
+
+	switch (phase) {
+	case PHASE_REGISTER:
+		vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_GUARANTEE,
+				       1 << 20);
+		vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_LIMIT, 2 << 20);
+		err = vcmmd_register_ve(name, VCMMD_VE_CT, &config, 0);
+		break;
+	case PHASE_ACTIVATE:
+		err = vcmmd_activate_ve(name, 0);
+		break;
+	case PHASE_UPDATE:
+		vcmmd_ve_config_append(&config, VCMMD_VE_CONFIG_LIMIT, 4 << 20);
+		err = vcmmd_update_ve(name, &config, 0);
+		break;
+	case PHASE_GET_CONFIG:
+		err = vcmmd_get_ve_config(name, &config);
+		break;
+	case PHASE_GET_STATE:
+		err = vcmmd_get_ve_state(name, &state);
+		break;
+	case PHASE_GET_CURRENT_POLICY:
+		err = vcmmd_get_current_policy(buf, sizeof(buf));
+		break;
+	case PHASE_GET_POLICY_FROM_FILE:
+		err = vcmmd_get_policy_from_file(buf, sizeof(buf));
+		break;
+	case PHASE_SET_POLICY:
+		err = vcmmd_set_policy(policy);
+		break;
+	case PHASE_DEACTIVATE:
+		err = vcmmd_deactivate_ve(name);
+		break;
+	case PHASE_UNREGISTER:
+		err = vcmmd_unregister_ve(name);
+		break;
+	default:
+		err = VCMMD_ERROR_VE_OPERATION_FAILED;
+	}
+
+	vcmmd_ve_config_deinit(&config);
+	return err;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t start;
+	unsigned int i;
+	int phase, err;
+
+	for (;;) {
+		pthread_barrier_wait(&start_barrier);
+		phase = cur_phase;
+		if (phase < 0)
+			break;
+
+		w->errors = 0;
+		w->first_error = 0;
+		for (i = 0; i < opts.nr_ops; i++) {
+			start = now_ns();
+			err = do_op(w, phase, i);
+			w->latency_ns[i] = now_ns() - start;
+			if (err) {
+				if (!w->errors)
+					w->first_error = err;
+				w->errors++;
+			}
+		}
+		pthread_barrier_wait(&end_barrier);
+	}
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double p)
+{
+	size_t i = (size_t)(p * n);
+
+	if (i >= n)
+		i = n - 1;
+	return sorted[i] / 1000.0;
+}
+
+static void report(FILE *f, struct worker *workers, int phase,
+		   uint64_t elapsed_ns, const struct vcmmd_stats *stats,
+		   bool first)
+{
+	size_t n = (size_t)nr_threads * opts.nr_ops;
+	uint64_t *all, sum = 0;
+	unsigned int t, errors = 0;
+	int first_error = 0;
+	char buf[128];
+	size_t i;
+
+	all = malloc(n * sizeof(*all));
+	if (!all) {
+		perror("vcmmd-bench");
+		exit(1);
+	}
+	for (t = 0; t < nr_threads; t++) {
+		memcpy(all + (size_t)t * opts.nr_ops, workers[t].latency_ns,
+		       opts.nr_ops * sizeof(*all));
+		if (workers[t].errors && !first_error)
+			first_error = workers[t].first_error;
+		errors += workers[t].errors;
+	}
+	qsort(all, n, sizeof(*all), cmp_u64);
+	for (i = 0; i < n; i++)
+		sum += all[i];
+
+	fprintf(f, "%s\n    {\"call\": \"%s\", \"threads\": %u, "
+		"\"ops\": %zu, \"errors\": %u, \"first_error\": %d, "
+		"\"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+		"\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+		"\"p999_us\": %.1f, \"max_us\": %.1f, "
+		"\"lock_waits\": %llu, \"lock_wait_us\": %.1f, "
+		"\"retries\": %llu, \"reconnects\": %llu}",
+		first ? "" : ",",
+		vcmmd_call_name(phase_calls[phase]), nr_threads,
+		n, errors, first_error,
+		elapsed_ns / 1e9, n * 1e9 / elapsed_ns,
+		sum / 1000.0 / n, percentile_us(all, n, 0.50),
+		percentile_us(all, n, 0.99), percentile_us(all, n, 0.999),
+		all[n - 1] / 1000.0,
+		(unsigned long long)stats->lock_waits,
+		stats->lock_wait_ns / 1000.0,
+		(unsigned long long)stats->retries,
+		(unsigned long long)stats->reconnects);
+
+	if (errors)
+		fprintf(stderr, "vcmmd-bench: %s: %u of %zu failed: %s\n",
+			vcmmd_call_name(phase_calls[phase]), errors, n,
+			vcmmd_strerror(first_error, buf, sizeof(buf)));
+	free(all);
+}
+
+/*
+ * Run all phases with @threads threads, appending results to @f
+ */
+static void run(FILE *f, struct worker *workers, unsigned int threads,
+		bool *first)
+{
+	struct vcmmd_stats stats;
+	uint64_t start;
+	unsigned int t;
+	int phase;
+
+	nr_threads = threads;
+	pthread_barrier_init(&start_barrier, NULL, threads + 1);
+	pthread_barrier_init(&end_barrier, NULL, threads + 1);
+
+	for (t = 0; t < threads; t++) {
+		workers[t].id = t;
+		if (pthread_create(&workers[t].thread, NULL, worker_fn,
+				   &workers[t])) {
+			perror("vcmmd-bench");
+			exit(1);
+		}
+	}
+
+	for (phase = 0; phase < __NR_PHASES; phase++) {
+		fprintf(stderr, "vcmmd-bench: %u thread%s, %s\n", threads,
+			threads > 1 ? "s" : "",
+			vcmmd_call_name(phase_calls[phase]));
+		vcmmd_reset_stats();
+		cur_phase = phase;
+		pthread_barrier_wait(&start_barrier);
+		start = now_ns();
+		pthread_barrier_wait(&end_barrier);
+		vcmmd_get_stats(&stats);
+		report(f, workers, phase, now_ns() - start, &stats, *first);
+		*first = false;
+	}
+
+	cur_phase = -1;
+	pthread_barrier_wait(&start_barrier);
+	for (t = 0; t < threads; t++)
+		pthread_join(workers[t].thread, NULL);
+
+	pthread_barrier_destroy(&start_barrier);
+	pthread_barrier_destroy(&end_barrier);
+}
+
+static void usage(FILE *f)
+{
+	fprintf(f,
+"Usage: vcmmd-bench [options]\n"
+"\n"
+"  -t N      run with 1, 2, 4, ... up to N threads (default: CPUs online)\n"
+"  -n N      requests per thread per call (default %u)\n"
+"  -b NAME   use library backend NAME, see vcmmd_set_backend\n"
+"  -o FILE   write JSON results to FILE instead of stdout\n",
+		opts.nr_ops);
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	unsigned int threads, t;
+	bool first = true;
+	FILE *f = stdout;
+	int opt, err;
+
+	while ((opt = getopt(argc, argv, "t:n:b:o:h")) != -1) {
+		switch (opt) {
+		case 't':
+			opts.max_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			opts.nr_ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			if (vcmmd_set_backend(optarg)) {
+				fprintf(stderr, "vcmmd-bench: unknown backend %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'o':
+			opts.output = optarg;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return 1;
+		}
+	}
+
+	if (!opts.max_threads)
+		opts.max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (opts.max_threads < 1 || opts.max_threads > MAX_THREADS ||
+	    opts.nr_ops < 1) {
+		usage(stderr);
+		return 1;
+	}
+
+	/* set_policy is benchmarked with the policy in effect */
+	err = vcmmd_get_current_policy(policy, sizeof(policy));
+	if (err) {
+		char buf[128];
+
+		fprintf(stderr, "vcmmd-bench: cannot reach VCMMD: %s\n",
+			vcmmd_strerror(err, buf, sizeof(buf)));
+		return 1;
+	}
+
+	workers = calloc(opts.max_threads, sizeof(*workers));
+	if (!workers) {
+		perror("vcmmd-bench");
+		return 1;
+	}
+	for (t = 0; t < opts.max_threads; t++) {
+		workers[t].latency_ns = calloc(opts.nr_ops, sizeof(uint64_t));
+		if (!workers[t].latency_ns) {
+			perror("vcmmd-bench");
+			return 1;
+		}
+	}
+
+	if (opts.output) {
+		f = fopen(opts.output, "w");
+		if (!f) {
+			perror(opts.output);
+			return 1;
+		}
+	}
+
+	fprintf(f, "{\n  \"version\": 1,\n  \"backend\": \"%s\",\n"
+		"  \"cpus\": %ld,\n  \"ops_per_thread\": %u,\n  \"results\": [",
+		vcmmd_get_backend(), sysconf(_SC_NPROCESSORS_ONLN),
+		opts.nr_ops);
+	for (threads = 1; ; threads *= 2) {
+		if (threads > opts.max_threads)
+			threads = opts.max_threads;
+		run(f, workers, threads, &first);
+		if (threads == opts.max_threads)
+			break;
+	}
+	fprintf(f, "\n  ]\n}\n");
+
+	if (f != stdout)
+		fclose(f);
+	for (t = 0; t < opts.max_threads; t++)
+		free(workers[t].latency_ns);
+	free(workers);
+	return 0;
+}
@@ -0,0 +1,418 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/*
+ * vcmmd-microbench: CPU and allocator cost of the library's own code
+ *
+ * Times VE config construction, lookup and destruction, config marshalling
+ * into a D-Bus message, GetVEConfig reply parsing and whole register and
+ * unregister calls served by the fake backend, without any IPC. Each
+ * benchmark works on a batch of objects prepared outside of the timed region
+ * and is repeated until it has run for at least -T milliseconds. Reports
+ * ns/op and allocations/op as JSON; allocations are counted by interposing
+ * malloc, so they include those done by libdbus.
+ *
+ * Links the library statically to reach its internal functions.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <dbus/dbus.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+
+#define BATCH		256
+
+/*
+ * Allocation counting. glibc exports its allocator under __libc_* names,
+ * which lets us wrap it without dlsym() (which itself allocates).
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t nr_allocs;
+
+void *malloc(size_t size)
+{
+	nr_allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	nr_allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	nr_allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+#define ALLOCS_COUNTED	true
+#else
+static uint64_t nr_allocs;
+#define ALLOCS_COUNTED	false
+#endif
+
+static const vcmmd_ve_config_key_t num_keys[] = {
+	VCMMD_VE_CONFIG_GUARANTEE,
+	VCMMD_VE_CONFIG_LIMIT,
+	VCMMD_VE_CONFIG_SWAP,
+	VCMMD_VE_CONFIG_VRAM,
+	VCMMD_VE_CONFIG_GUARANTEE_TYPE,
+	VCMMD_VE_CONFIG_CACHE,
+	VCMMD_VE_CONFIG_CPUNUM,
+};
+#define NR_NUM_KEYS	(sizeof(num_keys) / sizeof(num_keys[0]))
+
+static const vcmmd_ve_config_key_t str_keys[] = {
+	VCMMD_VE_CONFIG_NODE_LIST,
+	VCMMD_VE_CONFIG_CPU_LIST,
+};
+#define NR_STR_KEYS	(sizeof(str_keys) / sizeof(str_keys[0]))
+
+static struct vcmmd_ve_config configs[BATCH];
+static char names[BATCH][16];
+static DBusMessage *msgs[BATCH];
+static DBusMessage *reply;
+
+static unsigned int min_ms = 500;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fill_config(struct vcmmd_ve_config *config)
+{
+	unsigned int i;
+
+	vcmmd_ve_config_init(config);
+	for (i = 0; i < NR_NUM_KEYS; i++)
+		vcmmd_ve_config_append(config, num_keys[i], 1ULL << 30);
+	vcmmd_ve_config_append_string(config, VCMMD_VE_CONFIG_NODE_LIST, "0-1");
+	vcmmd_ve_config_append_string(config, VCMMD_VE_CONFIG_CPU_LIST,
+				      "0-15,32-47");
+}
+
+static void setup_empty(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < BATCH; i++)
+		vcmmd_ve_config_init(&configs[i]);
+}
+
+static void setup_full(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < BATCH; i++)
+		fill_config(&configs[i]);
+}
+
+static void teardown_configs(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < BATCH; i++)
+		vcmmd_ve_config_deinit(&configs[i]);
+}
+
+static void setup_msgs(void)
+{
+	unsigned int i;
+
+	setup_full();
+	for (i = 0; i < BATCH; i++) {
+		msgs[i] = dbus_message_new_method_call("com.virtuozzo.vcmmd",
+					"/LoadManager",
+					"com.virtuozzo.vcmmd.LoadManager",
+					"RegisterVE");
+		if (!msgs[i])
+			abort();
+	}
+}
+
+static void teardown_msgs(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < BATCH; i++)
+		dbus_message_unref(msgs[i]);
+	teardown_configs();
+}
+
+/* Each run function does BATCH * ops_per_item operations */
+
+static void run_append(void)
+{
+	unsigned int i, k;
+
+	for (i = 0; i < BATCH; i++)
+		for (k = 0; k < NR_NUM_KEYS; k++)
+			vcmmd_ve_config_append(&configs[i], num_keys[k], k);
+}
+
+static void run_append_string(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < BATCH; i++) {
+		vcmmd_ve_config_append_string(&configs[i],
+					      VCMMD_VE_CONFIG_NODE_LIST, "0-1");
+		vcmmd_ve_config_append_string(&configs[i],
+					      VCMMD_VE_CONFIG_CPU_LIST,
+					      "0-15,32-47");
+	}
+}
+
+static volatile uint64_t sink;
+
+static void run_extract(void)
+{
+	uint64_t value, sum = 0;
+	unsigned int i, k;
+
+	for (i = 0; i < BATCH; i++)
+		for (k = 0; k < NR_NUM_KEYS; k++)
+			if (vcmmd_ve_config_extract(&configs[i], num_keys[k],
+						    &value))
+				sum += value;
+	sink = sum;
+}
+
+static void run_deinit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < BATCH; i++)
+		vcmmd_ve_config_deinit(&configs[i]);
+}
+
+static void run_marshal(void)
+{
+	DBusMessageIter iter;
+	unsigned int i;
+
+	for (i = 0; i < BATCH; i++) {
+		dbus_message_iter_init_append(msgs[i], &iter);
+		if (!__vcmmd_append_config(&iter, &configs[i]))
+			abort();
+	}
+}
+
+static void run_marshal_compact(void)
+{
+	DBusMessageIter iter;
+	unsigned int i;
+
+	for (i = 0; i < BATCH; i++) {
+		dbus_message_iter_init_append(msgs[i], &iter);
+		if (!__vcmmd_append_config_compact(&iter, &configs[i]))
+			abort();
+	}
+}
+
+static void run_parse(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < BATCH; i++)
+		if (__vcmmd_parse_ve_config(reply, &configs[i]))
+			abort();
+}
+
+static void run_fake_calls(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < BATCH; i++)
+		if (vcmmd_register_ve(names[i], VCMMD_VE_CT, &configs[i], 0))
+			abort();
+	for (i = 0; i < BATCH; i++)
+		if (vcmmd_unregister_ve(names[i]))
+			abort();
+}
+
+static void setup_reply(void)
+{
+	struct vcmmd_ve_config config;
+	DBusMessageIter iter;
+	dbus_int32_t err = 0;
+
+	reply = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	if (!reply)
+		abort();
+	fill_config(&config);
+	dbus_message_iter_init_append(reply, &iter);
+	if (!dbus_message_iter_append_basic(&iter, DBUS_TYPE_INT32, &err) ||
+	    !__vcmmd_append_config(&iter, &config))
+		abort();
+	vcmmd_ve_config_deinit(&config);
+}
+
+struct bench {
+	const char *name;
+	const char *desc;
+	unsigned int ops_per_item;
+	void (*setup)(void);
+	void (*run)(void);
+	void (*teardown)(void);
+};
+
+static const struct bench benches[] = {
+	{ "config_append", "vcmmd_ve_config_append, one numeric key",
+	  NR_NUM_KEYS, setup_empty, run_append, teardown_configs },
+	{ "config_append_string", "vcmmd_ve_config_append_string, one list",
+	  NR_STR_KEYS, setup_empty, run_append_string, teardown_configs },
+	{ "config_extract", "vcmmd_ve_config_extract, one key of a full config",
+	  NR_NUM_KEYS, setup_full, run_extract, teardown_configs },
+	{ "config_deinit", "vcmmd_ve_config_deinit of a full config",
+	  1, setup_full, run_deinit, NULL },
+	{ "append_config", "marshal a full config, (qts) encoding",
+	  1, setup_msgs, run_marshal, teardown_msgs },
+	{ "append_config_compact", "marshal a full config, compact encoding",
+	  1, setup_msgs, run_marshal_compact, teardown_msgs },
+	{ "parse_ve_config", "parse a GetVEConfig reply with a full config",
+	  1, setup_empty, run_parse, teardown_configs },
+	{ "fake_calls", "register or unregister call, fake backend",
+	  2, setup_full, run_fake_calls, teardown_configs },
+};
+#define NR_BENCHES	(sizeof(benches) / sizeof(benches[0]))
+
+static void run_bench(FILE *f, const struct bench *b, bool first)
+{
+	uint64_t elapsed = 0, allocs = 0, ops = 0, start, allocs_start;
+
+	do {
+		if (b->setup)
+			b->setup();
+		allocs_start = nr_allocs;
+		start = now_ns();
+		b->run();
+		elapsed += now_ns() - start;
+		allocs += nr_allocs - allocs_start;
+		ops += BATCH * b->ops_per_item;
+		if (b->teardown)
+			b->teardown();
+	} while (elapsed < min_ms * 1000000ULL);
+
+	fprintf(f, "%s\n    {\"name\": \"%s\", \"desc\": \"%s\", "
+		"\"ops\": %llu, \"ns_per_op\": %.2f, \"allocs_per_op\": ",
+		first ? "" : ",", b->name, b->desc,
+		(unsigned long long)ops, (double)elapsed / ops);
+	if (ALLOCS_COUNTED)
+		fprintf(f, "%.2f}", (double)allocs / ops);
+	else
+		fprintf(f, "null}");
+}
+
+static void usage(FILE *f)
+{
+	fprintf(f,
+"Usage: vcmmd-microbench [options] [NAME...]\n"
+"\n"
+"  -T MS     run each benchmark for at least MS milliseconds (default %u)\n"
+"  -o FILE   write JSON results to FILE instead of stdout\n"
+"  -l        list benchmarks\n",
+		min_ms);
+}
+
+int main(int argc, char **argv)
+{
+	const char *output = NULL;
+	bool first = true;
+	FILE *f = stdout;
+	unsigned int i;
+	int opt, j;
+
+	while ((opt = getopt(argc, argv, "T:o:lh")) != -1) {
+		switch (opt) {
+		case 'T':
+			min_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'l':
+			for (i = 0; i < NR_BENCHES; i++)
+				printf("%-24s%s\n", benches[i].name,
+				       benches[i].desc);
+			return 0;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return 1;
+		}
+	}
+
+	if (output) {
+		f = fopen(output, "w");
+		if (!f) {
+			perror(output);
+			return 1;
+		}
+	}
+
+	setup_reply();
+	for (i = 0; i < BATCH; i++)
+		snprintf(names[i], sizeof(names[i]), "ve%u", i);
+	if (vcmmd_set_backend("fake"))
+		abort();
+
+	fprintf(f, "{\n  \"version\": 1,\n  \"results\": [");
+	for (i = 0; i < NR_BENCHES; i++) {
+		if (optind < argc) {
+			for (j = optind; j < argc; j++)
+				if (!strcmp(argv[j], benches[i].name))
+					break;
+			if (j == argc)
+				continue;
+		}
+		run_bench(f, &benches[i], first);
+		first = false;
+	}
+	fprintf(f, "\n  ]\n}\n");
+
+	dbus_message_unref(reply);
+	if (f != stdout)
+		fclose(f);
+	return 0;
+}
@@ -0,0 +1,1421 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/*
+ * vcmmd-mockd: stand-in for the VCMMD LoadManager service
+ *
+ * Implements the LoadManager methods used by libvcmmd with VE state kept in
+ * memory and a simple admission check: the sum of guarantees must fit the
+ * host memory given with -M and, with -N, the guarantees of VEs pinned to
+ * nodes, spread evenly over them, must fit the even share of each node.
+ * Replies can be delayed and errors injected, so the library can be exercised
+ * and benchmarked without a real VCMMD. Delayed replies are queued rather than
+ * slept on, so requests from many clients are served concurrently.
+ *
+ * Connects to the system bus, which DBUS_SYSTEM_BUS_ADDRESS can point at a
+ * private dbus-daemon; see vcmmd-private-bus.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <dbus/dbus.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+
+#define DEFAULT_BUS_NAME	"com.virtuozzo.vcmmd"
+#define DEFAULT_POLICY		"performance"
+
+struct ve {
+	struct ve *next;
+	uint64_t id;
+	vcmmd_ve_type_t type;
+	bool active;
+	struct vcmmd_ve_config config;
+	char name[];
+};
+
+struct reservation {
+	struct reservation *next;
+	uint64_t token;
+	uint64_t bytes;
+	uint64_t nodes;		/* as in ve_nodes */
+	uint64_t expires_ns;
+};
+
+struct pending_reply {
+	struct pending_reply *next;
+	uint64_t due_ns;
+	DBusMessage *reply;
+};
+
+static struct {
+	const char *bus_name;
+	unsigned int latency_ms;
+	unsigned int jitter_ms;
+	int error;
+	double error_rate;
+	const char *error_method;
+	uint64_t host_mem;
+	unsigned int nr_nodes;
+	unsigned int max_pending;
+	dbus_uint64_t features;
+	bool verbose;
+} opts = {
+	.bus_name = DEFAULT_BUS_NAME,
+	.host_mem = UINT64_MAX,
+	.features = VCMMD_FEATURE_COMPACT_CONFIG | VCMMD_FEATURE_VE_IDS |
+		    VCMMD_FEATURE_HOST_CAPACITY | VCMMD_FEATURE_SHORTFALL |
+		    VCMMD_FEATURE_VE_RANGE | VCMMD_FEATURE_DRY_RUN |
+		    VCMMD_FEATURE_RESERVE | VCMMD_FEATURE_NODE_CAPACITY,
+};
+
+static struct ve *ves;
+/*
+ * VE IDs are never reused; the high half is random so that a restarted mock
+ * does not give out the IDs of the previous one
+ */
+static uint64_t last_id;
+/* Reservation tokens, likewise */
+static struct reservation *reservations;
+static uint64_t last_token;
+/* Changes with the sum of guarantees and reservations */
+static uint64_t generation;
+static struct pending_reply *pending;
+static unsigned int nr_pending;
+static char policy[256] = DEFAULT_POLICY;
+static volatile sig_atomic_t stop;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct ve *find_ve(const char *name)
+{
+	struct ve *ve;
+
+	for (ve = ves; ve; ve = ve->next)
+		if (!strcmp(ve->name, name))
+			return ve;
+	return NULL;
+}
+
+static struct ve *find_ve_by_id(uint64_t id)
+{
+	struct ve *ve;
+
+	for (ve = ves; ve; ve = ve->next)
+		if (ve->id == id)
+			return ve;
+	return NULL;
+}
+
+static uint64_t config_value(const struct vcmmd_ve_config *config,
+			     vcmmd_ve_config_key_t key, uint64_t def)
+{
+	uint64_t value;
+
+	return vcmmd_ve_config_extract(config, key, &value) ? value : def;
+}
+
+static bool is_string_key(int key)
+{
+	return key == VCMMD_VE_CONFIG_NODE_LIST ||
+	       key == VCMMD_VE_CONFIG_CPU_LIST;
+}
+
+/*
+ * Set @key in @config, replacing the value if it is already there.
+ */
+static bool config_set(struct vcmmd_ve_config *config, int key,
+		       uint64_t value, const char *str)
+{
+	struct vcmmd_ve_config_entry *entry;
+	unsigned int i;
+
+	for (i = 0; i < config->nr_entries; i++) {
+		entry = &config->entries[i];
+		if (entry->key != key)
+			continue;
+		free(entry->str);
+		entry->value = value;
+		entry->str = strdup(str ? str : "");
+		return entry->str != NULL;
+	}
+
+	if (is_string_key(key))
+		return vcmmd_ve_config_append_string(config, key, str);
+	return vcmmd_ve_config_append(config, key, value);
+}
+
+static void config_merge(struct vcmmd_ve_config *dst,
+			 const struct vcmmd_ve_config *src)
+{
+	const struct vcmmd_ve_config_entry *entry;
+	unsigned int i;
+
+	for (i = 0; i < src->nr_entries; i++) {
+		entry = &src->entries[i];
+		config_set(dst, entry->key, entry->value, entry->str);
+	}
+}
+
+/*
+ * Parse a config in (q, t, s) encoding
+ */
+static int read_config(DBusMessageIter *iter, struct vcmmd_ve_config *config)
+{
+	DBusMessageIter array, item;
+	dbus_uint16_t key;
+	dbus_uint64_t value;
+	const char *str;
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
+		return VCMMD_ERROR_INVALID_VE_CONFIG;
+
+	dbus_message_iter_recurse(iter, &array);
+	while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+		dbus_message_iter_recurse(&array, &item);
+		if (dbus_message_iter_get_arg_type(&item) != DBUS_TYPE_UINT16)
+			return VCMMD_ERROR_INVALID_VE_CONFIG;
+		dbus_message_iter_get_basic(&item, &key);
+		if (!dbus_message_iter_next(&item) ||
+		    dbus_message_iter_get_arg_type(&item) != DBUS_TYPE_UINT64)
+			return VCMMD_ERROR_INVALID_VE_CONFIG;
+		dbus_message_iter_get_basic(&item, &value);
+		if (!dbus_message_iter_next(&item) ||
+		    dbus_message_iter_get_arg_type(&item) != DBUS_TYPE_STRING)
+			return VCMMD_ERROR_INVALID_VE_CONFIG;
+		dbus_message_iter_get_basic(&item, &str);
+
+		if (key >= __NR_VCMMD_VE_CONFIG_KEYS ||
+		    !config_set(config, key, value, str))
+			return VCMMD_ERROR_INVALID_VE_CONFIG;
+		dbus_message_iter_next(&array);
+	}
+	dbus_message_iter_next(iter);
+	return 0;
+}
+
+/*
+ * Parse a config in compact encoding: (t mask, at values, a(qs) strings)
+ */
+static int read_config_compact(DBusMessageIter *iter,
+			       struct vcmmd_ve_config *config)
+{
+	DBusMessageIter st, array, item;
+	dbus_uint64_t mask;
+	const dbus_uint64_t *values;
+	dbus_uint16_t key;
+	const char *str;
+	int nr_values, i, k;
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRUCT)
+		return VCMMD_ERROR_INVALID_VE_CONFIG;
+	dbus_message_iter_recurse(iter, &st);
+	if (dbus_message_iter_get_arg_type(&st) != DBUS_TYPE_UINT64)
+		return VCMMD_ERROR_INVALID_VE_CONFIG;
+	dbus_message_iter_get_basic(&st, &mask);
+	if (mask >> __NR_VCMMD_VE_CONFIG_KEYS)
+		return VCMMD_ERROR_INVALID_VE_CONFIG;
+
+	if (!dbus_message_iter_next(&st) ||
+	    dbus_message_iter_get_arg_type(&st) != DBUS_TYPE_ARRAY)
+		return VCMMD_ERROR_INVALID_VE_CONFIG;
+	dbus_message_iter_recurse(&st, &array);
+	dbus_message_iter_get_fixed_array(&array, &values, &nr_values);
+
+	for (k = 0, i = 0; k < __NR_VCMMD_VE_CONFIG_KEYS; k++) {
+		if (!(mask & (1ULL << k)))
+			continue;
+		if (i >= nr_values || !config_set(config, k, values[i++], NULL))
+			return VCMMD_ERROR_INVALID_VE_CONFIG;
+	}
+	if (i != nr_values)
+		return VCMMD_ERROR_INVALID_VE_CONFIG;
+
+	if (!dbus_message_iter_next(&st) ||
+	    dbus_message_iter_get_arg_type(&st) != DBUS_TYPE_ARRAY)
+		return VCMMD_ERROR_INVALID_VE_CONFIG;
+	dbus_message_iter_recurse(&st, &array);
+	while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+		dbus_message_iter_recurse(&array, &item);
+		dbus_message_iter_get_basic(&item, &key);
+		dbus_message_iter_next(&item);
+		dbus_message_iter_get_basic(&item, &str);
+		if (!is_string_key(key) || !config_set(config, key, 0, str))
+			return VCMMD_ERROR_INVALID_VE_CONFIG;
+		dbus_message_iter_next(&array);
+	}
+	dbus_message_iter_next(iter);
+	return 0;
+}
+
+/*
+ * Parse the request flags following the config, if any
+ */
+static dbus_uint32_t read_flags(DBusMessageIter *iter)
+{
+	dbus_uint32_t flags = 0;
+
+	if (dbus_message_iter_get_arg_type(iter) == DBUS_TYPE_UINT32)
+		dbus_message_iter_get_basic(iter, &flags);
+	return flags;
+}
+
+static bool config_is_valid(const struct vcmmd_ve_config *config)
+{
+	uint64_t guarantee, limit;
+
+	if (vcmmd_ve_config_extract(config, VCMMD_VE_CONFIG_GUARANTEE,
+				    &guarantee) &&
+	    vcmmd_ve_config_extract(config, VCMMD_VE_CONFIG_LIMIT, &limit) &&
+	    limit < guarantee)
+		return false;
+	return true;
+}
+
+static uint64_t sum_guarantees(const struct ve *except)
+{
+	uint64_t sum = 0;
+	struct ve *ve;
+
+	for (ve = ves; ve; ve = ve->next)
+		if (ve != except)
+			sum += config_value(&ve->config,
+					    VCMMD_VE_CONFIG_GUARANTEE, 0);
+	return sum;
+}
+
+/*
+ * Nodes the VE is pinned to, as a mask, or 0 if it is not pinned or nodes are
+ * not modelled
+ */
+static uint64_t ve_nodes(const struct vcmmd_ve_config *config)
+{
+	unsigned long first, last;
+	uint64_t mask = 0;
+	const char *str;
+	char *end;
+
+	if (!opts.nr_nodes ||
+	    !vcmmd_ve_config_extract_string(config, VCMMD_VE_CONFIG_NODE_LIST,
+					    &str))
+		return 0;
+
+	while (*str) {
+		first = last = strtoul(str, &end, 10);
+		if (end == str)
+			return 0;
+		if (*end == '-') {
+			str = end + 1;
+			last = strtoul(str, &end, 10);
+			if (end == str)
+				return 0;
+		}
+		for (; first <= last && first < opts.nr_nodes; first++)
+			mask |= 1ULL << first;
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return 0;
+		str = end;
+	}
+	return mask;
+}
+
+static uint64_t sum_reserved(const struct reservation *except)
+{
+	const struct reservation *res;
+	uint64_t sum = 0;
+
+	for (res = reservations; res; res = res->next)
+		if (res != except)
+			sum += res->bytes;
+	return sum;
+}
+
+/*
+ * Guarantees committed on @node by pinned VEs other than @except, and by
+ * reservations on nodes other than @except_res
+ */
+static uint64_t node_committed(const struct ve *except,
+			       const struct reservation *except_res,
+			       unsigned int node)
+{
+	const struct reservation *res;
+	uint64_t sum = 0, nodes;
+	struct ve *ve;
+
+	for (ve = ves; ve; ve = ve->next) {
+		nodes = ve_nodes(&ve->config);
+		if (ve == except || !(nodes & (1ULL << node)))
+			continue;
+		sum += config_value(&ve->config, VCMMD_VE_CONFIG_GUARANTEE, 0) /
+		       __builtin_popcountll(nodes);
+	}
+	for (res = reservations; res; res = res->next) {
+		if (res == except_res || !(res->nodes & (1ULL << node)))
+			continue;
+		sum += res->bytes / __builtin_popcountll(res->nodes);
+	}
+	return sum;
+}
+
+/*
+ * Bytes @need lacks to fit in @avail with @used taken
+ */
+static uint64_t missing(uint64_t avail, uint64_t used, uint64_t need)
+{
+	if (used >= avail)
+		return need;
+	return need > avail - used ? need - (avail - used) : 0;
+}
+
+/*
+ * Whether the guarantee of @config fits in place of VE @except, or of
+ * reservation @except_res. If not, @shortfall tells why.
+ */
+static bool guarantee_fits(const struct ve *except,
+			   const struct reservation *except_res,
+			   const struct vcmmd_ve_config *config,
+			   struct vcmmd_shortfall *shortfall)
+{
+	uint64_t guarantee = config_value(config, VCMMD_VE_CONFIG_GUARANTEE, 0);
+	uint64_t nodes = ve_nodes(config);
+	uint64_t share, node_mem, miss, worst = 0;
+	unsigned int n;
+
+	memset(shortfall, 0, sizeof(*shortfall));
+
+	miss = missing(opts.host_mem,
+		       sum_guarantees(except) + sum_reserved(except_res),
+		       guarantee);
+	if (miss) {
+		shortfall->resource = VCMMD_RESOURCE_HOST_MEMORY;
+		shortfall->missing = miss;
+		return false;
+	}
+	if (!nodes)
+		return true;
+
+	share = guarantee / __builtin_popcountll(nodes);
+	node_mem = opts.host_mem / opts.nr_nodes;
+	for (n = 0; n < opts.nr_nodes; n++) {
+		if (!(nodes & (1ULL << n)))
+			continue;
+		miss = missing(node_mem, node_committed(except, except_res, n),
+			       share);
+		shortfall->node_missing[n] = miss;
+		if (miss > worst)
+			worst = miss;
+	}
+	if (!worst)
+		return true;
+
+	shortfall->resource = VCMMD_RESOURCE_NODE_MEMORY;
+	shortfall->missing = worst * __builtin_popcountll(nodes);
+	return false;
+}
+
+static struct reservation **find_reservation(uint64_t token)
+{
+	struct reservation **p;
+
+	for (p = &reservations; *p; p = &(*p)->next)
+		if ((*p)->token == token)
+			break;
+	return p;
+}
+
+static void drop_reservation(struct reservation **p)
+{
+	struct reservation *res = *p;
+
+	*p = res->next;
+	free(res);
+	generation++;
+}
+
+static void expire_reservations(void)
+{
+	struct reservation **p = &reservations;
+	uint64_t now = now_ns();
+
+	while (*p) {
+		if ((*p)->expires_ns <= now)
+			drop_reservation(p);
+		else
+			p = &(*p)->next;
+	}
+}
+
+/*
+ * Register VE, into reservation @res unless it is NULL
+ */
+static int do_register(const char *name, dbus_int32_t type,
+		       struct vcmmd_ve_config *config, dbus_uint32_t flags,
+		       struct reservation **res,
+		       struct vcmmd_shortfall *shortfall)
+{
+	struct ve *ve;
+
+	if (!*name)
+		return VCMMD_ERROR_INVALID_VE_NAME;
+	if (type < VCMMD_VE_CT || type > VCMMD_VE_SERVICE)
+		return VCMMD_ERROR_INVALID_VE_TYPE;
+	if (!config_is_valid(config))
+		return VCMMD_ERROR_INVALID_VE_CONFIG;
+	if (find_ve(name))
+		return VCMMD_ERROR_VE_NAME_ALREADY_IN_USE;
+	if (res && !*res)
+		return VCMMD_ERROR_RESERVATION_NOT_FOUND;
+	if (!guarantee_fits(NULL, res ? *res : NULL, config, shortfall))
+		return VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE;
+	if (flags & VCMMD_FLAG_DRY_RUN)
+		return 0;
+
+	ve = calloc(1, sizeof(*ve) + strlen(name) + 1);
+	if (!ve)
+		return VCMMD_ERROR_VE_OPERATION_FAILED;
+	strcpy(ve->name, name);
+	ve->id = ++last_id;
+	ve->type = type;
+	ve->config = *config;
+	vcmmd_ve_config_init(config);
+	ve->next = ves;
+	ves = ve;
+	generation++;
+	if (res)
+		drop_reservation(res);
+	return 0;
+}
+
+static int do_reserve(uint64_t bytes, const char *nodes, uint32_t ttl_ms,
+		      uint64_t *token)
+{
+	struct vcmmd_shortfall shortfall;
+	struct vcmmd_ve_config config;
+	struct reservation *res;
+	uint64_t mask;
+	int err = 0;
+
+	vcmmd_ve_config_init(&config);
+	if (!config_set(&config, VCMMD_VE_CONFIG_GUARANTEE, bytes, NULL) ||
+	    (*nodes && !config_set(&config, VCMMD_VE_CONFIG_NODE_LIST, 0,
+				   nodes))) {
+		vcmmd_ve_config_deinit(&config);
+		return VCMMD_ERROR_VE_OPERATION_FAILED;
+	}
+	mask = ve_nodes(&config);
+	if (!ttl_ms || (*nodes && opts.nr_nodes && !mask))
+		err = VCMMD_ERROR_INVALID_VE_CONFIG;
+	else if (!guarantee_fits(NULL, NULL, &config, &shortfall))
+		err = VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE;
+	vcmmd_ve_config_deinit(&config);
+	if (err)
+		return err;
+
+	res = calloc(1, sizeof(*res));
+	if (!res)
+		return VCMMD_ERROR_VE_OPERATION_FAILED;
+	res->token = ++last_token;
+	res->bytes = bytes;
+	res->nodes = mask;
+	res->expires_ns = now_ns() + ttl_ms * 1000000ULL;
+	res->next = reservations;
+	reservations = res;
+	generation++;
+	*token = res->token;
+	return 0;
+}
+
+static int do_unreserve(uint64_t token)
+{
+	struct reservation **res = find_reservation(token);
+
+	if (!*res)
+		return VCMMD_ERROR_RESERVATION_NOT_FOUND;
+	drop_reservation(res);
+	return 0;
+}
+
+/*
+ * Register with the largest guarantee of @range that fits, coming down by the
+ * shortfall until it does
+ */
+static int do_register_range(const char *name, dbus_int32_t type,
+			     struct vcmmd_ve_config *config,
+			     const struct vcmmd_ve_range *range,
+			     dbus_uint32_t flags,
+			     uint64_t *guarantee, uint64_t *limit)
+{
+	struct vcmmd_shortfall shortfall;
+	uint64_t g, l;
+
+	if (range->guarantee_min > range->guarantee_max ||
+	    range->limit_min > range->limit_max ||
+	    range->guarantee_min > range->limit_max)
+		return VCMMD_ERROR_INVALID_VE_CONFIG;
+
+	l = __vcmmd_range_limit(range, opts.host_mem);
+	g = range->guarantee_max < l ? range->guarantee_max : l;
+	if (g < range->guarantee_min)
+		return VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE;
+
+	for (;;) {
+		if (!config_set(config, VCMMD_VE_CONFIG_GUARANTEE, g, NULL) ||
+		    !config_set(config, VCMMD_VE_CONFIG_LIMIT, l, NULL))
+			return VCMMD_ERROR_VE_OPERATION_FAILED;
+		if (guarantee_fits(NULL, NULL, config, &shortfall))
+			break;
+		/* Rounding over nodes may leave it a few bytes short */
+		if (!shortfall.missing)
+			shortfall.missing = 1;
+		if (g - range->guarantee_min < shortfall.missing)
+			return VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE;
+		g -= shortfall.missing;
+	}
+
+	*guarantee = g;
+	*limit = l;
+	return do_register(name, type, config, flags, NULL, &shortfall);
+}
+
+static int do_update(const char *name, struct vcmmd_ve_config *config,
+		     dbus_uint32_t flags, struct vcmmd_shortfall *shortfall)
+{
+	struct vcmmd_ve_config merged;
+	struct ve *ve = find_ve(name);
+	int err = 0;
+
+	if (!ve)
+		return VCMMD_ERROR_VE_NOT_REGISTERED;
+	if (!ve->active)
+		return VCMMD_ERROR_VE_NOT_ACTIVE;
+
+	vcmmd_ve_config_init(&merged);
+	config_merge(&merged, &ve->config);
+	config_merge(&merged, config);
+
+	if (!config_is_valid(&merged))
+		err = VCMMD_ERROR_INVALID_VE_CONFIG;
+	else if (!guarantee_fits(ve, NULL, &merged, shortfall))
+		err = VCMMD_ERROR_UNABLE_APPLY_VE_GUARANTEE;
+
+	if (err || (flags & VCMMD_FLAG_DRY_RUN)) {
+		vcmmd_ve_config_deinit(&merged);
+		return err;
+	}
+
+	vcmmd_ve_config_deinit(&ve->config);
+	ve->config = merged;
+	generation++;
+	return 0;
+}
+
+static int do_activate(const char *name)
+{
+	struct ve *ve = find_ve(name);
+
+	if (!ve)
+		return VCMMD_ERROR_VE_NOT_REGISTERED;
+	if (ve->active)
+		return VCMMD_ERROR_VE_ALREADY_ACTIVE;
+	ve->active = true;
+	return 0;
+}
+
+static int do_deactivate(const char *name)
+{
+	struct ve *ve = find_ve(name);
+
+	if (!ve)
+		return VCMMD_ERROR_VE_NOT_REGISTERED;
+	if (!ve->active)
+		return VCMMD_ERROR_VE_NOT_ACTIVE;
+	ve->active = false;
+	return 0;
+}
+
+static int do_unregister(const char *name)
+{
+	struct ve **p, *ve;
+
+	for (p = &ves; *p; p = &(*p)->next)
+		if (!strcmp((*p)->name, name))
+			break;
+	ve = *p;
+	if (!ve)
+		return VCMMD_ERROR_VE_NOT_REGISTERED;
+
+	*p = ve->next;
+	vcmmd_ve_config_deinit(&ve->config);
+	free(ve);
+	generation++;
+	return 0;
+}
+
+static int do_switch_policy(const char *name)
+{
+	if (!*name || strlen(name) >= sizeof(policy))
+		return VCMMD_ERROR_POLICY_SET_INVALID_NAME;
+	strcpy(policy, name);
+	return 0;
+}
+
+static bool append_config(DBusMessageIter *iter,
+			  const struct vcmmd_ve_config *config)
+{
+	DBusMessageIter array, item;
+	unsigned int i;
+
+	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "(qts)",
+					      &array))
+		return false;
+
+	for (i = 0; config && i < config->nr_entries; i++) {
+		const struct vcmmd_ve_config_entry *entry = &config->entries[i];
+		dbus_uint16_t key = entry->key;
+		dbus_uint64_t value = entry->value;
+		const char *str = entry->str ? entry->str : "";
+
+		if (!dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT,
+						      NULL, &item) ||
+		    !dbus_message_iter_append_basic(&item, DBUS_TYPE_UINT16,
+						    &key) ||
+		    !dbus_message_iter_append_basic(&item, DBUS_TYPE_UINT64,
+						    &value) ||
+		    !dbus_message_iter_append_basic(&item, DBUS_TYPE_STRING,
+						    &str) ||
+		    !dbus_message_iter_close_container(&array, &item))
+			return false;
+	}
+
+	return dbus_message_iter_close_container(iter, &array);
+}
+
+static DBusMessage *reply_int(DBusMessage *msg, dbus_int32_t err)
+{
+	DBusMessage *reply = dbus_message_new_method_return(msg);
+
+	if (reply)
+		dbus_message_append_args(reply, DBUS_TYPE_INT32, &err,
+					 DBUS_TYPE_INVALID);
+	return reply;
+}
+
+/*
+ * Append the shortfall of a RegisterVEEx or UpdateVEEx reply: u resource,
+ * t missing bytes, a(qt) bytes missing on each node
+ */
+static bool append_shortfall(DBusMessageIter *iter,
+			     const struct vcmmd_shortfall *shortfall)
+{
+	DBusMessageIter array, item;
+	dbus_uint32_t resource = shortfall->resource;
+	dbus_uint64_t miss = shortfall->missing;
+	dbus_uint16_t node;
+
+	if (!dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT32,
+					    &resource) ||
+	    !dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT64, &miss) ||
+	    !dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "(qt)",
+					      &array))
+		return false;
+
+	for (node = 0; node < VCMMD_SHORTFALL_MAX_NODES; node++) {
+		miss = shortfall->node_missing[node];
+		if (!miss)
+			continue;
+		if (!dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT,
+						      NULL, &item) ||
+		    !dbus_message_iter_append_basic(&item, DBUS_TYPE_UINT16,
+						    &node) ||
+		    !dbus_message_iter_append_basic(&item, DBUS_TYPE_UINT64,
+						    &miss) ||
+		    !dbus_message_iter_close_container(&array, &item))
+			return false;
+	}
+
+	return dbus_message_iter_close_container(iter, &array);
+}
+
+static DBusMessage *reply_invalid_args(DBusMessage *msg)
+{
+	return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS,
+				      "Invalid arguments");
+}
+
+/*
+ * Build the reply for a method carrying a VE name, or its ID if @by_id, as
+ * its first argument and returning an error code first.
+ */
+static DBusMessage *handle_ve_method(DBusMessage *msg, const char *method,
+				     bool by_id, int injected)
+{
+	struct vcmmd_shortfall shortfall = { 0 };
+	struct vcmmd_ve_config config;
+	DBusMessageIter args, array;
+	DBusMessage *reply;
+	const char *name;
+	dbus_int32_t type, err = 0;
+	dbus_bool_t active = FALSE;
+	dbus_uint64_t id;
+	struct ve *ve;
+
+	if (!dbus_message_iter_init(msg, &args) ||
+	    dbus_message_iter_get_arg_type(&args) !=
+	    (by_id ? DBUS_TYPE_UINT64 : DBUS_TYPE_STRING))
+		return reply_invalid_args(msg);
+	if (by_id) {
+		dbus_message_iter_get_basic(&args, &id);
+		ve = find_ve_by_id(id);
+		/* No VE has an empty name */
+		name = ve ? ve->name : "";
+	} else
+		dbus_message_iter_get_basic(&args, &name);
+	dbus_message_iter_next(&args);
+
+	vcmmd_ve_config_init(&config);
+
+	/* RegisterVE, RegisterVE2, RegisterVEEx */
+	if (!strncmp(method, "RegisterVE", 10)) {
+		if (dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_INT32) {
+			reply = reply_invalid_args(msg);
+			goto out;
+		}
+		dbus_message_iter_get_basic(&args, &type);
+		dbus_message_iter_next(&args);
+		err = method[10] ? read_config_compact(&args, &config) :
+				   read_config(&args, &config);
+		if (!err && !injected)
+			err = do_register(name, type, &config,
+					  read_flags(&args), NULL, &shortfall);
+	} else if (!strncmp(method, "UpdateVE", 8)) {
+		err = method[8] ? read_config_compact(&args, &config) :
+				  read_config(&args, &config);
+		if (!err && !injected)
+			err = do_update(name, &config, read_flags(&args),
+					&shortfall);
+	} else if (!injected) {
+		if (!strcmp(method, "ActivateVE"))
+			err = do_activate(name);
+		else if (!strcmp(method, "DeactivateVE"))
+			err = do_deactivate(name);
+		else if (!strcmp(method, "UnregisterVE"))
+			err = do_unregister(name);
+		else if (!strcmp(method, "GetVEConfig") ||
+			 !strcmp(method, "IsVEActive")) {
+			ve = find_ve(name);
+			if (!ve)
+				err = VCMMD_ERROR_VE_NOT_REGISTERED;
+			else
+				active = ve->active;
+		}
+	}
+	if (injected)
+		err = injected;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		goto out;
+	dbus_message_iter_init_append(reply, &array);
+	dbus_message_iter_append_basic(&array, DBUS_TYPE_INT32, &err);
+	if (!strcmp(method, "GetVEConfig")) {
+		ve = err ? NULL : find_ve(name);
+		append_config(&array, ve ? &ve->config : NULL);
+	} else if (!strcmp(method, "IsVEActive"))
+		dbus_message_iter_append_basic(&array, DBUS_TYPE_BOOLEAN,
+					       &active);
+	else if (!strcmp(method, "RegisterVEEx") ||
+		 !strcmp(method, "UpdateVEEx"))
+		append_shortfall(&array, &shortfall);
+out:
+	vcmmd_ve_config_deinit(&config);
+	return reply;
+}
+
+static bool should_inject(const char *method)
+{
+	if (!opts.error || opts.error_rate <= 0)
+		return false;
+	if (opts.error_method && strcmp(opts.error_method, method))
+		return false;
+	return drand48() < opts.error_rate;
+}
+
+/* Methods taking a VE ID, and the ones they stand for */
+static const struct {
+	const char *by_id;
+	const char *method;
+} by_id_methods[] = {
+	{ "ActivateVEById",	"ActivateVE" },
+	{ "UpdateVEById",	"UpdateVE2" },
+	{ "DeactivateVEById",	"DeactivateVE" },
+	{ "GetVEConfigById",	"GetVEConfig" },
+	{ "IsVEActiveById",	"IsVEActive" },
+};
+
+static DBusMessage *handle_open_ve(DBusMessage *msg, int injected)
+{
+	DBusMessage *reply;
+	const char *name;
+	dbus_int32_t err = 0;
+	dbus_uint64_t id = 0;
+	struct ve *ve;
+
+	if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &name,
+				   DBUS_TYPE_INVALID))
+		return reply_invalid_args(msg);
+
+	ve = find_ve(name);
+	if (injected)
+		err = injected;
+	else if (!ve)
+		err = VCMMD_ERROR_VE_NOT_REGISTERED;
+	else
+		id = ve->id;
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply)
+		dbus_message_append_args(reply, DBUS_TYPE_INT32, &err,
+					 DBUS_TYPE_UINT64, &id,
+					 DBUS_TYPE_INVALID);
+	return reply;
+}
+
+static DBusMessage *handle_register_ve_range(DBusMessage *msg, int injected)
+{
+	struct vcmmd_ve_config config;
+	struct vcmmd_ve_range range;
+	DBusMessageIter args;
+	DBusMessage *reply;
+	const char *name;
+	dbus_int32_t type, err;
+	dbus_uint64_t bounds[4], guarantee, limit;
+	uint64_t g = 0, l = 0;
+	unsigned int i;
+
+	if (!dbus_message_iter_init(msg, &args) ||
+	    dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_STRING)
+		return reply_invalid_args(msg);
+	dbus_message_iter_get_basic(&args, &name);
+	if (!dbus_message_iter_next(&args) ||
+	    dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_INT32)
+		return reply_invalid_args(msg);
+	dbus_message_iter_get_basic(&args, &type);
+	dbus_message_iter_next(&args);
+
+	vcmmd_ve_config_init(&config);
+	err = read_config_compact(&args, &config);
+	for (i = 0; !err && i < 4; i++) {
+		if (dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_UINT64) {
+			vcmmd_ve_config_deinit(&config);
+			return reply_invalid_args(msg);
+		}
+		dbus_message_iter_get_basic(&args, &bounds[i]);
+		dbus_message_iter_next(&args);
+	}
+	range.guarantee_min = bounds[0];
+	range.guarantee_max = bounds[1];
+	range.limit_min = bounds[2];
+	range.limit_max = bounds[3];
+
+	if (injected)
+		err = injected;
+	else if (!err)
+		err = do_register_range(name, type, &config, &range,
+					read_flags(&args), &g, &l);
+	vcmmd_ve_config_deinit(&config);
+	guarantee = err ? 0 : g;
+	limit = err ? 0 : l;
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply)
+		dbus_message_append_args(reply, DBUS_TYPE_INT32, &err,
+					 DBUS_TYPE_UINT64, &guarantee,
+					 DBUS_TYPE_UINT64, &limit,
+					 DBUS_TYPE_INVALID);
+	return reply;
+}
+
+static DBusMessage *handle_reserve(DBusMessage *msg, int injected)
+{
+	DBusMessage *reply;
+	const char *nodes;
+	dbus_uint64_t bytes, token = 0;
+	dbus_uint32_t ttl_ms;
+	dbus_int32_t err;
+	uint64_t t;
+
+	if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_UINT64, &bytes,
+				   DBUS_TYPE_STRING, &nodes,
+				   DBUS_TYPE_UINT32, &ttl_ms,
+				   DBUS_TYPE_INVALID))
+		return reply_invalid_args(msg);
+
+	err = injected ? injected : do_reserve(bytes, nodes, ttl_ms, &t);
+	if (!err)
+		token = t;
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply)
+		dbus_message_append_args(reply, DBUS_TYPE_INT32, &err,
+					 DBUS_TYPE_UINT64, &token,
+					 DBUS_TYPE_INVALID);
+	return reply;
+}
+
+static DBusMessage *handle_unreserve(DBusMessage *msg, int injected)
+{
+	dbus_uint64_t token;
+
+	if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_UINT64, &token,
+				   DBUS_TYPE_INVALID))
+		return reply_invalid_args(msg);
+	return reply_int(msg, injected ? injected : do_unreserve(token));
+}
+
+static DBusMessage *handle_register_ve_reserved(DBusMessage *msg,
+						int injected)
+{
+	struct vcmmd_shortfall shortfall;
+	struct vcmmd_ve_config config;
+	DBusMessageIter args;
+	const char *name;
+	dbus_int32_t type, err;
+	dbus_uint64_t token;
+
+	if (!dbus_message_iter_init(msg, &args) ||
+	    dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_STRING)
+		return reply_invalid_args(msg);
+	dbus_message_iter_get_basic(&args, &name);
+	if (!dbus_message_iter_next(&args) ||
+	    dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_INT32)
+		return reply_invalid_args(msg);
+	dbus_message_iter_get_basic(&args, &type);
+	dbus_message_iter_next(&args);
+
+	vcmmd_ve_config_init(&config);
+	err = read_config_compact(&args, &config);
+	if (!err && dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_UINT64) {
+		vcmmd_ve_config_deinit(&config);
+		return reply_invalid_args(msg);
+	}
+
+	if (injected)
+		err = injected;
+	else if (!err) {
+		dbus_message_iter_get_basic(&args, &token);
+		dbus_message_iter_next(&args);
+		err = do_register(name, type, &config, read_flags(&args),
+				  find_reservation(token), &shortfall);
+	}
+	vcmmd_ve_config_deinit(&config);
+	return reply_int(msg, err);
+}
+
+static DBusMessage *handle_get_host_capacity(DBusMessage *msg, int injected)
+{
+	DBusMessage *reply;
+	dbus_int32_t err = injected;
+	dbus_uint64_t total = opts.host_mem, guaranteed = sum_guarantees(NULL);
+	dbus_uint64_t reserved = sum_reserved(NULL), available;
+	dbus_uint64_t used = guaranteed + reserved, gen = generation;
+
+	available = total > used ? total - used : 0;
+	reply = dbus_message_new_method_return(msg);
+	if (reply)
+		dbus_message_append_args(reply, DBUS_TYPE_INT32, &err,
+					 DBUS_TYPE_UINT64, &total,
+					 DBUS_TYPE_UINT64, &guaranteed,
+					 DBUS_TYPE_UINT64, &reserved,
+					 DBUS_TYPE_UINT64, &available,
+					 DBUS_TYPE_UINT64, &gen,
+					 DBUS_TYPE_INVALID);
+	return reply;
+}
+
+/*
+ * Reply i error, a(qtt) total and committed memory of each node, none if
+ * nodes are not modelled
+ */
+static DBusMessage *handle_get_node_capacity(DBusMessage *msg, int injected)
+{
+	DBusMessageIter iter, array, item;
+	DBusMessage *reply;
+	dbus_int32_t err = injected;
+	dbus_uint64_t total, committed;
+	dbus_uint16_t node;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+	if (!dbus_message_iter_append_basic(&iter, DBUS_TYPE_INT32, &err) ||
+	    !dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(qtt)",
+					      &array))
+		goto fail;
+
+	for (node = 0; !err && node < opts.nr_nodes; node++) {
+		total = opts.host_mem / opts.nr_nodes;
+		committed = node_committed(NULL, NULL, node);
+		if (!dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT,
+						      NULL, &item) ||
+		    !dbus_message_iter_append_basic(&item, DBUS_TYPE_UINT16,
+						    &node) ||
+		    !dbus_message_iter_append_basic(&item, DBUS_TYPE_UINT64,
+						    &total) ||
+		    !dbus_message_iter_append_basic(&item, DBUS_TYPE_UINT64,
+						    &committed) ||
+		    !dbus_message_iter_close_container(&array, &item))
+			goto fail;
+	}
+
+	if (dbus_message_iter_close_container(&iter, &array))
+		return reply;
+fail:
+	dbus_message_unref(reply);
+	return NULL;
+}
+
+static DBusMessage *handle_method(DBusMessage *msg)
+{
+	const char *method = dbus_message_get_member(msg);
+	const char *str;
+	int injected = 0;
+	unsigned int i;
+
+	if (should_inject(method))
+		injected = opts.error;
+
+	expire_reservations();
+
+	if (!strcmp(method, "GetFeatures")) {
+		DBusMessage *reply = dbus_message_new_method_return(msg);
+
+		if (reply)
+			dbus_message_append_args(reply,
+						 DBUS_TYPE_UINT64, &opts.features,
+						 DBUS_TYPE_INVALID);
+		return reply;
+	}
+
+	if (!strcmp(method, "GetCurrentPolicy") ||
+	    !strcmp(method, "GetPolicyFromFile")) {
+		DBusMessage *reply = dbus_message_new_method_return(msg);
+
+		str = policy;
+		if (reply)
+			dbus_message_append_args(reply,
+						 DBUS_TYPE_STRING, &str,
+						 DBUS_TYPE_INVALID);
+		return reply;
+	}
+
+	if (!strcmp(method, "SwitchPolicy")) {
+		if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &str,
+					   DBUS_TYPE_INVALID))
+			return reply_invalid_args(msg);
+		return reply_int(msg, injected ? injected :
+					do_switch_policy(str));
+	}
+
+	if ((!strcmp(method, "RegisterVE2") || !strcmp(method, "UpdateVE2")) &&
+	    !(opts.features & VCMMD_FEATURE_COMPACT_CONFIG))
+		return NULL;
+
+	if ((!strcmp(method, "RegisterVEEx") || !strcmp(method, "UpdateVEEx")) &&
+	    !(opts.features & VCMMD_FEATURE_SHORTFALL))
+		return NULL;
+
+	if ((opts.features & VCMMD_FEATURE_VE_RANGE) &&
+	    !strcmp(method, "RegisterVERange"))
+		return handle_register_ve_range(msg, injected);
+
+	if ((opts.features & VCMMD_FEATURE_HOST_CAPACITY) &&
+	    !strcmp(method, "GetHostCapacity"))
+		return handle_get_host_capacity(msg, injected);
+
+	if ((opts.features & VCMMD_FEATURE_NODE_CAPACITY) &&
+	    !strcmp(method, "GetNodeCapacity"))
+		return handle_get_node_capacity(msg, injected);
+
+	if (opts.features & VCMMD_FEATURE_RESERVE) {
+		if (!strcmp(method, "Reserve"))
+			return handle_reserve(msg, injected);
+		if (!strcmp(method, "Unreserve"))
+			return handle_unreserve(msg, injected);
+		if (!strcmp(method, "RegisterVEReserved"))
+			return handle_register_ve_reserved(msg, injected);
+	}
+
+	if (opts.features & VCMMD_FEATURE_VE_IDS) {
+		if (!strcmp(method, "OpenVE"))
+			return handle_open_ve(msg, injected);
+		for (i = 0; i < sizeof(by_id_methods) / sizeof(by_id_methods[0]);
+		     i++)
+			if (!strcmp(method, by_id_methods[i].by_id))
+				return handle_ve_method(msg,
+						by_id_methods[i].method,
+						true, injected);
+	}
+
+	if (!strcmp(method, "RegisterVE") || !strcmp(method, "RegisterVE2") ||
+	    !strcmp(method, "RegisterVEEx") ||
+	    !strcmp(method, "UpdateVE") || !strcmp(method, "UpdateVE2") ||
+	    !strcmp(method, "UpdateVEEx") ||
+	    !strcmp(method, "ActivateVE") || !strcmp(method, "DeactivateVE") ||
+	    !strcmp(method, "UnregisterVE") || !strcmp(method, "GetVEConfig") ||
+	    !strcmp(method, "IsVEActive"))
+		return handle_ve_method(msg, method, false, injected);
+
+	return NULL;
+}
+
+static void queue_reply(DBusMessage *reply)
+{
+	struct pending_reply *r, **p;
+	uint64_t delay_ms = opts.latency_ms;
+
+	if (opts.jitter_ms)
+		delay_ms += lrand48() % (opts.jitter_ms + 1);
+
+	r = malloc(sizeof(*r));
+	if (!r) {
+		dbus_message_unref(reply);
+		return;
+	}
+	r->reply = reply;
+	r->due_ns = now_ns() + delay_ms * 1000000;
+
+	/* Keep the queue sorted by due time */
+	for (p = &pending; *p && (*p)->due_ns <= r->due_ns; p = &(*p)->next)
+		;
+	r->next = *p;
+	*p = r;
+	nr_pending++;
+}
+
+static void send_due_replies(DBusConnection *conn)
+{
+	struct pending_reply *r;
+	uint64_t now = now_ns();
+
+	while (pending && pending->due_ns <= now) {
+		r = pending;
+		pending = r->next;
+		nr_pending--;
+		dbus_connection_send(conn, r->reply, NULL);
+		dbus_message_unref(r->reply);
+		free(r);
+	}
+	dbus_connection_flush(conn);
+}
+
+static int next_timeout_ms(void)
+{
+	uint64_t now;
+
+	if (!pending)
+		return 100;
+	now = now_ns();
+	if (pending->due_ns <= now)
+		return 0;
+	return (pending->due_ns - now + 999999) / 1000000;
+}
+
+static void handle_message(DBusConnection *conn, DBusMessage *msg)
+{
+	char iface[256];
+	DBusMessage *reply;
+
+	if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+		return;
+
+	snprintf(iface, sizeof(iface), "%s.LoadManager", opts.bus_name);
+	if (!dbus_message_has_path(msg, "/LoadManager") ||
+	    !dbus_message_has_interface(msg, iface)) {
+		reply = dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD,
+					       "Unknown method");
+		goto send;
+	}
+
+	if (opts.verbose)
+		fprintf(stderr, "vcmmd-mockd: %s\n",
+			dbus_message_get_member(msg));
+
+	if (opts.max_pending && nr_pending >= opts.max_pending &&
+	    strcmp(dbus_message_get_member(msg), "GetFeatures")) {
+		reply = reply_int(msg, VCMMD_ERROR_TOO_MANY_REQUESTS);
+		goto send;
+	}
+
+	reply = handle_method(msg);
+	if (!reply)
+		reply = dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD,
+					       "Unknown method");
+	else if (opts.latency_ms || opts.jitter_ms) {
+		queue_reply(reply);
+		return;
+	}
+send:
+	if (reply) {
+		dbus_connection_send(conn, reply, NULL);
+		dbus_message_unref(reply);
+	}
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void usage(FILE *f)
+{
+	fprintf(f,
+"Usage: vcmmd-mockd [options]\n"
+"\n"
+"  -n NAME     bus name to own (default " DEFAULT_BUS_NAME ")\n"
+"  -l MS       reply latency in milliseconds\n"
+"  -j MS       random extra latency, up to MS milliseconds\n"
+"  -e CODE     error code to inject\n"
+"  -r RATE     fraction of requests failing with CODE, 0..1\n"
+"  -m METHOD   inject errors into METHOD only\n"
+"  -M BYTES    host memory available for guarantees\n"
+"  -N NODES    split host memory evenly over NODES NUMA nodes\n"
+"  -q N        reply %d when N replies are pending\n"
+"  -F MASK     features to advertise (default 0x%llx)\n"
+"  -v          log requests to stderr\n",
+		VCMMD_ERROR_TOO_MANY_REQUESTS,
+		(unsigned long long)(VCMMD_FEATURE_COMPACT_CONFIG |
+				     VCMMD_FEATURE_VE_IDS |
+				     VCMMD_FEATURE_HOST_CAPACITY |
+				     VCMMD_FEATURE_SHORTFALL |
+				     VCMMD_FEATURE_VE_RANGE |
+				     VCMMD_FEATURE_DRY_RUN |
+				     VCMMD_FEATURE_RESERVE |
+				     VCMMD_FEATURE_NODE_CAPACITY));
+}
+
+int main(int argc, char **argv)
+{
+	DBusConnection *conn;
+	DBusMessage *msg;
+	DBusError error;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "n:l:j:e:r:m:M:N:q:F:vh")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.bus_name = optarg;
+			break;
+		case 'l':
+			opts.latency_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			opts.jitter_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			opts.error = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			opts.error_rate = strtod(optarg, NULL);
+			break;
+		case 'm':
+			opts.error_method = optarg;
+			break;
+		case 'M':
+			opts.host_mem = strtoull(optarg, NULL, 0);
+			break;
+		case 'N':
+			opts.nr_nodes = strtoul(optarg, NULL, 0);
+			if (opts.nr_nodes > VCMMD_SHORTFALL_MAX_NODES)
+				opts.nr_nodes = VCMMD_SHORTFALL_MAX_NODES;
+			break;
+		case 'q':
+			opts.max_pending = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			opts.features = strtoull(optarg, NULL, 0);
+			break;
+		case 'v':
+			opts.verbose = true;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return 1;
+		}
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	srand48(getpid());
+	last_id = (uint64_t)lrand48() << 32;
+	last_token = (uint64_t)lrand48() << 32;
+
+	dbus_error_init(&error);
+	conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error);
+	if (!conn) {
+		fprintf(stderr, "vcmmd-mockd: %s\n", error.message);
+		return 1;
+	}
+
+	ret = dbus_bus_request_name(conn, opts.bus_name,
+				    DBUS_NAME_FLAG_DO_NOT_QUEUE, &error);
+	if (ret != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+		fprintf(stderr, "vcmmd-mockd: cannot own %s: %s\n",
+			opts.bus_name,
+			dbus_error_is_set(&error) ? error.message : "in use");
+		return 1;
+	}
+
+	while (!stop && dbus_connection_read_write(conn, next_timeout_ms())) {
+		while ((msg = dbus_connection_pop_message(conn))) {
+			handle_message(conn, msg);
+			dbus_message_unref(msg);
+		}
+		send_due_replies(conn);
+	}
+
+	dbus_connection_close(conn);
+	dbus_connection_unref(conn);
+	return 0;
+}
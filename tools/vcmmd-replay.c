@@ -0,0 +1,659 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * vcmmd-replay: re-issue calls captured with VCMMD_CAPTURE
+ *
+ * Reads a capture file and makes the same calls, with the same arguments, in
+ * the same order and from as many threads as the processes and threads that
+ * made them. Each call is issued when it was originally made, relative to the
+ * first one, with times divided by the speed factor; a speed of 0 issues
+ * every call as soon as the previous call of its thread is done. Calls are
+ * made through the library, so they go to whatever VCMMD or vcmmd-mockd is
+ * on the bus, or to the backend chosen with -b.
+ *
+ * Reservations cannot be replayed: the tokens of the captured run mean nothing
+ * to this one. Reserve, unreserve and registrations into a reservation are
+ * skipped and counted as such, and later calls for a VE that was to be
+ * registered into one will likely differ from the recorded ones.
+ *
+ * Reports, per call, latency percentiles as recorded and as replayed, how
+ * late calls were issued, how many were skipped, and how many results differ
+ * from the recorded ones. Output is JSON. With -d, prints the capture as text
+ * instead.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "vcmmd.h"
+#include "internal.h"
+
+#define POLICY_NAME_LEN		256
+
+struct samples {
+	uint64_t *ns;
+	size_t nr, size;
+};
+
+struct call {
+	const struct vcmmd_capture_record *rec;
+	char *name;
+	struct vcmmd_ve_config config;
+	struct vcmmd_ve_range range;
+};
+
+struct call_result {
+	struct samples recorded;
+	struct samples replayed;
+	struct samples late;
+	uint64_t errors;
+	uint64_t mismatches;
+	uint64_t skipped;
+};
+
+struct stream {
+	pthread_t thread;
+	uint32_t pid;
+	uint32_t tid;
+	struct call **calls;
+	size_t nr_calls, size;
+	struct call_result results[__NR_VCMMD_CALLS];
+};
+
+static struct {
+	double speed;
+	const char *prefix;
+	const char *backend;
+	const char *output;
+	bool dump;
+} opts = {
+	.speed = 1,
+	.prefix = "",
+};
+
+static struct call *calls;
+static size_t nr_calls;
+static struct stream *streams;
+static size_t nr_streams;
+static uint64_t first_start_ns;
+static uint64_t replay_start_ns;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr)
+		die("vcmmd-replay");
+	return ptr;
+}
+
+static void samples_add(struct samples *s, uint64_t ns)
+{
+	if (s->nr == s->size) {
+		s->size = s->size ? s->size * 2 : 256;
+		s->ns = xrealloc(s->ns, s->size * sizeof(*s->ns));
+	}
+	s->ns[s->nr++] = ns;
+}
+
+static void samples_merge(struct samples *dst, const struct samples *src)
+{
+	size_t i;
+
+	for (i = 0; i < src->nr; i++)
+		samples_add(dst, src->ns[i]);
+}
+
+static void samples_free(struct samples *s)
+{
+	free(s->ns);
+	memset(s, 0, sizeof(*s));
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct samples *s, double p)
+{
+	size_t i = (size_t)(p * s->nr);
+
+	if (!s->nr)
+		return 0;
+	if (i >= s->nr)
+		i = s->nr - 1;
+	return s->ns[i] / 1000.0;
+}
+
+static char *load_file(const char *path, size_t *len)
+{
+	size_t size = 1 << 20, n;
+	char *buf = NULL;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		die(path);
+
+	*len = 0;
+	do {
+		size *= 2;
+		buf = xrealloc(buf, size);
+		n = fread(buf + *len, 1, size - *len, f);
+		*len += n;
+	} while (*len == size);
+
+	if (ferror(f))
+		die(path);
+	fclose(f);
+	return buf;
+}
+
+static bool parse_config(const char **p, const char *end, unsigned int nr,
+			 struct vcmmd_ve_config *config)
+{
+	struct vcmmd_capture_entry e;
+	char *str;
+	bool ok;
+
+	vcmmd_ve_config_init(config);
+	while (nr--) {
+		if (end - *p < (ptrdiff_t)sizeof(e))
+			return false;
+		memcpy(&e, *p, sizeof(e));
+		*p += sizeof(e);
+		if (end - *p < e.str_len)
+			return false;
+		str = strndup(*p, e.str_len);
+		if (!str)
+			die("vcmmd-replay");
+		*p += e.str_len;
+
+		if (vcmmd_ve_config_entry_is_string(e.key))
+			ok = vcmmd_ve_config_append_string(config, e.key, str);
+		else
+			ok = vcmmd_ve_config_append(config, e.key, e.value);
+		free(str);
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+static bool parse_range(const char **p, const char *end, unsigned int call,
+			struct vcmmd_ve_range *range)
+{
+	struct vcmmd_capture_range r;
+
+	memset(range, 0, sizeof(*range));
+	if (call != VCMMD_CALL_REGISTER_VE_RANGE)
+		return true;
+	if (end - *p < (ptrdiff_t)sizeof(r))
+		return false;
+	memcpy(&r, *p, sizeof(r));
+	*p += sizeof(r);
+	range->guarantee_min = r.guarantee_min;
+	range->guarantee_max = r.guarantee_max;
+	range->limit_min = r.limit_min;
+	range->limit_max = r.limit_max;
+	return true;
+}
+
+static struct stream *get_stream(uint32_t pid, uint32_t tid)
+{
+	struct stream *s;
+	size_t i;
+
+	for (i = nr_streams; i-- > 0; )
+		if (streams[i].pid == pid && streams[i].tid == tid)
+			return &streams[i];
+
+	streams = xrealloc(streams, (nr_streams + 1) * sizeof(*streams));
+	s = &streams[nr_streams++];
+	memset(s, 0, sizeof(*s));
+	s->pid = pid;
+	s->tid = tid;
+	return s;
+}
+
+/*
+ * Parse capture @buf into calls[]. Records are kept in @buf.
+ */
+static void parse_capture(const char *path, const char *buf, size_t len)
+{
+	const struct vcmmd_capture_header *hdr = (const void *)buf;
+	const char *p = buf + sizeof(*hdr), *end = buf + len;
+	const struct vcmmd_capture_record *rec;
+	struct call *c;
+	size_t size = 0;
+
+	/* Version 1 is the same but for the calls it lacks */
+	if (len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, VCMMD_CAPTURE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version < 1 || hdr->version > VCMMD_CAPTURE_VERSION) {
+		fprintf(stderr, "%s: not a capture file\n", path);
+		exit(1);
+	}
+
+	while (p < end) {
+		rec = (const void *)p;
+		if (end - p < (ptrdiff_t)sizeof(*rec) ||
+		    rec->len < sizeof(*rec) + rec->name_len ||
+		    end - p < rec->len || rec->call >= __NR_VCMMD_CALLS)
+			break;
+
+		if (nr_calls == size) {
+			size = size ? size * 2 : 1024;
+			calls = xrealloc(calls, size * sizeof(*calls));
+		}
+		c = &calls[nr_calls];
+		c->rec = rec;
+		p += sizeof(*rec);
+		c->name = strndup(p, rec->name_len);
+		if (!c->name)
+			die("vcmmd-replay");
+		p += rec->name_len;
+		if (!parse_config(&p, (const char *)rec + rec->len,
+				  rec->nr_entries, &c->config) ||
+		    !parse_range(&p, (const char *)rec + rec->len, rec->call,
+				 &c->range)) {
+			vcmmd_ve_config_deinit(&c->config);
+			free(c->name);
+			break;
+		}
+		p = (const char *)rec + rec->len;
+
+		if (!nr_calls || rec->start_ns < first_start_ns)
+			first_start_ns = rec->start_ns;
+		nr_calls++;
+	}
+
+	if (p < end)
+		fprintf(stderr, "%s: truncated or corrupt record at offset %zu, "
+			"ignoring the rest\n", path, (size_t)(p - buf));
+}
+
+static void dump(FILE *f)
+{
+	const struct vcmmd_capture_record *rec;
+	const struct vcmmd_ve_config_entry *e;
+	size_t i;
+	unsigned int k;
+
+	for (i = 0; i < nr_calls; i++) {
+		rec = calls[i].rec;
+		fprintf(f, "t=%.6f pid=%u thread=%u call=%s name=%s type=%u "
+			"flags=0x%x duration_us=%llu retries=%u "
+			"reconnects=%u result=%d",
+			(rec->start_ns - first_start_ns) / 1e9, rec->pid,
+			rec->thread, vcmmd_call_name(rec->call),
+			*calls[i].name ? calls[i].name : "-", rec->ve_type,
+			rec->flags,
+			(unsigned long long)rec->duration_ns / 1000,
+			rec->retries, rec->reconnects, rec->result);
+		for (k = 0; k < calls[i].config.nr_entries; k++) {
+			e = &calls[i].config.entries[k];
+			if (vcmmd_ve_config_entry_is_string(e->key))
+				fprintf(f, " %u=%s", e->key, e->str);
+			else
+				fprintf(f, " %u=%llu", e->key,
+					(unsigned long long)e->value);
+		}
+		if (rec->call == VCMMD_CALL_REGISTER_VE_RANGE)
+			fprintf(f, " range=%llu-%llu,%llu-%llu",
+				(unsigned long long)calls[i].range.guarantee_min,
+				(unsigned long long)calls[i].range.guarantee_max,
+				(unsigned long long)calls[i].range.limit_min,
+				(unsigned long long)calls[i].range.limit_max);
+		fprintf(f, "\n");
+	}
+}
+
+/* Tokens of the captured run mean nothing to this one */
+static bool is_replayable(int call)
+{
+	return call != VCMMD_CALL_RESERVE &&
+	       call != VCMMD_CALL_UNRESERVE &&
+	       call != VCMMD_CALL_REGISTER_VE_RESERVED;
+}
+
+static int issue(const struct call *c, const char *name)
+{
+	const struct vcmmd_capture_record *rec = c->rec;
+	char policy[POLICY_NAME_LEN];
+	struct vcmmd_node_capacity nodes[VCMMD_MAX_NUMA_NODES];
+	struct vcmmd_host_capacity cap;
+	struct vcmmd_shortfall shortfall;
+	struct vcmmd_ve_config config;
+	vcmmd_ve_state_t state;
+	int err;
+
+	switch (rec->call) {
+	case VCMMD_CALL_REGISTER_VE:
+		return vcmmd_register_ve(name, rec->ve_type, &c->config,
+					 rec->flags);
+	case VCMMD_CALL_REGISTER_VE_EX:
+		return vcmmd_register_ve_ex(name, rec->ve_type, &c->config,
+					    rec->flags, &shortfall);
+	case VCMMD_CALL_REGISTER_VE_RANGE:
+		return vcmmd_register_ve_range(name, rec->ve_type, &c->config,
+					       &c->range, rec->flags,
+					       NULL, NULL);
+	case VCMMD_CALL_ACTIVATE_VE:
+		return vcmmd_activate_ve(name, rec->flags);
+	case VCMMD_CALL_UPDATE_VE:
+		return vcmmd_update_ve(name, &c->config, rec->flags);
+	case VCMMD_CALL_UPDATE_VE_EX:
+		return vcmmd_update_ve_ex(name, &c->config, rec->flags,
+					  &shortfall);
+	case VCMMD_CALL_DEACTIVATE_VE:
+		return vcmmd_deactivate_ve(name);
+	case VCMMD_CALL_UNREGISTER_VE:
+		return vcmmd_unregister_ve(name);
+	case VCMMD_CALL_GET_VE_CONFIG:
+		err = vcmmd_get_ve_config(name, &config);
+		if (!err)
+			vcmmd_ve_config_deinit(&config);
+		return err;
+	case VCMMD_CALL_GET_VE_STATE:
+		return vcmmd_get_ve_state(name, &state);
+	case VCMMD_CALL_GET_CURRENT_POLICY:
+		return vcmmd_get_current_policy(policy, sizeof(policy));
+	case VCMMD_CALL_GET_POLICY_FROM_FILE:
+		return vcmmd_get_policy_from_file(policy, sizeof(policy));
+	case VCMMD_CALL_SET_POLICY:
+		return vcmmd_set_policy(c->name);
+	case VCMMD_CALL_GET_HOST_CAPACITY:
+		return vcmmd_get_host_capacity(&cap);
+	case VCMMD_CALL_GET_NODE_CAPACITY:
+		return vcmmd_get_node_capacity(nodes, VCMMD_MAX_NUMA_NODES);
+	default:
+		/* Filtered out by is_replayable */
+		abort();
+	}
+}
+
+static bool is_ve_call(int call)
+{
+	return call != VCMMD_CALL_GET_CURRENT_POLICY &&
+	       call != VCMMD_CALL_GET_POLICY_FROM_FILE &&
+	       call != VCMMD_CALL_SET_POLICY &&
+	       call != VCMMD_CALL_GET_HOST_CAPACITY &&
+	       call != VCMMD_CALL_GET_NODE_CAPACITY &&
+	       call != VCMMD_CALL_RESERVE &&
+	       call != VCMMD_CALL_UNRESERVE;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static void *stream_fn(void *arg)
+{
+	struct stream *s = arg;
+	const struct vcmmd_capture_record *rec;
+	struct call_result *r;
+	uint64_t due, start;
+	char *name = NULL;
+	size_t i, len;
+	int err;
+
+	for (i = 0; i < s->nr_calls; i++) {
+		rec = s->calls[i]->rec;
+		r = &s->results[rec->call];
+		if (!is_replayable(rec->call)) {
+			r->skipped++;
+			continue;
+		}
+
+		len = strlen(opts.prefix) + strlen(s->calls[i]->name) + 1;
+		name = xrealloc(name, len);
+		snprintf(name, len, "%s%s",
+			 is_ve_call(rec->call) ? opts.prefix : "",
+			 s->calls[i]->name);
+
+		start = now_ns();
+		if (opts.speed > 0) {
+			due = replay_start_ns +
+			      (rec->start_ns - first_start_ns) / opts.speed;
+			if (due > start) {
+				sleep_until(due);
+				start = now_ns();
+			}
+			samples_add(&r->late, start > due ? start - due : 0);
+		}
+
+		err = issue(s->calls[i], name);
+		samples_add(&r->replayed, now_ns() - start);
+		samples_add(&r->recorded, rec->duration_ns);
+		if (err)
+			r->errors++;
+		if (err != rec->result)
+			r->mismatches++;
+	}
+	free(name);
+	return NULL;
+}
+
+static void report(FILE *f, uint64_t elapsed_ns)
+{
+	struct samples recorded = { 0 }, replayed = { 0 }, late = { 0 };
+	uint64_t errors, mismatches, skipped;
+	uint64_t total_mismatches = 0, total_skipped = 0;
+	const char *sep = "";
+	size_t i;
+	int call;
+
+	fprintf(f, "{\n  \"version\": 2,\n  \"backend\": \"%s\",\n"
+		"  \"speed\": %g,\n  \"calls\": %zu,\n  \"threads\": %zu,\n"
+		"  \"seconds\": %.6f,\n  \"results\": [",
+		vcmmd_get_backend(), opts.speed, nr_calls, nr_streams,
+		elapsed_ns / 1e9);
+
+	for (call = 0; call < __NR_VCMMD_CALLS; call++) {
+		errors = mismatches = skipped = 0;
+		for (i = 0; i < nr_streams; i++) {
+			samples_merge(&recorded,
+				      &streams[i].results[call].recorded);
+			samples_merge(&replayed,
+				      &streams[i].results[call].replayed);
+			samples_merge(&late, &streams[i].results[call].late);
+			errors += streams[i].results[call].errors;
+			mismatches += streams[i].results[call].mismatches;
+			skipped += streams[i].results[call].skipped;
+		}
+		if (!replayed.nr && !skipped)
+			continue;
+		qsort(recorded.ns, recorded.nr, sizeof(uint64_t), cmp_u64);
+		qsort(replayed.ns, replayed.nr, sizeof(uint64_t), cmp_u64);
+		qsort(late.ns, late.nr, sizeof(uint64_t), cmp_u64);
+		fprintf(f, "%s\n    {\"call\": \"%s\", \"ops\": %zu, "
+			"\"skipped\": %llu, \"errors\": %llu, "
+			"\"mismatches\": %llu,\n"
+			"     \"recorded\": {\"p50_us\": %.1f, \"p99_us\": %.1f, "
+			"\"p999_us\": %.1f, \"max_us\": %.1f},\n"
+			"     \"replayed\": {\"p50_us\": %.1f, \"p99_us\": %.1f, "
+			"\"p999_us\": %.1f, \"max_us\": %.1f},\n"
+			"     \"late\": {\"p50_us\": %.1f, \"p99_us\": %.1f, "
+			"\"max_us\": %.1f}}",
+			sep, vcmmd_call_name(call), replayed.nr,
+			(unsigned long long)skipped, (unsigned long long)errors,
+			(unsigned long long)mismatches,
+			percentile_us(&recorded, 0.50),
+			percentile_us(&recorded, 0.99),
+			percentile_us(&recorded, 0.999),
+			percentile_us(&recorded, 1),
+			percentile_us(&replayed, 0.50),
+			percentile_us(&replayed, 0.99),
+			percentile_us(&replayed, 0.999),
+			percentile_us(&replayed, 1),
+			percentile_us(&late, 0.50), percentile_us(&late, 0.99),
+			percentile_us(&late, 1));
+		sep = ",";
+		total_mismatches += mismatches;
+		total_skipped += skipped;
+		samples_free(&recorded);
+		samples_free(&replayed);
+		samples_free(&late);
+	}
+	fprintf(f, "\n  ],\n  \"skipped\": %llu,\n"
+		"  \"mismatches\": %llu\n}\n",
+		(unsigned long long)total_skipped,
+		(unsigned long long)total_mismatches);
+}
+
+static void usage(FILE *f)
+{
+	fprintf(f,
+"Usage: vcmmd-replay [options] FILE\n"
+"\n"
+"  -s SPEED  replay SPEED times as fast as recorded, 0 for no pauses\n"
+"            (default 1)\n"
+"  -p PREFIX prepend PREFIX to VE names\n"
+"  -b NAME   use library backend NAME, see vcmmd_set_backend\n"
+"  -d        print the calls in FILE and exit\n"
+"  -o FILE   write JSON results to FILE instead of stdout\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct stream *s;
+	FILE *f = stdout;
+	uint64_t start;
+	size_t len, i;
+	char *buf;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:p:b:do:h")) != -1) {
+		switch (opt) {
+		case 's':
+			opts.speed = strtod(optarg, NULL);
+			break;
+		case 'p':
+			opts.prefix = optarg;
+			break;
+		case 'b':
+			opts.backend = optarg;
+			break;
+		case 'd':
+			opts.dump = true;
+			break;
+		case 'o':
+			opts.output = optarg;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1 || opts.speed < 0) {
+		usage(stderr);
+		return 1;
+	}
+
+	if (opts.backend && vcmmd_set_backend(opts.backend)) {
+		fprintf(stderr, "vcmmd-replay: unknown backend %s\n",
+			opts.backend);
+		return 1;
+	}
+
+	if (opts.output) {
+		f = fopen(opts.output, "w");
+		if (!f)
+			die(opts.output);
+	}
+
+	buf = load_file(argv[optind], &len);
+	parse_capture(argv[optind], buf, len);
+
+	if (opts.dump) {
+		dump(f);
+		goto out;
+	}
+
+	for (i = 0; i < nr_calls; i++) {
+		s = get_stream(calls[i].rec->pid, calls[i].rec->thread);
+		if (s->nr_calls == s->size) {
+			s->size = s->size ? s->size * 2 : 64;
+			s->calls = xrealloc(s->calls,
+					    s->size * sizeof(*s->calls));
+		}
+		s->calls[s->nr_calls++] = &calls[i];
+	}
+
+	fprintf(stderr, "vcmmd-replay: %zu calls from %zu threads\n",
+		nr_calls, nr_streams);
+
+	/* Leave the threads time to start before the first call is due */
+	start = now_ns();
+	replay_start_ns = start + 10000000;
+	for (i = 0; i < nr_streams; i++)
+		if (pthread_create(&streams[i].thread, NULL, stream_fn,
+				   &streams[i]))
+			die("pthread_create");
+	for (i = 0; i < nr_streams; i++)
+		pthread_join(streams[i].thread, NULL);
+
+	report(f, now_ns() - start);
+out:
+	if (f != stdout)
+		fclose(f);
+	return 0;
+}
@@ -0,0 +1,477 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/*
+ * vcmmd-restart: recovery of the library from VCMMD and bus restarts
+ *
+ * Keeps worker threads calling VCMMD while vcmmd-mockd is killed and started
+ * again, and reports, per restart and per thread, how long after the restart
+ * the first call got through, how many calls failed meanwhile and how many
+ * times the library reconnected to the bus. Fault modes:
+ *
+ *   service  the daemon is killed and restarted under the same bus name
+ *   rename   the daemon comes back under another bus name each time
+ *   bus      the dbus-daemon is restarted along with the daemon, which
+ *            breaks the library's bus connection
+ *
+ * Must run under "vcmmd-private-bus -n", which provides the bus and, for
+ * the bus mode, the means to restart it. The daemon is started by this
+ * program. A call counts as getting through when VCMMD answers it, even with
+ * an error of its own. Output is JSON.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "vcmmd.h"
+
+#define MAX_WORKERS		256
+#define MAX_CYCLES		64
+#define MAX_MOCKD_ARGS		32
+
+static const char *bus_names[] = {
+	"com.virtuozzo.vcmmd",
+	"org.openvz.vcmmd",
+};
+
+enum fault_mode {
+	FAULT_SERVICE,
+	FAULT_RENAME,
+	FAULT_BUS,
+};
+
+static const char *fault_names[] = {
+	[FAULT_SERVICE]	= "service",
+	[FAULT_RENAME]	= "rename",
+	[FAULT_BUS]	= "bus",
+};
+
+struct cycle_result {
+	uint64_t first_ok_ns;	/* end of the first call through, 0 if none */
+	uint64_t failed;
+	uint64_t reconnects;
+	uint64_t retries;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	uint64_t calls;
+	struct cycle_result cycles[MAX_CYCLES];
+};
+
+static struct {
+	enum fault_mode mode;
+	unsigned int nr_cycles;
+	unsigned int uptime_ms;
+	unsigned int downtime_ms;
+	unsigned int nr_workers;
+	unsigned int think_us;
+	char *mockd_opts;
+	const char *output;
+} opts = {
+	.mode = FAULT_SERVICE,
+	.nr_cycles = 3,
+	.uptime_ms = 1000,
+	.downtime_ms = 500,
+	.nr_workers = 8,
+	.think_us = 1000,
+};
+
+static uint64_t fault_ns[MAX_CYCLES];
+static uint64_t restart_ns[MAX_CYCLES];
+static const char *cycle_bus_name[MAX_CYCLES];
+static int cur_cycle = -1;
+static volatile bool stop;
+
+static pid_t mockd_pid, bus_pid;
+static bool bus_is_ours;
+
+static __thread struct worker *self;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000L,
+	};
+
+	while (nanosleep(&ts, &ts))
+		;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static pid_t spawn(char *const argv[])
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	return pid;
+}
+
+static void kill_and_reap(pid_t pid)
+{
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+/*
+ * Start vcmmd-mockd owning @bus_name. Retried for a while, since it fails if
+ * the bus is not up yet or the previous owner of the name is still around.
+ */
+static void start_mockd(const char *bus_name)
+{
+	const char *mockd = getenv("MOCKD") ? getenv("MOCKD") : "vcmmd-mockd";
+	char *argv[MAX_MOCKD_ARGS + 4], *opts_copy, *tok;
+	unsigned int argc = 0, tries;
+	int status;
+
+	argv[argc++] = (char *)mockd;
+	argv[argc++] = "-n";
+	argv[argc++] = (char *)bus_name;
+	opts_copy = strdup(opts.mockd_opts ? opts.mockd_opts : "");
+	for (tok = strtok(opts_copy, " "); tok && argc < MAX_MOCKD_ARGS + 3;
+	     tok = strtok(NULL, " "))
+		argv[argc++] = tok;
+	argv[argc] = NULL;
+
+	for (tries = 0; tries < 100; tries++) {
+		mockd_pid = spawn(argv);
+		sleep_ms(50);
+		if (waitpid(mockd_pid, &status, WNOHANG) == 0)
+			break;
+		mockd_pid = 0;
+	}
+	free(opts_copy);
+	if (!mockd_pid) {
+		fprintf(stderr, "vcmmd-restart: cannot start %s\n", mockd);
+		exit(1);
+	}
+}
+
+static void start_bus(void)
+{
+	char config[4096];
+	char *argv[] = {
+		"dbus-daemon", config, "--nofork", "--nopidfile", NULL,
+	};
+
+	snprintf(config, sizeof(config), "--config-file=%s",
+		 getenv("VCMMD_BUS_CONFIG"));
+	bus_pid = spawn(argv);
+	bus_is_ours = true;
+}
+
+static void stop_bus(void)
+{
+	if (bus_is_ours)
+		kill_and_reap(bus_pid);
+	else
+		kill(bus_pid, SIGKILL);	/* reaped by vcmmd-private-bus */
+}
+
+static void trace_hook(const struct vcmmd_trace_span *span, void *ctx)
+{
+	int cycle = __atomic_load_n(&cur_cycle, __ATOMIC_ACQUIRE);
+
+	if (!self || cycle < 0)
+		return;
+	self->cycles[cycle].reconnects += span->reconnects;
+	self->cycles[cycle].retries += span->retries;
+}
+
+static bool got_through(int err)
+{
+	return err < __VCMMD_LIB_ERROR_START;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	vcmmd_ve_state_t state;
+	char buf[256];
+	uint64_t start, end;
+	int cycle, err;
+
+	self = w;
+	while (!stop) {
+		cycle = __atomic_load_n(&cur_cycle, __ATOMIC_ACQUIRE);
+		start = now_ns();
+		if (w->calls++ % 2)
+			err = vcmmd_get_current_policy(buf, sizeof(buf));
+		else
+			err = vcmmd_get_ve_state("restart-probe", &state);
+		end = now_ns();
+
+		/* Only calls started after the fault tell about recovery */
+		if (cycle >= 0 && start >= fault_ns[cycle]) {
+			struct cycle_result *res = &w->cycles[cycle];
+
+			if (!got_through(err))
+				res->failed++;
+			else if (!res->first_ok_ns)
+				res->first_ok_ns = end;
+		}
+		if (opts.think_us)
+			usleep(opts.think_us);
+	}
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(FILE *f, struct worker *workers)
+{
+	double recovery[MAX_WORKERS];
+	unsigned int c, t, nr;
+	uint64_t failed, reconnects;
+
+	fprintf(f, "{\n  \"version\": 1,\n  \"mode\": \"%s\",\n"
+		"  \"threads\": %u,\n  \"downtime_ms\": %u,\n"
+		"  \"cycles\": [", fault_names[opts.mode], opts.nr_workers,
+		opts.downtime_ms);
+
+	for (c = 0; c < opts.nr_cycles; c++) {
+		nr = 0;
+		failed = reconnects = 0;
+		for (t = 0; t < opts.nr_workers; t++) {
+			const struct cycle_result *res = &workers[t].cycles[c];
+
+			if (res->first_ok_ns)
+				recovery[nr++] = res->first_ok_ns > restart_ns[c] ?
+					(res->first_ok_ns - restart_ns[c]) / 1e6 :
+					0;
+			failed += res->failed;
+			reconnects += res->reconnects;
+		}
+		qsort(recovery, nr, sizeof(*recovery), cmp_double);
+
+		fprintf(f, "%s\n    {\"cycle\": %u, \"bus_name\": \"%s\", "
+			"\"recovered_threads\": %u, "
+			"\"first_success_ms_min\": %.3f, "
+			"\"first_success_ms_max\": %.3f, "
+			"\"failed_calls\": %llu, \"reconnects\": %llu,\n"
+			"     \"per_thread\": [",
+			c ? "," : "", c, cycle_bus_name[c], nr,
+			nr ? recovery[0] : -1.0, nr ? recovery[nr - 1] : -1.0,
+			(unsigned long long)failed,
+			(unsigned long long)reconnects);
+
+		for (t = 0; t < opts.nr_workers; t++) {
+			const struct cycle_result *res = &workers[t].cycles[c];
+
+			fprintf(f, "%s\n      {\"thread\": %u, "
+				"\"first_success_ms\": %.3f, "
+				"\"failed_calls\": %llu, \"reconnects\": %llu, "
+				"\"retries\": %llu}",
+				t ? "," : "", t,
+				!res->first_ok_ns ? -1.0 :
+				res->first_ok_ns > restart_ns[c] ?
+				(res->first_ok_ns - restart_ns[c]) / 1e6 : 0,
+				(unsigned long long)res->failed,
+				(unsigned long long)res->reconnects,
+				(unsigned long long)res->retries);
+		}
+		fprintf(f, "\n     ]}");
+	}
+	fprintf(f, "\n  ]\n}\n");
+}
+
+static void usage(FILE *f)
+{
+	fprintf(f,
+"Usage: vcmmd-private-bus -n vcmmd-restart [options]\n"
+"\n"
+"  -f MODE   fault: service, rename or bus (default service)\n"
+"  -c N      number of restarts (default %u, at most %d)\n"
+"  -u MS     time between restarts (default %u)\n"
+"  -D MS     time the daemon stays down (default %u)\n"
+"  -w N      worker threads (default %u)\n"
+"  -i US     pause between calls of a thread (default %u)\n"
+"  -m OPTS   extra vcmmd-mockd options\n"
+"  -o FILE   write JSON results to FILE instead of stdout\n",
+		opts.nr_cycles, MAX_CYCLES, opts.uptime_ms, opts.downtime_ms,
+		opts.nr_workers, opts.think_us);
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	const char *bus_name = bus_names[0];
+	char buf[256];
+	unsigned int c, t;
+	FILE *f = stdout;
+	int opt, err;
+
+	while ((opt = getopt(argc, argv, "f:c:u:D:w:i:m:o:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			for (t = 0; t < 3; t++)
+				if (!strcmp(optarg, fault_names[t]))
+					break;
+			if (t == 3) {
+				usage(stderr);
+				return 1;
+			}
+			opts.mode = t;
+			break;
+		case 'c':
+			opts.nr_cycles = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			opts.uptime_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			opts.downtime_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			opts.nr_workers = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			opts.think_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			opts.mockd_opts = optarg;
+			break;
+		case 'o':
+			opts.output = optarg;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return 1;
+		}
+	}
+
+	if (!opts.nr_cycles || opts.nr_cycles > MAX_CYCLES ||
+	    !opts.nr_workers || opts.nr_workers > MAX_WORKERS) {
+		usage(stderr);
+		return 1;
+	}
+	if (!getenv("VCMMD_BUS_PID") || !getenv("VCMMD_BUS_CONFIG")) {
+		fprintf(stderr, "vcmmd-restart: must be run under "
+				"vcmmd-private-bus -n\n");
+		return 1;
+	}
+	bus_pid = atoi(getenv("VCMMD_BUS_PID"));
+
+	if (opts.output) {
+		f = fopen(opts.output, "w");
+		if (!f)
+			die(opts.output);
+	}
+
+	start_mockd(bus_name);
+	err = vcmmd_get_current_policy(buf, sizeof(buf));
+	if (err) {
+		fprintf(stderr, "vcmmd-restart: cannot reach VCMMD: %s\n",
+			vcmmd_strerror(err, buf, sizeof(buf)));
+		kill_and_reap(mockd_pid);
+		return 1;
+	}
+
+	workers = calloc(opts.nr_workers, sizeof(*workers));
+	if (!workers)
+		die("vcmmd-restart");
+	vcmmd_set_trace_hook(trace_hook, NULL);
+	for (t = 0; t < opts.nr_workers; t++) {
+		workers[t].id = t;
+		if (pthread_create(&workers[t].thread, NULL, worker_fn,
+				   &workers[t]))
+			die("vcmmd-restart");
+	}
+
+	for (c = 0; c < opts.nr_cycles; c++) {
+		sleep_ms(opts.uptime_ms);
+
+		if (opts.mode == FAULT_RENAME)
+			bus_name = bus_names[(c + 1) % 2];
+		cycle_bus_name[c] = bus_name;
+		fprintf(stderr, "vcmmd-restart: %s restart %u\n",
+			fault_names[opts.mode], c);
+
+		fault_ns[c] = now_ns();
+		__atomic_store_n(&cur_cycle, c, __ATOMIC_RELEASE);
+		kill_and_reap(mockd_pid);
+		if (opts.mode == FAULT_BUS)
+			stop_bus();
+
+		sleep_ms(opts.downtime_ms);
+
+		restart_ns[c] = now_ns();
+		if (opts.mode == FAULT_BUS)
+			start_bus();
+		start_mockd(bus_name);
+	}
+	sleep_ms(opts.uptime_ms);
+
+	stop = true;
+	for (t = 0; t < opts.nr_workers; t++)
+		pthread_join(workers[t].thread, NULL);
+	vcmmd_set_trace_hook(NULL, NULL);
+
+	report(f, workers);
+
+	kill_and_reap(mockd_pid);
+	if (bus_is_ours)
+		kill_and_reap(bus_pid);
+	if (f != stdout)
+		fclose(f);
+	free(workers);
+	return 0;
+}
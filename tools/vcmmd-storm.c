@@ -0,0 +1,682 @@
+/*
+ *  Copyright (c) 2017-2022 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/*
+ * vcmmd-storm: VE lifecycle workload simulator
+ *
+ * Replays the VE lifecycle mixes seen on a host:
+ *
+ *   boot       every VE goes through register, activate and update at once,
+ *              as when a host comes up and starts all of its VEs
+ *   rebalance  VEs already running get their configs updated and queried at
+ *              random, as when the limits of running VEs are adjusted
+ *   evacuate   every VE is deactivated and unregistered at once, as when a
+ *              host is drained
+ *
+ * A pool of worker threads, standing for the processes that start VEs,
+ * shares the work. Per scenario it reports call latency percentiles, error
+ * counts by code, how often VCMMD answered VCMMD_ERROR_TOO_MANY_REQUESTS and,
+ * for a boot storm, the time each VE took to start. Output is JSON.
+ *
+ * Meant to be run against vcmmd-mockd, see "make storm".
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "vcmmd.h"
+
+#define VE_NAME_LEN		64
+#define MAX_WORKERS		1024
+#define MAX_ERRORS		64
+
+struct samples {
+	uint64_t *ns;
+	size_t nr, size;
+};
+
+struct call_result {
+	struct samples latency;
+	uint64_t errors;
+	uint64_t busy;		/* VCMMD_ERROR_TOO_MANY_REQUESTS replies */
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	unsigned short seed[3];
+	struct call_result calls[__NR_VCMMD_CALLS];
+	struct samples ve_start;
+	uint64_t ve_failed;
+};
+
+enum ve_state {
+	VE_ABSENT,
+	VE_REGISTERED,
+	VE_ACTIVE,
+};
+
+static struct {
+	unsigned int nr_ves;
+	unsigned int nr_workers;
+	unsigned int rebalance_ms;
+	unsigned int nr_keys;
+	bool lists;
+	uint64_t guarantee;
+	unsigned int vm_percent;
+	unsigned int busy_retries;
+	unsigned int busy_backoff_ms;
+	unsigned int rate_control;
+	bool handles;
+	const char *output;
+} opts = {
+	.nr_ves = 300,
+	.nr_workers = 32,
+	.rebalance_ms = 5000,
+	.nr_keys = 4,
+	.guarantee = 512ULL << 20,
+	.vm_percent = 50,
+	.busy_backoff_ms = 10,
+};
+
+static const vcmmd_ve_config_key_t num_keys[] = {
+	VCMMD_VE_CONFIG_GUARANTEE,
+	VCMMD_VE_CONFIG_LIMIT,
+	VCMMD_VE_CONFIG_SWAP,
+	VCMMD_VE_CONFIG_CPUNUM,
+	VCMMD_VE_CONFIG_VRAM,
+	VCMMD_VE_CONFIG_CACHE,
+	VCMMD_VE_CONFIG_GUARANTEE_TYPE,
+};
+#define NR_NUM_KEYS	(sizeof(num_keys) / sizeof(num_keys[0]))
+
+static enum ve_state *ve_states;
+static vcmmd_ve_handle_t *handles;
+static unsigned int next_ve;
+static uint64_t deadline_ns;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void samples_add(struct samples *s, uint64_t ns)
+{
+	if (s->nr == s->size) {
+		s->size = s->size ? s->size * 2 : 256;
+		s->ns = realloc(s->ns, s->size * sizeof(*s->ns));
+		if (!s->ns)
+			die("vcmmd-storm");
+	}
+	s->ns[s->nr++] = ns;
+}
+
+static void samples_merge(struct samples *dst, const struct samples *src)
+{
+	size_t i;
+
+	for (i = 0; i < src->nr; i++)
+		samples_add(dst, src->ns[i]);
+}
+
+static void samples_free(struct samples *s)
+{
+	free(s->ns);
+	memset(s, 0, sizeof(*s));
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct samples *s, double p)
+{
+	size_t i = (size_t)(p * s->nr);
+
+	if (!s->nr)
+		return 0;
+	if (i >= s->nr)
+		i = s->nr - 1;
+	return s->ns[i] / 1000.0;
+}
+
+static void ve_name(char *buf, unsigned int ve)
+{
+	snprintf(buf, VE_NAME_LEN, "storm-%d-%u", (int)getpid(), ve);
+}
+
+static vcmmd_ve_type_t ve_type(unsigned int ve)
+{
+	return ve % 100 < opts.vm_percent ? VCMMD_VE_VM : VCMMD_VE_CT;
+}
+
+/*
+ * Build a config of opts.nr_keys numeric keys, plus NUMA node and CPU lists
+ * if requested. @scale varies the sizes between calls.
+ */
+static void make_config(struct vcmmd_ve_config *config, unsigned int ve,
+			double scale)
+{
+	uint64_t guarantee = opts.guarantee * scale;
+	unsigned int i;
+
+	vcmmd_ve_config_init(config);
+	for (i = 0; i < opts.nr_keys && i < NR_NUM_KEYS; i++) {
+		uint64_t value;
+
+		switch (num_keys[i]) {
+		case VCMMD_VE_CONFIG_GUARANTEE:
+			value = guarantee;
+			break;
+		case VCMMD_VE_CONFIG_LIMIT:
+		case VCMMD_VE_CONFIG_SWAP:
+			value = guarantee * 2;
+			break;
+		case VCMMD_VE_CONFIG_CPUNUM:
+			value = 1 + ve % 8;
+			break;
+		case VCMMD_VE_CONFIG_VRAM:
+			value = 64 << 20;
+			break;
+		case VCMMD_VE_CONFIG_GUARANTEE_TYPE:
+			value = VCMMD_MEMGUARANTEE_BYTES;
+			break;
+		default:
+			value = 0;
+		}
+		vcmmd_ve_config_append(config, num_keys[i], value);
+	}
+	if (opts.lists) {
+		vcmmd_ve_config_append_string(config,
+					      VCMMD_VE_CONFIG_NODE_LIST, "0");
+		vcmmd_ve_config_append_string(config,
+					      VCMMD_VE_CONFIG_CPU_LIST, "0-3");
+	}
+}
+
+/*
+ * Issue @call for VE @ve, retrying replies of VCMMD_ERROR_TOO_MANY_REQUESTS
+ * as configured. Every attempt is accounted.
+ */
+static int do_call(struct worker *w, vcmmd_call_t call, unsigned int ve)
+{
+	struct call_result *res = &w->calls[call];
+	struct vcmmd_ve_config config;
+	char name[VE_NAME_LEN];
+	vcmmd_ve_state_t state;
+	unsigned int attempt;
+	uint64_t start;
+	int err;
+
+	ve_name(name, ve);
+
+	for (attempt = 0; ; attempt++) {
+		vcmmd_ve_config_init(&config);
+		start = now_ns();
+		switch (call) {
+		case VCMMD_CALL_REGISTER_VE:
+			make_config(&config, ve, 1);
+			err = vcmmd_register_ve(name, ve_type(ve), &config, 0);
+			break;
+		case VCMMD_CALL_ACTIVATE_VE:
+			err = handles ? vcmmd_activate_ve_handle(handles[ve], 0) :
+					vcmmd_activate_ve(name, 0);
+			break;
+		case VCMMD_CALL_UPDATE_VE:
+			make_config(&config, ve, 0.5 + erand48(w->seed));
+			err = handles ?
+				vcmmd_update_ve_handle(handles[ve], &config, 0) :
+				vcmmd_update_ve(name, &config, 0);
+			break;
+		case VCMMD_CALL_GET_VE_CONFIG:
+			err = handles ?
+				vcmmd_get_ve_config_handle(handles[ve], &config) :
+				vcmmd_get_ve_config(name, &config);
+			break;
+		case VCMMD_CALL_GET_VE_STATE:
+			err = handles ?
+				vcmmd_get_ve_state_handle(handles[ve], &state) :
+				vcmmd_get_ve_state(name, &state);
+			break;
+		case VCMMD_CALL_DEACTIVATE_VE:
+			err = handles ? vcmmd_deactivate_ve_handle(handles[ve]) :
+					vcmmd_deactivate_ve(name);
+			break;
+		case VCMMD_CALL_UNREGISTER_VE:
+			err = vcmmd_unregister_ve(name);
+			break;
+		default:
+			err = VCMMD_ERROR_VE_OPERATION_FAILED;
+		}
+		samples_add(&res->latency, now_ns() - start);
+		vcmmd_ve_config_deinit(&config);
+
+		if (!err)
+			break;
+		res->errors++;
+		if (err != VCMMD_ERROR_TOO_MANY_REQUESTS)
+			break;
+		res->busy++;
+		if (opts.rate_control || attempt >= opts.busy_retries)
+			break;
+		usleep(opts.busy_backoff_ms * 1000);
+	}
+	return err;
+}
+
+static bool next_ve_index(unsigned int *ve)
+{
+	*ve = __atomic_fetch_add(&next_ve, 1, __ATOMIC_RELAXED);
+	return *ve < opts.nr_ves;
+}
+
+static void *boot_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int ve;
+	uint64_t start;
+
+	while (next_ve_index(&ve)) {
+		start = now_ns();
+		if (do_call(w, VCMMD_CALL_REGISTER_VE, ve)) {
+			w->ve_failed++;
+			continue;
+		}
+		ve_states[ve] = VE_REGISTERED;
+		if (do_call(w, VCMMD_CALL_ACTIVATE_VE, ve)) {
+			w->ve_failed++;
+			continue;
+		}
+		ve_states[ve] = VE_ACTIVE;
+		if (do_call(w, VCMMD_CALL_UPDATE_VE, ve)) {
+			w->ve_failed++;
+			continue;
+		}
+		samples_add(&w->ve_start, now_ns() - start);
+	}
+	return NULL;
+}
+
+static void *rebalance_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int ve, tries;
+	double r;
+
+	while (now_ns() < deadline_ns) {
+		/* Pick a running VE; give up if there are hardly any */
+		for (tries = 0; tries < 16; tries++) {
+			ve = nrand48(w->seed) % opts.nr_ves;
+			if (ve_states[ve] == VE_ACTIVE)
+				break;
+		}
+		if (tries == 16)
+			break;
+
+		r = erand48(w->seed);
+		if (r < 0.7)
+			do_call(w, VCMMD_CALL_UPDATE_VE, ve);
+		else if (r < 0.9)
+			do_call(w, VCMMD_CALL_GET_VE_CONFIG, ve);
+		else
+			do_call(w, VCMMD_CALL_GET_VE_STATE, ve);
+	}
+	return NULL;
+}
+
+static void *evacuate_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int ve;
+
+	while (next_ve_index(&ve)) {
+		if (ve_states[ve] == VE_ACTIVE &&
+		    do_call(w, VCMMD_CALL_DEACTIVATE_VE, ve))
+			continue;
+		if (ve_states[ve] != VE_ABSENT &&
+		    !do_call(w, VCMMD_CALL_UNREGISTER_VE, ve))
+			ve_states[ve] = VE_ABSENT;
+	}
+	return NULL;
+}
+
+static void report_errors(FILE *f, const struct vcmmd_stats *stats)
+{
+	const char *sep = "";
+	int i;
+
+	fprintf(f, "\"errors\": {");
+	for (i = 1; i < VCMMD_STATS_MAX_ERRORS; i++) {
+		if (!stats->service_errors[i])
+			continue;
+		fprintf(f, "%s\"%d\": %llu", sep, i,
+			(unsigned long long)stats->service_errors[i]);
+		sep = ", ";
+	}
+	for (i = 0; i < VCMMD_STATS_MAX_ERRORS; i++) {
+		if (!stats->lib_errors[i])
+			continue;
+		fprintf(f, "%s\"%d\": %llu", sep, i + __VCMMD_LIB_ERROR_START,
+			(unsigned long long)stats->lib_errors[i]);
+		sep = ", ";
+	}
+	fprintf(f, "}");
+}
+
+static void report(FILE *f, const char *scenario, struct worker *workers,
+		   uint64_t elapsed_ns, bool first)
+{
+	struct vcmmd_stats stats;
+	struct samples all = { 0 };
+	uint64_t errors, busy, failed = 0;
+	const char *sep = "";
+	unsigned int t;
+	int call;
+
+	vcmmd_get_stats(&stats);
+
+	fprintf(f, "%s\n    {\"scenario\": \"%s\", \"seconds\": %.6f, ",
+		first ? "" : ",", scenario, elapsed_ns / 1e9);
+
+	for (t = 0; t < opts.nr_workers; t++) {
+		samples_merge(&all, &workers[t].ve_start);
+		failed += workers[t].ve_failed;
+	}
+	if (all.nr || failed) {
+		qsort(all.ns, all.nr, sizeof(*all.ns), cmp_u64);
+		fprintf(f, "\"ves_started\": %zu, \"ves_failed\": %llu, "
+			"\"ve_start_p50_us\": %.1f, \"ve_start_p99_us\": %.1f, "
+			"\"ve_start_p999_us\": %.1f, \"ve_start_max_us\": %.1f, ",
+			all.nr, (unsigned long long)failed,
+			percentile_us(&all, 0.50), percentile_us(&all, 0.99),
+			percentile_us(&all, 0.999), percentile_us(&all, 1));
+	}
+	samples_free(&all);
+
+	fprintf(f, "\"retries\": %llu, \"reconnects\": %llu, ",
+		(unsigned long long)stats.retries,
+		(unsigned long long)stats.reconnects);
+	if (opts.rate_control)
+		fprintf(f, "\"busy_retries\": %llu, \"admission_waits\": %llu, "
+			"\"admission_wait_ms\": %.1f, \"rate_limit\": %llu, ",
+			(unsigned long long)stats.busy_retries,
+			(unsigned long long)stats.admission_waits,
+			stats.admission_wait_ns / 1e6,
+			(unsigned long long)stats.rate_limit);
+	report_errors(f, &stats);
+
+	fprintf(f, ",\n     \"calls\": [");
+	for (call = 0; call < __NR_VCMMD_CALLS; call++) {
+		errors = busy = 0;
+		for (t = 0; t < opts.nr_workers; t++) {
+			samples_merge(&all, &workers[t].calls[call].latency);
+			errors += workers[t].calls[call].errors;
+			busy += workers[t].calls[call].busy;
+		}
+		if (!all.nr)
+			continue;
+		qsort(all.ns, all.nr, sizeof(*all.ns), cmp_u64);
+		fprintf(f, "%s\n      {\"call\": \"%s\", \"ops\": %zu, "
+			"\"errors\": %llu, \"error_rate\": %.4f, "
+			"\"too_many_requests\": %llu, "
+			"\"p50_us\": %.1f, \"p99_us\": %.1f, "
+			"\"p999_us\": %.1f, \"max_us\": %.1f}",
+			sep, vcmmd_call_name(call), all.nr,
+			(unsigned long long)errors, (double)errors / all.nr,
+			(unsigned long long)busy,
+			percentile_us(&all, 0.50), percentile_us(&all, 0.99),
+			percentile_us(&all, 0.999), percentile_us(&all, 1));
+		sep = ",";
+		samples_free(&all);
+	}
+	fprintf(f, "\n     ]}");
+}
+
+static void run(FILE *f, const char *scenario, void *(*fn)(void *),
+		bool first)
+{
+	struct worker *workers;
+	uint64_t start;
+	unsigned int t;
+	int call;
+
+	fprintf(stderr, "vcmmd-storm: %s\n", scenario);
+
+	workers = calloc(opts.nr_workers, sizeof(*workers));
+	if (!workers)
+		die("vcmmd-storm");
+
+	next_ve = 0;
+	deadline_ns = now_ns() + opts.rebalance_ms * 1000000ULL;
+	vcmmd_reset_stats();
+
+	start = now_ns();
+	for (t = 0; t < opts.nr_workers; t++) {
+		workers[t].id = t;
+		workers[t].seed[0] = t;
+		workers[t].seed[1] = getpid();
+		if (pthread_create(&workers[t].thread, NULL, fn, &workers[t]))
+			die("vcmmd-storm");
+	}
+	for (t = 0; t < opts.nr_workers; t++)
+		pthread_join(workers[t].thread, NULL);
+
+	report(f, scenario, workers, now_ns() - start, first);
+
+	for (t = 0; t < opts.nr_workers; t++) {
+		for (call = 0; call < __NR_VCMMD_CALLS; call++)
+			samples_free(&workers[t].calls[call].latency);
+		samples_free(&workers[t].ve_start);
+	}
+	free(workers);
+}
+
+static const struct {
+	const char *name;
+	void *(*fn)(void *);
+} scenarios[] = {
+	{ "boot", boot_fn },
+	{ "rebalance", rebalance_fn },
+	{ "evacuate", evacuate_fn },
+};
+#define NR_SCENARIOS	(sizeof(scenarios) / sizeof(scenarios[0]))
+
+static void usage(FILE *f)
+{
+	fprintf(f,
+"Usage: vcmmd-storm [options] [SCENARIO...]\n"
+"\n"
+"Scenarios: boot, rebalance, evacuate (default: all, in this order)\n"
+"\n"
+"  -n N      number of VEs (default %u)\n"
+"  -w N      number of worker threads (default %u)\n"
+"  -d MS     duration of the rebalance scenario (default %u)\n"
+"  -k N      numeric config keys per VE, 1..%zu (default %u)\n"
+"  -L        add NUMA node and CPU lists to VE configs\n"
+"  -g BYTES  VE memory guarantee (default %llu)\n"
+"  -V PCT    percentage of VMs among VEs (default %u)\n"
+"  -R N      retry calls refused with %d up to N times (default 0)\n"
+"  -B MS     delay between such retries (default %u)\n"
+"  -A N      let the library queue calls over N in flight and do the\n"
+"            -R retries itself, see vcmmd_set_rate_control\n"
+"  -H        address VEs by handle, see vcmmd_ve_open\n"
+"  -b NAME   use library backend NAME, see vcmmd_set_backend\n"
+"  -o FILE   write JSON results to FILE instead of stdout\n",
+		opts.nr_ves, opts.nr_workers, opts.rebalance_ms, NR_NUM_KEYS,
+		opts.nr_keys, (unsigned long long)opts.guarantee,
+		opts.vm_percent, VCMMD_ERROR_TOO_MANY_REQUESTS,
+		opts.busy_backoff_ms);
+}
+
+int main(int argc, char **argv)
+{
+	bool first = true;
+	FILE *f = stdout;
+	unsigned int i;
+	int opt, j;
+
+	while ((opt = getopt(argc, argv, "n:w:d:k:Lg:V:R:B:A:Hb:o:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.nr_ves = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			opts.nr_workers = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			opts.rebalance_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			opts.nr_keys = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			opts.lists = true;
+			break;
+		case 'g':
+			opts.guarantee = strtoull(optarg, NULL, 0);
+			break;
+		case 'V':
+			opts.vm_percent = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			opts.busy_retries = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			opts.busy_backoff_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'A':
+			opts.rate_control = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			opts.handles = true;
+			break;
+		case 'b':
+			if (vcmmd_set_backend(optarg)) {
+				fprintf(stderr, "vcmmd-storm: unknown backend %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'o':
+			opts.output = optarg;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return 1;
+		}
+	}
+
+	if (!opts.nr_ves || !opts.nr_workers ||
+	    opts.nr_workers > MAX_WORKERS ||
+	    !opts.nr_keys || opts.nr_keys > NR_NUM_KEYS) {
+		usage(stderr);
+		return 1;
+	}
+
+	if (opts.rate_control) {
+		struct vcmmd_rate_control rc = {
+			.calls = VCMMD_RATE_CONTROL_ALL_CALLS,
+			.max_in_flight = opts.rate_control,
+			.max_retries = opts.busy_retries,
+			.backoff_ms = opts.busy_backoff_ms,
+		};
+
+		vcmmd_set_rate_control(&rc);
+	}
+
+	ve_states = calloc(opts.nr_ves, sizeof(*ve_states));
+	if (!ve_states)
+		die("vcmmd-storm");
+
+	if (opts.handles) {
+		char name[VE_NAME_LEN];
+
+		handles = calloc(opts.nr_ves, sizeof(*handles));
+		if (!handles)
+			die("vcmmd-storm");
+		for (i = 0; i < opts.nr_ves; i++) {
+			ve_name(name, i);
+			if (vcmmd_ve_open(name, &handles[i]))
+				die("vcmmd-storm");
+		}
+	}
+
+	if (opts.output) {
+		f = fopen(opts.output, "w");
+		if (!f)
+			die(opts.output);
+	}
+
+	fprintf(f, "{\n  \"version\": 1,\n  \"backend\": \"%s\",\n"
+		"  \"ves\": %u,\n  \"workers\": %u,\n"
+		"  \"config_keys\": %u,\n  \"lists\": %s,\n"
+		"  \"rate_control\": %u,\n  \"handles\": %s,\n"
+		"  \"results\": [",
+		vcmmd_get_backend(), opts.nr_ves, opts.nr_workers,
+		opts.nr_keys + 2 * opts.lists,
+		opts.lists ? "true" : "false", opts.rate_control,
+		opts.handles ? "true" : "false");
+	for (i = 0; i < NR_SCENARIOS; i++) {
+		if (optind < argc) {
+			for (j = optind; j < argc; j++)
+				if (!strcmp(argv[j], scenarios[i].name))
+					break;
+			if (j == argc)
+				continue;
+		}
+		run(f, scenarios[i].name, scenarios[i].fn, first);
+		first = false;
+	}
+	fprintf(f, "\n  ]\n}\n");
+
+	if (f != stdout)
+		fclose(f);
+	if (handles)
+		for (i = 0; i < opts.nr_ves; i++)
+			vcmmd_ve_close(handles[i]);
+	free(handles);
+	free(ve_states);
+	return 0;
+}